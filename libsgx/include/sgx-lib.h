@@ -28,7 +28,36 @@
 #define NULL 0
 #endif
 
+/* Batched ocall ring (see sgx_ring in sgx-shared.h) */
+extern void sgx_ring_flush(void);
+extern void sgx_ring_post(fcode_t fcode, int arg1, int arg2, int arg3,
+                          const void *data, size_t len);
+extern void sgx_ring_post_stream(fcode_t fcode, int arg1,
+                                 const void *data, size_t len);
+extern int sgx_ring_call(fcode_t fcode, int arg1, int arg2, int arg3,
+                         const void *in, size_t inlen, void *out, size_t outlen);
+extern int sgx_ring_error(void);
+extern size_t sgx_bounce_size(void);
+extern ssize_t sgx_ring_bounce_io(fcode_t fcode, int fd, int flags,
+                                  void *buf, size_t len);
+
+/* Index of the TCS this enclave thread runs on (first word of its GS page) */
+static inline int sgx_thread_id(void)
+{
+    int tid;
+    asm volatile("movl %%gs:0, %0" : "=r"(tid));
+    return tid;
+}
+
+/* This thread's stub page; each TCS talks to the host through its own */
+static inline sgx_stub_info *sgx_stub(void)
+{
+    return (sgx_stub_info *)STUB_ADDR_OF(sgx_thread_id());
+}
+
 #define sgx_exit(ptr) {                         \
+    if ((void *)(ptr) != sgx_stub()->trampoline) \
+        sgx_ring_flush();                       \
     asm volatile("movl %0, %%eax\n\t"           \
                  "movq %1, %%rbx\n\t"           \
                  ".byte 0x0F\n\t"               \
@@ -54,18 +83,22 @@
                   "d"((uint64_t)output));       \
 }
 
-#define sgx_getkey(keyreq, output) {            \
-    asm volatile("movl %0, %%eax\n\t"           \
-                 "movq %1, %%rbx\n\t"           \
-                 "movq %2, %%rcx\n\t"           \
-                 ".byte 0x0F\n\t"               \
-                 ".byte 0x01\n\t"               \
-                 ".byte 0xd7\n\t"               \
-                 :                              \
-                 :"a"((uint32_t)ENCLU_EGETKEY), \
-                  "b"((uint64_t)keyreq),        \
-                  "c"((uint64_t)output));       \
-}
+// EGETKEY; evaluates to its status (0 or ERR_SGX_*)
+#define sgx_getkey(keyreq, output) __extension__ ({ \
+    uint32_t __ret;                                 \
+    asm volatile("movl %1, %%eax\n\t"               \
+                 "movq %2, %%rbx\n\t"               \
+                 "movq %3, %%rcx\n\t"               \
+                 ".byte 0x0F\n\t"                   \
+                 ".byte 0x01\n\t"                   \
+                 ".byte 0xd7\n\t"                   \
+                 :"=a"(__ret)                       \
+                 :"0"((uint32_t)ENCLU_EGETKEY),     \
+                  "b"((uint64_t)keyreq),            \
+                  "c"((uint64_t)output)             \
+                 :"memory");                        \
+    __ret;                                          \
+})
 
 extern int sgx_enclave_read(void *buf, int len);
 extern int sgx_enclave_write(void *buf, int len);
@@ -75,6 +108,7 @@ extern sigstruct_t *sgx_load_sigstruct(char *conf);
 
 /* Attestation supporting funcitons */
 extern int sgx_make_server(int port);
+extern int sgx_accept_client(int server_fd);
 extern int sgx_connect_server(const char *target_ip, int target_port);
 extern int sgx_get_report(int fd, report_t *report);
 extern int sgx_read_sock(int fd, void *buf, int len);
@@ -82,11 +116,31 @@ extern int sgx_write_sock(int fd, void *buf, int len);
 extern int sgx_match_mac(unsigned char *report_key, report_t *report);
 extern int sgx_make_quote(const char* pers, report_t *report, unsigned char *rsa_N, unsigned char *rsa_E);
 
+/* Quoting key, generated or unsealed once and reused by every quote */
+#define SGX_QUOTE_KEY_PATH "sgx-quote-key.sealed"
+extern int sgx_quote_key_init(const char *pers, const char *sealed_path);
+extern int sgx_quote_pubkey(unsigned char *rsa_N, unsigned char *rsa_E);
+extern int sgx_make_quotes(report_t *reports, int n);
+
+/* Attestation services: long-lived servers sharing one listening socket
+ * per port among all enclave threads, see sgx-remote-attest.c */
+#define SGX_ATTEST_BACKLOG 64
+#define SGX_ATTEST_BATCH   8            /* attestations per round trip */
+extern int sgx_attest_listen(int port);
+extern void sgx_attest_lock(volatile int *lock);
+extern void sgx_attest_unlock(volatile int *lock);
+extern int sgx_get_report_key(report_t *report, unsigned char *report_key);
+extern int sgx_verify_report(report_t *report);
+extern int sgx_get_targetinfo(char *conf, targetinfo_t *targetinfo);
+
 /* Intra attestation supporting functions */
 extern int sgx_intra_attest_challenger(int target_port, char *conf);
 extern int sgx_intra_attest_target(int port);
+extern int sgx_intra_attest_target_service(int port);
 
 /* Remote attestation supporing functions */
 extern int sgx_remote_attest_challenger(const char *target_ip, int target_port, const char *challenge);
 extern int sgx_remote_attest_target(int challenger_port, int quote_port, char *conf);
 extern int sgx_remote_attest_quote(int target_port);
+extern int sgx_remote_attest_target_service(int challenger_port, int quote_port, char *conf);
+extern int sgx_remote_attest_quote_service(int target_port);
@@ -28,12 +28,13 @@
 #define CPU_SVN                  1
 #define PAGE_SIZE                4096
 #define MEASUREMENT_SIZE         256
-#define NUM_EPC                  2000
+#define NUM_EPC                  2000     // default, see qemu -epc
 #define MIN_ALLOC                2
 
 // Enclave configuration
 #define STACK_PAGE_FRAMES_PER_THREAD 250
 #define HEAP_PAGE_FRAMES             300
+#define HEAP_MAX_PAGE_FRAMES         (1 << 24) // ELRANGE for the heap, see OPENSGX_HEAP
 
 // EINITTOKEN MAC size
 #define MAC_SIZE               16
@@ -42,6 +43,7 @@
 #define EINITTOKEN_ALIGN_SIZE  512
 #define PAGEINFO_ALIGN_SIZE    32
 #define SECINFO_ALIGN_SIZE     64
+#define PCMD_ALIGN_SIZE        128
 
 // For RSA
 #define KEY_LENGTH             384
@@ -87,7 +89,9 @@ typedef enum {
     FUNC_ACCEPT,
     FUNC_CONNECT,
     FUNC_SEND,
-    FUNC_RECV
+    FUNC_RECV,
+
+    FUNC_RING           // only drain the ocall ring
     // ...
 } fcode_t;
 
@@ -97,6 +101,13 @@ typedef enum {
     REQUEST_EAUG,
 } mcode_t;
 
+// REQUEST_EAUG asks for out_arg1 pages and accepts as few as out_arg2
+// (both 0 means a single page); the kernel EAUGs one run of adjacent pages
+// and the enclave EACCEPTs all of them. The enclave doubles its batch on
+// every request up to SGX_EAUG_MAX_PAGES; a larger allocation asks for
+// exactly the pages it needs.
+#define SGX_EAUG_MAX_PAGES 256
+
 typedef struct sgx_stub_info {
     int  abi;
     void *trampoline;
@@ -105,7 +116,8 @@ typedef struct sgx_stub_info {
     // in : from non-enclave to enclave
     uint64_t heap_beg;
     uint64_t heap_end;
-    uint32_t pending_page;
+    uint64_t pending_page;      // REQUEST_EAUG: first page of the run
+    uint32_t pending_npages;    //   and its length, out_arg2..out_arg1
     int  ret;
     char in_data1[SGXLIB_MAX_ARG];
     char in_data2[SGXLIB_MAX_ARG];
@@ -129,6 +141,74 @@ typedef struct sgx_stub_info {
    char out_shm[SGXLIB_MAX_ARG];
 } sgx_stub_info;
 
+// Batched ocall ring, right after the stub page
+//  - the enclave queues requests at sq_tail and exits only when it needs
+//    a result (or the ring is full); deferred requests (write, send,
+//    puts, ...) never wait for their completion
+//  - the trampoline drains sq_head..sq_tail on *every* exit, before the
+//    legacy sgx_stub_info call, and posts one cqe per sqe
+//  - seq numbers are free running, slot = seq & (SGX_RING_SLOTS - 1)
+#define SGX_RING_ADDR      (STUB_ADDR + PAGE_SIZE)
+#define SGX_RING_SLOTS     64
+#define SGX_RING_DATA      SGXLIB_MAX_ARG
+#define SGX_STUB_SIZE      (16 * PAGE_SIZE)   // stub page + ring
+
+// Multi-threaded enclaves: TCS #tid has its own stub page and ring at
+// STUB_ADDR_OF(tid); the enclave finds its tid in the first word of its
+// GS page (see sgx_thread_id()), thread 0 keeps STUB_ADDR/SGX_RING_ADDR
+#define SGX_MAX_TCS        8
+#define STUB_ADDR_OF(tid)      (STUB_ADDR + (uint64_t)(tid) * SGX_STUB_SIZE)
+#define SGX_RING_ADDR_OF(tid)  (STUB_ADDR_OF(tid) + PAGE_SIZE)
+
+#define SGX_RING_DEFERRED  0x1                // nobody waits for the cqe
+#define SGX_RING_BOUNCE    0x2                // data is in the bounce region
+
+// Untrusted bounce region for large I/O, mapped by sgx_init() (size can be
+// overridden with OPENSGX_BOUNCE_SIZE, 0 disables it) and published in
+// sgx_ring; read/write/send/recv move a whole buffer in one exit with it
+#define SGX_BOUNCE_SIZE    (1024 * 1024)
+
+// Exitless ocalls: host workers poll the ring instead of waiting for an
+// exit (OPENSGX_EXITLESS=<workers>, see sgx-trampoline.c for the knobs)
+#define SGX_EXITLESS_SPIN     (1 << 16)   // polls before sleeping/exiting
+#define SGX_EXITLESS_SLEEP_US (1000)      // max worker backoff
+
+typedef struct sgx_ring_sqe {
+    fcode_t  fcode;
+    uint32_t flags;
+    int      arg1;
+    int      arg2;
+    int      arg3;
+    uint32_t len;                   // valid bytes in data (or bounce)
+    char     data[SGX_RING_DATA];   // out (and in, for read/recv/time)
+} sgx_ring_sqe;
+
+typedef struct sgx_ring_cqe {
+    uint32_t seq;
+    int      ret;
+} sgx_ring_cqe;
+
+typedef struct sgx_ring {
+    uint32_t sq_head;               // host: next sqe to drain
+    uint32_t sq_tail;               // enclave: next free sqe
+    uint32_t cq_tail;               // host: completions posted so far
+    int      error;                 // host: first failed deferred request
+
+    uint64_t bounce;                // host: bounce region, page aligned
+    uint64_t bounce_size;           // host: 0 if there is none
+
+    uint32_t exitless;              // host: workers drain the ring
+    uint32_t spin;                  // host: enclave polls before exiting
+
+    // stats, host side
+    uint64_t nr_exits;              // trampoline entries
+    uint64_t nr_drains;             // drains that found queued requests
+    uint64_t nr_reqs;               // requests drained
+
+    sgx_ring_sqe sq[SGX_RING_SLOTS];
+    sgx_ring_cqe cq[SGX_RING_SLOTS];
+} sgx_ring;
+
 
 typedef enum {
     ENCLS_ECREATE      = 0x00,
@@ -155,6 +235,10 @@ typedef enum {
     ENCLS_OSGX_CPUSVN    = 0x13,
     ENCLS_OSGX_STAT      = 0x14,
     ENCLS_OSGX_SET_STACK = 0x15,
+    ENCLS_OSGX_EADD_RANGE = 0x16,
+    ENCLS_OSGX_PAGER     = 0x17,
+    ENCLS_OSGX_EPC_AGE   = 0x18,
+    ENCLS_OSGX_EVICT     = 0x19,
 } encls_cmd_t;
 
 typedef enum {
@@ -168,6 +252,34 @@ typedef enum {
    ENCLU_EACCEPTCOPY  = 0x07,
 } enclu_cmd_t;
 
+// from 5.1.3
+#define ERR_SGX_NOERROR             (0)
+#define ERR_SGX_INVALID_SIG_STRUCT  (1)        // EINIT
+#define ERR_SGX_INVALID_ATTRIBUTE   (2)        // EINIT, EGETKEY
+#define ERR_SGX_BLSTATE             (3)        // EBLOCK
+#define ERR_SGX_BLKSTATE            (3)        // EBLOCK
+#define ERR_SGX_INVALID_MEASUREMENT (4)        // EINIT
+#define ERR_SGX_NOTBLOCKABLE        (5)        // EBLOCK
+#define ERR_SGX_PG_INVLD            (6)        // EBLOCK
+#define ERR_SGX_LOCKFAIL            (7)        // EBLOCK
+#define ERR_SGX_INVALID_SIGNATURE   (8)        // EINIT
+#define ERR_SGX_MAC_COMPARE_FAIL    (9)        // ELDB, ELDU
+#define ERR_SGX_PAGE_NOT_BLOCKED    (10)        // EWB
+#define ERR_SGX_NOT_TRACKED         (11)        // EWB
+#define ERR_SGX_VA_SLOT_OCCUPIED    (12)        // EWB
+#define ERR_SGX_CHILD_PRESENT       (13)        // EWB, EREMOVE
+#define ERR_SGX_ENCLAVE_ACT         (14)        // EREMOVE
+#define ERR_SGX_ENTRYEPOCH_LOCKED   (15)        // EBLOCK
+#define ERR_SGX_INVALID_EINIT_TOKEN (16)        // EINIT
+#define ERR_SGX_PREV_TRK_INCMPL     (17)        // ETRACK
+#define ERR_SGX_PG_IS_SECS          (18)        // EBLOCK
+#define ERR_SGX_PAGE_ATTRIBUTES_MISMATCH (19)   // EACCEPT, EACCEPTCOPY
+#define ERR_SGX_PAGE_NOT_MODIFIABLE (20)        // EMODPR, EMODT
+#define ERR_SGX_INVALID_CPUSVN      (32)        // EINIT, EGETKEY
+#define ERR_SGX_INVALID_ISVSVN      (64)        // EGETKEY
+#define ERR_SGX_UNMASKED_EVENT      (128)       // EINIT
+#define ERR_SGX_INVALID_KEYNAME     (256)       // EGETKEY
+
 typedef enum {
    PT_SECS = 0x00,
    PT_TCS  = 0x01,
@@ -204,6 +316,43 @@ typedef struct {
    uint64_t secs;
  } pageinfo_t;
 
+// One page of ENCLS_OSGX_EADD_RANGE: the PAGEINFO and EPC page of an EADD,
+// padded so that PAGEINFO stays 32-byte aligned in an array
+#define EADD_DESC_EXTEND 1      // EEXTEND the whole page after EADD
+
+typedef struct {
+   pageinfo_t pageinfo;
+   uint64_t epcpage;
+   uint64_t flags;
+   uint8_t reserved[16];
+} eadd_desc_t;
+
+// Where the kernel pager put an evicted EPC page (ENCLS_OSGX_PAGER), one
+// entry per EPC page. An enclave access to a page in EPC_SWAP_OUT makes
+// qemu ELDU it with these operands; accesses to an EPC_SWAP_BUSY page
+// (being written back or loaded) are retried.
+#define EPC_SWAP_NONE    0
+#define EPC_SWAP_OUT     1      // EWB done, ELDU on access
+#define EPC_SWAP_BUSY    2
+#define EPC_SWAP_IN      3      // loaded on access, VA slot is free
+
+typedef struct {
+   pageinfo_t pageinfo;         // ELDU: backing page, PCMD, SECS, linaddr
+   uint64_t va_slot;            // VA slot of the EWB
+   uint32_t state;              // EPC_SWAP_*
+   uint8_t reserved[20];
+} epc_swap_t;
+
+// One page of ENCLS_OSGX_EVICT: EBLOCK it, then EWB it with this PAGEINFO
+// and VA slot; status gets the error code of the page
+typedef struct {
+    pageinfo_t pageinfo;
+    uint64_t epcpage;
+    uint64_t va_slot;
+    uint64_t status;
+    uint8_t reserved[8];
+} evict_desc_t;
+
 typedef struct  {
    unsigned int r:1;
    unsigned int w:1;
@@ -220,6 +369,14 @@ typedef struct {
    uint64_t reserved[7];
 } secinfo_t;
 
+// Paging crypto metadata, written by EWB and checked by ELDB/ELDU
+typedef struct {
+   secinfo_t secinfo;
+   uint64_t enclaveid;
+   uint8_t reserved[40];
+   uint64_t mac[2];
+} pcmd_t;
+
 typedef struct {
     unsigned int dbgoptin:1;
     unsigned int reserved1:31;
@@ -326,6 +483,15 @@ typedef struct {
     uint8_t      reserved2[456];
 } targetinfo_t;
 
+// Attestation service wire format (sgx_remote_attest_target_service()):
+// a challenger sends SGX_ATTEST_NONCE-byte nonces back to back on one
+// connection, and gets one response per nonce, in order:
+//   rsa_N[SGX_ATTEST_MPI] rsa_E[SGX_ATTEST_MPI] quote (report_t)
+// quote.reportData carries the nonce
+#define SGX_ATTEST_NONCE   64
+#define SGX_ATTEST_MPI     24           // sizeof(mpi), as in the one-shot flow
+#define SGX_ATTEST_RESP    (2 * SGX_ATTEST_MPI + sizeof(report_t))
+
 #define FIRST_PKCS1_5_PADDING \
     {0x00, 0x01}
 
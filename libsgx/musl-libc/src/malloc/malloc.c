@@ -36,52 +36,93 @@ void _enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
     }
 }
 
+static void* morecore(size_t *size);
+
+#define MMAP(s) morecore(&(s))
+/* EPC pages can not be given back, nor mapped outside of sys_alloc() */
+#define MUNMAP(a, s) (-1)
+#define DIRECT_MMAP(s) MFAIL
+#define HAVE_MREMAP 0
+#define ONLY_MSPACES 1
+/* Every TCS of an enclave shares the heap: dlmalloc's spin locks, which
+   spin without sched_yield() (no syscalls in the enclave) */
+#define USE_LOCKS 1
+#define USE_SPIN_LOCKS 1
+#define LACKS_SCHED_H 1
+#include "dlmalloc.inc" /* XXX: ugly include .. updating dlmalloc.inc does not trigger make */
+
+// Heap growth. Each exit asks the kernel for a run of at least the pages
+// dlmalloc needs and up to heap_batch pages, which doubles on every exit
+// (HEAP_BATCH_MIN .. SGX_EAUG_MAX_PAGES), so an allocation-heavy enclave
+// takes O(log n) exits instead of one per 4 KB page. The whole run is
+// EACCEPTed here and handed to dlmalloc: MMAP() passes asize by reference
+// and morecore() stores the size it really mapped. dlmalloc calls it with
+// the mspace locked, so heap_batch needs no lock of its own, and the exit
+// goes through the stub of the calling thread.
+#define HEAP_BATCH_MIN 8
+
+static size_t heap_batch = HEAP_BATCH_MIN;
+
 static
-void* morecore(void) {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    secinfo_t *secinfo = memalign(SECINFO_ALIGN_SIZE, sizeof(secinfo_t));
-
-    secinfo->flags.r = 1;
-    secinfo->flags.w = 1;
-    secinfo->flags.x = 0;
-    secinfo->flags.pending = 1;
-    secinfo->flags.modified = 0;
-    secinfo->flags.reserved1 = 0;
-    secinfo->flags.page_type = PT_REG;
-    int i = 0;
-    for (i = 0 ; i< 6; i++) {
-        secinfo->flags.reserved2[i] = 0;
-    }
+void* morecore(size_t *size) {
+    sgx_stub_info *stub = sgx_stub();
+    secinfo_t secinfo __attribute__((aligned(SECINFO_ALIGN_SIZE)));
+    size_t npages = (*size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t want = npages > heap_batch ? npages : heap_batch;
+    uint64_t run;
+    size_t i, n;
+
+    memset(&secinfo, 0, sizeof(secinfo));
+    secinfo.flags.r = 1;
+    secinfo.flags.w = 1;
+    secinfo.flags.pending = 1;
+    secinfo.flags.page_type = PT_REG;
 
     stub->fcode = FUNC_MALLOC;
     stub->mcode = REQUEST_EAUG;
+    stub->out_arg1 = want;
+    stub->out_arg2 = npages;
     // Enclave exit & jump into user-space trampoline
     sgx_exit(stub->trampoline);
-    unsigned long pending_page = stub->pending_page;
+    run = stub->pending_page;
+    n = stub->pending_npages;
+    if (!run || n < npages)
+        return MFAIL;
 
     // EACCEPT should be called with [RBX:the address of secinfo, RCX:the adress of pending page]
-    out_regs_t out;
-    _enclu(ENCLU_EACCEPT, (uint64_t)secinfo, (uint64_t)pending_page, 0, &out);
-    if (out.oeax == 0) {   // No error occurred in EACCEPT
-        return (void*)pending_page;
-    } else {
-        return NULL;
+    for (i = 0; i < n; i++) {
+        out_regs_t out;
+        _enclu(ENCLU_EACCEPT, (uint64_t)&secinfo, run + i * PAGE_SIZE, 0, &out);
+        if (out.oeax != 0)   // Error occurred in EACCEPT
+            break;
     }
-}
+    if (i < npages)
+        return MFAIL;
 
-#define MMAP(s) morecore()
-#define ONLY_MSPACES 1
-#define USE_LOCKS 0
-#define SINGLE_PAGE_EAUG 1
-#include "dlmalloc.inc" /* XXX: ugly include .. updating dlmalloc.inc does not trigger make */
+    if (heap_batch < SGX_EAUG_MAX_PAGES)
+        heap_batch <<= 1;
+    *size = i * PAGE_SIZE;
+    return (void*)run;
+}
 
 static mspace _ms = NULL;
+static volatile int _ms_lock;
 
 uint64_t heap_start = 0x0;
 uint64_t heap_size = 0x0;
 
+// The first malloc() of any thread sets the heap up, the others wait for
+// it: a second mspace over the same pages would corrupt both
 void _malloc_init() {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    while (__sync_lock_test_and_set(&_ms_lock, 1))
+        while (_ms_lock)
+            __asm__ __volatile__("pause" ::: "memory");
+    if (_ms) {
+        __sync_lock_release(&_ms_lock);
+        return;
+    }
+
+    sgx_stub_info *stub = sgx_stub();
     stub->fcode = FUNC_MALLOC;
     stub->mcode = MALLOC_INIT;
 
@@ -92,8 +133,11 @@ void _malloc_init() {
     heap_size = stub->heap_end - stub->heap_beg;
     printf("heap = %lx, size = %lx\n", heap_start, heap_size);
 
-    _ms = create_mspace_with_base((void*)heap_start,
-            (size_t)heap_size, 0);
+    // locked: the mspace takes its spin lock in every call
+    __atomic_store_n(&_ms, create_mspace_with_base((void*)heap_start,
+                                                   (size_t)heap_size, 1),
+                     __ATOMIC_RELEASE);
+    __sync_lock_release(&_ms_lock);
 }
 
 void* malloc(size_t bytes) {
@@ -7,7 +7,7 @@
 
 int accept(int fd, struct sockaddr *restrict addr, socklen_t *restrict len)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     stub->fcode = FUNC_ACCEPT;
     stub->out_arg1 = fd;
@@ -7,7 +7,7 @@
 
 int connect(int fd, const struct sockaddr *addr, socklen_t len)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     stub->fcode = FUNC_CONNECT;
     stub->out_arg1 = fd;
@@ -5,7 +5,7 @@
 
 int listen(int fd, int backlog)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     stub->fcode = FUNC_LISTEN;
     stub->out_arg1 = fd;
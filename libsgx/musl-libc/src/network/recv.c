@@ -5,26 +5,26 @@
 
 ssize_t recv(int fd, void *buf, size_t len, int flags)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    ssize_t rt;
     int tmp_len;
-    int rt;
-    int i;
+    int ret;
 
-    for (i = 0; i < len / SGXLIB_MAX_ARG + 1; i++) {
-        stub->fcode = FUNC_RECV;
-        stub->out_arg1 = fd;
-        stub->out_arg3 = flags;
+    if (len > SGX_RING_DATA && sgx_bounce_size())
+        return sgx_ring_bounce_io(FUNC_RECV, fd, flags, buf, len);
 
-        if (i == len / SGXLIB_MAX_ARG)
-        	tmp_len = (int)len % SGXLIB_MAX_ARG;
-        else
-        	tmp_len = SGXLIB_MAX_ARG;
-        
-        stub->out_arg2 = tmp_len;
-        sgx_exit(stub->trampoline);
+    rt = 0;
+    while (rt < len) {
+        tmp_len = len - rt < SGX_RING_DATA ? len - rt : SGX_RING_DATA;
 
-        memcpy((uint8_t *)buf + i * SGXLIB_MAX_ARG, stub->in_data1, tmp_len);
-        rt += stub->in_arg1;
+        // one exit, which also flushes any queued sends
+        ret = sgx_ring_call(FUNC_RECV, fd, 0, flags, NULL, 0,
+                            (uint8_t *)buf + rt, tmp_len);
+        if (ret < 0)
+            return rt ? rt : ret;
+
+        rt += ret;
+        if (ret < tmp_len)
+            break;
     }
 
     return rt;
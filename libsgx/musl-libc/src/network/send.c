@@ -3,29 +3,22 @@
 #include <string.h>
 #include <sgx-lib.h>
 
+// Like write(); deferred chunks are not merged to keep message boundaries
 ssize_t send(int fd, const void *buf, size_t len, int flags)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    size_t off;
     int tmp_len;
-    int i;
-    ssize_t rt;
 
-    rt = 0;
-    for (i = 0; i < len / SGXLIB_MAX_ARG + 1; i++) {
-        stub->fcode = FUNC_SEND;
-        stub->out_arg1 = fd;
-        stub->out_arg3 = flags;
+    if (sgx_ring_error() < 0)
+        return -1;
 
-        if (i == len / SGXLIB_MAX_ARG)
-        	tmp_len = (int)len % SGXLIB_MAX_ARG;
-        else
-        	tmp_len = SGXLIB_MAX_ARG;
+    if (len > SGX_RING_DATA && sgx_bounce_size())
+        return sgx_ring_bounce_io(FUNC_SEND, fd, flags, (void *)buf, len);
 
-        stub->out_arg2 = tmp_len;
-        memcpy(stub->out_data1, (uint8_t *)buf + i * SGXLIB_MAX_ARG, tmp_len);
-        sgx_exit(stub->trampoline);
-        rt += stub->in_arg1;
+    for (off = 0; off < len; off += tmp_len) {
+        tmp_len = len - off < SGX_RING_DATA ? len - off : SGX_RING_DATA;
+        sgx_ring_post(FUNC_SEND, fd, 0, flags, (uint8_t *)buf + off, tmp_len);
     }
 
-    return rt;
+    return len;
 }
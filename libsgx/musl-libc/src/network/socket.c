@@ -7,7 +7,7 @@
 
 int socket(int domain, int type, int protocol)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     stub->fcode = FUNC_SOCKET;
     stub->out_arg1 = domain;
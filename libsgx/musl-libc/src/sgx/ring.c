@@ -0,0 +1,262 @@
+#include <string.h>
+#include <sgx-lib.h>
+
+// Enclave side of the batched ocall ring (see sgx-shared.h)
+//  - sgx_ring_post(): queue a request nobody waits for; no exit unless
+//    the ring is full
+//  - sgx_ring_call(): queue a request and exit once, which also drains
+//    everything queued before it
+//  - sgx_ring_bounce_io(): same, with the data in the untrusted bounce
+//    region instead of the sqe
+// In exitless mode host workers drain the ring concurrently, so we spin
+// on sq_head/cq_tail instead of exiting and only fall back to an exit
+// after ring->spin polls.
+
+static inline
+sgx_ring *get_ring(void)
+{
+    return (sgx_ring *)SGX_RING_ADDR_OF(sgx_thread_id());
+}
+
+static inline
+sgx_ring_sqe *ring_sqe(sgx_ring *ring, uint32_t seq)
+{
+    return &ring->sq[seq & (SGX_RING_SLOTS - 1)];
+}
+
+static inline
+uint32_t ring_head(sgx_ring *ring)
+{
+    return __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static inline
+void ring_publish(sgx_ring *ring)
+{
+    __atomic_store_n(&ring->sq_tail, ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline
+int ring_exitless(sgx_ring *ring)
+{
+    return __atomic_load_n(&ring->exitless, __ATOMIC_ACQUIRE);
+}
+
+// Exitless: wait for the workers to drain up to seq, 0 if they are too slow
+static
+int ring_spin(sgx_ring *ring, uint32_t seq)
+{
+    uint32_t i;
+
+    for (i = 0; i < ring->spin; i++) {
+        if ((int32_t)(ring_head(ring) - seq) >= 0)
+            return 1;
+        __asm__ __volatile__("pause" ::: "memory");
+    }
+    return 0;
+}
+
+void sgx_ring_flush(void)
+{
+    sgx_stub_info *stub = sgx_stub();
+    sgx_ring *ring = get_ring();
+
+    if (ring_head(ring) == ring->sq_tail)
+        return;
+
+    stub->fcode = FUNC_RING;
+    sgx_exit(stub->trampoline);
+}
+
+static
+sgx_ring_sqe *ring_reserve(fcode_t fcode, uint32_t flags,
+                           int arg1, int arg2, int arg3)
+{
+    sgx_ring *ring = get_ring();
+    sgx_ring_sqe *sqe;
+
+    if (ring->sq_tail - ring_head(ring) >= SGX_RING_SLOTS) {
+        if (!ring_exitless(ring)
+            || !ring_spin(ring, ring->sq_tail - SGX_RING_SLOTS + 1))
+            sgx_ring_flush();
+    }
+
+    sqe = ring_sqe(ring, ring->sq_tail);
+    sqe->fcode = fcode;
+    sqe->flags = flags;
+    sqe->arg1 = arg1;
+    sqe->arg2 = arg2;
+    sqe->arg3 = arg3;
+    sqe->len = 0;
+
+    return sqe;
+}
+
+// Append to the last queued request if it is the same deferred stream
+// (e.g., consecutive write()s to one fd, puts()/putchar()), returns bytes
+// taken
+static
+size_t ring_coalesce(fcode_t fcode, int arg1, const void *data, size_t len)
+{
+    sgx_ring *ring = get_ring();
+    sgx_ring_sqe *sqe;
+    size_t room;
+
+    // a worker may be running the last sqe already
+    if (ring_exitless(ring) || ring_head(ring) == ring->sq_tail)
+        return 0;
+
+    sqe = ring_sqe(ring, ring->sq_tail - 1);
+    if (sqe->fcode != fcode || sqe->arg1 != arg1
+        || !(sqe->flags & SGX_RING_DEFERRED))
+        return 0;
+
+    room = SGX_RING_DATA - sqe->len;
+    if (len > room)
+        len = room;
+    memcpy(sqe->data + sqe->len, data, len);
+    sqe->len += len;
+
+    return len;
+}
+
+void sgx_ring_post(fcode_t fcode, int arg1, int arg2, int arg3,
+                   const void *data, size_t len)
+{
+    sgx_ring *ring = get_ring();
+    sgx_ring_sqe *sqe;
+
+    if (len > SGX_RING_DATA)
+        len = SGX_RING_DATA;
+
+    sqe = ring_reserve(fcode, SGX_RING_DEFERRED, arg1, arg2, arg3);
+    if (len)
+        memcpy(sqe->data, data, len);
+    sqe->len = len;
+
+    ring_publish(ring);
+}
+
+// Queue (data, len) as deferred byte stream requests, merging with the
+// previous one when possible
+void sgx_ring_post_stream(fcode_t fcode, int arg1, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t n;
+
+    if (fcode == FUNC_WRITE || fcode == FUNC_PUTS) {
+        n = ring_coalesce(fcode, arg1, p, len);
+        p += n;
+        len -= n;
+    }
+
+    while (len > 0) {
+        n = len < SGX_RING_DATA ? len : SGX_RING_DATA;
+        sgx_ring_post(fcode, arg1, 0, 0, p, n);
+        p += n;
+        len -= n;
+    }
+}
+
+// Queue the reserved sqe, wait for it (spin or exit) and return its
+// completion
+static
+int ring_submit(sgx_ring *ring)
+{
+    uint32_t seq = ring->sq_tail;
+
+    ring_publish(ring);
+    if (!ring_exitless(ring) || !ring_spin(ring, seq + 1))
+        sgx_ring_flush();
+
+    if (ring->cq[seq & (SGX_RING_SLOTS - 1)].seq != seq)
+        return -1;
+    return ring->cq[seq & (SGX_RING_SLOTS - 1)].ret;
+}
+
+int sgx_ring_call(fcode_t fcode, int arg1, int arg2, int arg3,
+                  const void *in, size_t inlen, void *out, size_t outlen)
+{
+    sgx_ring *ring = get_ring();
+    sgx_ring_sqe *sqe;
+    int ret;
+
+    if (inlen > SGX_RING_DATA)
+        inlen = SGX_RING_DATA;
+    if (outlen > SGX_RING_DATA)
+        outlen = SGX_RING_DATA;
+
+    sqe = ring_reserve(fcode, 0, arg1, arg2, arg3);
+    if (inlen)
+        memcpy(sqe->data, in, inlen);
+    sqe->len = inlen > outlen ? inlen : outlen;
+
+    // a positive ret is the number of bytes handed back in sqe->data
+    ret = ring_submit(ring);
+    if (out && ret > 0)
+        memcpy(out, sqe->data, (size_t)ret < outlen ? (size_t)ret : outlen);
+
+    return ret;
+}
+
+size_t sgx_bounce_size(void)
+{
+    return get_ring()->bounce_size;
+}
+
+// read/write/send/recv on a large buffer: one exit per bounce region
+// worth of data instead of one per SGX_RING_DATA chunk; stops at the
+// first short transfer like the syscall would
+ssize_t sgx_ring_bounce_io(fcode_t fcode, int fd, int flags,
+                           void *buf, size_t len)
+{
+    sgx_ring *ring = get_ring();
+    uint8_t *bounce = (uint8_t *)(uintptr_t)ring->bounce;
+    int to_host = (fcode == FUNC_WRITE || fcode == FUNC_SEND);
+    sgx_ring_sqe *sqe;
+    size_t done = 0;
+    size_t n;
+    int ret;
+
+    if (!ring->bounce_size)
+        return -1;
+
+    while (done < len) {
+        n = len - done;
+        if (n > ring->bounce_size)
+            n = ring->bounce_size;
+        // sqe->len is 32 bits
+        if (n > INT32_MAX)
+            n = INT32_MAX & ~(PAGE_SIZE - 1);
+
+        if (to_host)
+            memcpy(bounce, (uint8_t *)buf + done, n);
+
+        sqe = ring_reserve(fcode, SGX_RING_BOUNCE, fd, 0, flags);
+        sqe->len = n;
+        ret = ring_submit(ring);
+        if (ret < 0)
+            return done ? (ssize_t)done : ret;
+        if ((size_t)ret > n)
+            ret = n;
+
+        if (!to_host)
+            memcpy((uint8_t *)buf + done, bounce, ret);
+
+        done += ret;
+        if ((size_t)ret < n)
+            break;
+    }
+
+    return done;
+}
+
+// Error of the first failed deferred request since the last check
+int sgx_ring_error(void)
+{
+    sgx_ring *ring = get_ring();
+
+    if (!ring->error)
+        return 0;
+    return __atomic_exchange_n(&ring->error, 0, __ATOMIC_ACQ_REL);
+}
@@ -2,11 +2,12 @@
 
 #include <sgx-lib.h>
 
+// Deferred and merged with the surrounding puts()/putchar() output
 int putchar(int c)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    stub->out_arg1 = (int)c;
-    stub->fcode = FUNC_PUTCHAR;
+    unsigned char ch = (unsigned char)c;
 
-    sgx_exit(stub->trampoline);
+    sgx_ring_post_stream(FUNC_PUTS, 0, &ch, 1);
+
+    return ch;
 }
@@ -6,7 +6,7 @@
 
 struct tm *gmtime(const time_t *t)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
     struct tm temp_tm;
 
     stub->fcode = FUNC_GMTIME;
@@ -6,14 +6,12 @@
 
 time_t time(time_t *t)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    time_t now = (time_t)-1;
 
-    stub->fcode = FUNC_TIME;
-
-    sgx_exit(stub->trampoline);
+    sgx_ring_call(FUNC_TIME, 0, 0, 0, NULL, 0, &now, sizeof(time_t));
 
     if (t != NULL)
-        memcpy(t, stub->out_data1, sizeof(time_t));
+        *t = now;
 
-    return stub->in_arg3;
+    return now;
 }
@@ -6,12 +6,6 @@
 
 int close(int fd)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-
-    stub->fcode = FUNC_CLOSE;
-    stub->out_arg1 = fd;
-
-    sgx_exit(stub->trampoline);
-
-    return stub->in_arg1;
+    // queued writes to fd are drained before it is closed
+    return sgx_ring_call(FUNC_CLOSE, fd, 0, 0, NULL, 0, NULL, 0);
 }
@@ -6,25 +6,26 @@
 
 ssize_t read(int fd, void *buf, size_t count)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    int tmp_len;
     ssize_t rt;
-    int i;
+    int tmp_len;
+    int ret;
+
+    if (count > SGX_RING_DATA && sgx_bounce_size())
+        return sgx_ring_bounce_io(FUNC_READ, fd, 0, buf, count);
 
     rt = 0;
-    for (i = 0; i < count / SGXLIB_MAX_ARG + 1; i++) {
-        stub->fcode = FUNC_READ;
-        stub->out_arg1 = fd;
+    while (rt < count) {
+        tmp_len = count - rt < SGX_RING_DATA ? count - rt : SGX_RING_DATA;
 
-        if (i == count / SGXLIB_MAX_ARG)
-            tmp_len = (int)count % SGXLIB_MAX_ARG;
-        else
-            tmp_len = SGXLIB_MAX_ARG;
+        // one exit, which also flushes any queued writes
+        ret = sgx_ring_call(FUNC_READ, fd, 0, 0, NULL, 0,
+                            (uint8_t *)buf + rt, tmp_len);
+        if (ret < 0)
+            return rt ? rt : ret;
 
-        stub->out_arg2 = tmp_len;
-        sgx_exit(stub->trampoline);
-        memcpy((uint8_t *)buf + i * SGXLIB_MAX_ARG, stub->in_data1, tmp_len);
-        rt += stub->in_arg1;
+        rt += ret;
+        if (ret < tmp_len)
+            break;
     }
 
     return rt;
@@ -4,28 +4,18 @@
 #include <string.h>
 #include <sgx-lib.h>
 
+// Small writes are deferred: queued in the ocall ring and written at the
+// next exit, so a failure shows up on a later write().  Large ones go
+// through the bounce region in one exit.
 ssize_t write(int fd, const void *buf, size_t count)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    int tmp_len;
-    int i;
-    ssize_t rt;
+    if (sgx_ring_error() < 0)
+        return -1;
 
-    rt = 0;
-    for (i = 0; i < count / SGXLIB_MAX_ARG + 1; i++) {
-        stub->fcode = FUNC_WRITE;
-        stub->out_arg1 = fd;
+    if (count > SGX_RING_DATA && sgx_bounce_size())
+        return sgx_ring_bounce_io(FUNC_WRITE, fd, 0, (void *)buf, count);
 
-        if (i == count/SGXLIB_MAX_ARG)
-            tmp_len = (int)count % SGXLIB_MAX_ARG;
-        else
-            tmp_len = SGXLIB_MAX_ARG;
+    sgx_ring_post_stream(FUNC_WRITE, fd, buf, count);
 
-        stub->out_arg2 = tmp_len;
-        memcpy(stub->out_data1, (uint8_t *)buf + i * SGXLIB_MAX_ARG, tmp_len);
-        sgx_exit(stub->trampoline);
-        rt += stub->in_arg1;
-    }
-
-    return rt;
+    return count;
 }
@@ -18,9 +18,14 @@
 #include <sgx-lib.h>
 #include <sgx-shared.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdbool.h>
 
+#include <polarssl/aes.h>
 #include <polarssl/aes_cmac128.h>
 #include <polarssl/sha1.h>
 #include <polarssl/sha256.h>
@@ -31,12 +36,12 @@
 #define EXPONENT 3
 #define KEY_SIZE 128
 
-int sgx_make_server(int port) 
+static
+int make_listener(int port)
 {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len;
-    
+    int server_fd;
+    struct sockaddr_in server_addr;
+
     server_fd = socket(PF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
         puts("socket error");
@@ -61,24 +66,92 @@ int sgx_make_server(int port)
         return -1;
     }
     
-    if (listen(server_fd, 10) != 0) {
+    if (listen(server_fd, SGX_ATTEST_BACKLOG) != 0) {
         puts("listen error");
         close(server_fd);
         return -1;
     }
-    
+
+    return server_fd;
+}
+
+int sgx_make_server(int port) 
+{
+    int server_fd, client_fd;
+
+    server_fd = make_listener(port);
+    if (server_fd < 0)
+        return -1;
+
+    client_fd = sgx_accept_client(server_fd);
+    close(server_fd);
+    return client_fd;
+}
+
+int sgx_accept_client(int server_fd)
+{
+    struct sockaddr_in client_addr;
+    socklen_t addr_len;
+    int client_fd;
+
     addr_len = sizeof(client_addr);
     client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len);
     if (client_fd < 0) {
         puts("accept error");
-        close(server_fd);
         return -1;
     }
-
-    close(server_fd);
     return client_fd;
 }
 
+// Attestation services keep one listening socket per port, shared by all
+// enclave threads serving it; the first caller creates it
+#define ATTEST_LISTENERS 8
+
+static struct {
+    int port;
+    int fd;
+} listeners[ATTEST_LISTENERS];
+static int nr_listeners;
+static volatile int listeners_lock;
+
+void sgx_attest_lock(volatile int *lock)
+{
+    while (__sync_lock_test_and_set(lock, 1))
+        while (*lock)
+            __asm__ __volatile__("pause" ::: "memory");
+}
+
+void sgx_attest_unlock(volatile int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+int sgx_attest_listen(int port)
+{
+    int fd = -1;
+    int i;
+
+    sgx_attest_lock(&listeners_lock);
+    for (i = 0; i < nr_listeners; i++) {
+        if (listeners[i].port == port) {
+            fd = listeners[i].fd;
+            goto out;
+        }
+    }
+    if (nr_listeners == ATTEST_LISTENERS)
+        goto out;
+
+    fd = make_listener(port);
+    if (fd >= 0) {
+        listeners[nr_listeners].port = port;
+        listeners[nr_listeners].fd = fd;
+        nr_listeners++;
+    }
+out:
+    sgx_attest_unlock(&listeners_lock);
+    return fd;
+}
+
 int sgx_connect_server(const char *target_ip, int target_port)
 {
     struct sockaddr_in target_addr;
@@ -152,50 +225,449 @@ int sgx_match_mac(unsigned char *report_key, report_t *report)
     return 1;
 }
 
-int sgx_make_quote(const char* pers, report_t *report, 
-        unsigned char *rsa_N, unsigned char *rsa_E)
+// Reports are checked against the report key of their KEYID/MISCSELECT;
+// EREPORT keeps one KEYID per platform boot, so a few slots cover every
+// peer and EGETKEY runs once instead of once per attestation
+#define REPORT_KEY_SLOTS 8
+
+static struct {
+    bool valid;
+    uint8_t keyid[32];
+    miscselect_t miscselect;
+    unsigned char key[DEVICE_KEY_LENGTH];
+} report_keys[REPORT_KEY_SLOTS];
+static int next_report_key;
+static volatile int report_keys_lock;
+
+int sgx_get_report_key(report_t *report, unsigned char *report_key)
+{
+    keyrequest_t keyreq __attribute__((aligned(128)));
+    unsigned char key[DEVICE_KEY_LENGTH] __attribute__((aligned(16)));
+    int i;
+
+    sgx_attest_lock(&report_keys_lock);
+    for (i = 0; i < REPORT_KEY_SLOTS; i++) {
+        if (report_keys[i].valid
+            && !memcmp(report_keys[i].keyid, report->keyid, 32)
+            && !memcmp(&report_keys[i].miscselect, &report->miscselect,
+                       sizeof(miscselect_t))) {
+            memcpy(report_key, report_keys[i].key, DEVICE_KEY_LENGTH);
+            sgx_attest_unlock(&report_keys_lock);
+            return 1;
+        }
+    }
+    sgx_attest_unlock(&report_keys_lock);
+
+    //Get Report key from QEMU
+    memset(&keyreq, 0, sizeof(keyreq));
+    keyreq.keyname = REPORT_KEY;
+    memcpy(&keyreq.keyid, &report->keyid, 32);
+    memcpy(&keyreq.miscmask, &report->miscselect, 4);
+    sgx_getkey(&keyreq, key);
+    memcpy(report_key, key, DEVICE_KEY_LENGTH);
+
+    sgx_attest_lock(&report_keys_lock);
+    i = next_report_key++ % REPORT_KEY_SLOTS;
+    memcpy(report_keys[i].keyid, report->keyid, 32);
+    memcpy(&report_keys[i].miscselect, &report->miscselect, sizeof(miscselect_t));
+    memcpy(report_keys[i].key, key, DEVICE_KEY_LENGTH);
+    report_keys[i].valid = true;
+    sgx_attest_unlock(&report_keys_lock);
+
+    return 1;
+}
+
+// Check the MAC of a report targeted at this enclave
+int sgx_verify_report(report_t *report)
+{
+    unsigned char report_key[DEVICE_KEY_LENGTH];
+
+    if (sgx_get_report_key(report, report_key) < 0)
+        return -1;
+    return sgx_match_mac(report_key, report);
+}
+
+// TARGETINFO of the enclave described by conf; the SIGSTRUCT is parsed
+// once per conf
+#define TARGETINFO_SLOTS 8
+
+static struct {
+    char conf[256];
+    targetinfo_t targetinfo;
+} targetinfos[TARGETINFO_SLOTS];
+static int nr_targetinfos;
+static volatile int targetinfos_lock;
+
+int sgx_get_targetinfo(char *conf, targetinfo_t *targetinfo)
+{
+    sigstruct_t *sigstruct;
+    int i;
+
+    sgx_attest_lock(&targetinfos_lock);
+    for (i = 0; i < nr_targetinfos; i++) {
+        if (!strcmp(targetinfos[i].conf, conf)) {
+            memcpy(targetinfo, &targetinfos[i].targetinfo, sizeof(targetinfo_t));
+            sgx_attest_unlock(&targetinfos_lock);
+            return 1;
+        }
+    }
+    sgx_attest_unlock(&targetinfos_lock);
+
+    //Get SIGSTRUCT of the target
+    sigstruct = sgx_load_sigstruct(conf);
+    memset(targetinfo, 0, sizeof(targetinfo_t));
+    memcpy(&targetinfo->measurement, &sigstruct->enclaveHash, 32);
+    memcpy(&targetinfo->attributes, &sigstruct->attributes, 16);
+    memcpy(&targetinfo->miscselect, &sigstruct->miscselect, 4);
+    free(sigstruct);
+
+    sgx_attest_lock(&targetinfos_lock);
+    if (nr_targetinfos < TARGETINFO_SLOTS
+        && strlen(conf) < sizeof(targetinfos[0].conf)) {
+        strcpy(targetinfos[nr_targetinfos].conf, conf);
+        memcpy(&targetinfos[nr_targetinfos].targetinfo, targetinfo,
+               sizeof(targetinfo_t));
+        nr_targetinfos++;
+    }
+    sgx_attest_unlock(&targetinfos_lock);
+
+    return 1;
+}
+
+// Quoting key
+//  - generated once per quoting enclave (or unsealed from a previous run)
+//    and reused by every quote; key generation costs seconds of emulated
+//    time, signing a report is cheap
+//  - persisted sealed with an EGETKEY seal key bound to MRENCLAVE: the
+//    components are AES-CTR encrypted and CMAC'ed with keys derived from
+//    it, a fresh KEYID per sealing makes the CTR nonce unique
+//  - quote_lock serializes key setup and signing, enclave threads share
+//    one rsa_context
+#define QUOTE_KEY_MAGIC  0x59454b51     // "QKEY"
+#define QUOTE_KEY_NCOMPS 8              // N, E, D, P, Q, DP, DQ, QP
+#define QUOTE_KEY_MAX    (QUOTE_KEY_NCOMPS * (2 + KEY_SIZE / 8))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;                       // bytes used in data[]
+    uint8_t  keyid[32];                 // KEYREQUEST.KEYID of the seal key
+    uint8_t  data[QUOTE_KEY_MAX];       // encrypted (len, bytes) components
+    uint8_t  mac[MAC_SIZE];             // CMAC over everything above
+} sealed_quote_key_t;
+
+static rsa_context quote_rsa;
+static bool quote_key_ready;
+static volatile int quote_lock;
+
+static
+mpi *quote_key_comp(rsa_context *rsa, int i)
+{
+    mpi *comps[QUOTE_KEY_NCOMPS] = {
+        &rsa->N, &rsa->E, &rsa->D, &rsa->P,
+        &rsa->Q, &rsa->DP, &rsa->DQ, &rsa->QP,
+    };
+    return comps[i];
+}
+
+// Derive the encryption and MAC keys from the seal key of keyid
+static
+int quote_seal_keys(const uint8_t *keyid, unsigned char *enc_key,
+                    unsigned char *mac_key)
+{
+    keyrequest_t keyreq __attribute__((aligned(128)));
+    unsigned char seal_key[DEVICE_KEY_LENGTH] __attribute__((aligned(16))) = {0};
+    uint32_t status;
+    const char enc_label[16] = "quote-key-enc";
+    const char mac_label[16] = "quote-key-mac";
+    aes_cmac128_context ctx;
+
+    memset(&keyreq, 0, sizeof(keyreq));
+    keyreq.keyname = SEAL_KEY;
+    keyreq.keypolicy.mrenclave = 1;
+    memcpy(keyreq.keyid, keyid, sizeof(keyreq.keyid));
+    status = sgx_getkey(&keyreq, seal_key);
+    if (status != 0) {
+        printf("EGETKEY failed: %u\n", status);
+        return -1;
+    }
+
+    aes_cmac128_starts(&ctx, seal_key);
+    aes_cmac128_update(&ctx, (const uint8_t *)enc_label, sizeof(enc_label));
+    aes_cmac128_final(&ctx, enc_key);
+
+    aes_cmac128_starts(&ctx, seal_key);
+    aes_cmac128_update(&ctx, (const uint8_t *)mac_label, sizeof(mac_label));
+    aes_cmac128_final(&ctx, mac_key);
+
+    memset(seal_key, 0, sizeof(seal_key));
+    return 1;
+}
+
+static
+void quote_seal_crypt(const unsigned char *enc_key, unsigned char *data,
+                      size_t len)
+{
+    unsigned char nonce[16], stream[16];
+    size_t off = 0;
+    aes_context aes;
+
+    memset(nonce, 0, sizeof(nonce));
+    aes_setkey_enc(&aes, enc_key, 128);
+    aes_crypt_ctr(&aes, len, &off, nonce, stream, data, data);
+    memset(&aes, 0, sizeof(aes));
+}
+
+static
+void quote_seal_mac(const unsigned char *mac_key, sealed_quote_key_t *sealed,
+                    unsigned char *mac)
+{
+    aes_cmac128_context ctx;
+
+    aes_cmac128_starts(&ctx, mac_key);
+    aes_cmac128_update(&ctx, (uint8_t *)sealed,
+                       offsetof(sealed_quote_key_t, mac));
+    aes_cmac128_final(&ctx, mac);
+}
+
+static
+int quote_key_seal(rsa_context *rsa, ctr_drbg_context *ctr_drbg,
+                   sealed_quote_key_t *sealed)
+{
+    unsigned char enc_key[16], mac_key[16];
+    uint8_t *p = sealed->data;
+
+    memset(sealed, 0, sizeof(*sealed));
+    sealed->magic = QUOTE_KEY_MAGIC;
+    if (ctr_drbg_random(ctr_drbg, sealed->keyid, sizeof(sealed->keyid)) != 0)
+        return -1;
+
+    for (int i = 0; i < QUOTE_KEY_NCOMPS; i++) {
+        mpi *X = quote_key_comp(rsa, i);
+        size_t n = mpi_size(X);
+
+        if (p + 2 + n > sealed->data + QUOTE_KEY_MAX)
+            return -1;
+        p[0] = n >> 8;
+        p[1] = n & 0xff;
+        if (mpi_write_binary(X, p + 2, n) != 0)
+            return -1;
+        p += 2 + n;
+    }
+    sealed->len = p - sealed->data;
+
+    if (quote_seal_keys(sealed->keyid, enc_key, mac_key) < 0)
+        return -1;
+    quote_seal_crypt(enc_key, sealed->data, sealed->len);
+    quote_seal_mac(mac_key, sealed, sealed->mac);
+
+    memset(enc_key, 0, sizeof(enc_key));
+    memset(mac_key, 0, sizeof(mac_key));
+    return 1;
+}
+
+static
+int quote_key_unseal(sealed_quote_key_t *sealed, rsa_context *rsa)
+{
+    unsigned char enc_key[16], mac_key[16], mac[MAC_SIZE];
+    uint8_t *p = sealed->data;
+    uint8_t *end;
+    int ret = -1;
+
+    if (sealed->magic != QUOTE_KEY_MAGIC || sealed->len > QUOTE_KEY_MAX)
+        return -1;
+
+    if (quote_seal_keys(sealed->keyid, enc_key, mac_key) < 0)
+        goto out;
+    quote_seal_mac(mac_key, sealed, mac);
+    if (memcmp(mac, sealed->mac, MAC_SIZE) != 0) {
+        puts("Sealed quoting key does not match this enclave");
+        goto out;
+    }
+    quote_seal_crypt(enc_key, sealed->data, sealed->len);
+
+    end = sealed->data + sealed->len;
+    for (int i = 0; i < QUOTE_KEY_NCOMPS; i++) {
+        size_t n;
+
+        if (p + 2 > end)
+            goto out;
+        n = (p[0] << 8) | p[1];
+        if (p + 2 + n > end
+            || mpi_read_binary(quote_key_comp(rsa, i), p + 2, n) != 0)
+            goto out;
+        p += 2 + n;
+    }
+    rsa->len = (mpi_msb(&rsa->N) + 7) >> 3;
+    if (rsa_check_privkey(rsa) == 0)
+        ret = 1;
+out:
+    memset(sealed, 0, sizeof(*sealed));
+    memset(enc_key, 0, sizeof(enc_key));
+    memset(mac_key, 0, sizeof(mac_key));
+    return ret;
+}
+
+static
+int quote_key_load(const char *sealed_path, rsa_context *rsa)
+{
+    sealed_quote_key_t sealed;
+    int fd, n, ret;
+
+    fd = open(sealed_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    for (n = 0; n < sizeof(sealed); n += ret) {
+        ret = read(fd, (uint8_t *)&sealed + n, sizeof(sealed) - n);
+        if (ret <= 0)
+            break;
+    }
+    close(fd);
+    if (n != sizeof(sealed))
+        return -1;
+
+    return quote_key_unseal(&sealed, rsa);
+}
+
+static
+int quote_key_store(const char *sealed_path, sealed_quote_key_t *sealed)
+{
+    int fd, ret;
+
+    fd = open(sealed_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+    ret = write(fd, sealed, sizeof(*sealed));
+    close(fd);
+
+    return (ret == sizeof(*sealed)) ? 1 : -1;
+}
+
+static
+int quote_key_generate(const char *pers, const char *sealed_path,
+                       rsa_context *rsa)
 {
     entropy_context entropy;
     ctr_drbg_context ctr_drbg;
-    rsa_context rsa;
-    unsigned char hash[32], sign[32];
+    sealed_quote_key_t sealed;
     int ret;
 
-    sha256((unsigned char *)report, sizeof(report_t), hash, 0);
-
     entropy_init(&entropy);
 
-    if((ret = ctr_drbg_init(&ctr_drbg, entropy_func, &entropy, 
+    if((ret = ctr_drbg_init(&ctr_drbg, entropy_func, &entropy,
             (const unsigned char *)pers, strlen(pers))) != 0)
     {
         printf("Failed! ctr_drbg_init returned %d\n", ret);
         return -1;
     }
 
-    rsa_init(&rsa, RSA_PKCS_V15, 0);
-    
     puts("Generating RSA key ...");
 
-    if((ret = rsa_gen_key(&rsa, ctr_drbg_random, &ctr_drbg, KEY_SIZE, EXPONENT)) != 0)
+    if((ret = rsa_gen_key(rsa, ctr_drbg_random, &ctr_drbg, KEY_SIZE, EXPONENT)) != 0)
     {
-        printf("Failed! rsa_gen_key returned %d\n", ret);   
+        printf("Failed! rsa_gen_key returned %d\n", ret);
         return -1;
-    }   
-    
-    mpi_write_binary(&rsa.N, rsa_N, sizeof(mpi));
-    mpi_write_binary(&rsa.E, rsa_E, sizeof(mpi));
+    }
+
+    if (!sealed_path)
+        return 1;
+
+    // A key that cannot be sealed (no seal key) is not usable either
+    if (quote_key_seal(rsa, &ctr_drbg, &sealed) < 0) {
+        puts("Failed to seal quoting key");
+        return -1;
+    }
+    if (quote_key_store(sealed_path, &sealed) < 0)
+        printf("Failed to store sealed quoting key to %s\n", sealed_path);
+
+    return 1;
+}
+
+// Set up the quoting key: unseal it from sealed_path if that holds a key
+// sealed by this enclave, otherwise generate one (and seal it there).
+// sealed_path may be NULL to keep the key in enclave memory only.
+int sgx_quote_key_init(const char *pers, const char *sealed_path)
+{
+    int ret = 1;
+
+    sgx_attest_lock(&quote_lock);
+    if (quote_key_ready)
+        goto out;
 
-    puts("Signing RSA ...");
+    rsa_init(&quote_rsa, RSA_PKCS_V15, 0);
+    if (sealed_path && quote_key_load(sealed_path, &quote_rsa) > 0) {
+        puts("Unsealed RSA key");
+    } else {
+        rsa_free(&quote_rsa);
+        rsa_init(&quote_rsa, RSA_PKCS_V15, 0);
+        ret = quote_key_generate(pers, sealed_path, &quote_rsa);
+    }
+    quote_key_ready = (ret > 0);
+out:
+    sgx_attest_unlock(&quote_lock);
+    return ret;
+}
+
+// Public part of the quoting key, as sent to challengers
+int sgx_quote_pubkey(unsigned char *rsa_N, unsigned char *rsa_E)
+{
+    if (!quote_key_ready)
+        return -1;
+
+    mpi_write_binary(&quote_rsa.N, rsa_N, sizeof(mpi));
+    mpi_write_binary(&quote_rsa.E, rsa_E, sizeof(mpi));
+    return 1;
+}
+
+static
+int quote_sign(report_t *report)
+{
+    unsigned char hash[32], sign[32];
+    int ret;
 
-    if((ret = rsa_pkcs1_sign(&rsa, NULL, NULL, RSA_PRIVATE, POLARSSL_MD_NONE, 
+    sha256((unsigned char *)report, sizeof(report_t), hash, 0);
+
+    if((ret = rsa_pkcs1_sign(&quote_rsa, NULL, NULL, RSA_PRIVATE, POLARSSL_MD_NONE,
                     0, hash, sign)) != 0)
     {
-        printf("Sign error! ret = %d\n", ret);      
+        printf("Sign error! ret = %d\n", ret);
         return -1;
     }
-    
+
     memcpy(&report->mac, sign, 16);
+    return 1;
+}
+
+// Turn n reports into quotes in place with the cached quoting key (see
+// sgx_quote_key_init()); returns the number of quotes made
+int sgx_make_quotes(report_t *reports, int n)
+{
+    int i;
+
+    if (!quote_key_ready)
+        return -1;
+
+    sgx_attest_lock(&quote_lock);
+    for (i = 0; i < n; i++) {
+        if (quote_sign(&reports[i]) < 0)
+            break;
+    }
+    sgx_attest_unlock(&quote_lock);
+
+    return i;
+}
+
+int sgx_make_quote(const char* pers, report_t *report,
+        unsigned char *rsa_N, unsigned char *rsa_E)
+{
+    if (sgx_quote_key_init(pers, NULL) < 0)
+        return -1;
+
+    sgx_quote_pubkey(rsa_N, rsa_E);
+
+    if (sgx_make_quotes(report, 1) != 1)
+        return -1;
+
     puts("Making QUOTE done!");
-    
     return 1;
 }
@@ -62,7 +62,7 @@ void _enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
 
 int sgx_enclave_read(void *buf, int len)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     if (len <= 0) {
         return -1;
@@ -76,7 +76,7 @@ int sgx_enclave_read(void *buf, int len)
 
 int sgx_enclave_write(void *buf, int len)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = sgx_stub();
 
     if (len <= 0) {
         return -1;
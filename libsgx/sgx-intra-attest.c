@@ -26,12 +26,9 @@ int sgx_intra_attest_challenger(int target_port, char *conf)
     int target_fd;
     const char *target_ip = "127.0.0.1";
     targetinfo_t targetinfo;
-    sigstruct_t *sigstruct;
-    keyrequest_t keyreq;
     report_t report;
     report_t report_send;
     unsigned char nonce[64];
-    unsigned char report_key[DEVICE_KEY_LENGTH];
 
 
     //Connect to Target enclave (Intra)
@@ -43,15 +40,12 @@ int sgx_intra_attest_challenger(int target_port, char *conf)
     }
     puts("Target enclave accept!");
     
-    //Get SIGSTRUCT of enclave B
-    sigstruct = sgx_load_sigstruct(conf);
+    //Get TARGETINFO of enclave B (SIGSTRUCT is parsed once)
+    sgx_get_targetinfo(conf, &targetinfo);
     puts("Got SIGSTRUCT!");
 
     //EREPORT with sigstruct
     puts("Sending REPORT to Target enclave ...");
-    memcpy(&targetinfo.measurement, &sigstruct->enclaveHash, 32);
-    memcpy(&targetinfo.attributes, &sigstruct->attributes, 16);
-    memcpy(&targetinfo.miscselect, &sigstruct->miscselect, 4);
     sgx_report(&targetinfo, nonce, &report_send);
     if(sgx_write_sock(target_fd, &report_send, sizeof(report_t)) < 0) {
         puts("sgx_write_sock error\n");
@@ -65,15 +59,8 @@ int sgx_intra_attest_challenger(int target_port, char *conf)
     }
     puts("Received REPORT from Target enclave");
 
-    //Get Report key from QEMU
-    keyreq.keyname = REPORT_KEY;
-    memcpy(&keyreq.keyid, &report.keyid, 16);
-    memcpy(&keyreq.miscmask, &report.miscselect, 4);
-    sgx_getkey(&keyreq, report_key);
-    puts("Received Report Key");
-    
-    //Check MAC matching
-    if(sgx_match_mac(report_key, &report) < 0) {
+    //Check MAC matching (Report key is cached)
+    if(sgx_verify_report(&report) < 0) {
         puts("Mac not match!\n");
         goto failed;
     }
@@ -88,62 +75,82 @@ failed:
     return -1;
 }
 
-
-int sgx_intra_attest_target(int challenger_port)
+// One challenger on an accepted connection
+static
+int intra_attest_target_session(int client_fd)
 {
-    int client_fd;
     targetinfo_t targetinfo;
-    keyrequest_t keyreq;
     report_t report;
     report_t report_send;
     unsigned char nonce[64];
-    unsigned char report_key[DEVICE_KEY_LENGTH];
 
-    //server socket for Challenger enclave (Intra)
-    puts("Listening to Challenger enclave ...");
-    client_fd = sgx_make_server(challenger_port);
-    if(client_fd < 0) {
-        puts("sgx_connect_server error\n");
-        return -1;
-    }
-    puts("Challenger accepted");
-      
     //Get REPORT from Challenger enclvae
     if(sgx_get_report(client_fd, &report) < 0) {
         puts("sgx_get_report error\n");
-        goto failed;
+        return -1;
     }
     puts("Received REPORT from Challenger enclave");
 
-    //Get Report key from QEMU
-    keyreq.keyname = REPORT_KEY;
-    memcpy(&keyreq.keyid, &report.keyid, 16);
-    memcpy(&keyreq.miscmask, &report.miscselect, 4);
-    sgx_getkey(&keyreq, report_key);
-    puts("Received Report Key");
-
-    //Check MAC matching
-    if(sgx_match_mac(report_key, &report) < 0) {
+    //Check MAC matching (Report key is cached)
+    if(sgx_verify_report(&report) < 0) {
         puts("Mac not match!\n");
-        goto failed;
+        return -1;
     }
     puts("MAC match, PASS!");
 
     //EREPORT with given report
     puts("Sending REPORT to Challenger enclave ...");
+    memset(&targetinfo, 0, sizeof(targetinfo));
     memcpy(&targetinfo.measurement, &report.mrenclave, 32);
     memcpy(&targetinfo.attributes, &report.attributes, 16);
     memcpy(&targetinfo.miscselect, &report.miscselect, 4);
     sgx_report(&targetinfo, nonce, &report_send);
     if(sgx_write_sock(client_fd, &report_send, sizeof(report_t)) < 0) {
         puts("sgx_write_sock error\n");
-        goto failed;
+        return -1;
     }
-
-    close(client_fd);
-    puts("Target enclave end");
     return 1;
-failed:
+}
+
+int sgx_intra_attest_target(int challenger_port)
+{
+    int client_fd, ret;
+
+    //server socket for Challenger enclave (Intra)
+    puts("Listening to Challenger enclave ...");
+    client_fd = sgx_make_server(challenger_port);
+    if(client_fd < 0) {
+        puts("sgx_connect_server error\n");
+        return -1;
+    }
+    puts("Challenger accepted");
+
+    ret = intra_attest_target_session(client_fd);
+
     close(client_fd);
-    return -1;
+    if (ret > 0)
+        puts("Target enclave end");
+    return ret;
+}
+
+// Serve challengers until the listening socket fails; may run on every
+// enclave thread (TCS) at once
+int sgx_intra_attest_target_service(int challenger_port)
+{
+    int server_fd, client_fd;
+
+    server_fd = sgx_attest_listen(challenger_port);
+    if(server_fd < 0) {
+        puts("sgx_attest_listen error\n");
+        return -1;
+    }
+
+    for (;;) {
+        client_fd = sgx_accept_client(server_fd);
+        if(client_fd < 0)
+            return -1;
+
+        intra_attest_target_session(client_fd);
+        close(client_fd);
+    }
 }
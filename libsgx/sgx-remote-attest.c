@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include <polarssl/rsa.h>
 #include <polarssl/sha256.h>
@@ -114,10 +115,7 @@ int sgx_remote_attest_target(int challenger_port, int quote_port, char *conf)
     report_t quote;
     
     int client_fd, quote_fd;
-    sigstruct_t *sigstruct; 
     char *resultmsg;
-    keyrequest_t keyreq;
-    unsigned char report_key[DEVICE_KEY_LENGTH];
     unsigned char *rsa_N, *rsa_E;
 
     rsa_N = malloc(sizeof(mpi));
@@ -151,15 +149,12 @@ int sgx_remote_attest_target(int challenger_port, int quote_port, char *conf)
     }
     puts("Quoting enclave connected!");
 
-    //Get SIGSTRUCT of Quoting enclave
-    sigstruct = sgx_load_sigstruct(conf);
+    //Get TARGETINFO of Quoting enclave (SIGSTRUCT is parsed once)
+    sgx_get_targetinfo(conf, &targetinfo);
     puts("Got SIGSTRUCT!");
 
     //EREPORT with sigstruct
     puts("Sending REPORT to Quoting enclave ...");
-    memcpy(&targetinfo.measurement, &sigstruct->enclaveHash, 32);
-    memcpy(&targetinfo.attributes, &sigstruct->attributes, 16);
-    memcpy(&targetinfo.miscselect, &sigstruct->miscselect, 4);
     sgx_report(&targetinfo, nonce, &report_send);
     if(sgx_write_sock(quote_fd, &report_send, sizeof(report_t)) < 0) {
         puts("sgx_write_sock error\n");
@@ -173,15 +168,8 @@ int sgx_remote_attest_target(int challenger_port, int quote_port, char *conf)
     }
     puts("Received REPORT from Quoting enclave");
 
-    //Get Report key from QEMU
-    keyreq.keyname = REPORT_KEY;
-    memcpy(&keyreq.keyid, &report.keyid, 16);
-    memcpy(&keyreq.miscmask, &report.miscselect, 4);
-    sgx_getkey(&keyreq, report_key);
-    puts("Received Report Key");
-
-    //Check MAC matching
-    if(sgx_match_mac(report_key, &report) < 0) {
+    //Check MAC matching (Report key is cached)
+    if(sgx_verify_report(&report) < 0) {
         puts("Mac not match!\n");
         goto failed;
     }
@@ -251,8 +239,6 @@ int sgx_remote_attest_quote(int target_port)
     unsigned char nonce[64];
     char read_buf[512];
     int client_fd;    
-    keyrequest_t keyreq;
-    unsigned char report_key[DEVICE_KEY_LENGTH];
     const char *pers = "rsa_genkey";
     unsigned char *rsa_N, *rsa_E;
     
@@ -274,15 +260,8 @@ int sgx_remote_attest_quote(int target_port)
     }
     puts("Received REPORT from Target enclave");
     
-    //Get Report key from QEMU
-    keyreq.keyname = REPORT_KEY;
-    memcpy(&keyreq.keyid, &report.keyid, 16);
-    memcpy(&keyreq.miscmask, &report.miscselect, 4);    
-    sgx_getkey(&keyreq, report_key);
-    puts("Received Report Key");
-
-    //Check MAC matching
-    if(sgx_match_mac(report_key, &report) < 0) {
+    //Check MAC matching (Report key is cached)
+    if(sgx_verify_report(&report) < 0) {
         puts("Mac not match!\n");
         goto failed;
     }
@@ -311,8 +290,16 @@ int sgx_remote_attest_quote(int target_port)
         goto failed;
     }
 
-    //Make RSA & QUOTE
-    sgx_make_quote(pers, &report, rsa_N, rsa_E);
+    //Make QUOTE with the (cached) quoting key
+    if(sgx_quote_key_init(pers, SGX_QUOTE_KEY_PATH) < 0) {
+        puts("sgx_quote_key_init error\n");
+        goto failed;
+    }
+    sgx_quote_pubkey(rsa_N, rsa_E);
+    if(sgx_make_quotes(&report, 1) != 1) {
+        puts("sgx_make_quotes error\n");
+        goto failed;
+    }
 
     //Send quote
     if(sgx_write_sock(client_fd, rsa_N, sizeof(mpi)) < 0) {
@@ -335,3 +322,316 @@ failed:
     close(client_fd);
     return -1;
 }
+
+// Attestation services
+//  - sgx_remote_attest_quote_service(): every target connection does the
+//    intra attestation handshake once, gets the public quoting key once,
+//    then streams batches of reports and gets back batches of quotes
+//  - sgx_remote_attest_target_service(): every challenger connection
+//    streams nonces (see SGX_ATTEST_NONCE), each answered with
+//    rsa_N | rsa_E | quote, over one long-lived connection per enclave
+//    thread to the quoting service
+// Both may run on every enclave thread (TCS) at once; buffers are per
+// thread rather than malloc()ed since the enclave heap is not thread-safe.
+
+static
+int read_full(int fd, void *buf, int len)
+{
+    int n, done = 0;
+
+    while (done < len) {
+        n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+static
+int write_full(int fd, const void *buf, int len)
+{
+    int n, done = 0;
+
+    while (done < len) {
+        n = write(fd, (const char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+// Read between 1 and max records of size bytes: wait for the first one,
+// then take whatever whole records already arrived with it. Returns the
+// number of records, 0 on EOF, -1 on error
+static
+int read_records(int fd, void *buf, int size, int max)
+{
+    int n, want, done = 0;
+
+    while (done < size || done % size) {
+        want = size * max - done;
+        // a read() of more than one ring slot is only one OCALL with the
+        // bounce buffer; otherwise stay within a slot so that a short
+        // read still means "nothing more queued"
+        if (!sgx_bounce_size() && want > SGX_RING_DATA)
+            want = SGX_RING_DATA;
+        n = read(fd, (char *)buf + done, want);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return (done == 0) ? 0 : -1;
+        done += n;
+    }
+    return done / size;
+}
+
+static report_t quote_batch[SGX_MAX_TCS][SGX_ATTEST_BATCH];
+
+// One target enclave on an accepted connection
+static
+int remote_attest_quote_session(int client_fd)
+{
+    report_t *reports = quote_batch[sgx_thread_id()];
+    report_t report;
+    report_t report_send;
+    targetinfo_t targetinfo;
+    unsigned char nonce[64];
+    unsigned char rsa_N[SGX_ATTEST_MPI], rsa_E[SGX_ATTEST_MPI];
+    char result[4];
+    int i, n;
+
+    //Intra attestation with the target, once per connection
+    if(read_full(client_fd, &report, sizeof(report_t)) < 0) {
+        puts("sgx_get_report error\n");
+        return -1;
+    }
+    if(sgx_verify_report(&report) < 0) {
+        puts("Mac not match!\n");
+        return -1;
+    }
+
+    memset(&targetinfo, 0, sizeof(targetinfo));
+    memcpy(&targetinfo.measurement, &report.mrenclave, 32);
+    memcpy(&targetinfo.attributes, &report.attributes, 16);
+    memcpy(&targetinfo.miscselect, &report.miscselect, 4);
+    sgx_report(&targetinfo, nonce, &report_send);
+    if(write_full(client_fd, &report_send, sizeof(report_t)) < 0) {
+        puts("sgx_write_sock error\n");
+        return -1;
+    }
+
+    if(read_full(client_fd, result, sizeof(result)) < 0
+       || memcmp(result, "Good", sizeof(result)) != 0) {
+        puts("Target enclave denied");
+        return -1;
+    }
+
+    sgx_quote_pubkey(rsa_N, rsa_E);
+    if(write_full(client_fd, rsa_N, sizeof(rsa_N)) < 0
+       || write_full(client_fd, rsa_E, sizeof(rsa_E)) < 0) {
+        puts("sgx_write_sock error\n");
+        return -1;
+    }
+
+    //Quote batches until the target hangs up
+    for (;;) {
+        n = read_records(client_fd, reports, sizeof(report_t), SGX_ATTEST_BATCH);
+        if (n <= 0)
+            return n;
+
+        for (i = 0; i < n; i++) {
+            // only quote reports the target could have made for us
+            if(sgx_verify_report(&reports[i]) < 0) {
+                puts("Mac not match!\n");
+                return -1;
+            }
+        }
+        if(sgx_make_quotes(reports, n) != n) {
+            puts("sgx_make_quotes error\n");
+            return -1;
+        }
+        if(write_full(client_fd, reports, n * sizeof(report_t)) < 0) {
+            puts("sgx_write_sock error\n");
+            return -1;
+        }
+    }
+}
+
+int sgx_remote_attest_quote_service(int target_port)
+{
+    const char *pers = "rsa_genkey";
+    int server_fd, client_fd;
+
+    if(sgx_quote_key_init(pers, SGX_QUOTE_KEY_PATH) < 0) {
+        puts("sgx_quote_key_init error\n");
+        return -1;
+    }
+
+    server_fd = sgx_attest_listen(target_port);
+    if(server_fd < 0) {
+        puts("sgx_attest_listen error\n");
+        return -1;
+    }
+
+    for (;;) {
+        client_fd = sgx_accept_client(server_fd);
+        if(client_fd < 0)
+            return -1;
+
+        remote_attest_quote_session(client_fd);
+        close(client_fd);
+    }
+}
+
+// Per-thread connection to the quoting service
+static struct {
+    bool connected;
+    int fd;
+    unsigned char rsa_N[SGX_ATTEST_MPI];
+    unsigned char rsa_E[SGX_ATTEST_MPI];
+} quote_conns[SGX_MAX_TCS];
+
+static unsigned char nonce_batch[SGX_MAX_TCS][SGX_ATTEST_BATCH][SGX_ATTEST_NONCE];
+static report_t report_batch[SGX_MAX_TCS][SGX_ATTEST_BATCH];
+static unsigned char resp_batch[SGX_MAX_TCS][SGX_ATTEST_BATCH][SGX_ATTEST_RESP];
+
+static
+void quote_disconnect(int tid)
+{
+    if (quote_conns[tid].connected)
+        close(quote_conns[tid].fd);
+    quote_conns[tid].connected = false;
+}
+
+// Connect to the quoting service and do the intra attestation handshake
+static
+int quote_connect(int tid, int quote_port, char *conf)
+{
+    const char *quote_ip = "127.0.0.1";
+    targetinfo_t targetinfo;
+    unsigned char nonce[64];
+    report_t report;
+    report_t report_send;
+    int quote_fd;
+
+    if (quote_conns[tid].connected)
+        return 1;
+
+    quote_fd = sgx_connect_server(quote_ip, quote_port);
+    if(quote_fd < 0) {
+        puts("sgx_connect_server error\n");
+        return -1;
+    }
+
+    sgx_get_targetinfo(conf, &targetinfo);
+    sgx_report(&targetinfo, nonce, &report_send);
+    if(write_full(quote_fd, &report_send, sizeof(report_t)) < 0) {
+        puts("sgx_write_sock error\n");
+        goto failed;
+    }
+
+    if(read_full(quote_fd, &report, sizeof(report_t)) < 0) {
+        puts("sgx_get_report error\n");
+        goto failed;
+    }
+    if(sgx_verify_report(&report) < 0) {
+        puts("Mac not match!\n");
+        goto failed;
+    }
+
+    if(write_full(quote_fd, "Good", 4) < 0
+       || read_full(quote_fd, quote_conns[tid].rsa_N, SGX_ATTEST_MPI) < 0
+       || read_full(quote_fd, quote_conns[tid].rsa_E, SGX_ATTEST_MPI) < 0) {
+        puts("Quoting enclave handshake error\n");
+        goto failed;
+    }
+
+    quote_conns[tid].fd = quote_fd;
+    quote_conns[tid].connected = true;
+    return 1;
+
+failed:
+    close(quote_fd);
+    return -1;
+}
+
+// Quote n nonces through this thread's quoting service connection
+static
+int quote_nonces(int tid, int quote_port, char *conf, int n)
+{
+    report_t *reports = report_batch[tid];
+    targetinfo_t targetinfo;
+    unsigned char rptdata[SGX_ATTEST_NONCE] __attribute__((aligned(128)));
+    int i;
+
+    if(quote_connect(tid, quote_port, conf) < 0)
+        return -1;
+
+    sgx_get_targetinfo(conf, &targetinfo);
+    for (i = 0; i < n; i++) {
+        memcpy(rptdata, nonce_batch[tid][i], SGX_ATTEST_NONCE);
+        sgx_report(&targetinfo, rptdata, &reports[i]);
+    }
+
+    if(write_full(quote_conns[tid].fd, reports, n * sizeof(report_t)) < 0
+       || read_full(quote_conns[tid].fd, reports, n * sizeof(report_t)) < 0) {
+        puts("Quoting enclave connection lost\n");
+        quote_disconnect(tid);
+        return -1;
+    }
+    return 1;
+}
+
+// One challenger on an accepted connection
+static
+int remote_attest_target_session(int client_fd, int quote_port, char *conf)
+{
+    int tid = sgx_thread_id();
+    unsigned char *resp;
+    int i, n;
+
+    for (;;) {
+        n = read_records(client_fd, nonce_batch[tid], SGX_ATTEST_NONCE,
+                         SGX_ATTEST_BATCH);
+        if (n <= 0)
+            return n;
+
+        // a dropped quoting service connection is retried once
+        if(quote_nonces(tid, quote_port, conf, n) < 0
+           && quote_nonces(tid, quote_port, conf, n) < 0)
+            return -1;
+
+        for (i = 0; i < n; i++) {
+            resp = resp_batch[tid][i];
+            memcpy(resp, quote_conns[tid].rsa_N, SGX_ATTEST_MPI);
+            memcpy(resp + SGX_ATTEST_MPI, quote_conns[tid].rsa_E, SGX_ATTEST_MPI);
+            memcpy(resp + 2 * SGX_ATTEST_MPI, &report_batch[tid][i], sizeof(report_t));
+        }
+        if(write_full(client_fd, resp_batch[tid], n * SGX_ATTEST_RESP) < 0) {
+            puts("sgx_write_sock error\n");
+            return -1;
+        }
+    }
+}
+
+int sgx_remote_attest_target_service(int challenger_port, int quote_port, char *conf)
+{
+    int server_fd, client_fd;
+
+    server_fd = sgx_attest_listen(challenger_port);
+    if(server_fd < 0) {
+        puts("sgx_attest_listen error\n");
+        return -1;
+    }
+
+    for (;;) {
+        client_fd = sgx_accept_client(server_fd);
+        if(client_fd < 0)
+            return -1;
+
+        remote_attest_target_session(client_fd, quote_port, conf);
+        close(client_fd);
+    }
+}
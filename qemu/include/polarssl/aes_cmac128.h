@@ -1,3 +1,6 @@
+#ifndef POLARSSL_AES_CMAC128_H
+#define POLARSSL_AES_CMAC128_H
+
 #include <stdint.h>
 #include <stddef.h>
 #include "aes.h"
@@ -39,3 +42,5 @@ void aes_cmac128_update(aes_cmac128_context *ctx, const uint8_t *_msg, size_t _m
  * \param T        the generated MAC which is used to validate the message
  */
 void aes_cmac128_final(aes_cmac128_context *ctx, uint8_t T[16]);
+
+#endif /* aes_cmac128.h */
@@ -10,6 +10,11 @@
 #define POLARSSL_BIGNUM_C
 #define POLARSSL_CIPHER_MODE_CBC
 
+/* AES-NI for AES (and the CMAC built on it) when the host CPU has it;
+ * aesni_supports() checks CPUID at run time, tables otherwise */
+#define POLARSSL_HAVE_ASM
+#define POLARSSL_AESNI_C
+
 /**
  * \def POLARSSL_ASN1_PARSE_C
  *
@@ -110,6 +110,10 @@ extern int use_icount;
 
 extern int guest_ins_count;
 
+/* SGX EPC geometry (-epc), 0 picks the default */
+extern uint64_t sgx_epc_size;
+extern uint64_t sgx_epc_base;
+
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
 
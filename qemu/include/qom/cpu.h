@@ -588,6 +588,15 @@ void cpu_reset_interrupt(CPUState *cpu, int mask);
  */
 void cpu_exit(CPUState *cpu);
 
+/**
+ * cpu_exec_track:
+ * @cpu: The calling CPU.
+ *
+ * Waits until every other CPU has left the translated code it was
+ * running (SGX ETRACK). Only implemented for linux-user.
+ */
+void cpu_exec_track(CPUState *cpu);
+
 /**
  * cpu_resume:
  * @cpu: The CPU to resume.
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/resource.h>
@@ -37,6 +38,8 @@
 char *exec_path;
 
 int guest_ins_count;
+uint64_t sgx_epc_size;
+uint64_t sgx_epc_base;
 int singlestep;
 const char *filename;
 const char *argv0;
@@ -177,6 +180,34 @@ static inline void end_exclusive(void)
     pthread_mutex_unlock(&exclusive_lock);
 }
 
+/* Wait until every other cpu has left the translated code it was running
+   (SGX ETRACK: no access to a page blocked before can be in flight).  The
+   caller is inside a helper and counts as not running meanwhile, so that
+   concurrent trackers do not wait for each other.  */
+void cpu_exec_track(CPUState *cpu)
+{
+    CPUState *other_cpu;
+
+    pthread_mutex_lock(&exclusive_lock);
+    cpu->running = false;
+    exclusive_idle();
+
+    pending_cpus = 1;
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            cpu_exit(other_cpu);
+        }
+    }
+    if (pending_cpus > 1) {
+        pthread_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+    pending_cpus = 0;
+    pthread_cond_broadcast(&exclusive_resume);
+    cpu->running = true;
+    pthread_mutex_unlock(&exclusive_lock);
+}
+
 /* Wait for exclusive ops to finish, and begin cpu execution.  */
 static inline void cpu_exec_start(CPUState *cpu)
 {
@@ -284,7 +315,9 @@ void cpu_loop(CPUX86State *env)
     target_siginfo_t info;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_x86_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
@@ -414,15 +447,22 @@ void cpu_loop(CPUX86State *env)
             queue_signal(env, info.si_signo, &info);
             break;
         case EXCP_INTERRUPT:
-            fprintf(stderr, "Interrupt generated\n");
-            sigset_t signal_set;
-            sigaddset(&signal_set, SIGPROF);
+            {
+                /* also how ETRACK kicks a cpu out of its TB: no message */
+                sigset_t signal_set;
+                sigemptyset(&signal_set);
+                sigaddset(&signal_set, SIGPROF);
 
-            /* now signal_set == {SIGSEGV, SIGRTMIN} */
-            sigprocmask(SIG_BLOCK, &signal_set, NULL); 
+                /* now signal_set == {SIGSEGV, SIGRTMIN} */
+                sigprocmask(SIG_BLOCK, &signal_set, NULL); 
+            }
 
             /* just indicate that signals should be handled asap */
             break;
+        case EXCP_YIELD:
+            /* SGX: the EPC page of the instruction is in flight, retry */
+            sched_yield();
+            break;
         case EXCP_DEBUG:
             {
                 fprintf(stderr, "DEBUG\n");  
@@ -3655,6 +3695,32 @@ static void handle_arg_icount(const char *arg)
     guest_ins_count = 1;
 }
 
+static void handle_arg_epc(const char *arg)
+{
+    char *p;
+
+    sgx_epc_size = strtoull(arg, &p, 0);
+    if (*p == 'G' || *p == 'g') {
+        sgx_epc_size <<= 30;
+        p++;
+    } else if (*p == 'M' || *p == 'm') {
+        sgx_epc_size <<= 20;
+        p++;
+    } else if (*p == 'K' || *p == 'k') {
+        sgx_epc_size <<= 10;
+        p++;
+    }
+    if (*p == ',') {
+        sgx_epc_base = strtoull(p + 1, &p, 0);
+    }
+
+    if (*p != '\0' || sgx_epc_size == 0
+        || (sgx_epc_size & 0xfff) != 0 || (sgx_epc_base & 0xfff) != 0) {
+        fprintf(stderr, "-epc: page aligned size[,base] expected\n");
+        exit(1);
+    }
+}
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -3691,6 +3757,8 @@ static const struct qemu_argument arg_table[] = {
 #endif
     {"i",	   "",		       false, handle_arg_icount,
      "",	   "count the number of executed guest instructions"},
+    {"epc",        "QEMU_EPC",         true,  handle_arg_epc,
+     "size[,base]", "set the SGX EPC size (k/M/G suffix) and base address"},
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
      "(use '-d help' for a list of items)"},
@@ -155,6 +155,7 @@
 #define HF_SVMI_SHIFT       21 /* SVM intercepts are active */
 #define HF_OSFXSR_SHIFT     22 /* CR4.OSFXSR */
 #define HF_SMAP_SHIFT       23 /* CR4.SMAP */
+#define HF_SGX_SHIFT        24 /* SGX enclave mode (cregs.CR_ENCLAVE_MODE) */
 
 #define HF_CPL_MASK          (3 << HF_CPL_SHIFT)
 #define HF_SOFTMMU_MASK      (1 << HF_SOFTMMU_SHIFT)
@@ -178,6 +179,7 @@
 #define HF_SVMI_MASK         (1 << HF_SVMI_SHIFT)
 #define HF_OSFXSR_MASK       (1 << HF_OSFXSR_SHIFT)
 #define HF_SMAP_MASK         (1 << HF_SMAP_SHIFT)
+#define HF_SGX_MASK          (1 << HF_SGX_SHIFT)
 
 /* hflags2 */
 
@@ -805,6 +807,8 @@ typedef struct CREGS {
     uint64_t CR_TCS_PH;                 // 64 LP
     uint64_t CR_ACTIVE_SECS;            // 64 LP
     uint64_t CR_ELRANGE[2];             // 128 LP
+    uint64_t CR_EPC_BASE;               // 64 PACKAGE, first EPC page
+    uint64_t CR_EPC_SIZE;               // 64 PACKAGE, EPC size in bytes
     bool CR_SAVE_TF;                    // 1 LP
     SegmentCache CR_SAVE_FS;
     uint64_t CR_GPR_PA;
@@ -825,6 +829,20 @@ typedef struct CREGS {
     uint64_t CR_SEAL_FUSES[2];          // 128 PACKAGE
 } _cregs;
 
+/* SGX EPCM permission cache: direct mapped on the EPC page address and
+   probed inline by enclave TBs. A field holds the page address when the
+   access is allowed, -1 otherwise. */
+#define SGX_EPCM_CACHE_BITS       8
+#define SGX_EPCM_CACHE_SIZE       (1 << SGX_EPCM_CACHE_BITS)
+#define SGX_EPCM_CACHE_ENTRY_BITS 5
+
+typedef struct SGXEPCMCacheEntry {
+    uint64_t addr_read;
+    uint64_t addr_write;
+    uint64_t addr_code;
+    uint64_t dummy; /* pad to 1 << SGX_EPCM_CACHE_ENTRY_BITS bytes */
+} SGXEPCMCacheEntry;
+
 typedef struct CPUX86State {
     /* standard registers */
     target_ulong regs[CPU_NB_REGS];
@@ -854,6 +872,7 @@ typedef struct CPUX86State {
 
     /* cregs for SGX specific code */
     _cregs cregs; 	/* CREGs maintained by processor */
+    SGXEPCMCacheEntry sgx_epcm_cache[SGX_EPCM_CACHE_SIZE];
 
     int32_t a20_mask;
 
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sgx-aes.h"
+
+static
+void gcm_error(const char *msg)
+{
+    fprintf(stderr, "sgx-aes: %s\n", msg);
+    exit(-1);
+}
+
+static
+EVP_CIPHER_CTX *gcm_ctx_new(const uint8_t key[16], int enc)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    if (!ctx)
+        gcm_error("Context Creation Error !!!");
+    if (EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, enc) != 1)
+        gcm_error("EVP Init Error !!!");
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, SGX_GCM_IV_LEN, NULL) != 1)
+        gcm_error("Context Control Error !!!");
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, enc) != 1)
+        gcm_error("Key Init Error !!!");
+    return ctx;
+}
+
+void sgx_gcm_init(sgx_gcm_t *gcm, const uint8_t key[16])
+{
+    gcm->enc = gcm_ctx_new(key, 1);
+    gcm->dec = gcm_ctx_new(key, 0);
+}
+
+void sgx_gcm_free(sgx_gcm_t *gcm)
+{
+    EVP_CIPHER_CTX_free(gcm->enc);
+    EVP_CIPHER_CTX_free(gcm->dec);
+    memset(gcm, 0, sizeof(sgx_gcm_t));
+}
+
+int sgx_gcm_encrypt(sgx_gcm_t *gcm, const uint8_t iv[SGX_GCM_IV_LEN],
+                    const void *aad, int aad_len, const void *in, int len,
+                    void *out, uint8_t tag[SGX_GCM_TAG_LEN])
+{
+    EVP_CIPHER_CTX *ctx = gcm->enc;
+    int n, total;
+
+    // a NULL key keeps the expanded one, only the IV is loaded
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1)
+        gcm_error("IV Init Error !!!");
+    if (aad_len && EVP_EncryptUpdate(ctx, NULL, &n, aad, aad_len) != 1)
+        gcm_error("Aad Addtion Error !!!");
+    if (EVP_EncryptUpdate(ctx, out, &n, in, len) != 1)
+        gcm_error("Encryption Error !!!");
+    total = n;
+    if (EVP_EncryptFinal_ex(ctx, (unsigned char *)out + total, &n) != 1)
+        gcm_error("Finalize Error !!!");
+    total += n;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SGX_GCM_TAG_LEN, tag) != 1)
+        gcm_error("Getting Tag Error !!!");
+    return total;
+}
+
+int sgx_gcm_decrypt(sgx_gcm_t *gcm, const uint8_t iv[SGX_GCM_IV_LEN],
+                    const void *aad, int aad_len, const void *in, int len,
+                    void *out, const uint8_t tag[SGX_GCM_TAG_LEN])
+{
+    EVP_CIPHER_CTX *ctx = gcm->dec;
+    int n, total;
+
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1)
+        gcm_error("IV Init Error !!!");
+    if (aad_len && EVP_DecryptUpdate(ctx, NULL, &n, aad, aad_len) != 1)
+        gcm_error("Aad Addtion Error !!!");
+    if (EVP_DecryptUpdate(ctx, out, &n, in, len) != 1)
+        gcm_error("Decryption Error !!!");
+    total = n;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SGX_GCM_TAG_LEN,
+                            (void *)tag) != 1)
+        gcm_error("Setting Tag Error !!!");
+
+    // a non positive return means the tag does not authenticate the data
+    if (EVP_DecryptFinal_ex(ctx, (unsigned char *)out + total, &n) <= 0)
+        return -1;
+    return total + n;
+}
+
+void sgx_cmac_setkey(sgx_cmac_t *cmac, const uint8_t key[16])
+{
+    aes_cmac128_starts(cmac, key);
+}
+
+// aes_context.rk points into its own buf, so a plain copy would keep
+// using the source's round keys
+void sgx_cmac_copy(sgx_cmac_t *dst, const sgx_cmac_t *src)
+{
+    memcpy(dst, src, sizeof(sgx_cmac_t));
+    dst->aes_key.rk = dst->aes_key.buf + (src->aes_key.rk - src->aes_key.buf);
+}
+
+void sgx_cmac(const sgx_cmac_t *cmac, const void *msg, size_t len,
+              uint8_t mac[16])
+{
+    aes_cmac128_context ctx;
+
+    // fresh running state on top of the expanded key
+    sgx_cmac_copy(&ctx, cmac);
+
+    aes_cmac128_update(&ctx, msg, len);
+    aes_cmac128_final(&ctx, mac);
+}
+
+#ifdef UNITTEST
+//
+// AES-GCM/CMAC micro-benchmark:
+//   $ gcc -O2 -DUNITTEST -I. -I../include -o sgx-aes-bench sgx-aes.c
+//         ../polarssl/aes.c ../polarssl/aesni.c ../polarssl/aes_cmac128.c
+//         -lcrypto
+//   $ ./sgx-aes-bench
+//
+#include <time.h>
+
+#define BENCH_PAGE_SIZE          (4096)
+#define BENCH_PAGES              (1 << 16)
+#define BENCH_REPORTS            (1 << 18)
+
+static const uint8_t bench_key[16] = {
+    0x5f, 0x8a, 0xe6, 0xd1, 0x65, 0x8b, 0xb2, 0x6d,
+    0xe6, 0xf8, 0xa0, 0x69, 0xa3, 0x52, 0x02, 0x93
+};
+
+static
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old encrypt_epc(): a new context (and key schedule) per page
+static
+void gcm_encrypt_oneshot(const uint8_t *iv, const uint8_t *aad, int aad_len,
+                         const uint8_t *in, int len, uint8_t *out, uint8_t *tag)
+{
+    EVP_CIPHER_CTX *ctx = gcm_ctx_new(bench_key, 1);
+    int n;
+
+    EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+    EVP_EncryptUpdate(ctx, NULL, &n, aad, aad_len);
+    EVP_EncryptUpdate(ctx, out, &n, in, len);
+    EVP_EncryptFinal_ex(ctx, out + n, &n);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SGX_GCM_TAG_LEN, tag);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+static
+void bench_gcm(void)
+{
+    static uint8_t page[BENCH_PAGE_SIZE], enc[BENCH_PAGE_SIZE], dec[BENCH_PAGE_SIZE];
+    uint8_t aad[128], iv[SGX_GCM_IV_LEN], tag[SGX_GCM_TAG_LEN], tag2[SGX_GCM_TAG_LEN];
+    sgx_gcm_t gcm;
+    double t, reused, oneshot;
+    int i;
+
+    for (i = 0; i < BENCH_PAGE_SIZE; i ++)
+        page[i] = i * 7;
+    memset(aad, 0xa5, sizeof(aad));
+    memset(iv, 0, sizeof(iv));
+    sgx_gcm_init(&gcm, bench_key);
+
+    // correctness: round trip, same output as a fresh context, tag checked
+    assert(sgx_gcm_encrypt(&gcm, iv, aad, sizeof(aad), page, BENCH_PAGE_SIZE,
+                           enc, tag) == BENCH_PAGE_SIZE);
+    gcm_encrypt_oneshot(iv, aad, sizeof(aad), page, BENCH_PAGE_SIZE, dec, tag2);
+    assert(!memcmp(enc, dec, BENCH_PAGE_SIZE) && !memcmp(tag, tag2, sizeof(tag)));
+    assert(sgx_gcm_decrypt(&gcm, iv, aad, sizeof(aad), enc, BENCH_PAGE_SIZE,
+                           dec, tag) == BENCH_PAGE_SIZE);
+    assert(!memcmp(page, dec, BENCH_PAGE_SIZE));
+    enc[100] ^= 1;
+    assert(sgx_gcm_decrypt(&gcm, iv, aad, sizeof(aad), enc, BENCH_PAGE_SIZE,
+                           dec, tag) == -1);
+    enc[100] ^= 1;
+
+    t = now();
+    for (i = 0; i < BENCH_PAGES; i ++) {
+        memcpy(iv, &i, sizeof(i));
+        sgx_gcm_encrypt(&gcm, iv, aad, sizeof(aad), page, BENCH_PAGE_SIZE, enc, tag);
+        sgx_gcm_decrypt(&gcm, iv, aad, sizeof(aad), enc, BENCH_PAGE_SIZE, dec, tag);
+    }
+    reused = BENCH_PAGES / (now() - t);
+
+    t = now();
+    for (i = 0; i < BENCH_PAGES / 16; i ++) {
+        memcpy(iv, &i, sizeof(i));
+        gcm_encrypt_oneshot(iv, aad, sizeof(aad), page, BENCH_PAGE_SIZE, enc, tag);
+    }
+    oneshot = BENCH_PAGES / 16 / (now() - t);
+
+    printf("GCM  4K page: reused %10.0f enc+dec/sec (%6.0f MB/s), one-shot %10.0f enc/sec\n",
+           reused, reused * 2 * BENCH_PAGE_SIZE / 1e6, oneshot);
+    sgx_gcm_free(&gcm);
+}
+
+static
+void bench_cmac(void)
+{
+    uint8_t report[416], mac[16], mac2[16];
+    aes_cmac128_context ctx;
+    sgx_cmac_t cmac;
+    double t, reused, oneshot;
+    int i;
+
+    for (i = 0; i < (int)sizeof(report); i ++)
+        report[i] = i;
+    sgx_cmac_setkey(&cmac, bench_key);
+
+    // RFC 4493 example 2 (key 2b7e1516..., 16-byte message)
+    {
+        const uint8_t k[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+        const uint8_t m[16] = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+                                0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a };
+        const uint8_t t[16] = { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44,
+                                0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c };
+        sgx_cmac_t rfc;
+        sgx_cmac_setkey(&rfc, k);
+        sgx_cmac(&rfc, m, sizeof(m), mac);
+        assert(!memcmp(mac, t, 16));
+    }
+
+    sgx_cmac(&cmac, report, sizeof(report), mac);
+    aes_cmac128_starts(&ctx, bench_key);
+    aes_cmac128_update(&ctx, report, sizeof(report));
+    aes_cmac128_final(&ctx, mac2);
+    assert(!memcmp(mac, mac2, 16));
+
+    t = now();
+    for (i = 0; i < BENCH_REPORTS; i ++) {
+        report[0] = i;
+        sgx_cmac(&cmac, report, sizeof(report), mac);
+    }
+    reused = BENCH_REPORTS / (now() - t);
+
+    t = now();
+    for (i = 0; i < BENCH_REPORTS; i ++) {
+        report[0] = i;
+        aes_cmac128_starts(&ctx, bench_key);
+        aes_cmac128_update(&ctx, report, sizeof(report));
+        aes_cmac128_final(&ctx, mac);
+    }
+    oneshot = BENCH_REPORTS / (now() - t);
+
+    printf("CMAC report : reused %10.0f MACs/sec, one-shot %10.0f MACs/sec\n",
+           reused, oneshot);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_gcm();
+    bench_cmac();
+    return 0;
+}
+#endif
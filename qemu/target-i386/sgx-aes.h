@@ -0,0 +1,52 @@
+//====-------------------- 'sgx-aes.h' -------------------------------
+/// @file
+/// \brief Reusable AES contexts for the SGX leaves (AES-GCM for
+///        EWB/ELDB/ELDU, AES-CMAC for EREPORT/EINIT).
+//
+//-------------------------------------------------------------------
+// This file is distributed under The MIT License. See LICENSE for
+// details
+//
+//====---------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "openssl/evp.h"
+#include "polarssl/aes_cmac128.h"
+
+#define SGX_GCM_IV_LEN           (12)
+#define SGX_GCM_TAG_LEN          (16)
+
+// AES-128-GCM with the key schedule (and the GHASH table) expanded once;
+// an operation only loads a new IV. OpenSSL picks the AES-NI/PCLMULQDQ
+// kernels when the host has them and falls back to tables otherwise.
+// A context is stateful, so each vCPU keeps its own.
+typedef struct {
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+} sgx_gcm_t;
+
+void sgx_gcm_init(sgx_gcm_t *gcm, const uint8_t key[16]);
+void sgx_gcm_free(sgx_gcm_t *gcm);
+
+// Both return the number of bytes produced; decrypt returns -1 if the tag
+// does not authenticate aad and in (out is then garbage)
+int sgx_gcm_encrypt(sgx_gcm_t *gcm, const uint8_t iv[SGX_GCM_IV_LEN],
+                    const void *aad, int aad_len, const void *in, int len,
+                    void *out, uint8_t tag[SGX_GCM_TAG_LEN]);
+int sgx_gcm_decrypt(sgx_gcm_t *gcm, const uint8_t iv[SGX_GCM_IV_LEN],
+                    const void *aad, int aad_len, const void *in, int len,
+                    void *out, const uint8_t tag[SGX_GCM_TAG_LEN]);
+
+// AES-128-CMAC key: the key schedule and the K1/K2 subkeys. PolarSSL's
+// AES uses AES-NI when the host has it. Read-only once set, so a key may
+// be shared between vCPUs.
+typedef aes_cmac128_context sgx_cmac_t;
+
+void sgx_cmac_setkey(sgx_cmac_t *cmac, const uint8_t key[16]);
+void sgx_cmac_copy(sgx_cmac_t *dst, const sgx_cmac_t *src);
+void sgx_cmac(const sgx_cmac_t *cmac, const void *msg, size_t len,
+              uint8_t mac[16]);
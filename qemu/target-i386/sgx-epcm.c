@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sgx.h"
+#include "sgx-dbg.h"
+#include "sgx-epcm.h"
+
+#define EPCM_EMPTY_SLOT          (UINT64_MAX)
+
+static inline
+uint32_t epcm_hash(uint64_t pfn, uint32_t mask)
+{
+    // fibonacci hashing; EPC frames are mostly sequential
+    return (uint32_t)((pfn * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static
+void epcm_index_insert(epcm_index_t *idx, uint64_t page, uint32_t index)
+{
+    uint32_t slot = epcm_hash(page >> EPC_PAGE_SHIFT, idx->mask);
+
+    while (idx->keys[slot] != EPCM_EMPTY_SLOT)
+        slot = (slot + 1) & idx->mask;
+
+    idx->keys[slot] = page;
+    idx->vals[slot] = index;
+}
+
+static
+int64_t epcm_index_probe(const epcm_index_t *idx, uint64_t pfn, uint64_t addr)
+{
+    uint32_t slot = epcm_hash(pfn, idx->mask);
+
+    while (idx->keys[slot] != EPCM_EMPTY_SLOT) {
+        uint64_t page = idx->keys[slot];
+        if ((page >> EPC_PAGE_SHIFT) == pfn) {
+            if (page <= addr && addr < page + PAGE_SIZE)
+                return idx->vals[slot];
+            return -1;
+        }
+        slot = (slot + 1) & idx->mask;
+    }
+    return -1;
+}
+
+void epcm_index_free(epcm_index_t *idx)
+{
+    free(idx->keys);
+    free(idx->vals);
+    memset(idx, 0, sizeof(epcm_index_t));
+}
+
+// Build the index from epcm[].epcPageAddress
+void epcm_index_init(epcm_index_t *idx, epcm_entry_t *epcm, uint32_t npages)
+{
+    uint32_t i;
+
+    epcm_index_free(idx);
+    if (npages == 0)
+        return;
+
+    idx->base = epcm[0].epcPageAddress;
+    idx->npages = npages;
+    idx->contiguous = true;
+    for (i = 1; i < npages; i ++) {
+        if (epcm[i].epcPageAddress != idx->base + (uint64_t)i * PAGE_SIZE) {
+            idx->contiguous = false;
+            break;
+        }
+    }
+    if (idx->contiguous)
+        return;
+
+    sgx_dbg(info, "non-contiguous EPC layout, using hashed EPCM index");
+
+    // keep load factor <= 0.5
+    uint32_t size = 1;
+    while (size < npages * 2)
+        size <<= 1;
+
+    idx->mask = size - 1;
+    idx->keys = malloc(size * sizeof(uint64_t));
+    idx->vals = malloc(size * sizeof(uint32_t));
+    assert(idx->keys && idx->vals);
+
+    memset(idx->keys, 0xff, size * sizeof(uint64_t));
+    for (i = 0; i < npages; i ++)
+        epcm_index_insert(idx, epcm[i].epcPageAddress, i);
+}
+
+void epcm_index_init_range(epcm_index_t *idx, uint64_t base, uint32_t npages)
+{
+    epcm_index_free(idx);
+    idx->base = base;
+    idx->npages = npages;
+    idx->contiguous = true;
+}
+
+int64_t epcm_index_lookup_slow(const epcm_index_t *idx, uint64_t addr)
+{
+    uint64_t pfn = addr >> EPC_PAGE_SHIFT;
+    int64_t index;
+
+    if (!idx->keys)
+        return -1;
+
+    // an unaligned EPC page spans two frames, so also try the previous one
+    index = epcm_index_probe(idx, pfn, addr);
+    if (index < 0 && pfn > 0)
+        index = epcm_index_probe(idx, pfn - 1, addr);
+    return index;
+}
+
+#ifdef UNITTEST
+//
+// EPCM lookup micro-benchmark:
+//   $ gcc -O2 -DUNITTEST -I. -I../include sgx-epcm.c -o sgx-epcm-bench
+//   $ ./sgx-epcm-bench
+//
+#include <time.h>
+
+#define BENCH_EPC_BASE           (0x4fffc000ULL)
+#define BENCH_LOOKUPS            (1 << 24)
+#define BENCH_LINEAR_LOOKUPS     (1 << 14)
+
+// The old epcm_search(): scan every entry
+static
+int64_t linear_lookup(epcm_entry_t *epcm, uint32_t npages, uint64_t addr)
+{
+    uint32_t i;
+    for (i = 0; i < npages; i ++) {
+        if (epcm[i].epcPageAddress <= addr
+            && addr < epcm[i].epcPageAddress + PAGE_SIZE)
+            return i;
+    }
+    return -1;
+}
+
+static
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static
+void layout(epcm_entry_t *epcm, uint32_t npages, bool contiguous)
+{
+    uint32_t i;
+    for (i = 0; i < npages; i ++) {
+        // leave a one-page hole after every page to defeat arithmetic
+        uint64_t stride = contiguous ? PAGE_SIZE : 2 * PAGE_SIZE;
+        epcm[i].epcPageAddress = BENCH_EPC_BASE + i * stride;
+    }
+}
+
+static
+void bench(uint32_t npages, bool contiguous)
+{
+    epcm_entry_t *epcm = calloc(npages, sizeof(epcm_entry_t));
+    epcm_index_t idx;
+    uint64_t seed = 88172645463325252ULL;
+    int64_t sum = 0;
+    double t, indexed, linear;
+    uint32_t i;
+
+    assert(epcm);
+    memset(&idx, 0, sizeof(idx));
+    layout(epcm, npages, contiguous);
+    epcm_index_init(&idx, epcm, npages);
+    assert(idx.contiguous == contiguous);
+
+    // correctness: both ends of every page map to its own entry
+    for (i = 0; i < npages; i ++) {
+        uint64_t page = epcm[i].epcPageAddress;
+        assert(epcm_index_lookup(&idx, page) == i);
+        assert(epcm_index_lookup(&idx, page + PAGE_SIZE - 1) == i);
+    }
+    for (i = 0; i < npages; i += npages / 64 + 1) {
+        uint64_t addr = epcm[i].epcPageAddress + 256;
+        assert(epcm_index_lookup(&idx, addr) == linear_lookup(epcm, npages, addr));
+    }
+    assert(epcm_index_lookup(&idx, BENCH_EPC_BASE - 1) == -1);
+    assert(epcm_index_lookup(&idx, 0) == -1);
+    if (!contiguous)
+        assert(epcm_index_lookup(&idx, BENCH_EPC_BASE + PAGE_SIZE) == -1);
+
+    t = now();
+    for (i = 0; i < BENCH_LOOKUPS; i ++) {
+        uint32_t n = xorshift(&seed) % npages;
+        sum += epcm_index_lookup(&idx, epcm[n].epcPageAddress + (i & (PAGE_SIZE - 1)));
+    }
+    indexed = BENCH_LOOKUPS / (now() - t);
+
+    t = now();
+    for (i = 0; i < BENCH_LINEAR_LOOKUPS; i ++) {
+        uint32_t n = xorshift(&seed) % npages;
+        sum += linear_lookup(epcm, npages, epcm[n].epcPageAddress + (i & (PAGE_SIZE - 1)));
+    }
+    linear = BENCH_LINEAR_LOOKUPS / (now() - t);
+
+    printf("%7u pages (%-10s): indexed %12.0f lookups/sec, linear %12.0f lookups/sec (x%.0f) [%ld]\n",
+           npages, contiguous ? "contiguous" : "hashed",
+           indexed, linear, indexed / linear, (long)sum);
+
+    epcm_index_free(&idx);
+    free(epcm);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t sizes[] = { 2000, 32 * 1024, 256 * 1024 };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i ++) {
+        bench(sizes[i], true);
+        bench(sizes[i], false);
+    }
+    return 0;
+}
+#endif
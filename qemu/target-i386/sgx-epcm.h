@@ -0,0 +1,51 @@
+//====-------------------- 'sgx-epcm.h' ------------------------------
+/// @file
+/// \brief Indexed EPCM lookup (EPC address -> epcm[] index).
+//
+//-------------------------------------------------------------------
+// This file is distributed under The MIT License. See LICENSE for
+// details
+//
+//====---------------------------------------------------------------
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sgx.h"
+
+#define EPC_PAGE_SHIFT           (12)
+
+// EPCM index
+//  - contiguous: epcm[i].epcPageAddress == base + i * PAGE_SIZE, so the
+//    index is plain arithmetic on the faulting address
+//  - otherwise: open-addressing hash keyed by the page frame number
+typedef struct {
+    uint64_t base;                      // epcPageAddress of epcm[0]
+    uint32_t npages;                    // number of indexed EPC pages
+    bool contiguous;
+
+    // fallback for non-contiguous layouts
+    uint64_t *keys;                     // page frame numbers
+    uint32_t *vals;                     // epcm[] indices
+    uint32_t mask;                      // table size - 1
+} epcm_index_t;
+
+void epcm_index_init(epcm_index_t *idx, epcm_entry_t *epcm, uint32_t npages);
+// Contiguous EPC of npages pages at base; epcm[] itself is not touched
+void epcm_index_init_range(epcm_index_t *idx, uint64_t base, uint32_t npages);
+void epcm_index_free(epcm_index_t *idx);
+int64_t epcm_index_lookup_slow(const epcm_index_t *idx, uint64_t addr);
+
+// Returns the epcm[] index of the page containing addr, or -1
+static inline
+int64_t epcm_index_lookup(const epcm_index_t *idx, uint64_t addr)
+{
+    if (idx->contiguous) {
+        // wraps around for addr < base, hence a single compare
+        uint64_t n = (addr - idx->base) >> EPC_PAGE_SHIFT;
+        return (n < idx->npages) ? (int64_t)n : -1;
+    }
+    return epcm_index_lookup_slow(idx, addr);
+}
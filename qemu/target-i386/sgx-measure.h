@@ -0,0 +1,32 @@
+//====-------------------- 'sgx-measure.h' ---------------------------
+/// @file
+/// \brief Running MRENCLAVE of an enclave under construction
+///        (ECREATE/EADD/EEXTEND), finalised by EINIT.
+//
+//-------------------------------------------------------------------
+// This file is distributed under The MIT License. See LICENSE for
+// details
+//
+//====---------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "openssl/sha.h"
+
+// The SHA-256 chaining state is kept as native words for the whole build
+// and only turned into the big-endian SECS.MRENCLAVE layout at EINIT.
+// Updates are whole 64-byte blocks and go straight to OpenSSL's block
+// function, which uses the SHA extensions (or AVX2/SSSE3) when the host
+// has them and processes a run of blocks in one call.
+typedef SHA256_CTX sgx_measure_t;
+
+#define SGX_MEASURE_BLOCK        (64)
+
+void sgx_measure_init(sgx_measure_t *m);
+void sgx_measure_update(sgx_measure_t *m, const void *blocks, size_t nblocks);
+
+// Chaining state in the SECS.MRENCLAVE byte order (not yet finalised)
+void sgx_measure_serialise(const sgx_measure_t *m, uint8_t hash[32]);
@@ -10,6 +10,11 @@
 //====---------------------------------------------------------------
 
 #pragma once
+// before the pack pragma: shared with polarssl/aes_cmac128.c and
+// sgx-measure.c
+#include "polarssl/aes_cmac128.h"
+#include "sgx-measure.h"
+
 #pragma pack(push, 1)
 #include <stdbool.h>
 #include <stddef.h>
@@ -22,8 +27,13 @@
 #define CPU_SVN                  (1)              // Default CPU SVN
 #define PAGE_SIZE                (4096)
 #define EPC_SIZE                 (PAGE_SIZE)      // from 1.5
-//#define NUM_EPC                (100)            // XXX. where?
-#define NUM_EPC                  (2000)           // XXX. where?
+// Default EPC: NUM_EPC pages at SGX_EPC_BASE; -epc size[,base] (QEMU_EPC)
+// overrides both. An EPC that would run into the enclave stubs at
+// SGX_EPC_LOW_LIMIT goes to SGX_EPC_HIGH_BASE unless a base is given.
+#define NUM_EPC                  (2000)
+#define SGX_EPC_BASE             (0x4fffc000ULL)
+#define SGX_EPC_LOW_LIMIT        (0x80800000ULL)
+#define SGX_EPC_HIGH_BASE        (0x100000000ULL)
 #define ENCLAVE_SIZE             (16)             // XXX : Set temporarily
 #define MEASUREMENT_SIZE         (256)
 #define MIN_ALLOC                (2)
@@ -53,8 +63,10 @@
 /// custom format
 #define PRIfptr "0x%016"PRIxPTR
 
-/// QEMU resource management for enclave
-#define MAX_ENCLAVES 16
+/// QEMU resource management for enclave: EIDs of enclaves alive at once,
+/// recycled by EREMOVE of the SECS; qeid_t are allocated QEID_CHUNK at a time
+#define MAX_ENCLAVES (1 << 16)
+#define QEID_CHUNK   (64)
 
 typedef uint8_t rsa_key_t[KEY_LENGTH];
 typedef uint8_t rsa_sig_t[KEY_LENGTH];
@@ -116,6 +128,10 @@ typedef enum {
     ENCLS_OSGX_CPUSVN    = 0x13,          // XXX?
     ENCLS_OSGX_STAT      = 0x14,
     ENCLS_OSGX_SET_STACK = 0x15,
+    ENCLS_OSGX_EADD_RANGE = 0x16,
+    ENCLS_OSGX_PAGER     = 0x17,
+    ENCLS_OSGX_EPC_AGE   = 0x18,
+    ENCLS_OSGX_EVICT     = 0x19,
 } encls_cmd_t;
 
 // from 5.1.2
@@ -171,8 +187,11 @@ typedef struct {
 typedef unsigned char epc_t[EPC_SIZE];
 
 // from 2.19 (r2:p15)
+// Not packed: valid and the claim/track words are accessed atomically by
+// concurrent vCPUs and need their natural alignment
+#pragma pack(pop)
 typedef struct {
-    unsigned int valid:1;               // Indicates whether EPCM entry is valid
+    uint32_t valid;                     // Indicates whether EPCM entry is valid (set_epcm_entry())
     unsigned int read:1;                // Enclave Read accesses allowed for page
     unsigned int write:1;               // Enclave Write accesses allowed for page
     unsigned int execute:1;             // Enclave Execute accesses allowed for page
@@ -186,7 +205,12 @@ typedef struct {
     // XXX?
     uint64_t epcPageAddress;            // Maps EPCM <-> EPC ( enclaveAddress seems to have a different functionality
     uint64_t appAddress;                // Track App address - EPC address
+    uint32_t tcs_busy;                  // PT_TCS: entered by a logical processor
+    uint32_t busy;                      // claimed by an ENCLS/ENCLU leaf in flight
+    uint32_t accessed;                  // enclave access since ENCLS_OSGX_EPC_AGE
+    uint64_t block_epoch;               // ETRACK epoch of the EBLOCK
 } epcm_entry_t;
+#pragma pack(push, 1)
 
 typedef struct {
     uint8_t vector;
@@ -250,6 +274,43 @@ typedef struct {
     uint64_t secs;                      // Eff. addr. of EPC slot that currently contains a copy of the SECS
 } pageinfo_t;
 
+// One page of ENCLS_OSGX_EADD_RANGE: the PAGEINFO and EPC page of an EADD,
+// padded so that PAGEINFO stays 32-byte aligned in an array
+#define EADD_DESC_EXTEND         (1)      // EEXTEND the whole page after EADD
+
+typedef struct {
+    pageinfo_t pageinfo;
+    uint64_t epcpage;                   // EPC page (RCX of EADD)
+    uint64_t flags;                     // EADD_DESC_*
+    uint8_t reserved[16];
+} eadd_desc_t;
+
+// Where the kernel pager put an evicted EPC page (ENCLS_OSGX_PAGER), one
+// entry per EPC page. An enclave access to a page in EPC_SWAP_OUT makes
+// the vCPU ELDU it with these operands; accesses to an EPC_SWAP_BUSY page
+// (being written back or loaded) are retried.
+#define EPC_SWAP_NONE            (0)
+#define EPC_SWAP_OUT             (1)      // EWB done, ELDU on access
+#define EPC_SWAP_BUSY            (2)
+#define EPC_SWAP_IN              (3)      // loaded on access, VA slot is free
+
+typedef struct {
+    pageinfo_t pageinfo;                // ELDU: backing page, PCMD, SECS, linaddr
+    uint64_t va_slot;                   // VA slot of the EWB
+    uint32_t state;                     // EPC_SWAP_*
+    uint8_t reserved[20];
+} epc_swap_t;
+
+// One page of ENCLS_OSGX_EVICT: EBLOCK it, then EWB it with this PAGEINFO
+// and VA slot; status gets the error code of the page
+typedef struct {
+    pageinfo_t pageinfo;
+    uint64_t epcpage;
+    uint64_t va_slot;
+    uint64_t status;
+    uint8_t reserved[8];
+} evict_desc_t;
+
 typedef struct  {
     unsigned int reserved1 : 1;
     unsigned int debug : 1;             // If 1, enclave permits debugger to r/w
@@ -485,34 +546,83 @@ typedef struct epc_entry_map {
     struct epc_entry_map *next;
 } epc_map;
 
-typedef struct mark_eid_einit {
-    uint64_t eid;
-    struct mark_eid_einit *next;
-} eid_einit_t;
+// Per-enclave QEMU state. Not packed: the stat counters, the key cache
+// lock and children are updated atomically. stat_t only has uint64_t
+// fields, so it still matches the qstat_t the kernel copies it into.
+#pragma pack(pop)
+
+// Host time spent in one ENCLS/ENCLU leaf (or outside the enclave)
+#define SGX_STAT_BUCKETS        (32)
+#define SGX_STAT_ENCLS_LEAVES   (ENCLS_EMODT + 1)
+#define SGX_STAT_ENCLU_LEAVES   (ENCLU_EACCEPTCOPY + 1)
 
 typedef struct {
-    unsigned int mode_switch;
-    unsigned int tlbflush_n;
-
-    unsigned int encls_n;
-    unsigned int ecreate_n;
-    unsigned int eadd_n;
-    unsigned int eextend_n;
-    unsigned int einit_n;
-    unsigned int eaug_n;
- 
-    unsigned int enclu_n;
-    unsigned int eenter_n;
-    unsigned int eresume_n;
-    unsigned int eexit_n;
-    unsigned int egetkey_n;
-    unsigned int ereport_n;
-    unsigned int eaccept_n;
+    uint64_t n;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[SGX_STAT_BUCKETS];    // hist[i]: [2^(i-1), 2^i) ns
+} lat_stat_t;
+
+typedef struct {
+    uint64_t mode_switch;
+    uint64_t tlbflush_n;
+    uint64_t aex_n;
+
+    uint64_t encls_n;
+    uint64_t ecreate_n;
+    uint64_t eadd_n;
+    uint64_t eextend_n;
+    uint64_t einit_n;
+    uint64_t eaug_n;
+
+    uint64_t enclu_n;
+    uint64_t eenter_n;
+    uint64_t eresume_n;
+    uint64_t eexit_n;
+    uint64_t egetkey_n;
+    uint64_t ereport_n;
+    uint64_t eaccept_n;
+    uint64_t keycache_hit_n;             // derived keys served from the cache
+    uint64_t keycache_miss_n;
+
+    uint64_t ewb_n;                      // pages evicted
+    uint64_t eldu_n;                     // pages loaded back, by ELDU or on access
+    uint64_t epc_fault_n;                // enclave accesses that loaded a page
+    uint64_t epc_retry_n;                // accesses retried on a page in flight
+    uint64_t epc_readahead_n;            // pages loaded ahead of a fault
+
+    lat_stat_t encls_lat[SGX_STAT_ENCLS_LEAVES];
+    lat_stat_t enclu_lat[SGX_STAT_ENCLU_LEAVES];
 } stat_t;
 
+// Keys derived for one enclave by EGETKEY/EREPORT, looked up by the whole
+// key dependency tuple. Entries are only valid for the CPUSVN and owner
+// epoch they were derived under.
+#define SGX_KEYCACHE_SLOTS      (16)
+
+typedef struct {
+    bool     valid;
+    keydep_t keydep;
+    uint8_t  key[DEVICE_KEY_LENGTH];
+    aes_cmac128_context cmac;           // key expanded for CMAC (sgx-aes.h)
+} keycache_entry_t;
+
+typedef struct {
+    volatile int lock;
+    uint64_t cpusvn[2];
+    uint64_t ownerEpoch[2];
+    uint32_t next;                      // round-robin replacement
+    keycache_entry_t entries[SGX_KEYCACHE_SLOTS];
+} keycache_t;
+
 typedef struct {
     stat_t stat;
+    keycache_t keys;
+    sgx_measure_t measure;              // MRENCLAVE until EINIT (sgx-measure.h)
+    uint64_t children;                  // valid EPC pages, EREMOVE of the SECS waits for 0
+    bool einit;                         // EINIT succeeded
 } qeid_t;
+#pragma pack(push, 1)
 
 
 /* Not defined in the SGX spec sec2.6 but used in ewb & eldb instruction */
@@ -1,7 +1,7 @@
 #include <string.h>
 #include <stdio.h>
-#include "openssl/evp.h"
-#include "openssl/modes.h"
+#include <sched.h>
+#include <sys/mman.h>
 
 #include "cpu.h"
 #include "sgx.h"
@@ -11,6 +11,9 @@
 #include "sgx-dbg.h"
 #include "exec/cpu-all.h"
 #include "sgx-perf.h"
+#include "sgx-epcm.h"
+#include "sgx-aes.h"
+#include "tcg-plugin.h"
 
 #include "polarssl/sha256.h"
 #include "polarssl/rsa.h"
@@ -19,22 +22,128 @@
 #include "polarssl/sha1.h"
 #include "polarssl/aes_cmac128.h"
 
-static qeid_t qenclaves[MAX_ENCLAVES];
+// Per-enclave state by SECS.EID: chunks of QEID_CHUNK entries, allocated
+// by the ECREATE that first needs one and never freed, so that any vCPU
+// looks an enclave up without a lock
+static qeid_t *qenclaves[MAX_ENCLAVES / QEID_CHUNK];
+
+static inline
+qeid_t *qenclave(uint64_t eid)
+{
+    qeid_t *chunk;
+
+    if (eid >= MAX_ENCLAVES)
+        return NULL;
+    chunk = __atomic_load_n(&qenclaves[eid / QEID_CHUNK], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[eid % QEID_CHUNK] : NULL;
+}
+
+// Per-enclave statistics are bumped by every vCPU running the enclave
+#define QSTAT_ADD(eid, field, n)                                        \
+    do {                                                                \
+        qeid_t *qe_ = qenclave(eid);                                    \
+        if (qe_)                                                        \
+            __atomic_fetch_add(&qe_->stat.field, (n), __ATOMIC_RELAXED);\
+    } while (0)
+#define QSTAT_INC(eid, field) QSTAT_ADD(eid, field, 1)
+
+// Enclave the ENCLS/ENCLU leaf in flight on this vCPU accounts to; set by
+// the leaf once it passed its checks, so faulting leaves are not timed
+static __thread int64_t qstat_eid = -1;
+
+#define QSTAT_LEAF(eid, field)                  \
+    do {                                        \
+        QSTAT_INC(eid, field);                  \
+        qstat_eid = (eid);                      \
+    } while (0)
+
+static inline
+int64_t qstat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// log2 histogram, hist[i] counts latencies in [2^(i-1), 2^i) ns
+static
+void qstat_lat_add(lat_stat_t *lat, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&lat->max_ns, __ATOMIC_RELAXED);
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if (bucket >= SGX_STAT_BUCKETS)
+        bucket = SGX_STAT_BUCKETS - 1;
+
+    __atomic_fetch_add(&lat->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->hist[bucket], 1, __ATOMIC_RELAXED);
+    while (ns > max
+           && !__atomic_compare_exchange_n(&lat->max_ns, &max, ns, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline
+int64_t qstat_leaf_begin(void)
+{
+    qstat_eid = -1;
+    return qstat_now();
+}
+
+// Charge the host time since qstat_leaf_begin() to the leaf's histogram
+static inline
+void qstat_leaf_end(bool enclu, uint64_t leaf, int64_t start)
+{
+    qeid_t *qe;
+    stat_t *stat;
+
+    if (qstat_eid < 0 || !(qe = qenclave(qstat_eid)))
+        return;
+
+    stat = &qe->stat;
+    if (enclu && leaf < SGX_STAT_ENCLU_LEAVES)
+        qstat_lat_add(&stat->enclu_lat[leaf], qstat_now() - start);
+    else if (!enclu && leaf < SGX_STAT_ENCLS_LEAVES)
+        qstat_lat_add(&stat->encls_lat[leaf], qstat_now() - start);
+}
 
 /**
  *  SGX Global Data Structures
+ *
+ *  Every guest thread is a vCPU that may run ENCLS/ENCLU concurrently:
+ *   - epcm[]: an ENCLS/ENCLU leaf that changes an entry claims it first
+ *     (epcm_claim()); memory accesses read entries without locking, and
+ *     set_epcm_entry() publishes the valid bit last.
+ *   - qenclaves[]: see qenclave(); an EID is only handed out again once
+ *     EREMOVE took its SECS, with no page of the enclave left.
+ *   - enclaveTrackEntry: lists only ever grow at the head with
+ *     a CAS and nodes are never freed, so readers walk them lock-free.
+ *   - EPC_BaseAddr/EPC_EndAddr, epcm/epcm_npages, epcm_idx and the device
+ *     keys are written once by encls_qemu_init(), before any enclave runs.
+ *   - epc_swap[] belongs to the kernel pager; a vCPU only takes an entry
+ *     from EPC_SWAP_OUT to EPC_SWAP_IN with a CAS (see epc_page_in()).
  */
-static epcm_entry_t epcm[NUM_EPC];
+static epcm_entry_t *epcm;                      // one entry per EPC page
+static uint32_t epcm_npages;
+static epcm_index_t epcm_idx;                   // EPC address -> epcm[] index
 static epc_map * enclaveTrackEntry = NULL;      // Tracking pointers For enclaves
-static eid_einit_t * entry_eid = NULL;
 static uint64_t EPC_BaseAddr;
 static uint64_t EPC_EndAddr;
+static uint64_t next_eid;                       // SECS.EID never handed out
+static uint32_t eid_free[MAX_ENCLAVES];         // EIDs freed by EREMOVE
+static uint32_t eid_nfree;
+static volatile int eid_lock;
+static epc_swap_t *epc_swap;                    // kernel pager, per EPC page
+static uint64_t *epc_swap_faults;               // pages loaded on access
+static uint64_t epc_version;                    // EWB version (VA slot) allocator
+static uint64_t track_epoch = 1;                // stamped on pages by EBLOCK
+static uint64_t tracked_epoch;                  // EBLOCKs before it are tracked
 // Collaborate them
 static bool enclave_init = false;
 //static bool enclave_Access = false;
 static bool einit_Success = false;
 //static bool enclave_Exit = false;
-static int32_t curr_Eid = -1;
 
 static uint64_t enclave_ssa_base;
 
@@ -48,125 +157,25 @@ typedef struct {
     bool write_perm;
 } perm_check_t;
 
-typedef enum {
-    eenter,
-    eresume,
-    none,
-} op_type_t;
-
-// why?
-op_type_t operation = none;
-
 // Data structure &Functions for Ewb inst
 static const unsigned char gcm_key[] = {
 0x5f, 0x8a, 0xe6, 0xd1, 0x65, 0x8b, 0xb2, 0x6d, 0xe6, 0xf8, 0xa0, 0x69,
 0xa3, 0x52, 0x02, 0x93};
 
-static
-void handleError(const char *errMsg)
-{
-    printf("%s\n", errMsg);
-    exit(-1);
-}
-
-static
-int encrypt_epc(unsigned char *plaintext, int plaintext_len, unsigned char *aad,
-            int aad_len, const unsigned char *key, unsigned char *iv,
-            unsigned char *ciphertext, unsigned char *tag) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int ciphertext_len;
-
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleError("Context Creation Error !!!");
-    }
-    if(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1) {
-        handleError("EVP Init Error !!!");
-    }
-    if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 16, NULL) != 1) {
-        handleError("Context Control Error !!!");
-    }
-    if(EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
-        handleError("Key & IV Init Error !!!");
-    }
-    if(EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_len) !=1 ) {
-        handleError("Aad Addtion Error !!!");
-    }
-    if(EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len) !=1 ) {
-        handleError("Encryption Error !!!");
-    }
-    ciphertext_len = len;
-
-
-    // Finalise the encryption. Normally ciphertext bytes may be written at
-    // this stage, but this does not occur in GCM mode
-    if(EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) {
-        handleError("Finalize Error !!!");
-    }
-    // Get the tag
-    if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) != 1) {
-        handleError("Getting Tag Error !!!");
-    }
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
-    return ciphertext_len;
-}
+// EWB/ELDB page cipher: gcm_key expanded once per vCPU
+static __thread sgx_gcm_t epc_gcm;
+static __thread bool epc_gcm_ready;
 
 static
-int decrypt_epc(unsigned char *ciphertext, int ciphertext_len, unsigned char *aad,
-            int aad_len, unsigned char *tag, const unsigned char *key, unsigned char *iv,
-            unsigned char *plaintext)
+sgx_gcm_t *epc_cipher(void)
 {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int plaintext_len;
-    int ret;
-
-    // create and init the context
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleError("Context Creation Error !!!");
-    }
-    // init the decrypt operation
-    if(!EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL)) {
-        handleError("EVIP Decrypt Init Error !!!");
-    }
-    // Set iv length.
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 16, NULL)) {
-        handleError("Context Control Error !!!");
-    }
-    if(EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
-        handleError("Key & IV Init Error !!!");
-    }
-    if(EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len) !=1 ) {
-        handleError("Aad Addtion Error !!!");
-    }
-    if(EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) !=1 ) {
-        handleError("Encryption Error !!!");
-    }
-    plaintext_len = len;
-
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag)) {
-        handleError("Setting Tag Error !!!");
-    }
-
-    //  A non positive return value from EVP_DecryptFinal_ex
-    //  should be considered as a failure to authenticate
-    //  ciphertext and/or AAD
-    ret = EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
-
-    // clean up
-    EVP_CIPHER_CTX_free(ctx);
-
-    if(ret > 0) { //Decrypt Success 
-        plaintext_len += len;
-        return plaintext_len;
-    }
-    else {
-        return -1;
+    if (!epc_gcm_ready) {
+        sgx_gcm_init(&epc_gcm, gcm_key);
+        epc_gcm_ready = true;
     }
+    return &epc_gcm;
 }
 
-
 // A helper function to intialize attributes_t
 static inline
 attributes_t attr_create(uint64_t a1, uint64_t a2)
@@ -241,6 +250,79 @@ bool is_within_enclave(CPUX86State *env, uint64_t mem_addr)
          (mem_addr <= (env->cregs.CR_ELRANGE[0] + env->cregs.CR_ELRANGE[1])));
 }
 
+// EPCM permission cache (env->sgx_epcm_cache), probed inline by enclave
+// TBs. Only pages that passed the ELRANGE check are filled, so the cache
+// is dropped on every enclave transition and whenever EPCM permissions or
+// validity of a page may shrink.
+static inline
+SGXEPCMCacheEntry *epcm_cache_entry(CPUX86State *env, uint64_t page)
+{
+    return &env->sgx_epcm_cache[(page >> TARGET_PAGE_BITS) & (SGX_EPCM_CACHE_SIZE - 1)];
+}
+
+static
+void epcm_cache_flush(CPUX86State *env)
+{
+    memset(env->sgx_epcm_cache, 0xff, sizeof(env->sgx_epcm_cache));
+}
+
+// Drop a single page from the cache of every vCPU
+static
+void epcm_cache_flush_page(uint64_t addr)
+{
+    uint64_t page = addr & TARGET_PAGE_MASK;
+    CPUState *cs;
+
+    CPU_FOREACH(cs) {
+        SGXEPCMCacheEntry *entry = epcm_cache_entry(&X86_CPU(cs)->env, page);
+        // the owning vCPU may be probing this entry: word-sized stores only
+        if (entry->addr_read == page)
+            __atomic_store_n(&entry->addr_read, -1, __ATOMIC_RELAXED);
+        if (entry->addr_write == page)
+            __atomic_store_n(&entry->addr_write, -1, __ATOMIC_RELAXED);
+        if (entry->addr_code == page)
+            __atomic_store_n(&entry->addr_code, -1, __ATOMIC_RELAXED);
+    }
+}
+
+static
+void epcm_cache_fill(CPUX86State *env, uint64_t addr, epcm_entry_t *epcm_entry)
+{
+    uint64_t page = addr & TARGET_PAGE_MASK;
+    SGXEPCMCacheEntry *entry = epcm_cache_entry(env, page);
+    bool read    = epcm_entry->read;
+    bool write   = epcm_entry->write;
+    bool execute = epcm_entry->execute;
+
+    entry->addr_read  = read    ? page : -1;
+    entry->addr_write = write   ? page : -1;
+    entry->addr_code  = execute ? page : -1;
+
+    // Another vCPU may have shrunk the permissions or blocked the page and
+    // flushed this entry between our EPCM check and the fill above; drop
+    // it in that case
+    __sync_synchronize();
+    if (!epcm_entry->valid || epcm_entry->blocked || epcm_entry->read != read
+        || epcm_entry->write != write || epcm_entry->execute != execute) {
+        memset(entry, 0xff, sizeof(SGXEPCMCacheEntry));
+    }
+}
+
+// Enter/leave enclave mode. The mode is mirrored into hflags so that it
+// becomes part of the TB flags: the translator emits the SGX memory checks
+// only for TBs that run in enclave mode (see gen_sgx_mem_access()).
+static
+void set_enclave_mode(CPUX86State *env, bool mode)
+{
+    env->cregs.CR_ENCLAVE_MODE = mode;
+    epcm_cache_flush(env);
+    if (mode) {
+        env->hflags |= HF_SGX_MASK;
+    } else {
+        env->hflags &= ~HF_SGX_MASK;
+    }
+}
+
 // Check if mem_addr is in EPC
 static
 bool is_within_epc(uint64_t mem_addr)
@@ -286,27 +368,11 @@ bool is_within_same_epc(void *target_addr1, void *target_addr2, CPUX86State *env
     check_within_epc(target_addr1, env);
     check_within_epc(target_addr2, env);
 
-    int i = 0, target_index1 = 0, target_index2 = 0 ;
-    int start_addr, end_addr;
-
-    start_addr = EPC_BaseAddr;
-    end_addr = EPC_BaseAddr + PAGE_SIZE;
-    for (i = 0 ; i < NUM_EPC; i++) {
-       if (target_index1 && target_index2) //found two indices.
-           break;
-       if((!target_index1) && ((uintptr_t)target_addr1 > start_addr) &&
-		  ((uintptr_t)target_addr1 < end_addr)) {
-           target_index1 = i;
-       }
-       if((!target_index2) && ((uintptr_t)target_addr2 > start_addr) &&
-		  ((uintptr_t)target_addr2 < end_addr)) {
-           target_index2 = i;
-       }
-       start_addr += PAGE_SIZE;
-       end_addr += PAGE_SIZE;
-    }
-    printf("first target addr:%lx\t index:%d\n", (uintptr_t)target_addr1, target_index1);
-    printf("second target addr:%lx\t index:%d\n", (uintptr_t)target_addr2, target_index2);
+    int64_t target_index1 = epcm_index_lookup(&epcm_idx, (uint64_t)target_addr1);
+    int64_t target_index2 = epcm_index_lookup(&epcm_idx, (uint64_t)target_addr2);
+
+    sgx_dbg(trace, "first target addr:%lx\t index:%ld", (uintptr_t)target_addr1, target_index1);
+    sgx_dbg(trace, "second target addr:%lx\t index:%ld", (uintptr_t)target_addr2, target_index2);
 
     return (target_index1 == target_index2);
 }
@@ -434,7 +500,7 @@ void epcm_field_check(epcm_entry_t *epcm_entry, uint64_t enclave_addr,
 static
 void set_ssa_base(void)
 {
-    enclave_ssa_base = NUM_EPC;
+    enclave_ssa_base = epcm_npages;
 }
 
 // Update the SSA Base
@@ -443,8 +509,8 @@ void set_ssa_base(void)
 static
 void update_ssa_base(void)
 {
-    enclave_ssa_base = (enclave_ssa_base < NUM_EPC) ?
-                       enclave_ssa_base + 1 : NUM_EPC;
+    enclave_ssa_base = (enclave_ssa_base < epcm_npages) ?
+                       enclave_ssa_base + 1 : epcm_npages;
 }
 #endif
 
@@ -642,30 +708,34 @@ uint64_t compute_xsave_frame_size( CPUX86State *env, attributes_t attributes) {
 
 // Searches EPCM for effective address
 static
-uint16_t epcm_search(void *addr, CPUX86State *env)
+uint32_t epcm_search(void *addr, CPUX86State *env)
 {
 
     assert(addr);
     assert(env);
 
-    uint16_t i;
-    int16_t index = -1;
+    // Can be in between page addresses. for example: EEXTEND : 256 chunks && EWB : Version Array (VA)
+    int64_t index = epcm_index_lookup(&epcm_idx, (uint64_t)addr);
 
-    for (i = 0; i < NUM_EPC; i ++) {
-        // Can be in between page addresses. for example: EEXTEND : 256 chunks && EWB : Version Array (VA)
-        if ((epcm[i].epcPageAddress <= (uint64_t)addr)
-                && ((uint64_t)addr < epcm[i].epcPageAddress + PAGE_SIZE)) {
-            index = i;
-            break;
-        }
-    }
-
-    if (index == -1) {
-        sgx_msg(warn, "Fail to get epcm index addr: %lx");
+    if (index < 0) {
+        sgx_dbg(warn, "Fail to get epcm index addr: %lx", (uint64_t)addr);
         raise_exception(env, EXCP0D_GPF);
     }
 
-    return (uint16_t)index;
+    return (uint32_t)index;
+}
+
+// Valid pages of the enclave of SECS secs (0: none) go up or down by delta
+static
+void qenclave_children(uint64_t secs, int64_t delta)
+{
+    qeid_t *qe;
+
+    if (!secs)
+        return;
+    qe = qenclave(((secs_t *)secs)->eid_reserved.eid_pad.eid);
+    if (qe)
+        __atomic_fetch_add(&qe->children, delta, __ATOMIC_RELAXED);
 }
 
 // Set fields of epcm_entry
@@ -676,7 +746,14 @@ void set_epcm_entry(epcm_entry_t *epcm_entry, bool valid, bool read, bool write,
 {
     assert(epcm_entry);
 
-    epcm_entry->valid        = valid;
+    if (epcm_entry->valid)
+        qenclave_children(epcm_entry->enclave_secs, -1);
+
+    // Lock-free readers on other vCPUs must never see a valid entry with
+    // stale fields: withdraw the valid bit first and publish it last
+    __atomic_store_n(&epcm_entry->valid, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
     epcm_entry->read         = read;
     epcm_entry->write        = write;
     epcm_entry->execute      = execute;
@@ -684,6 +761,57 @@ void set_epcm_entry(epcm_entry_t *epcm_entry, bool valid, bool read, bool write,
     epcm_entry->page_type    = pt;
     epcm_entry->enclave_secs = secs;
     epcm_entry->enclave_addr = addr;
+    epcm_entry->tcs_busy     = 0;
+
+    if (valid) {
+        qenclave_children(secs, 1);
+        __atomic_store_n(&epcm_entry->valid, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Pairs with the release store in set_epcm_entry(), for readers that do
+// not hold the entry
+static inline bool epcm_valid(const epcm_entry_t *epcm_entry)
+{
+    return __atomic_load_n(&epcm_entry->valid, __ATOMIC_ACQUIRE);
+}
+
+// EPC page concurrency check: a leaf that updates an EPCM entry claims it
+// for the duration of the update, and a concurrent leaf on the same page
+// gets #GP(0) instead of waiting (as on hardware). Callers claim after
+// their faulting checks, since raise_exception() does not return.
+static
+bool epcm_try_claim(epcm_entry_t *epcm_entry)
+{
+    return __sync_bool_compare_and_swap(&epcm_entry->busy, 0, 1);
+}
+
+static
+void epcm_release(epcm_entry_t *epcm_entry)
+{
+    __sync_lock_release(&epcm_entry->busy);
+}
+
+static
+void epcm_claim(epcm_entry_t *epcm_entry, CPUX86State *env)
+{
+    if (!epcm_try_claim(epcm_entry)) {
+        sgx_dbg(warn, "EPC page %p is in use",
+                (void *)(epcm_idx.base + (epcm_entry - epcm) * PAGE_SIZE));
+        raise_exception(env, EXCP0D_GPF);
+    }
+}
+
+// Claim a page that is about to become valid (ECREATE/EADD/EAUG): whoever
+// loses the race against another leaf on the same page faults
+static
+void epcm_claim_invalid(epcm_entry_t *epcm_entry, CPUX86State *env)
+{
+    epcm_claim(epcm_entry, env);
+    if (epcm_entry->valid) {
+        epcm_release(epcm_entry);
+        raise_exception(env, EXCP0D_GPF);
+    }
 }
 
 // Unused.
@@ -691,7 +819,7 @@ void set_epcm_entry(epcm_entry_t *epcm_entry, bool valid, bool read, bool write,
 static
 bool checkRWAccessible(uint64_t page, CPUX86State *env)
 {
-    uint16_t index_current = epcm_search((void *)page, env);
+    uint32_t index_current = epcm_search((void *)page, env);
 
     if ((epcm[index_current].read) || (epcm[index_current].write)) {
         return 1;
@@ -719,6 +847,24 @@ bool releaseLocks(void)
 }
 #endif
 
+// A TCS is owned by at most one logical processor between EENTER/ERESUME
+// and EEXIT, so that several host threads can run one enclave through
+// different TCSes but never through the same one
+static
+void tcs_acquire(epcm_entry_t *pepcm, tcs_t *tcs, CPUX86State *env)
+{
+    if (!__sync_bool_compare_and_swap(&pepcm->tcs_busy, 0, 1)) {
+        sgx_dbg(warn, "TCS %p is already in use", tcs);
+        raise_exception(env, EXCP0D_GPF);
+    }
+}
+
+static
+void tcs_release(epcm_entry_t *pepcm)
+{
+    __sync_lock_release(&pepcm->tcs_busy);
+}
+
 // Check within DS Segment
 static
 void checkWithinDSSegment(CPUX86State *env, uint64_t addr)
@@ -757,27 +903,18 @@ bool checkEINITSuccess(void)
 static
 bool checkEINIT(uint64_t eid)
 {
-    eid_einit_t *temp = entry_eid;
-    while (temp != NULL) {
-        if (temp->eid == eid)
-            return true;
-        temp = temp->next;
-    }
-    return false;
+    qeid_t *qe = qenclave(eid);
+
+    return qe && __atomic_load_n(&qe->einit, __ATOMIC_ACQUIRE);
 }
 
 static
 void markEnclave(uint64_t eid)
 {
-    eid_einit_t *temp;
-    if ((temp = (eid_einit_t *) malloc (sizeof (eid_einit_t))) == NULL) {
-        sgx_msg(warn, "no more memory");
-        return;
-    } else {
-        temp->eid = eid;
-        temp->next = entry_eid;
-        entry_eid = temp;
-    }
+    qeid_t *qe = qenclave(eid);
+
+    if (qe)
+        __atomic_store_n(&qe->einit, true, __ATOMIC_RELEASE);
 }
 
 /*
@@ -937,26 +1074,19 @@ bool checkLastFuncEntries(uint64_t mem_addr)
 }
 */
 
-// Check whether eid is new(newly allocted enclave) or not
+// Locate the epc_map of an enclave. Lookups do not reorder the list (it
+// used to be move-to-front), so that they are safe against other vCPUs.
 static
-bool checkEnclaveID (uint64_t eid)
+epc_map *findEnclaveMap(uint64_t eid)
 {
     epc_map *tmp_map = enclaveTrackEntry;
-    epc_map *prev = NULL;
 
     while (tmp_map != NULL) {
-        if (tmp_map->eid == eid) {
-            if (prev != NULL) {
-                prev->next = tmp_map->next;
-                tmp_map->next = enclaveTrackEntry;
-                enclaveTrackEntry = tmp_map;
-            }
-            return true;
-        }
-        prev = tmp_map;
+        if (tmp_map->eid == eid)
+            return tmp_map;
         tmp_map = tmp_map->next;
     }
-    return false;
+    return NULL;
 }
 
 // Check whether addr is included in the specific epc_map's tmp_entry list
@@ -1013,14 +1143,14 @@ bool trackEnclaveEntry(secs_t *secs, uint64_t addr)
         tmp_map->active = true;
         tmp_map->lastAddr = NULL;
 
-        if (enclaveTrackEntry != NULL) {
+        do {
             tmp_map->next = enclaveTrackEntry;
-        }
-        enclaveTrackEntry = tmp_map;
+        } while (!__sync_bool_compare_and_swap(&enclaveTrackEntry,
+                                               tmp_map->next, tmp_map));
     }
 
-    bool isInEnclave = checkWithinEnclave(enclaveTrackEntry, addr);
-    tmp_map = enclaveTrackEntry;
+    tmp_map = findEnclaveMap(eid);
+    bool isInEnclave = checkWithinEnclave(tmp_map, addr);
     //Now tmp_map indicates epc_map of EID
 
     if (!isInEnclave) {
@@ -1049,9 +1179,9 @@ static
 bool removeEnclaveEntry (secs_t *secs)
 {
     uint64_t eid = secs->eid_reserved.eid_pad.eid;
-    bool isPresent = checkEnclaveID(eid);
-    if (isPresent ) {
-        enclaveTrackEntry->active = 0;
+    epc_map *tmp_map = findEnclaveMap(eid);
+    if (tmp_map) {
+        tmp_map->active = 0;
         return true;
     }
     return false;
@@ -1063,7 +1193,7 @@ static
 uint64_t addressMapping(CPUX86State *env, void *addr)
 {
     uint8_t i;
-    for (i = 0; i < NUM_EPC; i ++) {
+    for (i = 0; i < epcm_npages; i ++) {
         // Can be in between page addresses. for example: EEXTEND : 256 chunks
         if (epcm[i].appAddress == (uint64_t)addr) {
             return epcm[i].enclave_addr;
@@ -1081,8 +1211,260 @@ static void abortAccess(CPUX86State *env) {
 }
 */
 
+// EPC paging
+//
+// EWB encrypts a page under a fresh version that it stores in a VA slot
+// and that doubles as the AES-GCM nonce; ELDB/ELDU only load the page
+// back under that version and free the slot. The kernel pager tells where
+// it keeps evicted pages (ENCLS_OSGX_PAGER), and an enclave access to one
+// is served with an ELDU by the faulting vCPU itself, since the emulator
+// delivers no #PF to the untrusted runtime.
+
+static
+void epc_version_iv(uint8_t iv[SGX_GCM_IV_LEN], uint64_t version)
+{
+    memset(iv, 0, SGX_GCM_IV_LEN);
+    memcpy(iv, &version, sizeof(version));
+}
+
+// MAC header of EWB: binds the ciphertext to the enclave, linear address
+// and EPCM attributes of the page
+static
+void epc_mac_header(mac_header_t *header, secs_t *secs, uint64_t linaddr,
+                    const secinfo_flags_t *flags)
+{
+    memset(header, 0, sizeof(mac_header_t));
+    header->eid = secs ? secs->eid_reserved.eid_pad.eid : 0;
+    header->linaddr = linaddr;
+    header->secinfo.flags.page_type = flags->page_type;
+    header->secinfo.flags.r = flags->r;
+    header->secinfo.flags.w = flags->w;
+    header->secinfo.flags.x = flags->x;
+    header->secinfo.flags.pending = flags->pending;
+    header->secinfo.flags.modified = flags->modified;
+}
+
+#define ELD_GPF ((uint64_t)-1)      // eld_page(): the operands fault
+
+// ELDB/ELDU: load the page EWB wrote to pageinfo->srcpge back into
+// epc_page, if its MAC checks out under the version in va_slot, which is
+// then freed. Returns 0, the error code for RAX or ELD_GPF. It does not
+// raise #GP itself, so that epc_swap_in() can give its slot back first.
+static
+uint64_t eld_page(CPUX86State *env, pageinfo_t *pageinfo, uint64_t epc_page,
+                  uint64_t *va_slot, bool blocked)
+{
+    uint8_t *srcpge = (uint8_t *)pageinfo->srcpge;
+    pcmd_t *pcmd = (pcmd_t *)pageinfo->secinfo;
+    secs_t *secs = (secs_t *)pageinfo->secs;
+    secinfo_flags_t flags;
+    mac_header_t header;
+    uint8_t iv[SGX_GCM_IV_LEN];
+    int64_t epc_index, va_index, secs_index;
+    epcm_entry_t *entry;
+
+    if (!is_aligned(pageinfo, PAGEINFO_ALIGN_SIZE) ||
+        !is_aligned(epc_page, PAGE_SIZE) || !is_aligned(va_slot, 8)) {
+        return ELD_GPF;
+    }
+    if (!is_within_epc(epc_page) || !is_within_epc((uint64_t)va_slot)) {
+        return ELD_GPF;
+    }
+
+    if (!is_aligned(pcmd, sizeof(pcmd_t)) || !is_aligned(srcpge, PAGE_SIZE)) {
+        return ELD_GPF;
+    }
+
+    epc_index = epcm_index_lookup(&epcm_idx, epc_page);
+    va_index = epcm_index_lookup(&epcm_idx, (uint64_t)va_slot);
+    if (epc_index < 0 || va_index < 0 ||
+        epcm[va_index].valid == 0 || epcm[va_index].page_type != PT_VA) {
+        return ELD_GPF;
+    }
+
+    flags = pcmd->secinfo.flags;
+    switch (flags.page_type) {
+    case PT_REG:
+    case PT_TCS:
+        if (!is_aligned(secs, PAGE_SIZE) || !is_within_epc((uint64_t)secs)) {
+            return ELD_GPF;
+        }
+        secs_index = epcm_index_lookup(&epcm_idx, (uint64_t)secs);
+        if (secs_index < 0 || epcm[secs_index].valid == 0 ||
+            epcm[secs_index].page_type != PT_SECS) {
+            return ELD_GPF;
+        }
+        break;
+    case PT_VA:
+        if (secs) {
+            return ELD_GPF;
+        }
+        break;
+    default:
+        // EWB never evicts a SECS (see sgx_ewb())
+        return ELD_GPF;
+    }
+    epc_mac_header(&header, secs, pageinfo->linaddr, &flags);
+
+    // as epcm_claim_invalid(), without raising
+    entry = &epcm[epc_index];
+    if (!epcm_try_claim(entry)) {
+        return ELD_GPF;
+    }
+    if (entry->valid) {
+        epcm_release(entry);
+        return ELD_GPF;
+    }
+
+    epc_version_iv(iv, *va_slot);
+    if (sgx_gcm_decrypt(epc_cipher(), iv, &header, sizeof(header),
+                        srcpge, PAGE_SIZE, (void *)epc_page,
+                        (uint8_t *)pcmd->mac) < 0) {
+        epcm_release(entry);
+        return ERR_SGX_MAC_COMPARE_FAIL;
+    }
+    *va_slot = 0;
+
+    entry->pending  = flags.pending;
+    entry->modified = flags.modified;
+    set_epcm_entry(entry, 1, flags.r, flags.w, flags.x, blocked,
+                   flags.page_type, (uint64_t)secs, pageinfo->linaddr);
+    epcm_release(entry);
+    return 0;
+}
+
+// Re-execute the instruction at retaddr once the vCPU went through
+// cpu_loop(): its page is on the way out or in
+static QEMU_NORETURN
+void epc_page_retry(CPUX86State *env, uint64_t eid, uintptr_t retaddr)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+
+    QSTAT_INC(eid, epc_retry_n);
+    cpu_restore_state(cs, retaddr);
+    cs->exception_index = EXCP_YIELD;
+    cpu_loop_exit(cs);
+}
+
+// ELDU of the evicted page epcm[index] unless another vCPU got to it
+// first: 1 if it is loaded, 0 if it was not out, -1 if it cannot be loaded
+// (its MAC does not match or its operands fault; it stays out)
+static
+int epc_swap_in(CPUX86State *env, uint32_t index)
+{
+    uint64_t page = epcm_idx.base + (uint64_t)index * PAGE_SIZE;
+    epc_swap_t *swap = &epc_swap[index];
+
+    if (__atomic_load_n(&swap->state, __ATOMIC_ACQUIRE) != EPC_SWAP_OUT ||
+        !__sync_bool_compare_and_swap(&swap->state, EPC_SWAP_OUT,
+                                      EPC_SWAP_BUSY)) {
+        return 0;
+    }
+    if (eld_page(env, &swap->pageinfo, page, (uint64_t *)swap->va_slot,
+                 false)) {
+        __atomic_store_n(&swap->state, EPC_SWAP_OUT, __ATOMIC_RELEASE);
+        sgx_dbg(warn, "evicted page %p cannot be loaded back", (void *)page);
+        return -1;
+    }
+    __atomic_store_n(&swap->state, EPC_SWAP_IN, __ATOMIC_RELEASE);
+    __atomic_fetch_add(epc_swap_faults, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Readahead: a vCPU that faults on the page right after the last one it
+// loaded (ahead) walks sequentially, so it loads a window of the pages
+// that follow, doubling up to EPC_READAHEAD_MAX while the walk lasts
+#define EPC_READAHEAD_MIN 4
+#define EPC_READAHEAD_MAX 32
+
+static __thread uint32_t ra_next = UINT32_MAX;  // page after the last window
+static __thread uint32_t ra_window;
+
+static
+void epc_readahead(CPUX86State *env, uint32_t index, uint64_t eid)
+{
+    uint64_t secs = epc_swap[index].pageinfo.secs;
+    uint32_t n = 0;
+
+    if (index == ra_next) {
+        ra_window = ra_window ? ra_window * 2 : EPC_READAHEAD_MIN;
+        if (ra_window > EPC_READAHEAD_MAX) {
+            ra_window = EPC_READAHEAD_MAX;
+        }
+    } else {
+        ra_window = 0;
+    }
+
+    // only pages of the same enclave, and the window stops at the first
+    // one that is not out
+    while (n < ra_window && index + 1 + n < epcm_npages &&
+           epc_swap[index + 1 + n].pageinfo.secs == secs &&
+           epc_swap_in(env, index + 1 + n) > 0) {
+        n ++;
+    }
+    ra_next = index + 1 + n;
+
+    QSTAT_ADD(eid, eldu_n, n);
+    QSTAT_ADD(eid, epc_readahead_n, n);
+}
+
+// An enclave access to the invalid or blocked EPC page epcm[index]: ELDU
+// it if the pager evicted it, or retry the access while the page is in
+// flight. Returns false for a page that the pager knows nothing about.
+static
+bool epc_page_in(CPUX86State *env, uint32_t index, uintptr_t retaddr)
+{
+    secs_t *active = (secs_t *)env->cregs.CR_ACTIVE_SECS;
+    uint64_t eid = active->eid_reserved.eid_pad.eid;
+    epc_swap_t *swap;
+    int64_t start;
+
+    if (!epc_swap) {
+        return false;
+    }
+
+    swap = &epc_swap[index];
+    switch (__atomic_load_n(&swap->state, __ATOMIC_ACQUIRE)) {
+    case EPC_SWAP_OUT:
+        start = qstat_now();
+        switch (epc_swap_in(env, index)) {
+        case 0:
+            break;
+        case 1:
+            QSTAT_INC(eid, eldu_n);
+            QSTAT_INC(eid, epc_fault_n);
+            qstat_lat_add(&qenclave(eid)->stat.encls_lat[ENCLS_ELDU],
+                          qstat_now() - start);
+            epc_readahead(env, index, eid);
+            return true;
+        default:
+            raise_exception(env, EXCP0D_GPF);
+        }
+        break;
+    case EPC_SWAP_BUSY:
+        break;
+    default:
+        if (!epcm[index].blocked) {
+            return false;
+        }
+        break;
+    }
+    epc_page_retry(env, eid, retaddr);
+}
+
+// Accessed bit for ENCLS_OSGX_EPC_AGE, set once the EPCM cache holds the
+// page: the bit and the cache entry are cleared together
+static inline
+void epcm_accessed(epcm_entry_t *epcm_entry)
+{
+    if (!epcm_entry->accessed) {
+        __atomic_store_n(&epcm_entry->accessed, 1, __ATOMIC_RELAXED);
+    }
+}
+
 void helper_mem_execute(CPUX86State *env, target_ulong a0)
 {
+    uintptr_t retaddr = GETPC();
     int epcm_index = 0;
     uint64_t mem_addr = (uint64_t)a0;
     sgx_dbg(mtrace, "Executing memory (enclave:%d): %p",
@@ -1098,10 +1480,15 @@ void helper_mem_execute(CPUX86State *env, target_ulong a0)
                 sgx_msg(trace, "Inside Enclave. Executing Incorrect enclave memory");
                 raise_exception(env, EXCP0D_GPF);
             }
-            else if((epcm[epcm_index].execute) == 0){
+            if (!epcm_valid(&epcm[epcm_index]) || epcm[epcm_index].blocked) {
+                epc_page_in(env, epcm_index, retaddr);
+            }
+            if((epcm[epcm_index].execute) == 0){
                 sgx_dbg(trace, "EPCM execute property is violated at %p", (void *)mem_addr);
                 raise_exception(env, EXCP0D_GPF);
             }
+            epcm_cache_fill(env, mem_addr, &epcm[epcm_index]);
+            epcm_accessed(&epcm[epcm_index]);
         }
     }
 }
@@ -1109,6 +1496,7 @@ void helper_mem_execute(CPUX86State *env, target_ulong a0)
 // helper test
 void helper_mem_access(CPUX86State *env, target_ulong a0, int operation)
 {
+    uintptr_t retaddr = GETPC();
     int ld_ = 0;
     int st_ = 1;
     int epcm_index = 0;
@@ -1137,14 +1525,19 @@ void helper_mem_access(CPUX86State *env, target_ulong a0, int operation)
                 sgx_msg(trace, "Inside Enclave. Accessing Incorrect enclave memory");
                 raise_exception(env, EXCP0D_GPF);
             }
-            else if((operation == ld_) && (epcm[epcm_index].read) == 0){
+            if (!epcm_valid(&epcm[epcm_index]) || epcm[epcm_index].blocked) {
+                epc_page_in(env, epcm_index, retaddr);
+            }
+            if((operation == ld_) && (epcm[epcm_index].read) == 0){
                 sgx_dbg(trace, "EPCM read property is violated at %p", (void *)mem_addr);
-                //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
+                raise_exception(env, EXCP0D_GPF);
             }
             else if((operation == st_) && (epcm[epcm_index].write) == 0){
                 sgx_dbg(trace, "EPCM write property is violated at %p", (void *)mem_addr);
-                //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
+                raise_exception(env, EXCP0D_GPF);
             }
+            epcm_cache_fill(env, mem_addr, &epcm[epcm_index]);
+            epcm_accessed(&epcm[epcm_index]);
         }
     } else {
         if (is_within_epc(mem_addr) || (mem_addr == (uint64_t)epcm) ||
@@ -1177,12 +1570,14 @@ secs_t* get_secs_address(epcm_entry_t *cur_epcm)
     return (secs_t *)cur_epcm->enclave_secs;
 }
 
-// Allocate PKCS padding constant (352 bytes).
+// PKCS padding constant (352 bytes) of every key dependency, built once
+// by encls_qemu_init()
+static uint8_t pkcs1_5_padding[352];
+
 static
-uint8_t *alloc_pkcs1_5_padding(void) {
+void init_pkcs1_5_padding(void) {
     const char first_pkcs1_5_padding[2] = FIRST_PKCS1_5_PADDING;
     const char last_pkcs1_5_padding[20] = LAST_PKCS1_5_PADDING;
-    uint8_t *pkcs1_5_padding = (uint8_t *)calloc(sizeof(uint8_t), 352);
     int i;
 
     // [15:0] = 0100H
@@ -1195,8 +1590,6 @@ uint8_t *alloc_pkcs1_5_padding(void) {
 
     // [2815:2656] = 2004000501020403650148866009060D30313000H
     memcpy(&pkcs1_5_padding[332], last_pkcs1_5_padding, 20);
-
-    return pkcs1_5_padding;
 }
 
 // Outputs a 16-byte (128-bit) key
@@ -1204,41 +1597,115 @@ static
 void sgx_derivekey(const keydep_t* keydep, unsigned char* outputdata)
 {
     unsigned char hash[32];
-    unsigned char *input;
-    size_t size;
-
-    size = sizeof(keydep_t) + sizeof(process_priv_key);
-    input = malloc(size);
-    memset(input, 0, size);
-    memcpy(input, (unsigned char *)keydep, sizeof(keydep_t));
-    memcpy(input + sizeof(keydep_t), (unsigned char *)process_priv_key,
-           sizeof(process_priv_key));
+    sha256_context ctx;
 
-    sha256(input, size, hash, 0);
+    sha256_init(&ctx);
+    sha256_starts(&ctx, 0);
+    sha256_update(&ctx, (const unsigned char *)keydep, sizeof(keydep_t));
+    sha256_update(&ctx, process_priv_key, sizeof(process_priv_key));
+    sha256_finish(&ctx, hash);
+    sha256_free(&ctx);
 
     /* Copy the first 16 bytes (128-bits) */
     memcpy(outputdata, hash, 16);
 }
 
-// Performs common parameter (rbx, rcx) checks for EGETKEY
 static
-void sgx_egetkey_common_check(CPUX86State *env, uint64_t *reg,
-                              int alignment, perm_check_t perm)
+void keycache_lock(keycache_t *cache)
 {
+    while (!__sync_bool_compare_and_swap(&cache->lock, 0, 1))
+        ;
+}
 
-    // If reg is not in CR_ELRANGE, then GP(0)
-    if (((uint64_t)reg < env->cregs.CR_ELRANGE[0])
-        || ((uint64_t)reg >= env->cregs.CR_ELRANGE[0] + env->cregs.CR_ELRANGE[1])) {
-        sgx_dbg(trace, "reg is not in CR_ELRANGE: %lx", (long unsigned int)reg);
-        raise_exception(env, EXCP0D_GPF);
-    }
+static
+void keycache_unlock(keycache_t *cache)
+{
+    __sync_lock_release(&cache->lock);
+}
 
-    /* If reg is not properly aligned, then GP(0) */
+// sgx_derivekey() through the enclave's key cache: local attestation and
+// sealing keep asking for the same few keys, and the derivation (SHA-256
+// over the 544-byte keydep_t and the device key) is a pure function of
+// the request. The whole cache is dropped once CPUSVN or the owner epoch
+// moves, since no later request can match an entry derived before.
+// If cmac is given, it also receives the expanded CMAC key of the key.
+static
+void sgx_derivekey_cached(CPUX86State *env, uint64_t eid,
+                          const keydep_t *keydep, unsigned char *outputdata,
+                          sgx_cmac_t *cmac)
+{
+    qeid_t *qe = qenclave(eid);
+    keycache_t *cache;
+    uint8_t key[DEVICE_KEY_LENGTH];
+    sgx_cmac_t key_cmac;
+    int i;
+
+    if (!qe) {
+        sgx_derivekey(keydep, outputdata);
+        if (cmac)
+            sgx_cmac_setkey(cmac, outputdata);
+        return;
+    }
+
+    cache = &qe->keys;
+    keycache_lock(cache);
+    if (memcmp(cache->cpusvn, env->cregs.CR_CPUSVN, 16)
+        || memcmp(cache->ownerEpoch, env->cregs.CSR_SGX_OWNEREPOCH, 16)) {
+        for (i = 0; i < SGX_KEYCACHE_SLOTS; i ++)
+            cache->entries[i].valid = false;
+        memcpy(cache->cpusvn, env->cregs.CR_CPUSVN, 16);
+        memcpy(cache->ownerEpoch, env->cregs.CSR_SGX_OWNEREPOCH, 16);
+    }
+    for (i = 0; i < SGX_KEYCACHE_SLOTS; i ++) {
+        keycache_entry_t *entry = &cache->entries[i];
+        if (entry->valid && !memcmp(&entry->keydep, keydep, sizeof(keydep_t))) {
+            memcpy(outputdata, entry->key, DEVICE_KEY_LENGTH);
+            if (cmac)
+                sgx_cmac_copy(cmac, &entry->cmac);
+            keycache_unlock(cache);
+            QSTAT_INC(eid, keycache_hit_n);
+            return;
+        }
+    }
+    keycache_unlock(cache);
+
+    // derive outside the lock, other vCPUs of the enclave may hit meanwhile
+    sgx_derivekey(keydep, key);
+    sgx_cmac_setkey(&key_cmac, key);
+    memcpy(outputdata, key, DEVICE_KEY_LENGTH);
+    if (cmac)
+        sgx_cmac_copy(cmac, &key_cmac);
+    QSTAT_INC(eid, keycache_miss_n);
+
+    keycache_lock(cache);
+    i = cache->next;
+    cache->next = (i + 1) % SGX_KEYCACHE_SLOTS;
+    memcpy(&cache->entries[i].keydep, keydep, sizeof(keydep_t));
+    memcpy(cache->entries[i].key, key, DEVICE_KEY_LENGTH);
+    sgx_cmac_copy(&cache->entries[i].cmac, &key_cmac);
+    cache->entries[i].valid = true;
+    keycache_unlock(cache);
+}
+
+// Performs common parameter (rbx, rcx) checks for EGETKEY
+static
+void sgx_egetkey_common_check(CPUX86State *env, uint64_t *reg,
+                              int alignment, perm_check_t perm)
+{
+
+    // If reg is not in CR_ELRANGE, then GP(0)
+    if (((uint64_t)reg < env->cregs.CR_ELRANGE[0])
+        || ((uint64_t)reg >= env->cregs.CR_ELRANGE[0] + env->cregs.CR_ELRANGE[1])) {
+        sgx_dbg(trace, "reg is not in CR_ELRANGE: %lx", (long unsigned int)reg);
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    /* If reg is not properly aligned, then GP(0) */
     // FIXME: enforce memory alignment with array declaration inside the enclave.
     // is_aligned((void *)reg, alignment, env);
 
     /* Check reg is an EPC address */
-    uint16_t index_page = epcm_search(reg, env);
+    uint32_t index_page = epcm_search(reg, env);
 
     epcm_entry_t * pepcm = &epcm[index_page];
     assert(pepcm);
@@ -1298,7 +1765,7 @@ void sgx_eaccept(CPUX86State *env)
     // If RBX does not resolve within an EPC, then GP(0).
     check_within_epc(tmp_secinfo, env);
 
-    uint16_t index_secinfo = epcm_search(tmp_secinfo, env);
+    uint32_t index_secinfo = epcm_search(tmp_secinfo, env);
     epcm_entry_t *epcm_secinfo = &epcm[index_secinfo];
 
     //NOTE: the last condition is different to SPEC, since it is not reasonable to compare the address of secinfo with the start address of the EPC where secinfo is located
@@ -1342,7 +1809,7 @@ void sgx_eaccept(CPUX86State *env)
         raise_exception(env, EXCP0D_GPF);
     }
 
-    uint16_t index_page = epcm_search(destPage, env);
+    uint32_t index_page = epcm_search(destPage, env);
     epcm_entry_t *epcm_dest = &epcm[index_page];
 
     // TODO: PT_TRIM needs to be added
@@ -1353,8 +1820,6 @@ void sgx_eaccept(CPUX86State *env)
         raise_exception(env, EXCP0D_GPF);
     }
 
-    // TODO: check the destination EPC page for concurrency
-
     // Re-check security attributes of the destination EPC page
     if ((epcm_dest->valid == 0) || (epcm_dest->enclave_secs != env->cregs.CR_ACTIVE_SECS)){
         sgx_msg(warn, "there is something wrong in destPage");
@@ -1400,9 +1865,23 @@ void sgx_eaccept(CPUX86State *env)
         }
     }
 
+    // Destination EPC page concurrency check: of two EACCEPTs racing for
+    // one page only the first one clears PENDING
+    epcm_claim(epcm_dest, env);
+    if ((epcm_dest->valid == 0) ||
+        (epcm_dest->pending != scratch_secinfo.flags.pending) ||
+        (epcm_dest->modified != scratch_secinfo.flags.modified)) {
+        epcm_release(epcm_dest);
+        sgx_msg(warn, "accept request does not match current EPC page settings");
+        env->eflags |= CC_Z;
+        env->regs[R_EAX] = ERR_SGX_PAGE_ATTRIBUTES_MISMATCH;
+        goto Done;
+    }
+
     // Clear PENDING/MODIFIED flags to mark accept operation complete
     epcm_dest->pending = 0;
     epcm_dest->modified = 0;
+    epcm_release(epcm_dest);
 
     // Clear EAX and ZF to indicate successful completion
     env->eflags &= ~CC_Z;
@@ -1419,8 +1898,8 @@ Done:
 #if PERF
     int64_t eid;
     eid = tmp_secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.eaccept_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, eaccept_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
 }
 
@@ -1541,11 +2020,11 @@ void sgx_eenter(CPUX86State *env)
     uint64_t tmp_gpr;
     uint64_t tmp_target;
     uint64_t eid;
-    uint16_t index_gpr;
-    uint16_t index_tcs;
+    uint32_t index_gpr;
+    uint32_t index_tcs;
     // Unused variables.
     //uint16_t iter;
-    //uint16_t index_secs;
+    //uint32_t index_secs;
     //uint64_t tmp_ssa_page;
 
 
@@ -1747,7 +2226,7 @@ void sgx_eenter(CPUX86State *env)
 #if 0
     iter = 0;
     for (tmp_ssa_page = tmp_ssa; tmp_ssa_page > (tmp_ssa - tmp_xsize); tmp_ssa_page -= PAGE_SIZE ) {
-        uint16_t index_ssa = epcm_search((void *)tmp_ssa_page, env);
+        uint32_t index_ssa = epcm_search((void *)tmp_ssa_page, env);
         // Check page is read/write accessible
         if (!checkRWAccessible(tmp_ssa_page, env)) {
                 releaseLocks();
@@ -1824,11 +2303,11 @@ void sgx_eenter(CPUX86State *env)
         }
     }
     // Ensure the enclave is not already active and also concurrency of TCS
-    /* if ( tcs->state == ACTIVE )
-           raise_exception(env, EXCP0D_GPF);
-    */
-    curr_Eid = tmp_secs->eid_reserved.eid_pad.eid;
-    env->cregs.CR_ENCLAVE_MODE = true;
+    tcs_acquire(&epcm[index_tcs], tcs, env);
+    if (guest_ins_count == 1)
+        tcg_plugin_sgx_enter(tmp_secs->eid_reserved.eid_pad.eid, (uint64_t)tcs, false);
+
+    set_enclave_mode(env, true);
     env->cregs.CR_ACTIVE_SECS = (uint64_t)tmp_secs;
     env->cregs.CR_ELRANGE[0] = tmp_secs->baseAddr;
     env->cregs.CR_ELRANGE[1] = tmp_secs->size;
@@ -1968,10 +2447,10 @@ void sgx_eenter(CPUX86State *env)
     tlb_flush(cs, 1);
 
 #if PERF
-    qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
-    qenclaves[eid].stat.eenter_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, mode_switch);
+    QSTAT_INC(eid, tlbflush_n);
+    QSTAT_INC(eid, eenter_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
     return;
 }
@@ -2088,9 +2567,15 @@ void sgx_eexit(CPUX86State *env)
         //raise_exception(env, EXCP0D_GPF);
     }
 
+    // The logical processor gives up the TCS (ERESUME takes it back after
+    // a trampoline call)
+    tcs_release(&epcm[epcm_search((void *)env->cregs.CR_TCS_LA, env)]);
+    if (guest_ins_count == 1)
+        tcg_plugin_sgx_exit(env->cregs.CR_NEXT_EIP, retAddr != 0);
+
     //update_ssa_base();
 
-    env->cregs.CR_ENCLAVE_MODE = false;
+    set_enclave_mode(env, false);
     env->cregs.CR_EXIT_MODE = true;
 //    setEnclaveAccess(false);
 
@@ -2105,10 +2590,10 @@ void sgx_eexit(CPUX86State *env)
 #if PERF
     int64_t eid;
     eid = secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
-    qenclaves[eid].stat.eexit_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, mode_switch);
+    QSTAT_INC(eid, tlbflush_n);
+    QSTAT_INC(eid, eexit_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
 }
 
@@ -2168,9 +2653,6 @@ void sgx_egetkey(CPUX86State *env)
     // check for parameters
     sgx_egetkey_param_check(env);
 
-    // Hard-coded padding
-    uint8_t *pkcs1_5_padding = alloc_pkcs1_5_padding();
-
     secs_t *tmp_currentsecs = (secs_t *)env->cregs.CR_ACTIVE_SECS;
 
     // Main egetkey operation
@@ -2396,8 +2878,8 @@ void sgx_egetkey(CPUX86State *env)
 
     uint8_t tmp_key[16]; // REPORTKEY generated by instruction
     // Calculate the final derived key and output
-    //sgx_derivekey(&keydep, (unsigned char *)outputdata);
-    sgx_derivekey(&keydep, tmp_key);
+    sgx_derivekey_cached(env, tmp_currentsecs->eid_reserved.eid_pad.eid,
+                         &keydep, tmp_key, NULL);
     memcpy((uint8_t *)outputdata, tmp_key, 16);
 
 #if DEBUG
@@ -2422,8 +2904,8 @@ _EXIT:
 #if PERF
     int64_t eid;
     eid = tmp_currentsecs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.egetkey_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, egetkey_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
 }
 
@@ -2493,6 +2975,7 @@ void sgx_emodpe(CPUX86State *env)
     epcm[epc_index].read |= scratch_secinfo.flags.r;
     epcm[epc_index].write |= scratch_secinfo.flags.w;
     epcm[epc_index].execute |= scratch_secinfo.flags.x;
+    epcm_cache_flush_page(env->regs[R_ECX]);
 
 }
 
@@ -2559,8 +3042,6 @@ void sgx_ereport(CPUX86State *env)
     }
 #endif
 
-    uint8_t *pkcs1_5_padding = alloc_pkcs1_5_padding();
-
     // key dependencies init
     memset((unsigned char *)&tmp_keydependencies, 0, sizeof(keydep_t));
 
@@ -2586,7 +3067,10 @@ void sgx_ereport(CPUX86State *env)
     memcpy(tmp_keydependencies.padding,         pkcs1_5_padding,               352);
 
     /* Calculate Derived Key */
-    sgx_derivekey(&tmp_keydependencies, (unsigned char *)tmp_reportkey);
+    sgx_cmac_t report_cmac;
+    sgx_derivekey_cached(env, tmp_currentsecs->eid_reserved.eid_pad.eid,
+                         &tmp_keydependencies, (unsigned char *)tmp_reportkey,
+                         &report_cmac);
 
 #if DEBUG
     {
@@ -2598,11 +3082,7 @@ void sgx_ereport(CPUX86State *env)
     }
 #endif
 
-    aes_cmac128_context ctx;
-
-    aes_cmac128_starts(&ctx, tmp_reportkey);
-    aes_cmac128_update(&ctx, (uint8_t *)&tmp_report, 416);
-    aes_cmac128_final(&ctx, tmp_report.mac);
+    sgx_cmac(&report_cmac, (uint8_t *)&tmp_report, 416, tmp_report.mac);
 
     uint8_t report[512];
     memset(report, 0, 512);
@@ -2624,8 +3104,8 @@ void sgx_ereport(CPUX86State *env)
 #if PERF
     int64_t eid;
     eid = tmp_currentsecs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.ereport_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, ereport_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
 }
 
@@ -2647,12 +3127,11 @@ void sgx_eresume(CPUX86State *env)
     uint64_t tmp_gpr;
     uint64_t eid;
     uint64_t tmp_target;
-    uint16_t index_gpr;
-    uint16_t index_tcs;
-    operation = eresume;
+    uint32_t index_gpr;
+    uint32_t index_tcs;
     // Unused variables.
     //uint16_t iter;
-    //uint16_t index_secs;
+    //uint32_t index_secs;
     //uint64_t tmp_ssa_page;
     //uint64_t tmp_xsize;
 
@@ -2813,7 +3292,7 @@ void sgx_eresume(CPUX86State *env)
 #if 0
     iter = 0;
     for (tmp_ssa_page = tmp_ssa; tmp_ssa_page > (tmp_ssa - tmp_xsize); tmp_ssa_page -= PAGE_SIZE ) {
-        uint16_t index_ssa = epcm_search((void *)tmp_ssa_page, env);
+        uint32_t index_ssa = epcm_search((void *)tmp_ssa_page, env);
         sgx_dbg(trace, "Index_ssa : %d", index_ssa);
 
         // Check page is read/write accessible
@@ -2914,7 +3393,11 @@ void sgx_eresume(CPUX86State *env)
         is_canonical((uint64_t)(void*)tmp_gsbase, env);
     }
 
-    env->cregs.CR_ENCLAVE_MODE = true;
+    tcs_acquire(&epcm[index_tcs], tcs, env);
+    if (guest_ins_count == 1)
+        tcg_plugin_sgx_enter(tmp_secs->eid_reserved.eid_pad.eid, (uint64_t)tcs, true);
+
+    set_enclave_mode(env, true);
     env->cregs.CR_ACTIVE_SECS = (uint64_t)tmp_secs;
     env->cregs.CR_ELRANGE[0] = tmp_secs->baseAddr;
     env->cregs.CR_ELRANGE[1] = tmp_secs->size;
@@ -3026,10 +3509,10 @@ void sgx_eresume(CPUX86State *env)
     CPUState *cs = CPU(x86_env_get_cpu(env));
     tlb_flush(cs, 1);
 #if PERF
-    qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
-    qenclaves[eid].stat.eresume_n++;
-    qenclaves[eid].stat.enclu_n++;
+    QSTAT_INC(eid, mode_switch);
+    QSTAT_INC(eid, tlbflush_n);
+    QSTAT_INC(eid, eresume_n);
+    QSTAT_LEAF(eid, enclu_n);
 #endif
     return;
 }
@@ -3049,8 +3532,35 @@ const char *enclu_cmd_to_str(long cmd) {
     return "UNKONWN";
 }
 
+// ENCLU leaves access their memory operands directly, past the EPCM
+// checks of helper_mem_access(): load the ones the pager evicted first
+static
+void epc_operands_in(CPUX86State *env, uintptr_t retaddr)
+{
+    static const int regs[] = { R_EBX, R_ECX, R_EDX };
+    unsigned int i;
+
+    if (!env->cregs.CR_ENCLAVE_MODE || !epc_swap) {
+        return;
+    }
+    for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i ++) {
+        uint64_t addr = env->regs[regs[i]];
+        int64_t index;
+
+        if (!is_within_epc(addr) || !is_within_enclave(env, addr)) {
+            continue;
+        }
+        index = epcm_index_lookup(&epcm_idx, addr);
+        if (index >= 0 && (!epcm_valid(&epcm[index]) || epcm[index].blocked)) {
+            epc_page_in(env, index, retaddr);
+        }
+    }
+}
+
 void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
 {
+    uintptr_t retaddr = GETPC();
+
     sgx_dbg(ttrace,
             "(%-13s), EBX=0x%08"PRIx64", "
             "RCX=0x%08"PRIx64", RDX=0x%08"PRIx64,
@@ -3058,6 +3568,15 @@ void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
             env->regs[R_EBX],
             env->regs[R_ECX],
             env->regs[R_EDX]);
+#if PERF
+    uint64_t leaf = env->regs[R_EAX];
+    int64_t start = qstat_leaf_begin();
+#endif
+    // EENTER/ERESUME/EEXIT take no data operands
+    if (env->regs[R_EAX] != ENCLU_EENTER && env->regs[R_EAX] != ENCLU_ERESUME &&
+        env->regs[R_EAX] != ENCLU_EEXIT) {
+        epc_operands_in(env, retaddr);
+    }
     switch (env->regs[R_EAX]) {
         case ENCLU_EACCEPT:
             env->cregs.CR_NEXT_EIP = next_eip;
@@ -3104,6 +3623,9 @@ void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
         default:
             sgx_err("not implemented yet");
     }
+#if PERF
+    qstat_leaf_end(true, leaf, start);
+#endif
 }
 
 // ENCLS instruction implementation.
@@ -3126,17 +3648,57 @@ int popcnt(uint64_t v)
     return ((v1 * 0x01010101) >> 24) + ((v2 * 0x01010101) >> 24);
 }
 
-// Increments counter by value
 static
-void LockedXAdd(uint64_t* counter, uint64_t value)
+void eid_table_lock(void)
 {
-    /* Method 1
-    asm volatile("lock; xaddl %%eax, %2;"
-                  :"=a" (value)                  //Output
-                  :"a" (value), "m" (*counter)  //Input
-                  :);
-    */
-    __sync_add_and_fetch(counter, value);
+    while (!__sync_bool_compare_and_swap(&eid_lock, 0, 1))
+        ;
+}
+
+static
+void eid_table_unlock(void)
+{
+    __sync_lock_release(&eid_lock);
+}
+
+// SECS.EID for ECREATE, -1 once MAX_ENCLAVES enclaves are alive. EIDs
+// that EREMOVE gave back go first, so the chunks of qenclaves[] stay few.
+static
+int64_t eid_alloc(void)
+{
+    int64_t eid = -1;
+    qeid_t *chunk;
+
+    eid_table_lock();
+    if (eid_nfree > 0)
+        eid = eid_free[--eid_nfree];
+    else if (next_eid < MAX_ENCLAVES)
+        eid = next_eid++;
+
+    if (eid >= 0 && !qenclaves[eid / QEID_CHUNK]) {
+        chunk = calloc(QEID_CHUNK, sizeof(qeid_t));
+        if (chunk) {
+            __atomic_store_n(&qenclaves[eid / QEID_CHUNK], chunk,
+                             __ATOMIC_RELEASE);
+        } else {
+            eid_free[eid_nfree++] = eid;
+            eid = -1;
+        }
+    }
+    eid_table_unlock();
+
+    // whatever the last enclave with this EID left behind
+    if (eid >= 0)
+        memset(qenclave(eid), 0, sizeof(qeid_t));
+    return eid;
+}
+
+static
+void eid_release(uint64_t eid)
+{
+    eid_table_lock();
+    eid_free[eid_nfree++] = eid;
+    eid_table_unlock();
 }
 
 /* TODO
@@ -3174,6 +3736,57 @@ void *cpu_load_pi_linaddr(CPUX86State *env, pageinfo_t *pi)
     return (void *)cpu_ldq_data(env, addr);
 }
 
+// While an enclave is built, MRENCLAVE is a native SHA-256 state in
+// qenclave(eid)->measure; SECS.MRENCLAVE only receives it at EINIT.
+// Enclaves without a qeid_t keep the old per-block update of
+// SECS.MRENCLAVE. Callers hold the SECS (epcm claim) and account the
+// blocks in SECS.MRENCLAVEUPDATECOUNTER.
+static
+sgx_measure_t *secs_measure(secs_t *secs)
+{
+    qeid_t *qe = qenclave(secs->eid_reserved.eid_pad.eid);
+
+    return qe ? &qe->measure : NULL;
+}
+
+static
+void measure_start(secs_t *secs)
+{
+    sgx_measure_t *m = secs_measure(secs);
+
+    if (m)
+        sgx_measure_init(m);
+    else
+        sha256init(secs->mrEnclave);
+}
+
+static
+void measure_update(secs_t *secs, const void *blocks, int nblocks)
+{
+    sgx_measure_t *m = secs_measure(secs);
+    int i;
+
+    if (m) {
+        sgx_measure_update(m, blocks, nblocks);
+        return;
+    }
+    for (i = 0; i < nblocks; i ++)
+        sha256update((unsigned char *)blocks + i * SGX_MEASURE_BLOCK,
+                     secs->mrEnclave);
+}
+
+// The running (not yet finalized) MRENCLAVE
+static
+void measure_serialise(secs_t *secs, uint8_t hash[32])
+{
+    sgx_measure_t *m = secs_measure(secs);
+
+    if (m)
+        sgx_measure_serialise(m, hash);
+    else
+        memcpy(hash, secs->mrEnclave, 32);
+}
+
 // ECREATE is the first instruction in the enclave build process.
 // In ECREATE, an SECS structure (PAGEINFO.SRCPGE) outside the epc is copied
 // into an EPC page (with page type = SECS).
@@ -3197,6 +3810,7 @@ void sgx_ecreate(CPUX86State *env)
     secinfo_t *tmp_secinfo;
     void *tmp_linaddr;
     secs_t *tmp_secs_pi;
+    int64_t eid;
 
     // If RBX is not 32 Byte aligned, then GP(0)
     if (!is_aligned(pageInfo, PAGEINFO_ALIGN_SIZE)) {
@@ -3255,7 +3869,7 @@ void sgx_ecreate(CPUX86State *env)
     memcpy(tmp_secs, tmp_srcpge, PAGE_SIZE);
 
     // if epcm[RCX].valid == 1, then GP(0)
-    uint16_t index_secs = epcm_search(tmp_secs, env);
+    uint32_t index_secs = epcm_search(tmp_secs, env);
     epcm_valid_check(&epcm[index_secs], env);
 
     // check lower 2bits of XFRM are set
@@ -3308,9 +3922,7 @@ void sgx_ecreate(CPUX86State *env)
     // TODO : SECS does not have any unsupported attributes
     // XXX: Where to set CR_SGX_ATTRIBUTES_MASK and the value?
 
-    // Initialize MRENCLAVE field, isvsvn, and isvProdId
-    sha256init(tmp_secs->mrEnclave);
-
+    // Initialize isvsvn and isvProdId (MRENCLAVE once the EID is known)
     tmp_secs->isvsvn = 0;
     tmp_secs->isvprodID = 0;
 
@@ -3324,36 +3936,34 @@ void sgx_ecreate(CPUX86State *env)
     memcpy(&tmpUpdateField[12], &tmp_secs->size, sizeof(uint64_t));
     memset(&tmpUpdateField[20], 0, 44);
 
-    // Update MRENCLAVE hash value
-    sha256update((unsigned char *)tmpUpdateField, tmp_secs->mrEnclave);
+    // EPC page concurrency check
+    epcm_claim_invalid(&epcm[index_secs], env);
+
+    // Set SECS.EID : starts from 0. CR_NEXT_EID is per vCPU here, so the
+    // package-wide allocator lives in eid_alloc()
+    eid = eid_alloc();
+    if (eid < 0) {
+        sgx_dbg(err, "%d enclaves alive, no EID left", MAX_ENCLAVES);
+        epcm_release(&epcm[index_secs]);
+        raise_exception(env, EXCP0D_GPF);
+    }
+    tmp_secs->eid_reserved.eid_pad.eid = eid;
+
+    // Initialize and update MRENCLAVE hash value
+    measure_start(tmp_secs);
+    measure_update(tmp_secs, tmpUpdateField, 1);
 
     // Increase enclave's MRENCLAVE update counter
     tmp_secs->mrEnclaveUpdateCounter++;
 
-/*
-    // Check MRENCLAVE after ECREATE
-    {
-        char hash[64+1];
-        uint64_t counter = tmp_secs->mrEnclaveUpdateCounter;
-
-        fmt_hash(tmp_secs->mrEnclave, hash);
-
-        sgx_dbg(info, "measurement: %.20s.., counter: %ld", hash, counter);
-    }
-*/
-
-    // Set SECS.EID : starts from 0
-    tmp_secs->eid_reserved.eid_pad.eid = env->cregs.CR_NEXT_EID;
-    LockedXAdd(&(env->cregs.CR_NEXT_EID), 1);
-
     // Update EPCM of EPC page
     set_epcm_entry(&epcm[index_secs], 1, 0, 0, 0, 0, PT_SECS, 0, 0);
+    epcm_release(&epcm[index_secs]);
 
 #if PERF
-    int64_t eid;
     eid = tmp_secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.ecreate_n++;
-    qenclaves[eid].stat.encls_n++;
+    QSTAT_INC(eid, ecreate_n);
+    QSTAT_LEAF(eid, encls_n);
 #endif
 }
 
@@ -3363,14 +3973,8 @@ void sgx_ecreate(CPUX86State *env)
 // Measuring target includes: EADD string, page address offset,
 // PAGEINFO.SECINFO.
 static
-void sgx_eadd(CPUX86State *env)
+void eadd_page(CPUX86State *env, pageinfo_t *pageInfo, epc_t *destPage)
 {
-    // RBX: PAGEINFO(In, EA)
-    // RCX: EPCPAGE(In, EA)
-
-    pageinfo_t *pageInfo = (pageinfo_t *)env->regs[R_EBX];
-    epc_t *destPage = (epc_t *)env->regs[R_ECX];
-
     //TEMP Vars
     epc_t *tmp_srcpge;
     secs_t *tmp_secs;
@@ -3448,26 +4052,17 @@ void sgx_eadd(CPUX86State *env)
         raise_exception(env, EXCP0D_GPF);
     }
 
-    // EPC page concurrency check
-    // TODO: if EPC in use than raise exception
-
     // if epcm[RCX].valid == 1, then GP(0).
-    uint16_t index_page = epcm_search(destPage, env);
+    uint32_t index_page = epcm_search(destPage, env);
     //sgx_dbg(eadd, "index_page: %d, destPage: %p", index_page, destPage);
     epcm_valid_check(&epcm[index_page], env);
 
-    // SECS concurrency check
-    // TODO: if secs not available for eadd raise exception
-
     // if epcm[tmp_secs] = 0 or epcm[tmp_secs].PT != PT_SECS, then GP(0)
-    uint16_t index_secs = epcm_search(tmp_secs, env);
+    uint32_t index_secs = epcm_search(tmp_secs, env);
 
     epcm_invalid_check(&epcm[index_secs], env);
     epcm_page_type_check(&epcm[index_secs], PT_SECS, env);
 
-    // copy
-    memcpy(destPage, tmp_srcpge, PAGE_SIZE);
-
     // Actual Page copy from source to destination - XXX- Copy the entire page
     // 1) PT_TCS - Copy the entire page
     // 2) PT_REGS - Copy the address
@@ -3538,9 +4133,6 @@ void sgx_eadd(CPUX86State *env)
         raise_exception(env, EXCP0D_GPF);
 */
 
-    // Check concurrency of measurement resource
-    //TODO
-
     // Check if the enclave to which the page will be added is already init
     // TODO
 
@@ -3559,12 +4151,23 @@ void sgx_eadd(CPUX86State *env)
     //sgx_dbg(info, "r:%d w:%d x:%d", scratch_secinfo.flags.r, scratch_secinfo.flags.w, scratch_secinfo.flags.x);
     }
 
+    // EPC page and SECS (measurement) concurrency checks; everything that
+    // may fault has been checked above
+    epcm_claim_invalid(&epcm[index_page], env);
+    if (!epcm_try_claim(&epcm[index_secs])) {
+        epcm_release(&epcm[index_page]);
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    // copy
+    memcpy(destPage, tmp_srcpge, PAGE_SIZE);
+
     // Update MRENCLAVE hash value
     tmp_enclaveoffset = (uintptr_t)tmp_linaddr - tmp_secs->baseAddr;
     tmpUpdateField[0] = 0x0000000044444145;
     memcpy(&tmpUpdateField[1], &tmp_enclaveoffset, 8);
     memcpy(&tmpUpdateField[2], &scratch_secinfo, 48);
-    sha256update((unsigned char *)tmpUpdateField, tmp_secs->mrEnclave);
+    measure_update(tmp_secs, tmpUpdateField, 1);
 
     // INC enclave's MRENCLAVE update counter
     tmp_secs->mrEnclaveUpdateCounter++;
@@ -3588,6 +4191,9 @@ void sgx_eadd(CPUX86State *env)
                    (uintptr_t)tmp_linaddr);
     epcm[index_page].appAddress = (uint64_t)tmp_srcpge;
 
+    epcm_release(&epcm[index_secs]);
+    epcm_release(&epcm[index_page]);
+
 #if DEBUG
     sgx_dbg(trace, "INDEX : %d EPC addr: %"PRIx64" SECS: %lx", index_page, epcm[index_page].enclave_addr, tmp_secs);
 #endif
@@ -3600,11 +4206,19 @@ void sgx_eadd(CPUX86State *env)
 #if PERF
     int64_t eid;
     eid = tmp_secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.eadd_n++;
-    qenclaves[eid].stat.encls_n++;
+    QSTAT_INC(eid, eadd_n);
+    QSTAT_LEAF(eid, encls_n);
 #endif
 }
 
+static
+void sgx_eadd(CPUX86State *env)
+{
+    // RBX: PAGEINFO(In, EA)
+    // RCX: EPCPAGE(In, EA)
+    eadd_page(env, (pageinfo_t *)env->regs[R_EBX], (epc_t *)env->regs[R_ECX]);
+}
+
 static
 bool verify_signature(sigstruct_t *sig, uint8_t *signature, uint8_t *modulus,
                       uint32_t exponent)
@@ -3710,7 +4324,7 @@ void sgx_einit(CPUX86State *env)
     memcpy(&tmp_sig, sig, sizeof(sigstruct_t));
     memcpy(&tmp_token, token, sizeof(einittoken_t));
 
-    memcpy(tmp_mrEnclave, secs->mrEnclave, sizeof(tmp_mrEnclave));
+    measure_serialise(secs, tmp_mrEnclave);
     memcpy(tmp_mrSigner, secs->mrSigner, sizeof(tmp_mrSigner));
 
     uint64_t mask_val = 0x0000000000000020;
@@ -3763,7 +4377,7 @@ void sgx_einit(CPUX86State *env)
     }
 
     // if epcm[tmp_secs] = 0 or epcm[tmp_secs].PT != PT_SECS, then GP(0)
-    uint16_t index_secs = epcm_search(secs, env);
+    uint32_t index_secs = epcm_search(secs, env);
     epcm_invalid_check(&epcm[index_secs], env);
     epcm_page_type_check(&epcm[index_secs], PT_SECS, env);
 
@@ -3857,7 +4471,6 @@ void sgx_einit(CPUX86State *env)
     }
 
     // Derive launch key used to calculate EINITTOKEN.MAC
-    uint8_t *pkcs1_5_padding = alloc_pkcs1_5_padding();
 
 // (ref. r2 p85)
 /*
@@ -3895,10 +4508,9 @@ void sgx_einit(CPUX86State *env)
     // Only 192 bytes of EINITTOKEN are CMACed.
     uint8_t tmp_cmac[16];
 
-    aes_cmac128_context ctx;
-    aes_cmac128_starts(&ctx, launch_key);
-    aes_cmac128_update(&ctx, (uint8_t *)&tmp_token, 192);
-    aes_cmac128_final(&ctx, tmp_cmac);
+    sgx_cmac_t launch_cmac;
+    sgx_cmac_setkey(&launch_cmac, launch_key);
+    sgx_cmac(&launch_cmac, (uint8_t *)&tmp_token, 192, tmp_cmac);
 
 #if DEBUG
     {
@@ -3984,8 +4596,8 @@ _EXIT:
 #if PERF
     int64_t eid;
     eid = secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.einit_n++;
-    qenclaves[eid].stat.encls_n++;
+    QSTAT_INC(eid, einit_n);
+    QSTAT_LEAF(eid, encls_n);
 #endif
 }
 
@@ -3997,157 +4609,99 @@ void sgx_eldb(CPUX86State *env)
     //RCX: Epc page addr(In)
     //RDX: VA  slot addr(In)
     //EAX: Error code(Out)
-    epc_t* tmp_srcpge;
-    epc_t  ciphertext;
-    secs_t* tmp_secs;
-    pcmd_t* tmp_pcmd;
-    mac_header_t tmp_header;
-    uint64_t tmp_ver;
-    uint64_t tmp_mac[2];
-    uint64_t epc_index, va_index, secs_index;
+    pageinfo_t *pageinfo = (pageinfo_t *)env->regs[R_EBX];
+    bool blocked = (env->regs[R_EAX] == ENCLS_ELDB);
+    uint64_t err;
 
-    if(!is_aligned(env->regs[R_EBX], 32) || !is_aligned(env->regs[R_ECX], PAGE_SIZE)) {
+    err = eld_page(env, pageinfo, env->regs[R_ECX],
+                   (uint64_t *)env->regs[R_EDX], blocked);
+    if (err == ELD_GPF) {
         raise_exception(env, EXCP0D_GPF);
     }
 
-    check_within_epc((void *)env->regs[R_ECX], env);
-    if(!is_aligned(env->regs[R_EDX], 8)) {
-        raise_exception(env, EXCP0D_GPF);
-    }
-    check_within_epc((void *)env->regs[R_EDX], env);
-
-    tmp_srcpge = ((pageinfo_t *)env->regs[R_EBX])->srcpge;
-    tmp_secs = ((pageinfo_t *)env->regs[R_EBX])->secs;
-    tmp_pcmd = ((pageinfo_t *)env->regs[R_EBX])->secinfo;
-
-    if(!is_aligned(tmp_pcmd, sizeof(pcmd_t)) || !is_aligned(tmp_srcpge, PAGE_SIZE)) {
-        raise_exception(env, EXCP0D_GPF);
-    }
-    //TODO: (* Check concurrency of EPC and VASLOT by other SGX instructions *)
-
-    epc_index = epcm_search((void *)env->regs[R_ECX], env);
-    va_index = epcm_search((void *)env->regs[R_EDX], env);
-    if(epcm[epc_index].valid == 1 ||
-       epcm[va_index].valid == 0 || epcm[va_index].page_type != PT_VA) {
-        raise_exception(env, EXCP0D_GPF);
-    }
-
-    memset(&tmp_header, 0 , sizeof(tmp_header));
-    tmp_header.secinfo.flags.page_type = tmp_pcmd->secinfo.flags.page_type;
-    tmp_header.secinfo.flags.r = tmp_pcmd->secinfo.flags.r;
-    tmp_header.secinfo.flags.w = tmp_pcmd->secinfo.flags.w;
-    tmp_header.secinfo.flags.x = tmp_pcmd->secinfo.flags.x;
-    tmp_header.linaddr = ((pageinfo_t *)(env->regs[R_EBX]))-> linaddr;
-
-    if(tmp_header.secinfo.flags.page_type == PT_REG || 
-       tmp_header.secinfo.flags.page_type == PT_TCS) {
-        if(!is_aligned(tmp_secs, PAGE_SIZE)) {
-            raise_exception(env, EXCP0D_GPF);
-        }
-        check_within_epc((void *)tmp_secs, env);
-        secs_index = epcm_search(tmp_secs, env);
-        if(epcm[secs_index].valid == 0 || epcm[secs_index].page_type == PT_SECS) {
-            raise_exception(env, EXCP0D_GPF);
-        }
-    }
-    else if(tmp_header.secinfo.flags.page_type == PT_SECS ||
-            tmp_header.secinfo.flags.page_type == PT_VA) {
-        if(tmp_secs != 0)
-            raise_exception(env, EXCP0D_GPF);
-    }
-    else {
-        raise_exception(env, EXCP0D_GPF);
-    }
-    if (tmp_header.secinfo.flags.page_type == PT_REG ||
-        tmp_header.secinfo.flags.page_type == PT_TCS) { 
-        tmp_header.eid = tmp_secs->eid_reserved.eid_pad.eid;
-    }
-    else {
-        tmp_header.eid = 0;
+    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
+    env->regs[R_EAX] = err;
+    if (err) {
+        env->eflags |= CC_Z;
+        return;
     }
-    memcpy(ciphertext, tmp_srcpge, PAGE_SIZE);
-    tmp_ver = env->regs[R_EDX];
-
-    decrypt_epc(ciphertext, PAGE_SIZE, (unsigned char *)&tmp_header, sizeof(tmp_header),
-                (unsigned char *)tmp_mac, gcm_key, NULL, (unsigned char *)env->regs[R_ECX]); 
 
-    if(!memcmp(tmp_mac, tmp_pcmd->mac, 16)) {
-        env->regs[R_EAX] = ERR_SGX_MAC_COMPARE_FAIL;
-        goto ERROR_EXIT;
-    }
-    if(env->regs[R_EDX] != 0) { //XXX ? 
-        raise_exception(env, EXCP0D_GPF);
-    }
-    else {
-        env->regs[R_EDX] = tmp_ver;
+#if PERF
+    if (pageinfo->secs) {
+        int64_t eid = ((secs_t *)pageinfo->secs)->eid_reserved.eid_pad.eid;
+        QSTAT_INC(eid, eldu_n);
+        QSTAT_LEAF(eid, encls_n);
     }
-    epcm[epc_index].page_type = tmp_header.secinfo.flags.page_type;
-    epcm[epc_index].read    = tmp_header.secinfo.flags.r;
-    epcm[epc_index].write   = tmp_header.secinfo.flags.w;
-    epcm[epc_index].execute = tmp_header.secinfo.flags.x;
-    epcm[epc_index].enclave_addr = tmp_header.linaddr;
-
-    if(env->regs[R_EAX] == 0x07) 
-        epcm[epc_index].blocked = 1;
-    else
-        epcm[epc_index].blocked = 0;
-
-    epcm[epc_index].valid = 1;
-    env->regs[R_EAX] = 0;
-    env->eflags &= ~(CC_Z);
-
-    ERROR_EXIT:
-        env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
+#endif
 }
 
-/*
-static void sgx_eremove(CPUX86State *env)
+// EREMOVE: take a page out of its enclave and give its memory back. The
+// SECS goes last, once no page of the enclave is valid, and hands its EID
+// back to eid_alloc().
+static
+void sgx_eremove(CPUX86State *env)
 {
-    epc_t *tmp_epcpage = (epc_t *)env->regs[R_ECX];
+    // RCX: EPC Addr(In, EA)
+    // EAX: Error Code(Out)
+    uint64_t epc_page = env->regs[R_ECX];
+    epcm_entry_t *entry;
+    qeid_t *qe = NULL;
+    uint64_t eid = 0;
+    uint64_t err = 0;
 
     // If RCX is not 4KB Aligned, then GP(0)
-    if (!is_aligned((void *)tmp_epcpage, PAGE_SIZE)) {
+    if (!is_aligned(epc_page, PAGE_SIZE)) {
         sgx_dbg(err, "Failed to check alignment: %p on %d bytes",
-                (void *)tmp_epcpage, PAGE_SIZE);
+                (void *)epc_page, PAGE_SIZE);
         raise_exception(env, EXCP0D_GPF);
     }
 
     // If RCX does not resolve within an EPC, then GP(0)
-    check_within_epc((void *)tmp_epcpage, env);
+    check_within_epc((void *)epc_page, env);
 
-    // TODO : Check the EPC page for concurrency
+    entry = &epcm[epcm_search((void *)epc_page, env)];
+    epcm_claim(entry, env);
 
     // If RCX is already unused, nothing to do
-    uint8_t index_page = epcm_search((void *)tmp_epcpage, env);
-
-    if (epcm[index_page].valid == 0) {
+    if (entry->valid == 0) {
         goto _DONE;
     }
 
-    if (epcm[index_page].page_type == PT_VA) {
-        epcm[index_page].valid = 0;
-        goto _DONE;
+    switch (entry->page_type) {
+    case PT_SECS:
+        eid = ((secs_t *)epc_page)->eid_reserved.eid_pad.eid;
+        qe = qenclave(eid);
+        if (qe && __atomic_load_n(&qe->children, __ATOMIC_ACQUIRE)) {
+            err = ERR_SGX_CHILD_PRESENT;
+            goto _DONE;
+        }
+        break;
+    case PT_TCS:
+        // a logical processor is in the enclave through this TCS
+        if (entry->tcs_busy) {
+            err = ERR_SGX_ENCLAVE_ACT;
+            goto _DONE;
+        }
+        break;
+    default:
+        break;
     }
 
-    if (epcm[index_page].page_type == PT_SECS) {
-        // TODO : RCX has an EPC page associated with it check
-        epcm[index_page].valid = 0;
-        goto _DONE;
+    set_epcm_entry(entry, 0, 0, 0, 0, 0, PT_REG, 0, 0);
+    epcm_cache_flush_page(epc_page);
+    madvise((void *)epc_page, PAGE_SIZE, MADV_DONTNEED);
+    if (qe) {
+        eid_release(eid);
     }
 
-    // secs_t *tmp_secs = get_secs_address(&epcm[index_page]);
-
-    // TODO : If other threads active using SECS
-
 _DONE:
-    env->regs[R_EAX] = 0;
-    env->eflags &= ~CC_Z;
-
-//_ERROR_EXIT:
-    // clear flags : CF, PF, AF, OF, SF
-    env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
+    epcm_release(entry);
+    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
+    env->regs[R_EAX] = err;
+    if (err) {
+        env->eflags |= CC_Z;
+    }
 }
-*/
 
 // In EEXTEND, security measurement (SECS.MRENCLAVE) is updated for every
 // page chunk (256 Bytes).
@@ -4155,11 +4709,8 @@ _DONE:
 // Step 1. Measuring EEXTEND string, page chunk offset.
 // Step 2. Measuring the page chunk memory (4 times, 64 Bytes each).
 static
-void sgx_eextend(CPUX86State *env)
+void eextend_chunk(CPUX86State *env, uint64_t *target_addr)
 {
-    // RCX: EPCPAGE(In, EA)
-
-    uint64_t *target_addr = (uint64_t *)env->regs[R_ECX];
     secs_t *tmp_secs;
     uint64_t tmp_enclaveoffset;
     uint64_t tmpUpdateField[8];
@@ -4175,7 +4726,7 @@ void sgx_eextend(CPUX86State *env)
     check_within_epc(target_addr, env);
 
     // Check other instructions accessing EPCM
-    uint16_t index_page = epcm_search(target_addr, env);
+    uint32_t index_page = epcm_search(target_addr, env);
     epcm_invalid_check(&epcm[index_page], env);
 
     // Page Type check of RCX
@@ -4188,7 +4739,8 @@ void sgx_eextend(CPUX86State *env)
     tmp_secs = get_secs_address(&epcm[index_page]);
 
     // check other instructions are accessing MRENCLAVE or ATTRIBUTES.INIT
-    // TODO
+    epcm_entry_t *epcm_secs = &epcm[epcm_search(tmp_secs, env)];
+    epcm_claim(epcm_secs, env);
 
     // Calculate enclave offset
     tmp_enclaveoffset = (uint64_t)target_addr - tmp_secs->baseAddr;
@@ -4199,7 +4751,7 @@ void sgx_eextend(CPUX86State *env)
     memset(&tmpUpdateField[2], 0, 48);
 
     // Update MRENCLAVE hash value
-    sha256update((unsigned char *)tmpUpdateField, tmp_secs->mrEnclave);
+    measure_update(tmp_secs, tmpUpdateField, 1);
 
     // Increase MRENCLAVE update counter
     tmp_secs->mrEnclaveUpdateCounter++;
@@ -4216,15 +4768,14 @@ void sgx_eextend(CPUX86State *env)
     }
 */
 
-    // Add 256 bytes to MRENCLAVE, 64 byte at a time
-    sha256update((unsigned char *)(&target_addr[0]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[8]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[16]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[24]), tmp_secs->mrEnclave);
+    // Add 256 bytes to MRENCLAVE, 4 blocks of 64 bytes in one go
+    measure_update(tmp_secs, target_addr, MEASUREMENT_SIZE / SGX_MEASURE_BLOCK);
 
     // Increase enclaves's MRENCLAVE update counter by 4
     tmp_secs->mrEnclaveUpdateCounter += 4;
 
+    epcm_release(epcm_secs);
+
 /*
     // Check MRENCLAVE for page chunk
     {
@@ -4239,11 +4790,18 @@ void sgx_eextend(CPUX86State *env)
 #if PERF
     int64_t eid;
     eid = tmp_secs->eid_reserved.eid_pad.eid;
-    qenclaves[eid].stat.eextend_n++;
-    qenclaves[eid].stat.encls_n++;
+    QSTAT_INC(eid, eextend_n);
+    QSTAT_LEAF(eid, encls_n);
 #endif
 }
 
+static
+void sgx_eextend(CPUX86State *env)
+{
+    // RCX: EPCPAGE(In, EA)
+    eextend_chunk(env, (uint64_t *)env->regs[R_ECX]);
+}
+
 // EAUG instruction
 static
 void sgx_eaug(CPUX86State *env)
@@ -4302,18 +4860,12 @@ void sgx_eaug(CPUX86State *env)
     // If tmp_secs does not resolve within an EPC, then GP(0).
     check_within_epc(tmp_secs, env);
 
-    // EPC page concurrency check
-    // TODO: if EPC in use than raise exception
-
     // if epcm[RCX].valid == 1, then GP(0).
-    uint16_t index_page = epcm_search(destPage, env);
+    uint32_t index_page = epcm_search(destPage, env);
     epcm_valid_check(&epcm[index_page], env);
 
-    // SECS concurrency check
-    // TODO: if secs not available for eaug raise exception
-
     // if epcm[tmp_secs].valid = 0 or epcm[tmp_secs].PT != PT_SECS, then GP(0)
-    uint16_t index_secs = epcm_search(tmp_secs, env);
+    uint32_t index_secs = epcm_search(tmp_secs, env);
 
     epcm_invalid_check(&epcm[index_secs], env);
     epcm_page_type_check(&epcm[index_secs], PT_SECS, env);
@@ -4335,21 +4887,25 @@ void sgx_eaug(CPUX86State *env)
     sgx_dbg(trace, "DEBUG linear addr is %p", (void *)tmp_linaddr);
 
 
+    // EPC page concurrency check
+    epcm_claim_invalid(&epcm[index_page], env);
+
     // clear the content of EPC page
     memset(destPage, 0, PAGE_SIZE);
 
-    // Set epcm entry
+    // Set epcm entry (pending first: the entry becomes visible once valid)
+    epcm[index_page].pending = 1;
+    epcm[index_page].modified = 0;
     set_epcm_entry(&epcm[index_page], 1,       //epcm_entry, valid,
                    1, 1, 0, 0,                 //read, write, execute, block,
                    PT_REG, (uint64_t)tmp_secs, //pt, secs,
                    (uintptr_t)tmp_linaddr);               //linaddr
 
-    epcm[index_page].pending = 1;
-    epcm[index_page].modified = 0;
+    epcm_release(&epcm[index_page]);
 
 #if PERF
-    qenclaves[eid].stat.eaug_n++;
-    qenclaves[eid].stat.encls_n++;
+    QSTAT_INC(eid, eaug_n);
+    QSTAT_LEAF(eid, encls_n);
 #endif
 }
 
@@ -4404,6 +4960,7 @@ void sgx_emodpr(CPUX86State *env)
     epcm[page_index].read &= scratch_secinfo.flags.r;
     epcm[page_index].write &= scratch_secinfo.flags.w;
     epcm[page_index].execute &= scratch_secinfo.flags.x;
+    epcm_cache_flush_page(env->regs[R_ECX]);
 
     env->eflags &= ~(CC_Z);
     env->regs[R_EAX] = 0;
@@ -4412,14 +4969,12 @@ void sgx_emodpr(CPUX86State *env)
         env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
 }
 
+// EBLOCK of epc_addr: 0 or the error code for RAX, *carry tells the
+// errors reported in CF from the ones in ZF
 static
-void sgx_eblock(CPUX86State *env)
+uint64_t eblock_page(CPUX86State *env, uint64_t *epc_addr, bool *carry)
 {
-    // RCX: EPC Addr(In, EA)
-    // EAX: Error Code(Out)
-
-    uint64_t *epc_addr = (uint64_t *)env->regs[R_ECX];
-    uint16_t epcm_index = 0;
+    uint32_t epcm_index = 0;
     uint64_t tmp_blkstate = 0;
     // Check if DS:RCX is not 4KByte Aligned
     if (!is_aligned(epc_addr, PAGE_SIZE)) {
@@ -4431,28 +4986,21 @@ void sgx_eblock(CPUX86State *env)
     // If RCX does not resolve within an EPC, then GP(0).
     check_within_epc(epc_addr, env);
 
-    // Clear ZF,CF,PF,AF,OF,SF;
-    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
-
     // TODO - Check concurrency with other instructions
 
+    *carry = false;
     epcm_index = epcm_search(epc_addr, env);
     if(epcm[epcm_index].valid == 0) {
-        env->eflags |= CC_Z;
-        env->regs[R_EAX] = ERR_SGX_PG_INVLD;
-	goto Done; 
+        return ERR_SGX_PG_INVLD;
     }
 
+    *carry = true;
     if((epcm[epcm_index].page_type != PT_REG) && (epcm[epcm_index].page_type != PT_TCS) &&
        (epcm[epcm_index].page_type != PT_TRIM)) {
-        env->eflags &= CC_C;
         if(epcm[epcm_index].page_type == PT_SECS) {
-            env->regs[R_EAX] = ERR_SGX_PG_IS_SECS;
-        }
-        else {
-            env->regs[R_EAX] = ERR_SGX_NOTBLOCKABLE;
+            return ERR_SGX_PG_IS_SECS;
         }
-        goto Done;
+        return ERR_SGX_NOTBLOCKABLE;
     }
     
     // (* Check if the page is already blocked and report blocked state *)
@@ -4460,16 +5008,80 @@ void sgx_eblock(CPUX86State *env)
 
     // (* at this point, the page must be valid and PT_TCS or PT_REG or PT_TRIM*)
     if(tmp_blkstate == 1) {
-        env->eflags |= CC_C;
-        env->regs[R_EAX] = ERR_SGX_BLKSTATE;
+        return ERR_SGX_BLKSTATE;
     }
-    else {
-        epcm[epcm_index].blocked = 1;
+
+    // EWB wants an ETRACK that started after this
+    epcm[epcm_index].block_epoch = __atomic_load_n(&track_epoch,
+                                                   __ATOMIC_ACQUIRE);
+    epcm[epcm_index].blocked = 1;
+    epcm_cache_flush_page((uint64_t)epc_addr);
+    return 0;
+}
+
+static
+void sgx_eblock(CPUX86State *env)
+{
+    // RCX: EPC Addr(In, EA)
+    // EAX: Error Code(Out)
+    bool carry;
+    uint64_t err = eblock_page(env, (uint64_t *)env->regs[R_ECX], &carry);
+
+    // Clear ZF,CF,PF,AF,OF,SF;
+    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
+    env->regs[R_EAX] = err;
+    if (err) {
+        env->eflags |= carry ? CC_C : CC_Z;
     }
-   
+}
 
-Done: 
-    return;
+// ETRACK: once it returns, no logical processor can still be accessing a
+// page blocked before it started. Emulated for all enclaves at once, by
+// waiting until every other vCPU has left the TB it was running: a vCPU
+// that comes back finds the blocked pages gone from its EPCM cache.
+static
+void epc_track(CPUX86State *env)
+{
+    uint64_t epoch, tracked;
+
+    epoch = __atomic_fetch_add(&track_epoch, 1, __ATOMIC_ACQ_REL);
+    cpu_exec_track(CPU(x86_env_get_cpu(env)));
+
+    // a later ETRACK may have finished first
+    tracked = __atomic_load_n(&tracked_epoch, __ATOMIC_RELAXED);
+    while (tracked < epoch + 1 &&
+           !__atomic_compare_exchange_n(&tracked_epoch, &tracked, epoch + 1,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+static
+void sgx_etrack(CPUX86State *env)
+{
+    // RCX: SECS Addr(In, EA)
+    // EAX: Error Code(Out)
+    secs_t *secs = (secs_t *)env->regs[R_ECX];
+    uint32_t secs_index;
+
+    if (!is_aligned(secs, PAGE_SIZE)) {
+        sgx_dbg(err, "Failed to check alignment: %p on %d bytes",
+                secs, PAGE_SIZE);
+        raise_exception(env, EXCP0D_GPF);
+    }
+    check_within_epc(secs, env);
+
+    secs_index = epcm_search(secs, env);
+    epcm_invalid_check(&epcm[secs_index], env);
+    epcm_page_type_check(&epcm[secs_index], PT_SECS, env);
+
+    epc_track(env);
+
+    env->regs[R_EAX] = 0;
+    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
+#if PERF
+    QSTAT_LEAF(secs->eid_reserved.eid_pad.eid, encls_n);
+#endif
 }
 
 /*
@@ -4492,7 +5104,7 @@ void sgx_emodt(CPUX86State *env)
     secinfo_t scratch_secinfo;
     uint64_t *tmp_secinfo = env->regs[R_EBX];
     uint64_t *target_addr = (uint64_t *)env->regs[R_ECX];
-    uint16_t epcm_index = 0;
+    uint32_t epcm_index = 0;
 
 
     // If RBX is not 64 Byte aligned, then GP(0).
@@ -4552,6 +5164,7 @@ void sgx_emodt(CPUX86State *env)
     epcm[epcm_index].write = 0;
     epcm[epcm_index].execute  = 0;
     epcm[epcm_index].page_type = scratch_secinfo.flags.page_type;
+    epcm_cache_flush_page((uint64_t)target_addr);
 
     env->eflags &= ~(CC_Z);
     env->regs[R_EAX] = 0;
@@ -4568,147 +5181,173 @@ void sgx_epa(CPUX86State *env)
     // RBX: PT_VA (In, Const)
     // RCX: EPC Addr(In, EA)
     uint64_t *epc_addr = (uint64_t *)env->regs[R_ECX];
-    uint16_t epcm_index = 0;
+    uint32_t epcm_index = 0;
     if(env->regs[R_EBX] != PT_VA || !(is_aligned(epc_addr, PAGE_SIZE))) {
         raise_exception(env, EXCP0D_GPF);
     }
     check_within_epc(epc_addr, env);
 
-    /*TODO (* Check concurrency with other SGX instructions *)*/
-
     /* Check EPC page must be empty */
     epcm_index = epcm_search(epc_addr, env);
-    if(epcm[epcm_index].valid != 0) {
-        raise_exception(env, EXCP0D_GPF);
-    }
+    epcm_claim_invalid(&epcm[epcm_index], env);
+
+    /* Clears EPC page: every VA slot is free */
+    memset(epc_addr, 0, PAGE_SIZE);
 
-    /* Clears EPC page */
-    memset(epc_addr, 0, PAGE_SIZE * 8);
-  
-    epcm[epcm_index].page_type = PT_VA;
-    epcm[epcm_index].enclave_addr = 0;
-    epcm[epcm_index].blocked = 0;
     /* Based on Spec ver2--------- */
     epcm[epcm_index].pending = 0;
     epcm[epcm_index].modified = 0;
     /* --------------------------- */
-    epcm[epcm_index].read = 0;
-    epcm[epcm_index].write = 0;
-    epcm[epcm_index].execute = 0;
-    epcm[epcm_index].valid = 0;
+    set_epcm_entry(&epcm[epcm_index], 1,       //epcm_entry, valid,
+                   0, 0, 0, 0,                 //read, write, execute, block,
+                   PT_VA, 0, 0);               //pt, secs, linaddr
+    epcm_release(&epcm[epcm_index]);
 }
 
+// EWB of epc_page to pageinfo->srcpge and the PCMD at pageinfo->secinfo,
+// under a fresh version kept in va_slot: 0 or the error code for RAX,
+// *carry as for eblock_page(). *eid is the enclave of the page, or -1.
 static
-void sgx_ewb(CPUX86State *env)
+uint64_t ewb_page(CPUX86State *env, pageinfo_t *pageinfo, uint64_t epc_page,
+                  uint64_t *va_slot, bool *carry, int64_t *eid)
 {
-    // EAX: Error(Out)
-    // RBX: Pageinfo Addr(In)
-    // RCX: EPC addr(In)
-    // RDX: VA slot addr(In)
-    int epc_index = 0, va_index = 0;
-    uint64_t *tmp_srcpge;
+    uint64_t err = 0;
+    uint32_t epc_index, va_index;
+    epcm_entry_t *entry;
+    uint8_t *tmp_srcpge;
     pcmd_t *tmp_pcmd;
-    secs_t *tmp_secs;
-    uint64_t tmp_pcmd_enclaveid;
-    mac_header_t tmp_header; //MAC Header
-    memset(&tmp_header, 0, 128);
-    uint64_t tmp_ver = 0;
+    secs_t *tmp_secs = NULL;
+    secinfo_flags_t flags;
+    mac_header_t tmp_header;
+    uint64_t tmp_ver;
+    uint8_t tmp_iv[SGX_GCM_IV_LEN];
 
-    if (!(is_aligned(env->regs[R_EBX], 32)) ||
-        !(is_aligned(env->regs[R_ECX], PAGE_SIZE))) {
+    if (!is_aligned(pageinfo, PAGEINFO_ALIGN_SIZE) ||
+        !is_aligned(epc_page, PAGE_SIZE)) {
         raise_exception(env, EXCP0D_GPF);
     }
-    check_within_epc((void *)env->regs[R_ECX], env);
+    check_within_epc((void *)epc_page, env);
 
-    if (!(is_aligned(env->regs[R_EDX], 8))) {
+    if (!is_aligned(va_slot, 8)) {
         raise_exception(env, EXCP0D_GPF);
     }
-    check_within_epc((void *)env->regs[R_EDX], env);
+    check_within_epc(va_slot, env);
 
     /* EPCPAGE and VASLOT should not resolve to the same EPC page */
-    if(is_within_same_epc((void *)env->regs[R_ECX], (void *)env->regs[R_EDX], env)) {
+    if(is_within_same_epc((void *)epc_page, va_slot, env)) {
         raise_exception(env, EXCP0D_GPF);
     }
-    tmp_srcpge = ((pageinfo_t*)(env->regs[R_EBX]))->srcpge;
-    tmp_pcmd = ((pageinfo_t*)(env->regs[R_EBX]))->secinfo; //secinfo = pcmd addr
+    tmp_srcpge = (uint8_t *)pageinfo->srcpge;
+    tmp_pcmd = (pcmd_t *)pageinfo->secinfo; //secinfo = pcmd addr
 
-    if(!(is_aligned(tmp_pcmd, 128)) || !(is_aligned(tmp_srcpge, PAGE_SIZE))) {
+    if(!(is_aligned(tmp_pcmd, sizeof(pcmd_t))) || !(is_aligned(tmp_srcpge, PAGE_SIZE))) {
         raise_exception(env, EXCP0D_GPF);
     }
-    /* TODO: Check for concurrent SGX instruction access to the page */
-    /* TODO: Check if the VA Page is being removed or changed*/
-    epc_index = epcm_search((void *)env->regs[R_ECX], env);
-    va_index = epcm_search((void *)env->regs[R_EDX], env);
+
+    epc_index = epcm_search((void *)epc_page, env);
+    va_index = epcm_search(va_slot, env);
+    entry = &epcm[epc_index];
+
     /* Verify that EPCPAGE and VASLOT page are valid EPC pages and DS:RDX is VA */
-    if((epcm[epc_index].valid == 0) || (epcm[va_index].valid == 0) ||
+    if((entry->valid == 0) || (epcm[va_index].valid == 0) ||
        (epcm[va_index].page_type != PT_VA)) {
         raise_exception(env, EXCP0D_GPF);
     }
-    /* Perform page-type-specific exception checks */
-    if((epcm[epc_index].page_type == PT_REG || epcm[epc_index].page_type == PT_TCS)) {
-        tmp_secs = get_secs_address(&epcm[epc_index]);
-        /* TODO: Check that EBLOCK has occurred correctly */
+    /* Children of a SECS are not tracked: a SECS is never evicted */
+    if (entry->page_type == PT_SECS) {
+        raise_exception(env, EXCP0D_GPF);
     }
+    epcm_claim(entry, env);
 
-    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
-    env->regs[R_EAX] = 0x0;
-
-    /* Perform page-type-specific checks */
-    if((epcm[epc_index].page_type == PT_REG || epcm[epc_index].page_type == PT_TCS)) {
+    *carry = false;
+    *eid = -1;
+    if (entry->page_type == PT_REG || entry->page_type == PT_TCS) {
         /* check to see if the page is evictable */
-        if(epcm[epc_index].blocked == 0) {
-            env->regs[R_EAX] = ERR_SGX_PAGE_NOT_BLOCKED;
-            env->eflags |= CC_Z;
+        if (entry->blocked == 0) {
+            err = ERR_SGX_PAGE_NOT_BLOCKED;
             goto ERROR_EXIT;
         }
-        /* TODO: Check if tracking done correctly */
-        /* Obtain EID to establish cryptographic binding betw the paged-out page and the enclave */
-        tmp_header.eid = tmp_secs->eid_reserved.eid_pad.eid;
-
-        /* Obtain EID as an enclave handle for software */
-        tmp_pcmd_enclaveid = tmp_secs->eid_reserved.eid_pad.eid;
-    }
-    else if(epcm[epc_index].page_type == PT_SECS) {
-    /*TODO: check that there are no child pages inside the enclave
-      Skip this temporalily... please never swap out PT_SECS...
-    */
+        /* and that no TLB of it may be left */
+        if (entry->block_epoch >= __atomic_load_n(&tracked_epoch,
+                                                  __ATOMIC_ACQUIRE)) {
+            err = ERR_SGX_NOT_TRACKED;
+            goto ERROR_EXIT;
+        }
+        tmp_secs = get_secs_address(entry);
+        *eid = tmp_secs->eid_reserved.eid_pad.eid;
     }
-    else if(epcm[epc_index].page_type == PT_VA) {
-        tmp_header.eid = 0;
-        tmp_pcmd_enclaveid = 0;
+
+    /* Check if version array slot was empty */
+    if (*va_slot) {
+        err = ERR_SGX_VA_SLOT_OCCUPIED;
+        *carry = true;
+        goto ERROR_EXIT;
     }
-    tmp_header.linaddr = epcm[epc_index].enclave_addr;
-    tmp_header.secinfo.flags.page_type = epcm[epc_index].page_type;
-    tmp_header.secinfo.flags.r = epcm[epc_index].read;
-    tmp_header.secinfo.flags.w = epcm[epc_index].write;
-    tmp_header.secinfo.flags.x = epcm[epc_index].execute;
-    // it seems rsvd in the spec indicates reserved field.. but not sure..
-    //TMP_HEADER.SECINFO.FLAGS.RSVD = 0;
+
+    memset(&flags, 0, sizeof(flags));
+    flags.page_type = entry->page_type;
+    flags.r = entry->read;
+    flags.w = entry->write;
+    flags.x = entry->execute;
+    flags.pending = entry->pending;
+    flags.modified = entry->modified;
+    epc_mac_header(&tmp_header, tmp_secs, entry->enclave_addr, &flags);
 
     /* Encrypt the page, AES-GCM produces 2 values, {ciphertext, MAC}. */
-    encrypt_epc((unsigned char *)env->regs[R_ECX], PAGE_SIZE, (unsigned char *)&tmp_header,
-                sizeof(tmp_header), gcm_key, NULL, (unsigned char *)tmp_srcpge,
-				(unsigned char *)tmp_pcmd->mac);
+    tmp_ver = __atomic_add_fetch(&epc_version, 1, __ATOMIC_RELAXED);
+    epc_version_iv(tmp_iv, tmp_ver);
+    sgx_gcm_encrypt(epc_cipher(), tmp_iv, &tmp_header, sizeof(tmp_header),
+                    (void *)epc_page, PAGE_SIZE, tmp_srcpge,
+                    (uint8_t *)tmp_pcmd->mac);
 
     memset(&tmp_pcmd->secinfo, 0 , sizeof(secinfo_t));
-    tmp_pcmd->secinfo.flags.page_type = epcm[epc_index].page_type;
-    tmp_pcmd->secinfo.flags.r = epcm[epc_index].read;
-    tmp_pcmd->secinfo.flags.w = epcm[epc_index].write;
-    tmp_pcmd->secinfo.flags.x = epcm[epc_index].execute;
+    tmp_pcmd->secinfo.flags = flags;
     memset(tmp_pcmd->reserved, 0, sizeof(tmp_pcmd->reserved));
-    tmp_pcmd->enclaveid = tmp_pcmd_enclaveid;
-    ((pageinfo_t *)(env->regs[R_EBX]))->linaddr = epcm[epc_index].enclave_addr;
+    tmp_pcmd->enclaveid = tmp_header.eid;
+    pageinfo->linaddr = entry->enclave_addr;
+    *va_slot = tmp_ver;
+
+    set_epcm_entry(entry, 0, 0, 0, 0, 0, PT_REG, 0, 0);
+    epcm_cache_flush_page(epc_page);
 
-    /*Check if version array slot was empty */
-    if( *((uint64_t *)(env->regs[R_EDX])) ){
-        env->regs[R_EAX] = ERR_SGX_VA_SLOT_OCCUPIED;
-        env->eflags |= CC_C;
+    /* the frame holds nothing until ELDB/ELDU: give its memory back */
+    madvise((void *)epc_page, PAGE_SIZE, MADV_DONTNEED);
+
+#if PERF
+    if (*eid >= 0) {
+        QSTAT_INC(*eid, ewb_n);
     }
-    env->regs[R_EDX] = tmp_ver;
-    epcm[epc_index].valid = 0;
+#endif
 
     ERROR_EXIT:
-        env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
+        epcm_release(entry);
+        return err;
+}
+
+static
+void sgx_ewb(CPUX86State *env)
+{
+    // EAX: Error(Out)
+    // RBX: Pageinfo Addr(In)
+    // RCX: EPC addr(In)
+    // RDX: VA slot addr(In)
+    bool carry;
+    int64_t eid;
+    uint64_t err;
+
+    err = ewb_page(env, (pageinfo_t *)env->regs[R_EBX], env->regs[R_ECX],
+                   (uint64_t *)env->regs[R_EDX], &carry, &eid);
+
+    env->eflags &= ~(CC_Z | CC_C | CC_P | CC_A | CC_O | CC_S);
+    env->regs[R_EAX] = err;
+    if (err) {
+        env->eflags |= carry ? CC_C : CC_Z;
+    }
+#if PERF
+    if (!err && eid >= 0) {
+        QSTAT_LEAF(eid, encls_n);
+    }
+#endif
 }
 
 static
@@ -4726,7 +5365,89 @@ void encls_epcm_clear(CPUX86State *env)
 {
     epc_t *target = (epc_t *)env->regs[R_EBX];
     int target_index = epcm_search(target, env);
-    epcm[target_index].valid = 0;
+    set_epcm_entry(&epcm[target_index], 0, 0, 0, 0, 0, PT_REG, 0, 0);
+    epcm_cache_flush_page((uint64_t)target);
+}
+
+// Kernel pager: RBX = epc_swap_t per EPC page (RCX of them, 0 to stop
+// paging), RDX = counter of pages loaded on access
+static
+void encls_pager(CPUX86State *env)
+{
+    epc_swap_t *swap = (epc_swap_t *)env->regs[R_EBX];
+    uint64_t *faults = (uint64_t *)env->regs[R_EDX];
+
+    if (swap && (env->regs[R_ECX] != epcm_npages || !faults ||
+                 !is_aligned(swap, PAGEINFO_ALIGN_SIZE))) {
+        sgx_dbg(err, "pager table does not match EPC (%u pages)",
+                epcm_npages);
+        raise_exception(env, EXCP0D_GPF);
+    }
+    epc_swap_faults = faults;
+    __atomic_store_n(&epc_swap, swap, __ATOMIC_RELEASE);
+}
+
+// Page ageing for the pager: RBX = RCX EPC page addresses, RDX = as many
+// bytes, set to whether the enclave accessed the page since the last call.
+// The accessed bit is cleared along with the EPCM cache entries, so the
+// next access sets it again.
+static
+void encls_epc_age(CPUX86State *env)
+{
+    uint64_t *pages = (uint64_t *)env->regs[R_EBX];
+    uint8_t *accessed = (uint8_t *)env->regs[R_EDX];
+    uint64_t i;
+
+    for (i = 0; i < env->regs[R_ECX]; i ++) {
+        int64_t index = epcm_index_lookup(&epcm_idx, pages[i]);
+
+        accessed[i] = 0;
+        if (index < 0) {
+            continue;
+        }
+        if (__atomic_exchange_n(&epcm[index].accessed, 0, __ATOMIC_RELAXED)) {
+            accessed[i] = 1;
+            epcm_cache_flush_page(pages[i]);
+        }
+    }
+}
+
+// Batched eviction for the pager: RBX = RCX evict_desc_t. All pages are
+// EBLOCKed, tracked with one ETRACK and written back with one exit from
+// the translated code; RAX <- the number of pages written back, and the
+// status of each desc gets the error code of its EBLOCK or EWB.
+static
+void encls_evict(CPUX86State *env)
+{
+    evict_desc_t *descs = (evict_desc_t *)env->regs[R_EBX];
+    uint64_t n = env->regs[R_ECX];
+    uint64_t i, written = 0;
+    int64_t eid;
+    bool carry;
+
+    if (!is_aligned(descs, PAGEINFO_ALIGN_SIZE)) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    for (i = 0; i < n; i ++) {
+        descs[i].status = eblock_page(env, (uint64_t *)descs[i].epcpage,
+                                      &carry);
+    }
+
+    epc_track(env);
+
+    for (i = 0; i < n; i ++) {
+        if (descs[i].status) {
+            continue;
+        }
+        descs[i].status = ewb_page(env, &descs[i].pageinfo, descs[i].epcpage,
+                                   (uint64_t *)descs[i].va_slot, &carry, &eid);
+        if (!descs[i].status) {
+            written ++;
+        }
+    }
+
+    env->regs[R_EAX] = written;
 }
 
 // Sanity checks data structures
@@ -4739,6 +5460,7 @@ static void sanity_check(void)
     assert(sizeof(gprsgx_t) == 192);
     assert(sizeof(ssa_t) == 4096);
     assert(sizeof(pageinfo_t) == 32);
+    assert(sizeof(evict_desc_t) == 64);
     assert(sizeof(secinfo_flags_t) == 8);
     assert(sizeof(secinfo_t) == 64);
     assert(sizeof(sigstruct_t) == 1808);
@@ -4748,26 +5470,58 @@ static void sanity_check(void)
     assert(sizeof(keydep_t) == 544);
     assert(sizeof(pcmd_t) == 128);
     assert(sizeof(mac_header_t) == 128);
+    assert(sizeof(epc_swap_t) == 64);
 }
 
+// qeid_t are cleared as eid_alloc() hands them out
 static void init_qenclave(void)
 {
-    int i = 0;
-    for(i = 0; i < MAX_ENCLAVES; i++){
-        memset(&(qenclaves[i]), 0, sizeof(qeid_t));
-    }
+    eid_table_lock();
+    eid_nfree = 0;
+    eid_table_unlock();
 }
 
 #define KEY_PATH1 "user/conf/device.key"
 #define KEY_PATH2 "conf/device.key"
 
+// EPC geometry for ENCLS_OSGX_INIT with RBX = 0: RBX/RCX <- first/end page
+// of the EPC that -epc asked for; the runtime maps it there and passes the
+// same range back to ENCLS_OSGX_INIT
+static void encls_epc_geometry(CPUX86State *env)
+{
+    uint64_t size = sgx_epc_size ? sgx_epc_size : (uint64_t)NUM_EPC * PAGE_SIZE;
+    uint64_t base = sgx_epc_base;
+
+    if (!base)
+        base = (SGX_EPC_BASE + size <= SGX_EPC_LOW_LIMIT) ?
+               SGX_EPC_BASE : SGX_EPC_HIGH_BASE;
+
+    env->regs[R_EBX] = base;
+    env->regs[R_ECX] = base + size;
+}
+
 //Initializes qemu with the EPC address
 static void encls_qemu_init(CPUX86State *env)
 {
     // firstPage represents the first page of EPC - the start of EPC
     epc_t *firstPage = (epc_t *)env->regs[R_EBX];
     epc_t *endPage = (epc_t *)env->regs[R_ECX];
-    memset(epcm, 0, NUM_EPC * sizeof(epcm_entry_t));
+    uint64_t npages = endPage - firstPage;
+
+    if (endPage <= firstPage || npages > UINT32_MAX) {
+        sgx_dbg(err, "invalid EPC range %p-%p", firstPage, endPage);
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    // EPCM entries are zero until a leaf touches the page, so only the part
+    // of a large EPC that is in use gets backed
+    if (epcm)
+        munmap(epcm, (size_t)epcm_npages * sizeof(epcm_entry_t));
+    epcm = mmap(NULL, npages * sizeof(epcm_entry_t), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(epcm != MAP_FAILED);
+    epcm_npages = npages;
+    epc_swap = NULL;            // the pager registers against this EPCM
 
     // Save the epc base and address
     // Made Base the previous value since it appears as an address inside is_within_epc (thus goes to mem_access
@@ -4775,23 +5529,28 @@ static void encls_qemu_init(CPUX86State *env)
     EPC_BaseAddr = (uint64_t)firstPage - 1;
     EPC_EndAddr  = (uint64_t)endPage;
 
-    sgx_dbg(trace, "set EPC pages %p-%p",
+    // Used by the inline EPC range check of enclave TBs (gen_sgx_mem_access)
+    env->cregs.CR_EPC_BASE = (uint64_t)firstPage;
+    env->cregs.CR_EPC_SIZE = (uint64_t)endPage - (uint64_t)firstPage;
+
+    sgx_dbg(trace, "set EPC pages %p-%p (%u pages)",
             (void *)EPC_BaseAddr,
-            (void *)EPC_EndAddr);
+            (void *)EPC_EndAddr, epcm_npages);
+
+    epcm_index_init_range(&epcm_idx, (uint64_t)firstPage, epcm_npages);
+    epcm_cache_flush(env);
 
-    int iter;
-    for (iter = 0; iter < NUM_EPC; iter++) {
-        epcm[iter].epcPageAddress = (uint64_t)firstPage;
-        firstPage++;
-    }
     // Initializing CR_ Registers in cpu.h (For CR_NEXT_EID)
     env->cregs.CR_NEXT_EID = 0; // Next Enclave EID
+    next_eid = 0;
     env->cregs.CR_ENC_INSN_RET = false;
     env->cregs.CR_EXIT_MODE = false;
 
     // Setting the SSA Base
     set_ssa_base();
 
+    init_pkcs1_5_padding();
+
     // Load device key pair
     if (file_exist(KEY_PATH1))
         assert( load_rsa_keys(KEY_PATH1, process_pub_key, process_priv_key, 
@@ -4814,12 +5573,21 @@ void encls_set_cpusvn(CPUX86State *env)
     env->cregs.CR_CPUSVN[0] = (uint64_t)svn;
 }
 
+// RBX = SECS of the enclave, RCX = stat_t; zeroes once the SECS is gone
 static
 void encls_set_stat(CPUX86State *env)
 {
-    int32_t eid = (int32_t)env->regs[R_EBX];
+    uint64_t secs = env->regs[R_EBX];
     stat_t *stat = (stat_t *)env->regs[R_ECX];
-    memcpy(stat, &(qenclaves[eid].stat), sizeof(stat_t));
+    int64_t index = epcm_index_lookup(&epcm_idx, secs);
+    qeid_t *qe = NULL;
+
+    if (index >= 0 && epcm[index].valid && epcm[index].page_type == PT_SECS)
+        qe = qenclave(((secs_t *)secs)->eid_reserved.eid_pad.eid);
+    if (qe)
+        memcpy(stat, &qe->stat, sizeof(stat_t));
+    else
+        memset(stat, 0, sizeof(stat_t));
 }
 
 static
@@ -4831,6 +5599,39 @@ void encls_set_stack(CPUX86State *env)
     env->cregs.CR_ESP = (uint64_t)sp;
 }
 
+// EADD (and EEXTEND) a range of pages in one exit: each descriptor goes
+// through exactly the checks and measurement steps of an EADD followed by
+// the EEXTENDs of its 256-byte chunks, so MRENCLAVE is the same as if the
+// kernel had issued them one by one. A faulting page faults the leaf with
+// the pages before it already added.
+static
+void encls_eadd_range(CPUX86State *env)
+{
+    // RBX: eadd_desc_t array (In, EA)
+    // RCX: number of descriptors (In)
+    eadd_desc_t *descs = (eadd_desc_t *)env->regs[R_EBX];
+    uint64_t n = env->regs[R_ECX];
+    uint64_t i;
+    int j;
+
+    if (!is_aligned(descs, PAGEINFO_ALIGN_SIZE)) {
+        sgx_dbg(err, "Failed to check alignment: %p on %d bytes",
+                descs, PAGEINFO_ALIGN_SIZE);
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    for (i = 0; i < n; i ++) {
+        eadd_desc_t *desc = &descs[i];
+        uint8_t *page = (uint8_t *)desc->epcpage;
+
+        eadd_page(env, &desc->pageinfo, (epc_t *)page);
+        if (!(desc->flags & EADD_DESC_EXTEND))
+            continue;
+        for (j = 0; j < PAGE_SIZE; j += MEASUREMENT_SIZE)
+            eextend_chunk(env, (uint64_t *)(page + j));
+    }
+}
+
 /* static uint8_t skipSECSPages(uint64_t baseAddr)
 {
     uint8_t iter = 0;
@@ -4857,10 +5658,20 @@ const char *encls_cmd_to_str(long cmd) {
     case ENCLS_EREMOVE:       return "EREMOVE";
     case ENCLS_EEXTEND:       return "EEXTEND";
     case ENCLS_EAUG:          return "EAUG";
+    case ENCLS_ELDB:          return "ELDB";
+    case ENCLS_ELDU:          return "ELDU";
+    case ENCLS_EBLOCK:        return "EBLOCK";
+    case ENCLS_EPA:           return "EPA";
+    case ENCLS_EWB:           return "EWB";
+    case ENCLS_ETRACK:        return "ETRACK";
     case ENCLS_OSGX_INIT:     return "OSGX_INIT";
     case ENCLS_OSGX_PUBKEY:   return "OSGX_PUBKEY";
     case ENCLS_OSGX_EPCM_CLR: return "OSGX_EPCM_CLR";
     case ENCLS_OSGX_CPUSVN:   return "OSGX_CPUSVN";
+    case ENCLS_OSGX_EADD_RANGE: return "OSGX_EADD_RANGE";
+    case ENCLS_OSGX_PAGER:    return "OSGX_PAGER";
+    case ENCLS_OSGX_EPC_AGE:  return "OSGX_EPC_AGE";
+    case ENCLS_OSGX_EVICT:    return "OSGX_EVICT";
     }
     return "UNKONWN";
 }
@@ -4875,6 +5686,10 @@ void helper_sgx_encls(CPUX86State *env)
             env->regs[R_EBX],
             env->regs[R_ECX],
             env->regs[R_EDX]);
+#if PERF
+    uint64_t leaf = env->regs[R_EAX];
+    int64_t start = qstat_leaf_begin();
+#endif
     switch (env->regs[R_EAX]) {
         case ENCLS_ECREATE:
             sgx_ecreate(env);
@@ -4888,8 +5703,9 @@ void helper_sgx_encls(CPUX86State *env)
         case ENCLS_ELDB:
         case ENCLS_ELDU:
             sgx_eldb(env);
+            break;
         case ENCLS_EREMOVE:
-           //sgx_eremove(env);
+            sgx_eremove(env);
             break;
         case ENCLS_EEXTEND:
             sgx_eextend(env);
@@ -4899,9 +5715,13 @@ void helper_sgx_encls(CPUX86State *env)
             break;
         case ENCLS_EPA:
             sgx_epa(env);
+            break;
         case ENCLS_EWB:
             sgx_ewb(env);
             break;
+        case ENCLS_ETRACK:
+            sgx_etrack(env);
+            break;
         case ENCLS_EAUG:
             sgx_eaug(env);
             break;
@@ -4911,6 +5731,10 @@ void helper_sgx_encls(CPUX86State *env)
 
         // custom (non-spec) hypercalls: for setting up qemu
         case ENCLS_OSGX_INIT:
+            if (!env->regs[R_EBX]) {
+                encls_epc_geometry(env);
+                break;
+            }
             init_qenclave(); // Initializing QEMU Enclave Descriptor
             encls_qemu_init(env);
             break;
@@ -4929,9 +5753,24 @@ void helper_sgx_encls(CPUX86State *env)
         case ENCLS_OSGX_SET_STACK:
             encls_set_stack(env);
             break;
+        case ENCLS_OSGX_EADD_RANGE:
+            encls_eadd_range(env);
+            break;
+        case ENCLS_OSGX_PAGER:
+            encls_pager(env);
+            break;
+        case ENCLS_OSGX_EPC_AGE:
+            encls_epc_age(env);
+            break;
+        case ENCLS_OSGX_EVICT:
+            encls_evict(env);
+            break;
         default:
             sgx_err("not implemented yet");
     }
+#if PERF
+    qstat_leaf_end(false, leaf, start);
+#endif
 }
 
 void helper_sgx_ehandle(CPUX86State *env)
@@ -4944,6 +5783,9 @@ void helper_sgx_ehandle(CPUX86State *env)
     sgx_msg(info, "Entered Exception Handler QEMU");
 
     secs = (secs_t *)env->cregs.CR_ACTIVE_SECS;
+#if PERF
+    QSTAT_INC(secs->eid_reserved.eid_pad.eid, aex_n);
+#endif
     tmp_gpr = (gprsgx_t *)(env->cregs.CR_GPR_PA); //CR_XSAVE_PAGE[0];
 
     // Check for 64 bit mode
@@ -4959,6 +5801,10 @@ void helper_sgx_ehandle(CPUX86State *env)
         saveState(tmp_gpr, env);
     //    tmp_ssa->rflags.tf = 0;
     }
+    // ERESUME restarts at the faulting instruction, or after a trap; the
+    // translator left it in EIP (see gen_exception()/gen_interrupt())
+    tmp_gpr->rip = env->eip;
+    tmp_gpr->SAVED_EXIT_EIP = env->cregs.CR_EXIT_EIP;
 #if DEBUG
     sgx_msg(info, "Ssaved the state");
 #endif
@@ -5007,6 +5853,13 @@ void helper_sgx_ehandle(CPUX86State *env)
         env->xcr0 = env->cregs.CR_SAVE_XCR0;
     }
 
+    // Leave the enclave: the logical processor gives up the TCS, as on
+    // EEXIT, so that the ERESUME of the AEP can take it again, and the
+    // exception is reported at the AEP
+    tcs_release(&epcm[epcm_search((void *)env->cregs.CR_TCS_LA, env)]);
+    set_enclave_mode(env, false);
+    env->eip = env->cregs.CR_AEP;
+
     sgx_msg(info, "Exception Check- Gets redirected to the appropriate exception Handler");
     return;
 }
@@ -63,7 +63,6 @@
 /* global register indexes */
 static TCGv_ptr cpu_env;
 static TCGv cpu_A0;
-static bool enclave_mode = false;
 static int ld_ = 0;
 static int st_ = 1;
 //static TCGv ld_ = 0;
@@ -128,6 +127,7 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    int enclave_mode; /* SGX enclave mode, from HF_SGX_MASK */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -479,15 +479,96 @@ static inline void gen_op_addq_A0_reg_sN(int shift, int reg)
 }
 #endif
 
+/* SGX EPCM/ELRANGE checks only apply to code running in enclave mode.
+   Enclave mode is part of the TB flags, so non-enclave TBs are translated
+   without any check and never reused for enclave code.
+
+   In enclave TBs the EPC bounds and the per-vCPU EPCM permission cache
+   (env->sgx_epcm_cache) are checked inline; the helper only runs for
+   in-EPC pages that miss the cache, does the ELRANGE/EPCM checks (#GP on
+   violation) and refills the entry. The branches end a basic block in the
+   middle of an instruction, which is why enclave TBs allocate
+   cpu_T/cpu_A0/cpu_tmp* as local temps. */
+static inline void gen_sgx_epc_brcond(TCGv a0, int label)
+{
+    TCGv t0 = tcg_temp_new();
+    TCGv t1 = tcg_temp_new();
+
+    /* (a0 - base) >= size, unsigned */
+    tcg_gen_ld_tl(t0, cpu_env, offsetof(CPUX86State, cregs.CR_EPC_BASE));
+    tcg_gen_ld_tl(t1, cpu_env, offsetof(CPUX86State, cregs.CR_EPC_SIZE));
+    tcg_gen_sub_tl(t0, a0, t0);
+    tcg_gen_brcond_tl(TCG_COND_GEU, t0, t1, label);
+    tcg_temp_free(t0);
+    tcg_temp_free(t1);
+}
+
+static inline void gen_sgx_epcm_cache_brcond(TCGv a0, int field_ofs, int label)
+{
+    TCGv t0 = tcg_temp_new();
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    /* &env->sgx_epcm_cache[(a0 >> 12) & mask] */
+    tcg_gen_shri_tl(t0, a0, TARGET_PAGE_BITS - SGX_EPCM_CACHE_ENTRY_BITS);
+    tcg_gen_andi_tl(t0, t0, (SGX_EPCM_CACHE_SIZE - 1) << SGX_EPCM_CACHE_ENTRY_BITS);
+    tcg_gen_trunc_tl_i32(t1, t0);
+    tcg_gen_ext_i32_ptr(ptr, t1);
+    tcg_gen_add_ptr(ptr, ptr, cpu_env);
+    tcg_gen_ld_tl(t0, ptr, offsetof(CPUX86State, sgx_epcm_cache) + field_ofs);
+
+    /* hit when the cached tag is the page of a0 */
+    tcg_gen_xor_tl(t0, t0, a0);
+    tcg_gen_andi_tl(t0, t0, TARGET_PAGE_MASK);
+    tcg_gen_brcondi_tl(TCG_COND_EQ, t0, 0, label);
+
+    tcg_temp_free(t0);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_ptr(ptr);
+}
+
+static inline void gen_sgx_mem_access(DisasContext *s, TCGv a0, int op)
+{
+    int l_done;
+
+    if (!s->enclave_mode) {
+        return;
+    }
+
+    l_done = gen_new_label();
+    gen_sgx_epc_brcond(a0, l_done);
+    gen_sgx_epcm_cache_brcond(a0, op == st_ ?
+                              offsetof(SGXEPCMCacheEntry, addr_write) :
+                              offsetof(SGXEPCMCacheEntry, addr_read), l_done);
+    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(op));
+    gen_set_label(l_done);
+}
+
+static inline void gen_sgx_mem_execute(DisasContext *s, TCGv a0)
+{
+    int l_done;
+
+    if (!s->enclave_mode) {
+        return;
+    }
+
+    l_done = gen_new_label();
+    gen_sgx_epc_brcond(a0, l_done);
+    gen_sgx_epcm_cache_brcond(a0, offsetof(SGXEPCMCacheEntry, addr_code),
+                              l_done);
+    gen_helper_mem_execute(cpu_env, a0);
+    gen_set_label(l_done);
+}
+
 static inline void gen_op_ld_v(DisasContext *s, int idx, TCGv t0, TCGv a0)
 {
-    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, a0, ld_);
     tcg_gen_qemu_ld_tl(t0, a0, s->mem_index, idx | MO_LE);
 }
 
 static inline void gen_op_st_v(DisasContext *s, int idx, TCGv t0, TCGv a0)
 {
-    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, a0, st_);
     tcg_gen_qemu_st_tl(t0, a0, s->mem_index, idx | MO_LE);
 }
 
@@ -1746,7 +1827,8 @@ static void gen_shiftd_rm_T1(DisasContext *s, TCGMemOp ot, int op1,
         gen_op_mov_v_reg(ot, cpu_T[0], op1);
     }
 
-    count = tcg_temp_new();
+    /* live across the store, see gen_sgx_mem_access() */
+    count = s->enclave_mode ? tcg_temp_local_new() : tcg_temp_new();
     tcg_gen_andi_tl(count, count_in, mask);
 
     switch (ot) {
@@ -2520,11 +2602,13 @@ static void gen_enter(DisasContext *s, int esp_addend, int level)
 
 static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
 {
-    if (enclave_mode) {
-        gen_helper_sgx_ehandle(cpu_env);
-    }
     gen_update_cc_op(s);
     gen_jmp_im(cur_eip);
+    if (s->enclave_mode) {
+        /* AEX: ERESUME restarts the faulting instruction, the exception
+           is reported at the AEP */
+        gen_helper_sgx_ehandle(cpu_env);
+    }
     gen_helper_raise_exception(cpu_env, tcg_const_i32(trapno));
     s->is_jmp = DISAS_TB_JUMP;
 }
@@ -2534,10 +2618,17 @@ static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
 static void gen_interrupt(DisasContext *s, int intno,
                           target_ulong cur_eip, target_ulong next_eip)
 {
-    if (enclave_mode) {
+    gen_update_cc_op(s);
+    if (s->enclave_mode) {
+        /* AEX: ERESUME continues after the trap, the interrupt is
+           reported at the AEP */
+        gen_jmp_im(next_eip);
         gen_helper_sgx_ehandle(cpu_env);
+        gen_helper_raise_interrupt(cpu_env, tcg_const_i32(intno),
+                                   tcg_const_i32(0));
+        s->is_jmp = DISAS_TB_JUMP;
+        return;
     }
-    gen_update_cc_op(s);
     gen_jmp_im(cur_eip);
     gen_helper_raise_interrupt(cpu_env, tcg_const_i32(intno),
                                tcg_const_i32(next_eip - cur_eip));
@@ -2595,7 +2686,7 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
 
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_A0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset);
 }
@@ -2603,18 +2694,18 @@ static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 static inline void gen_stq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset);
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));//st_);
+    gen_sgx_mem_access(s, cpu_A0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
 }
 
 static inline void gen_ldo_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_A0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_tmp0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
 }
@@ -2623,11 +2714,11 @@ static inline void gen_sto_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, cpu_A0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, cpu_tmp0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
 }
 
@@ -3656,14 +3747,14 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         break;
                     case 0x21: case 0x31: /* pmovsxbd, pmovzxbd */
                     case 0x24: case 0x34: /* pmovsxwq, pmovzxwq */
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, op2_offset +
                                         offsetof(XMMReg, XMM_L(0)));
                         break;
                     case 0x22: case 0x32: /* pmovsxbq, pmovzxbq */
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_tl(cpu_tmp0, cpu_A0,
                                            s->mem_index, MO_LEUW);
                         tcg_gen_st16_tl(cpu_tmp0, cpu_env, op2_offset +
@@ -3753,12 +3844,12 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 
                 gen_lea_modrm(env, s, modrm);
                 if ((b & 1) == 0) {
-                    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                    gen_sgx_mem_access(s, cpu_A0, ld_);
                     tcg_gen_qemu_ld_tl(cpu_T[0], cpu_A0,
                                        s->mem_index, ot | MO_BE);
                     gen_op_mov_reg_v(ot, reg, cpu_T[0]);
                 } else {
-                    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                    gen_sgx_mem_access(s, cpu_A0, st_);
                     tcg_gen_qemu_st_tl(cpu_regs[reg], cpu_A0,
                                        s->mem_index, ot | MO_BE);
                 }
@@ -4096,7 +4187,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_UB);
                     }
@@ -4107,7 +4198,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_LEUW);
                     }
@@ -4120,7 +4211,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_extu_i32_tl(cpu_regs[rm], cpu_tmp2_i32);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                            gen_sgx_mem_access(s, cpu_A0, st_);
                             tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                                 s->mem_index, MO_LEUL);
                         }
@@ -4132,7 +4223,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_mov_i64(cpu_regs[rm], cpu_tmp1_i64);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                            gen_sgx_mem_access(s, cpu_A0, st_);
                             tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                                 s->mem_index, MO_LEQ);
                         }
@@ -4147,7 +4238,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_LEUL);
                     }
@@ -4156,7 +4247,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_v_reg(MO_32, cpu_T[0], rm);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_ld_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_UB);
                     }
@@ -4169,7 +4260,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                                         offsetof(CPUX86State,xmm_regs[rm]
                                                 .XMM_L((val >> 6) & 3)));
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                     }
@@ -4198,7 +4289,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_regs[rm]);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                            gen_sgx_mem_access(s, cpu_A0, ld_);
                             tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                                 s->mem_index, MO_LEUL);
                         }
@@ -4210,7 +4301,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             gen_op_mov_v_reg(ot, cpu_tmp1_i64, rm);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                            gen_sgx_mem_access(s, cpu_A0, ld_);
                             tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                                 s->mem_index, MO_LEQ);
                         }
@@ -4971,7 +5062,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (dflag == MO_16) {
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);  //cpu_T[0] contains the destination address
+            gen_sgx_mem_execute(s, cpu_T[0]);  //cpu_T[0] contains the destination address
             next_eip = s->pc - s->cs_base;
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
@@ -5002,7 +5093,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (dflag == MO_16) {
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_op_jmp_v(cpu_T[0]);
             gen_eob(s);
             break;
@@ -5019,7 +5110,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                                           tcg_const_i32(s->pc - pc_start));
             } else {
                 gen_op_movl_seg_T0_vm(R_CS);
-                gen_helper_mem_execute(cpu_env, cpu_T[1]);
+                gen_sgx_mem_execute(s, cpu_T[1]);
                 gen_op_jmp_v(cpu_T[1]);
             }
             gen_eob(s);
@@ -5784,26 +5875,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 
                     switch(op >> 4) {
                     case 0:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_flds_FT0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 1:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_fildl_FT0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 2:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         gen_helper_fldl_FT0(cpu_env, cpu_tmp1_i64);
                         break;
                     case 3:
                     default:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LESW);
                         gen_helper_fildl_FT0(cpu_env, cpu_tmp2_i32);
@@ -5827,26 +5918,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 case 0:
                     switch(op >> 4) {
                     case 0:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_flds_ST0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 1:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_fildl_ST0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 2:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         gen_helper_fldl_ST0(cpu_env, cpu_tmp1_i64);
                         break;
                     case 3:
                     default:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LESW);
                         gen_helper_fildl_ST0(cpu_env, cpu_tmp2_i32);
@@ -5858,20 +5949,20 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     switch(op >> 4) {
                     case 1:
                         gen_helper_fisttl_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 2:
                         gen_helper_fisttll_ST0(cpu_tmp1_i64, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         break;
                     case 3:
                     default:
                         gen_helper_fistt_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUW);
                         break;
@@ -5882,26 +5973,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     switch(op >> 4) {
                     case 0:
                         gen_helper_fsts_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 1:
                         gen_helper_fistl_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 2:
                         gen_helper_fstl_ST0(cpu_tmp1_i64, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         break;
                     case 3:
                     default:
                         gen_helper_fist_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUW);
                         break;
@@ -5917,7 +6008,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 gen_helper_fldenv(cpu_env, cpu_A0, tcg_const_i32(dflag - 1));
                 break;
             case 0x0d: /* fldcw mem */
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 gen_helper_fldcw(cpu_env, cpu_tmp2_i32);
@@ -5929,7 +6020,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 break;
             case 0x0f: /* fnstcw mem */
                 gen_helper_fnstcw(cpu_tmp2_i32, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 break;
@@ -5956,7 +6047,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 break;
             case 0x2f: /* fnstsw mem */
                 gen_helper_fnstsw(cpu_tmp2_i32, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 break;
@@ -5972,13 +6063,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 gen_helper_fpop(cpu_env);
                 break;
             case 0x3d: /* fildll */
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
                 gen_helper_fildll_ST0(cpu_env, cpu_tmp1_i64);
                 break;
             case 0x3f: /* fistpll */
                 gen_helper_fistll_ST0(cpu_tmp1_i64, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
                 gen_helper_fpop(cpu_env);
                 break;
@@ -6463,7 +6554,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         s->pc += 2;
         ot = gen_pop_T0(s);
         gen_stack_update(s, val + (1 << ot));
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
         gen_eob(s);
@@ -6471,7 +6562,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_op_jmp_v(cpu_T[0]);
         gen_eob(s);
         break;
@@ -6482,7 +6573,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->pe && !s->vm86) {
             gen_update_cc_op(s);
             tcg_gen_movi_tl(cpu_T[0], pc_start - s->cs_base);  
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);  
+            gen_sgx_mem_execute(s, cpu_T[0]);  
             gen_jmp_im(pc_start - s->cs_base);
             gen_helper_lret_protected(cpu_env, tcg_const_i32(dflag - 1),
                                       tcg_const_i32(val));
@@ -6492,7 +6583,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_ld_v(s, dflag, cpu_T[0], cpu_A0);
             /* NOTE: keeping EIP updated is not a problem in case of
                exception */
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_op_jmp_v(cpu_T[0]);
             /* pop selector */
             gen_op_addl_A0_im(1 << dflag);
@@ -6522,7 +6613,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_update_cc_op(s);
             tcg_gen_movi_tl(cpu_T[0], pc_start - s->cs_base);
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_jmp_im(pc_start - s->cs_base);
             gen_helper_iret_protected(cpu_env, tcg_const_i32(dflag - 1),
                                       tcg_const_i32(s->pc - s->cs_base));
@@ -6545,8 +6636,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     tval &= 0xffffffff;
                 }
                 tcg_gen_movi_tl(cpu_T[0], tval);
-                gen_helper_mem_execute(cpu_env, cpu_T[0]);
-                if (enclave_mode) {
+                gen_sgx_mem_execute(s, cpu_T[0]);
+                if (s->enclave_mode) {
                     sgx_dbg(trace, "In 0xe8(call im), enclave mode, cur env->eip : %lx s-----> PC: %lx", env->eip, s->pc);
                     sgx_dbg(trace, "In 0xe8(call im), enclave mode, target: %lx", tval);
                     jmpOutEnc = true;
@@ -6586,7 +6677,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffffffff;
         }
         tcg_gen_movi_tl(cpu_T[0], tval);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_jmp(s, tval);
         break;
     case 0xea: /* ljmp im */
@@ -6609,7 +6700,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         }
         tcg_gen_movi_tl(cpu_T[0], tval);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_jmp(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
@@ -7868,7 +7959,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 goto illegal_op;
             gen_lea_modrm(env, s, modrm);
             if (op == 2) {
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUL);
                 gen_helper_ldmxcsr(cpu_env, cpu_tmp2_i32);
@@ -8026,7 +8117,6 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     CPUState *cs = CPU(cpu);
     CPUX86State *env = &cpu->env;
 
-    enclave_mode = env->cregs.CR_ENCLAVE_MODE;
     DisasContext dc1, *dc = &dc1;
     target_ulong pc_ptr;
     uint16_t *gen_opc_end;
@@ -8052,6 +8142,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     dc->cpl = (flags >> HF_CPL_SHIFT) & 3;
     dc->iopl = (flags >> IOPL_SHIFT) & 3;
     dc->tf = (flags >> TF_SHIFT) & 1;
+    dc->enclave_mode = (flags >> HF_SGX_SHIFT) & 1;
     dc->singlestep_enabled = cs->singlestep_enabled;
     dc->cc_op = CC_OP_DYNAMIC;
     dc->cc_op_dirty = false;
@@ -8085,15 +8176,28 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
         printf("ERROR addseg\n");
 #endif
 
-    cpu_T[0] = tcg_temp_new();
-    cpu_T[1] = tcg_temp_new();
-    cpu_A0 = tcg_temp_new();
-
-    cpu_tmp0 = tcg_temp_new();
-    cpu_tmp1_i64 = tcg_temp_new_i64();
-    cpu_tmp2_i32 = tcg_temp_new_i32();
-    cpu_tmp3_i32 = tcg_temp_new_i32();
-    cpu_tmp4 = tcg_temp_new();
+    if (dc->enclave_mode) {
+        /* must survive the inline SGX checks, see gen_sgx_mem_access() */
+        cpu_T[0] = tcg_temp_local_new();
+        cpu_T[1] = tcg_temp_local_new();
+        cpu_A0 = tcg_temp_local_new();
+
+        cpu_tmp0 = tcg_temp_local_new();
+        cpu_tmp1_i64 = tcg_temp_local_new_i64();
+        cpu_tmp2_i32 = tcg_temp_local_new_i32();
+        cpu_tmp3_i32 = tcg_temp_local_new_i32();
+        cpu_tmp4 = tcg_temp_local_new();
+    } else {
+        cpu_T[0] = tcg_temp_new();
+        cpu_T[1] = tcg_temp_new();
+        cpu_A0 = tcg_temp_new();
+
+        cpu_tmp0 = tcg_temp_new();
+        cpu_tmp1_i64 = tcg_temp_new_i64();
+        cpu_tmp2_i32 = tcg_temp_new_i32();
+        cpu_tmp3_i32 = tcg_temp_new_i32();
+        cpu_tmp4 = tcg_temp_new();
+    }
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
     cpu_cc_srcT = tcg_temp_local_new();
@@ -7,6 +7,8 @@
 #include <string.h>  /* strlen(3), */
 #include <stdio.h>   /* *printf(3), memset(3), */
 #include <pthread.h> /* pthread_*, */
+#include <inttypes.h> /* PRI*, */
+#include <limits.h>   /* PATH_MAX, */
 
 #include "tcg-op.h"
 
@@ -14,6 +16,7 @@
 #include "exec/exec-all.h"   /* TranslationBlock */
 #include "qom/cpu.h"         /* CPUState */
 #include "sysemu/sysemu.h"   /* max_cpus */
+#include "qemu/timer.h"      /* cpu_get_real_ticks */
 
 /* Interface for the TCG plugin.  */
 static TCGPluginInterface tpi;
@@ -22,8 +25,6 @@ static bool mutex_protected;
 
 static uint64_t current_pc = 0;
 
-static uint64_t *icount_total;
-
 /* Ensure resources used by *_helper_code are protected from
    concurrent access.  */
 static pthread_mutex_t helper_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -50,21 +51,417 @@ static int init=0;
     } while (0);
 
 
-static void cpus_stopped(const TCGPluginInterface *tpi)
+/***********************************************************************
+ * SGX profiler: executed instructions and host ticks per TB, attributed
+ * to the enclave (EID), the mode (enclave, untrusted, untrusted code
+ * serving an OCALL) and the ECALL/OCALL the vCPU is in.  The context is
+ * switched by the tcg_plugin_sgx_*() hooks called from sgx_helper.c.
+ *
+ * Each vCPU (guest thread) fills its own table, so the TB helper takes
+ * no lock; the tables are merged when the CPUs are stopped, and dumped
+ * as a flat profile (PREFIX.txt) and as folded stacks for flame graphs
+ * (PREFIX.folded), PREFIX being $OPENSGX_PROFILE or "sgx-profile".
+ */
+
+typedef enum {
+    SGX_PROF_UNTRUSTED,         /* outside of any ECALL */
+    SGX_PROF_ENCLAVE,           /* enclave mode */
+    SGX_PROF_OCALL,             /* untrusted code serving an OCALL */
+} SGXProfMode;
+
+static const char *sgx_prof_mode_name[] = { "untrusted", "enclave", "ocall" };
+
+typedef struct {
+    int64_t eid;                /* -1 when untrusted */
+    uint64_t tcs;               /* TCS of the ECALL */
+    uint64_t ocall;             /* enclave PC following the OCALL's EEXIT */
+    uint64_t pc;                /* TB address, 0 for ECALL/OCALL records */
+    SGXProfMode mode;
+} SGXProfKey;
+
+typedef struct {
+    SGXProfKey key;
+    bool used;
+    uint64_t icount;
+    uint64_t ticks;
+    uint64_t count;             /* TB executions, or calls for records */
+} SGXProfSlot;
+
+typedef struct SGXProfTable {
+    SGXProfSlot *slots;
+    size_t size;                /* power of 2 */
+    size_t used;
+
+    int cpu_index;
+    uint64_t icount;
+    SGXProfKey ctx;             /* current context of the vCPU */
+    SGXProfSlot *last;          /* TB the ticks since last_tick go to */
+    int64_t last_tick;
+
+    struct SGXProfTable *next;
+} SGXProfTable;
+
+#define SGX_PROF_INIT_SIZE 4096
+
+static __thread SGXProfTable *sgx_prof;
+static SGXProfTable *sgx_prof_tables;
+static pthread_mutex_t sgx_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t sgx_prof_hash(const SGXProfKey *key)
 {
-    unsigned int i;
-    for (i = 0; i < tpi->nb_cpus; i++) {
-        printf("number of executed instructions on CPU #%d = %" PRIu64 "\n",
-                 i, icount_total[i]);
+    uint64_t h = key->pc ^ (key->ocall * 31) ^ (key->tcs * 17)
+                 ^ ((uint64_t)key->eid << 48) ^ ((uint64_t)key->mode << 56);
+    return h * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline bool sgx_prof_key_eq(const SGXProfKey *a, const SGXProfKey *b)
+{
+    return a->pc == b->pc && a->eid == b->eid && a->mode == b->mode
+        && a->tcs == b->tcs && a->ocall == b->ocall;
+}
+
+static void sgx_prof_alloc(SGXProfTable *t, size_t size)
+{
+    t->slots = g_malloc0(size * sizeof(SGXProfSlot));
+    t->size = size;
+    t->used = 0;
+}
+
+static SGXProfSlot *sgx_prof_slot(SGXProfTable *t, const SGXProfKey *key);
+
+static void sgx_prof_grow(SGXProfTable *t)
+{
+    SGXProfSlot *old = t->slots;
+    size_t i, size = t->size;
+
+    sgx_prof_alloc(t, size * 2);
+    for (i = 0; i < size; i++) {
+        if (old[i].used) {
+            *sgx_prof_slot(t, &old[i].key) = old[i];
+        }
     }
+    g_free(old);
+    t->last = NULL;
 }
 
+/* Find or insert the slot of KEY.  */
+static SGXProfSlot *sgx_prof_slot(SGXProfTable *t, const SGXProfKey *key)
+{
+    size_t i;
+
+    if ((t->used + 1) * 2 > t->size) {
+        sgx_prof_grow(t);
+    }
+
+    i = (sgx_prof_hash(key) >> 20) & (t->size - 1);
+    while (t->slots[i].used) {
+        if (sgx_prof_key_eq(&t->slots[i].key, key)) {
+            return &t->slots[i];
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+
+    t->slots[i].used = true;
+    t->slots[i].key = *key;
+    t->used++;
+    return &t->slots[i];
+}
+
+static SGXProfTable *sgx_prof_table(void)
+{
+    SGXProfTable *t = sgx_prof;
+
+    if (t) {
+        return t;
+    }
+
+    t = g_malloc0(sizeof(SGXProfTable));
+    sgx_prof_alloc(t, SGX_PROF_INIT_SIZE);
+    t->cpu_index = current_cpu ? current_cpu->cpu_index : 0;
+    t->ctx.eid = -1;
+    t->ctx.mode = SGX_PROF_UNTRUSTED;
+
+    /* Tables outlive their thread: they are dumped at exit.  */
+    pthread_mutex_lock(&sgx_prof_lock);
+    t->next = sgx_prof_tables;
+    sgx_prof_tables = t;
+    pthread_mutex_unlock(&sgx_prof_lock);
+
+    sgx_prof = t;
+    return t;
+}
+
+/* Count one ECALL/OCALL in the current context.  */
+static void sgx_prof_call(SGXProfTable *t)
+{
+    SGXProfKey key = t->ctx;
+
+    key.pc = 0;
+    sgx_prof_slot(t, &key)->count++;
+}
+
+void tcg_plugin_sgx_enter(int64_t eid, uint64_t tcs, bool resume)
+{
+    SGXProfTable *t = sgx_prof_table();
+
+    if (!resume) {
+        t->ctx.eid = eid;
+        t->ctx.tcs = tcs;
+        t->ctx.ocall = 0;
+        t->ctx.mode = SGX_PROF_ENCLAVE;
+        sgx_prof_call(t);
+    } else {
+        /* back from an OCALL */
+        t->ctx.ocall = 0;
+        t->ctx.mode = SGX_PROF_ENCLAVE;
+    }
+}
+
+void tcg_plugin_sgx_exit(uint64_t pc, bool ocall)
+{
+    SGXProfTable *t = sgx_prof_table();
+
+    if (ocall) {
+        t->ctx.ocall = pc;
+        t->ctx.mode = SGX_PROF_OCALL;
+        sgx_prof_call(t);
+    } else {
+        t->ctx.eid = -1;
+        t->ctx.tcs = 0;
+        t->ctx.ocall = 0;
+        t->ctx.mode = SGX_PROF_UNTRUSTED;
+    }
+}
 
 static void pre_tb_helper_code(const TCGPluginInterface *tpi,
                                TPIHelperInfo info, uint64_t address,
                                uint64_t data1, uint64_t data2)
 {
-    icount_total[info.cpu_index] += info.icount;
+    SGXProfTable *t = sgx_prof_table();
+    int64_t now = cpu_get_real_ticks();
+    SGXProfKey key = t->ctx;
+    SGXProfSlot *slot;
+
+    /* Host time since the previous TB started is charged to it.  */
+    if (t->last) {
+        t->last->ticks += now - t->last_tick;
+    }
+
+    key.pc = address;
+    slot = sgx_prof_slot(t, &key);
+    slot->icount += info.icount;
+    slot->count++;
+    t->icount += info.icount;
+
+    t->last = slot;
+    t->last_tick = now;
+}
+
+static void sgx_prof_add(SGXProfTable *dst, const SGXProfKey *key,
+                         const SGXProfSlot *src, bool count)
+{
+    SGXProfSlot *slot = sgx_prof_slot(dst, key);
+
+    slot->icount += src->icount;
+    slot->ticks += src->ticks;
+    if (count) {
+        slot->count += src->count;
+    }
+}
+
+static int sgx_prof_cmp(const void *a, const void *b)
+{
+    const SGXProfSlot *x = *(SGXProfSlot * const *)a;
+    const SGXProfSlot *y = *(SGXProfSlot * const *)b;
+
+    if (x->icount != y->icount) {
+        return x->icount < y->icount ? 1 : -1;
+    }
+    return x->key.pc < y->key.pc ? -1 : x->key.pc > y->key.pc;
+}
+
+/* Used slots of T (only TBs if TBS_ONLY), hottest first, NULL-ended.  */
+static SGXProfSlot **sgx_prof_sorted(SGXProfTable *t, bool tbs_only)
+{
+    SGXProfSlot **v = g_malloc0((t->used + 1) * sizeof(SGXProfSlot *));
+    size_t i, n = 0;
+
+    for (i = 0; i < t->size; i++) {
+        if (t->slots[i].used && (!tbs_only || t->slots[i].key.pc != 0)) {
+            v[n++] = &t->slots[i];
+        }
+    }
+    qsort(v, n, sizeof(SGXProfSlot *), sgx_prof_cmp);
+    return v;
+}
+
+static double sgx_prof_pct(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+static void sgx_prof_frames(FILE *out, const SGXProfSlot *slot)
+{
+    const SGXProfKey *key = &slot->key;
+
+    if (key->mode == SGX_PROF_UNTRUSTED) {
+        fprintf(out, "untrusted");
+    } else {
+        fprintf(out, "enclave#%" PRId64 ";ecall@0x%" PRIx64, key->eid, key->tcs);
+        if (key->mode == SGX_PROF_OCALL) {
+            fprintf(out, ";ocall@0x%" PRIx64, key->ocall);
+        }
+    }
+}
+
+static void sgx_prof_dump(void)
+{
+    SGXProfTable all, modes, calls;
+    SGXProfSlot **tbs, **v;
+    SGXProfTable *t;
+    uint64_t icount = 0, ticks = 0;
+    const char *prefix = getenv("OPENSGX_PROFILE");
+    char path[PATH_MAX];
+    FILE *flat, *folded;
+    size_t i;
+
+    memset(&all, 0, sizeof(all));
+    memset(&modes, 0, sizeof(modes));
+    memset(&calls, 0, sizeof(calls));
+    sgx_prof_alloc(&all, SGX_PROF_INIT_SIZE);
+    sgx_prof_alloc(&modes, 64);
+    sgx_prof_alloc(&calls, 64);
+
+    pthread_mutex_lock(&sgx_prof_lock);
+    for (t = sgx_prof_tables; t; t = t->next) {
+        printf("number of executed instructions on CPU #%d = %" PRIu64 "\n",
+               t->cpu_index, t->icount);
+        for (i = 0; i < t->size; i++) {
+            if (t->slots[i].used) {
+                sgx_prof_add(&all, &t->slots[i].key, &t->slots[i], true);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sgx_prof_lock);
+
+    /* Per mode/EID totals, and inclusive totals per ECALL and OCALL.  */
+    for (i = 0; i < all.size; i++) {
+        SGXProfSlot *slot = &all.slots[i];
+        SGXProfKey key;
+
+        if (!slot->used) {
+            continue;
+        }
+        if (slot->key.pc == 0) {
+            sgx_prof_slot(&calls, &slot->key)->count += slot->count;
+            continue;
+        }
+
+        icount += slot->icount;
+        ticks += slot->ticks;
+
+        memset(&key, 0, sizeof(key));
+        key.eid = slot->key.eid;
+        key.mode = slot->key.mode;
+        sgx_prof_add(&modes, &key, slot, true);
+
+        if (slot->key.mode == SGX_PROF_UNTRUSTED) {
+            continue;
+        }
+        key = slot->key;
+        key.pc = 0;
+        key.ocall = 0;
+        key.mode = SGX_PROF_ENCLAVE;
+        sgx_prof_add(&calls, &key, slot, false);
+        if (slot->key.mode == SGX_PROF_OCALL) {
+            key = slot->key;
+            key.pc = 0;
+            sgx_prof_add(&calls, &key, slot, false);
+        }
+    }
+
+    v = sgx_prof_sorted(&modes, false);
+    for (i = 0; v[i]; i++) {
+        printf("sgx-profile: %-9s eid %3" PRId64 ": %12" PRIu64
+               " instructions (%5.1f%%), %14" PRIu64 " host ticks (%5.1f%%)\n",
+               sgx_prof_mode_name[v[i]->key.mode], v[i]->key.eid,
+               v[i]->icount, sgx_prof_pct(v[i]->icount, icount),
+               v[i]->ticks, sgx_prof_pct(v[i]->ticks, ticks));
+    }
+    g_free(v);
+
+    if (!prefix || !*prefix) {
+        prefix = "sgx-profile";
+    }
+
+    snprintf(path, sizeof(path), "%s.txt", prefix);
+    flat = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.folded", prefix);
+    folded = fopen(path, "w");
+    if (!flat || !folded) {
+        fprintf(stderr, "sgx-profile: cannot write %s.{txt,folded}\n", prefix);
+        goto out;
+    }
+
+    fprintf(flat, "# SGX profile: %" PRIu64 " instructions, %" PRIu64
+            " host ticks\n", icount, ticks);
+
+    fprintf(flat, "\n# ECALLs and OCALLs (inclusive)\n"
+            "# %-6s %4s %18s %18s %10s %14s %7s %16s %7s\n",
+            "kind", "eid", "tcs", "ocall-site", "calls",
+            "instructions", "%", "host-ticks", "%");
+    v = sgx_prof_sorted(&calls, false);
+    for (i = 0; v[i]; i++) {
+        fprintf(flat, "  %-6s %4" PRId64 " %#18" PRIx64 " %#18" PRIx64
+                " %10" PRIu64 " %14" PRIu64 " %6.2f%% %16" PRIu64 " %6.2f%%\n",
+                v[i]->key.mode == SGX_PROF_OCALL ? "ocall" : "ecall",
+                v[i]->key.eid, v[i]->key.tcs, v[i]->key.ocall, v[i]->count,
+                v[i]->icount, sgx_prof_pct(v[i]->icount, icount),
+                v[i]->ticks, sgx_prof_pct(v[i]->ticks, ticks));
+    }
+    g_free(v);
+
+    fprintf(flat, "\n# Translation blocks\n"
+            "# %14s %7s %16s %7s %12s %-9s %4s %18s\n",
+            "instructions", "%", "host-ticks", "%", "executions",
+            "mode", "eid", "pc");
+    tbs = sgx_prof_sorted(&all, true);
+    for (i = 0; tbs[i]; i++) {
+        fprintf(flat, "  %14" PRIu64 " %6.2f%% %16" PRIu64 " %6.2f%% %12"
+                PRIu64 " %-9s %4" PRId64 " %#18" PRIx64 "\n",
+                tbs[i]->icount, sgx_prof_pct(tbs[i]->icount, icount),
+                tbs[i]->ticks, sgx_prof_pct(tbs[i]->ticks, ticks),
+                tbs[i]->count, sgx_prof_mode_name[tbs[i]->key.mode],
+                tbs[i]->key.eid, tbs[i]->key.pc);
+
+        sgx_prof_frames(folded, tbs[i]);
+        fprintf(folded, ";0x%" PRIx64 " %" PRIu64 "\n",
+                tbs[i]->key.pc, tbs[i]->icount);
+    }
+    g_free(tbs);
+
+out:
+    if (flat) {
+        fclose(flat);
+    }
+    if (folded) {
+        fclose(folded);
+    }
+    g_free(all.slots);
+    g_free(modes.slots);
+    g_free(calls.slots);
+}
+
+static void cpus_stopped(const TCGPluginInterface *tpi)
+{
+    static bool dumped;
+
+    /* cpu_abort() and gdb_exit() may both get here.  */
+    if (dumped) {
+        return;
+    }
+    dumped = true;
+    sgx_prof_dump();
 }
 
 /* Hook called once all CPUs are stopped/paused.  */
@@ -86,8 +483,6 @@ void tcg_plugin_before_gen_tb(CPUState *env, TranslationBlock *tb)
     	tpi.pre_tb_helper_code = pre_tb_helper_code;
     	tpi.cpus_stopped = cpus_stopped;
 	tpi.nb_cpus = 1;
-
-    	icount_total = g_malloc0(tpi.nb_cpus * sizeof(uint64_t));    	
     	init++;
     }
 
@@ -20,6 +20,13 @@ void tcg_plugin_before_gen_tb(CPUState *env, TranslationBlock *tb);
 void tcg_plugin_after_gen_tb(CPUState *env, TranslationBlock *tb);
 void tcg_plugin_after_gen_opc(uint16_t *opcode, TCGArg *opargs, uint8_t nb_args);
 
+/* SGX profiler context switches, reported by target-i386/sgx_helper.c:
+ * EENTER (resume = false) or ERESUME (resume = true) into enclave EID
+ * through TCS, and EEXIT from the enclave PC, either to serve an OCALL
+ * through the trampoline or to return from the ECALL.  */
+void tcg_plugin_sgx_enter(int64_t eid, uint64_t tcs, bool resume);
+void tcg_plugin_sgx_exit(uint64_t pc, bool ocall);
+
 /***********************************************************************
  * TCG plugin interface.
  */
@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Remote attestation - Quoting Enclave, serving target enclaves until killed
+// (run with OPENSGX_THREADS=<n> to serve n target connections at once)
+
+#include <sgx-lib.h>
+#include <stdio.h>
+
+void enclave_main()
+{
+    int target_port = 8026;
+
+    sgx_remote_attest_quote_service(target_port);
+    puts("Remote Attestation service stopped!");
+
+    sgx_exit(NULL);
+}
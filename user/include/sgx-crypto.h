@@ -30,7 +30,7 @@
 //extern void generate_enclavehash(void *hash, void *entries[], unsigned int codes_size[],
 //                                 int n_of_codes, tcs_t *tcs);
 extern void generate_enclavehash(void *hash, void *code, int code_pages,
-                                 size_t tcs);
+                                 size_t tcs, int ntcs, int heap_max);
 
 //extern void generate_einittoken_mac(einittoken_t *token, uint64_t le_tcs,
 //                                    uint64_t le_aep);
@@ -41,6 +41,9 @@ extern uint8_t get_tls_npages(tcs_t *tcs);
 
 extern void set_tcs_fields(tcs_t *tcs, size_t offset);
 extern void update_tcs_fields(tcs_t *tcs, int tls_page_offset, int ssa_page_offset);
+extern void set_thread_tcs_fields(tcs_t *tcs, tcs_t *tcs0, uint64_t tls_offset);
+extern int enclave_npages(tcs_t *tcs, int code_pages, int ntcs,
+                          int heap_npages);
 
 extern void rsa_key_generate(uint8_t *pubkey, uint8_t *seckey, rsa_context *rsa, int bits);
 
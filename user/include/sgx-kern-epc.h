@@ -22,6 +22,7 @@
 #define SGX_KERNEL
 #include <sgx.h>
 
+// default EPC base, qemu decides (see ENCLS_OSGX_INIT)
 #define EPC_ADDR       0x4fffc000
 
 // linear address is in fact just addr of epc page (physical page)
@@ -35,27 +36,36 @@ typedef enum {
     SECS_PAGE = 0x1,
     TCS_PAGE  = 0x2,
     REG_PAGE  = 0x3,
-    RESERVED  = 0x4
+    RESERVED  = 0x4,
+    VA_PAGE   = 0x5
 } epc_type_t;
 
 typedef struct {
     int key;
     epc_type_t type;
+    int order;          // free block head: its buddy order, -1 otherwise
+    int prev, next;     // free list of that order, or a page list of the key
 } epc_info_t;
 
 
 // exported
-extern void init_epc(int nepc);
+extern void init_epc(uint64_t base, int nepc);
 
 extern epc_t *get_epc(int key, epc_type_t pt);
+extern epc_t *get_epc_run(int key, epc_type_t pt, int npages);
 extern epc_t *get_epc_region_beg(void);
 extern epc_t *get_epc_region_end(void);
 extern epc_t *alloc_epc_pages(int npages, int key);
 extern epc_t *alloc_epc_page(int key);
+extern epc_t *alloc_epc_run(int key, epc_type_t pt, int npages, epc_t *hint);
 extern void free_epc_pages(epc_t *epc);
+extern void for_each_epc(int key, void (*fn)(epc_t *, epc_type_t, void *),
+                         void *arg);
 
 extern void dbg_dump_epc(void);
 
 extern int find_epc_type(void *addr);
+extern int epc_index(void *addr);
+extern int count_used_epc(void);
 
 extern void free_reserved_epc_pages(epc_t *epc);
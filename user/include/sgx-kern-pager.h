@@ -0,0 +1,36 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <sgx-kern-epc.h>
+
+// EPC paging: with OPENSGX_EPC_LIMIT set, at most that much EPC stays
+// resident; cold stack and heap pages are written back with EWB and
+// loaded again with ELDU when the enclave touches them.
+
+// exported
+extern void epc_pager_init(void);
+
+// npages adjacent pages of the enclave secs that may be evicted
+extern void epc_pager_track(epc_t *epc, int npages, epc_t *secs);
+extern void epc_pager_untrack(epc_t *secs);
+
+// make room for npages more resident pages, best effort
+extern void epc_pager_reserve(int npages);
@@ -35,11 +35,23 @@ typedef enum {
 extern bool sys_sgx_init(void);
 extern int sys_create_enclave(void *base, unsigned int code_pages,
                               tcs_t *tcs, sigstruct_t *sig, einittoken_t *token,
-                              int intel_flag);
+                              int intel_flag, int ntcs, int heap_max);
 extern int sys_stat_enclave(int keid, keid_t *stat);
-extern unsigned long get_epc_heap_beg();
-extern unsigned long get_epc_heap_end();
-extern unsigned long sys_add_epc(int keid);
+extern int sys_destroy_enclave(int keid);
+extern unsigned long get_epc_heap_beg(int keid);
+extern unsigned long get_epc_heap_end(int keid);
+extern unsigned long sys_add_epcs(int keid, int min, int max, int *npages);
+
+// ENCLS leaves of the EPC pager (sgx-kern-pager.c)
+extern int EBLOCK(uint64_t epc_addr);
+extern int ETRACK(epc_t *secs);
+extern int EWB(pageinfo_t *pageinfo_addr, epc_t *epc_addr, uint64_t *VA_slot_addr);
+extern void EPA(epc_t *epc);
+extern int ELDU(pageinfo_t *pageinfo, epc_t *epc, uint64_t *va_slot);
+extern int EREMOVE(epc_t *epc);
+extern void encls_pager(epc_swap_t *swap, int nepc, uint64_t *faults);
+extern void encls_epc_age(uint64_t *pages, int n, uint8_t *accessed);
+extern int encls_evict(evict_desc_t *descs, int n);
 
 // For unit test
 void test_ecreate(pageinfo_t *pageinfo, epc_t *epc);
@@ -31,3 +31,19 @@
 extern void execute_code(void);
 extern void sgx_trampoline(void);
 extern int sgx_init(void);
+extern void sgx_bind_tcs(tcs_t *tcs);
+extern tcs_t *sgx_bound_tcs(void);
+
+// Host-side accounting of ocalls, per function code and per path (calls
+// through the stub, or requests drained from the ocall ring)
+#define SGX_STAT_FCODES (FUNC_RING + 1)
+
+typedef struct {
+    uint64_t bytes_out;             // marshalled enclave -> host
+    uint64_t bytes_in;              // marshalled host -> enclave
+    qlat_t lat;                     // stub: trampoline entry .. ERESUME,
+                                    // ring: host time per request
+} ocall_stat_t;
+
+extern const char *fcode_to_str(fcode_t fcode);
+extern const ocall_stat_t *sgx_ocall_stat(fcode_t fcode, bool ring);
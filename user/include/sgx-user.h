@@ -27,6 +27,8 @@ int cur_keid;
 extern void enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
                   out_regs_t* out_regs);
 tcs_t *init_enclave(void *base_addr, unsigned int entry_offset, unsigned int n_of_pages, char *conf);
+tcs_t *init_enclave_mt(void *base_addr, unsigned int entry_offset, unsigned int n_of_pages,
+                       char *conf, int ntcs, tcs_t **tcss);
 
 extern void exception_handler(void);
 
@@ -37,6 +39,8 @@ extern int sgx_host_read(void *buf, int len);
 extern int sgx_host_write(void *buf, int len);
 
 extern void collecting_enclu_stat(void);
+extern int sgx_stat_export(const char *path);
+extern void sgx_stat_init(void);
 
 /* Macros to define user-side enclave calls with different argument
  * numbers */
@@ -26,6 +26,10 @@ extern unsigned char *swap_endian(unsigned char *in, size_t bytes);
 extern void fmt_hash(uint8_t hash[32], char out[65]);
 extern char *fmt_bytes(uint8_t *bytes, int size);
 extern unsigned char *load_measurement(char *conf);
+extern int load_threads(char *conf);
+extern int load_heap(char *conf);
+extern unsigned long long env_size(const char *name);
+extern int env_heap_npages(void);
 extern char *dump_sigstruct(sigstruct_t *s);
 extern char *dbg_dump_sigstruct(sigstruct_t *s);
 extern sigstruct_t *load_sigstruct(char *conf);
@@ -32,7 +32,7 @@
 #include <polarssl/aes_cmac128.h>
 #include <polarssl/dhm.h>
 
-#define OPENSGX_ABI_VERSION 1
+#define OPENSGX_ABI_VERSION 2
 #define SGX_USERLIB
 
 #include <sgx-shared.h>
@@ -46,41 +46,74 @@ int to_npages(int size) {
     return (size - 1) / PAGE_SIZE + 1;
 }
 
-// OS resource management for enclave
-#define MAX_ENCLAVES 16
+// OS resource management for enclave: enclaves alive at once, their
+// keid_t are allocated KEID_CHUNK at a time (mirrors qemu's MAX_ENCLAVES)
+#define MAX_ENCLAVES (1 << 16)
+#define KEID_CHUNK   (64)
+
+// Mirrors stat_t in qemu/target-i386/sgx.h (ENCLS_OSGX_STAT)
+#define SGX_STAT_BUCKETS        (32)
+#define SGX_STAT_ENCLS_LEAVES   (ENCLS_EMODT + 1)
+#define SGX_STAT_ENCLU_LEAVES   (ENCLU_EACCEPTCOPY + 1)
+
+typedef struct {
+    uint64_t n;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[SGX_STAT_BUCKETS];    // hist[i]: [2^(i-1), 2^i) ns
+} qlat_t;
 
 typedef struct {
-    unsigned int mode_switch;
-    unsigned int tlbflush_n;
-
-    unsigned int encls_n;
-    unsigned int ecreate_n;
-    unsigned int eadd_n;
-    unsigned int eextend_n;
-    unsigned int einit_n;
-    unsigned int eaug_n;
-
-    unsigned int enclu_n;
-    unsigned int eenter_n;
-    unsigned int eresume_n;
-    unsigned int eexit_n;
-    unsigned int egetkey_n;
-    unsigned int ereport_n;
-    unsigned int eaccept_n;
+    uint64_t mode_switch;
+    uint64_t tlbflush_n;
+    uint64_t aex_n;
+
+    uint64_t encls_n;
+    uint64_t ecreate_n;
+    uint64_t eadd_n;
+    uint64_t eextend_n;
+    uint64_t einit_n;
+    uint64_t eaug_n;
+
+    uint64_t enclu_n;
+    uint64_t eenter_n;
+    uint64_t eresume_n;
+    uint64_t eexit_n;
+    uint64_t egetkey_n;
+    uint64_t ereport_n;
+    uint64_t eaccept_n;
+    uint64_t keycache_hit_n;             // derived keys served from the cache
+    uint64_t keycache_miss_n;
+
+    uint64_t ewb_n;                      // pages evicted
+    uint64_t eldu_n;                     // pages loaded back, by ELDU or on access
+    uint64_t epc_fault_n;                // enclave accesses that loaded a page
+    uint64_t epc_retry_n;                // accesses retried on a page in flight
+    uint64_t epc_readahead_n;            // pages loaded ahead of a fault
+
+    qlat_t encls_lat[SGX_STAT_ENCLS_LEAVES];
+    qlat_t enclu_lat[SGX_STAT_ENCLU_LEAVES];
 } qstat_t;
 
 typedef struct {
     int keid;
     uint64_t enclave;
     tcs_t *tcs;
+    int ntcs;
+    tcs_t *tcss[SGX_MAX_TCS];   // tcss[0] == tcs
     epc_t *secs;
     // XXX. stats
-    unsigned int kin_n;
-    unsigned int kout_n;
+    uint64_t kin_n;
+    uint64_t kout_n;
     unsigned long prealloc_ssa;
     unsigned long prealloc_stack;
     unsigned long prealloc_heap;
     unsigned long augged_heap;
+    epc_t *aug_next;            // one past the last EAUG'd run
+    epc_t *elrange_end;         // one past the enclave's ELRANGE
+    epc_t *heap_beg;            // preallocated heap, its first page
+    epc_t *heap_end;            // and its last byte
+    epc_t *stack_end;           // main thread's stack, its last page
 
     qstat_t qstat;
 } keid_t;
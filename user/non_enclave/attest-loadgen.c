@@ -0,0 +1,246 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Load generator for the remote attestation services: stands in for the
+// challenger, keeps several connections to a target service
+// (test/remote-attest-target-service) with a number of nonces in flight on
+// each, verifies every quote as sgx_remote_attest_challenger() does and
+// reports attestations/sec.
+//
+//   $ ./attest-loadgen [-c conns] [-d depth] [-t seconds] [-p port] [ip]
+
+#include <nonEncLib.h>
+#include <sgx-shared.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <err.h>
+
+#include <polarssl/rsa.h>
+
+#define LOADGEN_MAX_DEPTH 64
+
+static const char *target_ip = "127.0.0.1";
+static int target_port = 8025;
+static int nr_conns = 4;
+static int depth = 8;
+static int seconds = 10;
+
+static volatile int stop;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    uint64_t done;
+    uint64_t failed;
+    uint64_t lat_ns;
+} loadgen_t;
+
+static
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+int connect_target(void)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(target_port);
+    addr.sin_addr.s_addr = inet_addr(target_ip);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static
+int xfer_full(int fd, void *buf, size_t len, bool out)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if (out)
+            n = write(fd, (char *)buf + done, len - done);
+        else
+            n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Same checks as sgx_remote_attest_challenger(), plus the nonce binding
+static
+int verify(unsigned char *resp, unsigned char *nonce)
+{
+    report_t quote;
+    rsa_context rsa;
+    unsigned char hash[32], sign[32];
+    int ret;
+
+    memcpy(&quote, resp + 2 * SGX_ATTEST_MPI, sizeof(report_t));
+    if (memcmp(quote.reportData, nonce, SGX_ATTEST_NONCE) != 0)
+        return -1;
+
+    rsa_init(&rsa, RSA_PKCS_V15, 0);
+    mpi_read_binary(&rsa.N, resp, SGX_ATTEST_MPI);
+    mpi_read_binary(&rsa.E, resp + SGX_ATTEST_MPI, SGX_ATTEST_MPI);
+    rsa.len = (mpi_msb(&rsa.N) + 7) >> 3;
+
+    memset(hash, 0, sizeof(hash));
+    memcpy(sign, &quote.mac, 16);
+    ret = rsa_pkcs1_verify(&rsa, NULL, NULL, RSA_PUBLIC,
+                           POLARSSL_MD_NONE, 0, hash, sign);
+    rsa_free(&rsa);
+    return ret ? -1 : 0;
+}
+
+static
+void *loadgen_main(void *arg)
+{
+    loadgen_t *lg = arg;
+    unsigned char nonces[LOADGEN_MAX_DEPTH][SGX_ATTEST_NONCE];
+    uint64_t sent[LOADGEN_MAX_DEPTH];
+    unsigned char resp[SGX_ATTEST_RESP];
+    uint64_t seq = 0;
+    int fd, i, head = 0, inflight = 0;
+
+    fd = connect_target();
+    if (fd < 0) {
+        warn("connect to %s:%d", target_ip, target_port);
+        return NULL;
+    }
+
+    while (!stop || inflight) {
+        // keep depth nonces outstanding, sent as one write
+        int n = stop ? 0 : depth - inflight;
+        for (i = 0; i < n; i++) {
+            int slot = (head + inflight + i) % depth;
+            memset(nonces[slot], 0, SGX_ATTEST_NONCE);
+            snprintf((char *)nonces[slot], SGX_ATTEST_NONCE,
+                     "loadgen %d %" PRIu64, lg->id, seq++);
+            sent[slot] = now_ns();
+        }
+        if (n > 0) {
+            int first = (head + inflight) % depth;
+            int run = (first + n <= depth) ? n : depth - first;
+            if (xfer_full(fd, nonces[first], run * SGX_ATTEST_NONCE, true) < 0
+                || xfer_full(fd, nonces[0], (n - run) * SGX_ATTEST_NONCE, true) < 0)
+                break;
+            inflight += n;
+        }
+
+        // responses come back in order
+        if (xfer_full(fd, resp, SGX_ATTEST_RESP, false) < 0)
+            break;
+        if (verify(resp, nonces[head]) < 0)
+            lg->failed++;
+        else
+            lg->done++;
+        lg->lat_ns += now_ns() - sent[head];
+        head = (head + 1) % depth;
+        inflight--;
+    }
+
+    if (inflight && !stop)
+        warnx("connection %d closed with %d attestations in flight",
+              lg->id, inflight);
+    close(fd);
+    return NULL;
+}
+
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-d depth] [-t seconds] [-p port] [ip]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    loadgen_t *lgs;
+    uint64_t start, elapsed, done = 0, failed = 0, lat_ns = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "c:d:t:p:")) != -1) {
+        switch (opt) {
+        case 'c': nr_conns = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'p': target_port = atoi(optarg); break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        target_ip = argv[optind];
+    if (nr_conns < 1 || depth < 1 || depth > LOADGEN_MAX_DEPTH || seconds < 1)
+        usage(argv[0]);
+
+    lgs = calloc(nr_conns, sizeof(loadgen_t));
+    if (!lgs)
+        err(1, "calloc");
+
+    start = now_ns();
+    for (i = 0; i < nr_conns; i++) {
+        lgs[i].id = i;
+        if (pthread_create(&lgs[i].thread, NULL, loadgen_main, &lgs[i]) != 0)
+            err(1, "pthread_create");
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+    for (i = 0; i < nr_conns; i++) {
+        pthread_join(lgs[i].thread, NULL);
+        done += lgs[i].done;
+        failed += lgs[i].failed;
+        lat_ns += lgs[i].lat_ns;
+    }
+    elapsed = now_ns() - start;
+
+    printf("%d connections x depth %d: %" PRIu64 " attestations (%" PRIu64
+           " failed) in %.2f s\n", nr_conns, depth, done, failed, elapsed / 1e9);
+    printf("throughput: %.1f attestations/sec, mean latency: %.2f ms\n",
+           done / (elapsed / 1e9),
+           (done + failed) ? lat_ns / 1e6 / (done + failed) : 0.0);
+
+    free(lgs);
+    return failed ? 1 : 0;
+}
@@ -27,175 +27,77 @@
 #include <sgx-utils.h>
 #include <sgx-crypto.h>
 
-#ifndef GET_UINT32_BE
-#define GET_UINT32_BE(n,b,i)                            \
-{                                                       \
-   (n) = ( (uint32_t) (b)[(i)    ] << 24 )              \
-       | ( (uint32_t) (b)[(i) + 1] << 16 )              \
-       | ( (uint32_t) (b)[(i) + 2] <<  8 )              \
-       | ( (uint32_t) (b)[(i) + 3]       );             \
-}
-#endif
-
-#ifndef PUT_UINT32_BE
-#define PUT_UINT32_BE(n,b,i)                            \
-{                                                       \
-    (b)[(i)    ] = (unsigned char) ( (n) >> 24 );       \
-    (b)[(i) + 1] = (unsigned char) ( (n) >> 16 );       \
-    (b)[(i) + 2] = (unsigned char) ( (n) >>  8 );       \
-    (b)[(i) + 3] = (unsigned char) ( (n)       );       \
-}
-#endif
-
-static uint64_t g_update_counter;
+// Offline MRENCLAVE, computed the way ECREATE/EADD/EEXTEND/EINIT do it
+// in qemu. The SHA-256 state stays in native form for the whole build and
+// 64-byte blocks are hashed straight out of the pages.
+typedef struct {
+    sha256_context ctx;
+    uint64_t counter;                   // SECS.MRENCLAVEUPDATECOUNTER
+} measure_t;
 
 static
-void sha256init(unsigned char *hash)
+void measure_init(measure_t *m)
 {
-    sha256_context ctx;
-
-    sha256_init(&ctx);
-    sha256_starts(&ctx, 0);
-
-    PUT_UINT32_BE(ctx.state[0], hash,  0);
-    PUT_UINT32_BE(ctx.state[1], hash,  4);
-    PUT_UINT32_BE(ctx.state[2], hash,  8);
-    PUT_UINT32_BE(ctx.state[3], hash, 12);
-    PUT_UINT32_BE(ctx.state[4], hash, 16);
-    PUT_UINT32_BE(ctx.state[5], hash, 20);
-    PUT_UINT32_BE(ctx.state[6], hash, 24);
-    PUT_UINT32_BE(ctx.state[7], hash, 28);
+    sha256_init(&m->ctx);
+    sha256_starts(&m->ctx, 0);
+    m->counter = 0;
 }
 
 static
-void sha256update(unsigned char *input, unsigned char *hash)
+void measure_blocks(measure_t *m, const void *blocks, int nblocks)
 {
-    sha256_context ctx;
+    const unsigned char *p = blocks;
 
-    sha256_init(&ctx);
-    GET_UINT32_BE(ctx.state[0], hash,  0);
-    GET_UINT32_BE(ctx.state[1], hash,  4);
-    GET_UINT32_BE(ctx.state[2], hash,  8);
-    GET_UINT32_BE(ctx.state[3], hash, 12);
-    GET_UINT32_BE(ctx.state[4], hash, 16);
-    GET_UINT32_BE(ctx.state[5], hash, 20);
-    GET_UINT32_BE(ctx.state[6], hash, 24);
-    GET_UINT32_BE(ctx.state[7], hash, 28);
-
-    sha256_process(&ctx, input);
-
-    PUT_UINT32_BE(ctx.state[0], hash,  0);
-    PUT_UINT32_BE(ctx.state[1], hash,  4);
-    PUT_UINT32_BE(ctx.state[2], hash,  8);
-    PUT_UINT32_BE(ctx.state[3], hash, 12);
-    PUT_UINT32_BE(ctx.state[4], hash, 16);
-    PUT_UINT32_BE(ctx.state[5], hash, 20);
-    PUT_UINT32_BE(ctx.state[6], hash, 24);
-    PUT_UINT32_BE(ctx.state[7], hash, 28);
-
-    sha256_free(&ctx);
+    for (int i = 0; i < nblocks; i++)
+        sha256_process(&m->ctx, p + i * 64);
+    m->counter += nblocks;
 }
 
+// EINIT pads with a message length of counter * 512 bytes (sic), which
+// only keeps the low 32 bits
 static
-void sha256final(unsigned char *hash, size_t len)
+void measure_final(measure_t *m, unsigned char *hash)
 {
-    sha256_context ctx;
-
-    sha256_init(&ctx);
-    ctx.total[0] = (uint32_t)len;
-    ctx.total[0] &= 0xFFFFFFFF;
-
-    if (ctx.total[0] < (uint32_t)len)
-        ctx.total[1]++;
-
-    GET_UINT32_BE(ctx.state[0], hash,  0);
-    GET_UINT32_BE(ctx.state[1], hash,  4);
-    GET_UINT32_BE(ctx.state[2], hash,  8);
-    GET_UINT32_BE(ctx.state[3], hash, 12);
-    GET_UINT32_BE(ctx.state[4], hash, 16);
-    GET_UINT32_BE(ctx.state[5], hash, 20);
-    GET_UINT32_BE(ctx.state[6], hash, 24);
-    GET_UINT32_BE(ctx.state[7], hash, 28);
-    memset(hash, 0, 32);
-    sha256_finish(&ctx, hash);
-
-    sha256_free(&ctx);
+    m->ctx.total[0] = (uint32_t)(m->counter * 512);
+    m->ctx.total[1] = 0;
+    sha256_finish(&m->ctx, hash);
+    sha256_free(&m->ctx);
 }
 
 static
-void measure_chunk_page(void *measurement, void *page, uint64_t chunk_offset)
+void measure_chunk_page(measure_t *m, const unsigned char *chunk,
+                        uint64_t chunk_offset)
 {
     uint64_t tmp_update_field[8];
 
     tmp_update_field[0] = STRING_EEXTEND;
     tmp_update_field[1] = chunk_offset;
     memset(&tmp_update_field[2], 0, 48);
-    sha256update((unsigned char *)tmp_update_field, measurement);
-    g_update_counter++;
-
-#if 0
-    {
-        char hash[64+1];
-        fmt_hash(measurement, hash);
-        sgx_dbg(info, "pre-measurement extend: %.20s.., counter: %ld", hash,
-                                                                g_update_counter);
-    }
-#endif
-
-    unsigned char *cast_page = (unsigned char *)page;
-    sha256update((unsigned char *)(&cast_page[0]),   measurement);
-    sha256update((unsigned char *)(&cast_page[64]),  measurement);
-    sha256update((unsigned char *)(&cast_page[128]), measurement);
-    sha256update((unsigned char *)(&cast_page[192]), measurement);
-    g_update_counter += 4;
-
-#if 0
-    {
-        char hash[64+1];
-        fmt_hash(measurement, hash);
-        sgx_dbg(info, "pre-measurement extend: %.20s.., counter: %ld", hash,
-                                                                g_update_counter);
-    }
-#endif
-
+    measure_blocks(m, tmp_update_field, 1);
+    measure_blocks(m, chunk, MEASUREMENT_SIZE / 64);
 }
 
 static
-void measure_page_add(void *measurement, void *page, secinfo_t *secinfo,
+void measure_page_add(measure_t *m, const void *page, secinfo_t *secinfo,
                       uint64_t page_offset)
 {
     uint64_t tmp_update_field[8];
-    int i;
-
-#if 0
-    hexdump(stderr, page, 32);
-#endif
+    const unsigned char *cast_page = page;
 
     tmp_update_field[0] = STRING_EADD;
     tmp_update_field[1] = page_offset;
     memcpy(&tmp_update_field[2], secinfo, 48);
-    sha256update((unsigned char *)tmp_update_field, measurement);
-    g_update_counter++;
-
-#if 0
-    {
-        char hash[64+1];
-        fmt_hash(measurement, hash);
-        sgx_dbg(info, "pre-measurement add: %.20s.., counter: %ld", hash,
-                                                                g_update_counter);
-    }
-#endif
+    measure_blocks(m, tmp_update_field, 1);
 
-    unsigned char *cast_page = (unsigned char *)page;
-    for (i = 0; i < PAGE_SIZE/MEASUREMENT_SIZE; i++) {
+    for (int i = 0; i < PAGE_SIZE/MEASUREMENT_SIZE; i++) {
         uint64_t chunk_offset = i * MEASUREMENT_SIZE;
-        measure_chunk_page(measurement, &cast_page[chunk_offset],
+        measure_chunk_page(m, &cast_page[chunk_offset],
                            page_offset + chunk_offset);
     }
 }
 
 static
-void measure_enclave_create(void *measurement, uint32_t ssa_frame_size,
+void measure_enclave_create(measure_t *m, uint32_t ssa_frame_size,
                             uint64_t enclave_size)
 {
     uint8_t tmp_update_field[64];
@@ -206,17 +108,7 @@ void measure_enclave_create(void *measurement, uint32_t ssa_frame_size,
     memcpy(&tmp_update_field[8], &ssa_frame_size, 4);
     memcpy(&tmp_update_field[12], &enclave_size, 8);
     memset(&tmp_update_field[20], 0, 44);
-    sha256update((unsigned char *)tmp_update_field, measurement);
-    g_update_counter++;
-
-#if 0
-    {
-        char hash[64+1];
-        fmt_hash(measurement, hash);
-        sgx_dbg(info, "pre-measurement create: %.20s.., counter: %ld", hash,
-                                                                       g_update_counter);
-    }
-#endif
+    measure_blocks(m, tmp_update_field, 1);
 }
 
 uint8_t get_tls_npages(tcs_t *tcs) {
@@ -273,24 +165,66 @@ void update_tcs_fields(tcs_t *tcs, int tls_page_offset, int ssa_page_offset)
     tcs->ossa = ssa_offset;
 }
 
+// TCS of thread #tid >= 1: a copy of the main TCS whose TLS starts at
+// tls_offset, followed by its SSA (the stack follows the SSA, see
+// sgx-entry.S)
+void set_thread_tcs_fields(tcs_t *tcs, tcs_t *tcs0, uint64_t tls_offset)
+{
+    memcpy(tcs, tcs0, sizeof(tcs_t));
+    tcs->ofsbasgx = tls_offset;
+    tcs->ogsbasgx = tcs->ofsbasgx + tcs->fslimit + 1;
+    tcs->ossa     = tls_offset + get_tls_npages(tcs) * PAGE_SIZE;
+}
+
+// SECS.SIZE in pages of an enclave with ntcs threads and heap_npages of
+// heap (HEAP_PAGE_FRAMES of them added, the rest left to EAUG), laid out
+// as sys_create_enclave() does:
+//   [SECS][TCS][TLS][CODE][SSA][STACK]
+//   ([TCS][TLS][SSA][STACK]) * (ntcs - 1) [HEAP]
+int enclave_npages(tcs_t *tcs, int code_pages, int ntcs, int heap_npages)
+{
+    int thread_npages = 1 + get_tls_npages(tcs) + tcs->nssa
+                        + STACK_PAGE_FRAMES_PER_THREAD;
+
+    return rop2(1 + code_pages + ntcs * thread_npages + heap_npages);
+}
+
+// MRENCLAVE of the binary code run on ntcs TCSes, with ELRANGE room for
+// heap_max heap pages
 void generate_enclavehash(void *hash, void *code, int code_pages,
-                          size_t entry_offset)
+                          size_t entry_offset, int ntcs, int heap_max)
 {
     tcs_t *tmp_tcs;
+    tcs_t *thread_tcs;
     secinfo_t tmp_secinfo;
-    epc_t current_page;
+    secinfo_t tcs_secinfo;
+    epc_t *empty;
+    epc_t *gs_page;
+    measure_t m;
     uint32_t ssa_frame_size;
     uint64_t enclave_size;
     uint64_t page_offset = 0;
-    void *page;
 
     // Pre-compute tcs.
-    tmp_tcs = (tcs_t *)memalign(PAGE_SIZE, sizeof(tcs_t));
+    tmp_tcs = (tcs_t *)memalign(PAGE_SIZE, PAGE_SIZE);
     if (!tmp_tcs)
         err(1, "failed to allocate tcs");
-    memset(tmp_tcs, 0, sizeof(tcs_t));
+    memset(tmp_tcs, 0, PAGE_SIZE);
     set_tcs_fields(tmp_tcs, entry_offset);
 
+    thread_tcs = (tcs_t *)memalign(PAGE_SIZE, PAGE_SIZE);
+    gs_page = (epc_t *)memalign(PAGE_SIZE, PAGE_SIZE);
+    if (!thread_tcs || !gs_page)
+        err(1, "failed to allocate tcs");
+
+    // Content of the TLS/SSA/stack/heap pages: starts with the address of
+    // empty_page (which is NULL outside the kernel)
+    empty = (epc_t *)memalign(PAGE_SIZE, PAGE_SIZE);
+    if (!empty)
+        err(1, "failed to allocate page");
+    memset(empty, 0, PAGE_SIZE);
+    memcpy(empty, &empty_page, sizeof(uintptr_t));
+
     int sec_npages = 1;
     int tcs_npages = 1;
     int tls_npages = get_tls_npages(tmp_tcs);
@@ -298,23 +232,18 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     int stack_npages = STACK_PAGE_FRAMES_PER_THREAD;
     int heap_npages = HEAP_PAGE_FRAMES;
 
-    int npages = sec_npages + tcs_npages + tls_npages + code_pages +
-                 ssa_npages + stack_npages + heap_npages;
-
     // Initialize hash value.
-    memset(hash, 0, 32);
-    sha256init(hash);
-    g_update_counter = 0;
+    measure_init(&m);
 
     // Pre-compute ssa frame and enclave size.
     ssa_frame_size = 1;
 
     // Set enclave_size
-    npages = rop2(npages);
-    enclave_size = PAGE_SIZE * npages;
+    enclave_size = PAGE_SIZE * enclave_npages(tmp_tcs, code_pages, ntcs,
+                                              heap_max);
 
     // Update measurement for ECREATE.
-    measure_enclave_create(hash, ssa_frame_size, enclave_size);
+    measure_enclave_create(&m, ssa_frame_size, enclave_size);
     page_offset += PAGE_SIZE;
 
     // tcs update.
@@ -324,21 +253,16 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
 
     // Initialize secinfo.
     memset(&tmp_secinfo, 0, sizeof(tmp_secinfo));
-    tmp_secinfo.flags.pending = 0;
-    tmp_secinfo.flags.modified = 0;
-    tmp_secinfo.flags.reserved1 = 0;
-    memset(tmp_secinfo.flags.reserved2, 0, sizeof(tmp_secinfo.flags.reserved2));
-    memset(tmp_secinfo.reserved, 0, sizeof(tmp_secinfo.reserved));
 
     // TCS page setting.
     tmp_secinfo.flags.r = 0;
     tmp_secinfo.flags.w = 0;
     tmp_secinfo.flags.x = 0;
     tmp_secinfo.flags.page_type = PT_TCS;
+    tcs_secinfo = tmp_secinfo;
 
     // Update measurement for EADD.
-    memcpy(&current_page, tmp_tcs, PAGE_SIZE);
-    measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+    measure_page_add(&m, tmp_tcs, &tmp_secinfo, page_offset);
     page_offset += PAGE_SIZE;
 
     // REG page setting.
@@ -348,54 +272,53 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     tmp_secinfo.flags.page_type = PT_REG;
 
     // Measure tls pages.
-    page = (void *)empty_page;
     for (int i = 0; i < tls_npages; i++) {
-        memset(&current_page, 0, PAGE_SIZE);
-        memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&m, empty, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
-    // Measure code pages.
-    page = (void *)code;
+    // Measure code pages, straight from the loaded binary.
     for (int i = 0; i < code_pages; i++) {
-        memset(&current_page, 0, PAGE_SIZE);
-        memcpy(&current_page, page, PAGE_SIZE);
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
-        page = (void *)((uintptr_t)page + PAGE_SIZE);
+        measure_page_add(&m, (char *)code + i * PAGE_SIZE, &tmp_secinfo,
+                         page_offset);
         page_offset += PAGE_SIZE;
     }
 
-    // Measrue ssa pages.
-    page = (void *)empty_page;
-    for (int i = 0; i < ssa_npages; i++) {
-        memset(&current_page, 0, PAGE_SIZE);
-        memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+    // Measure ssa and stack pages.
+    for (int i = 0; i < ssa_npages + stack_npages; i++) {
+        measure_page_add(&m, empty, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
-    // Measure stack pages.
-    page = (void *)empty_page;
-    for (int i = 0; i < stack_npages; i++) {
-        memset(&current_page, 0, PAGE_SIZE);
-        memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+    // Measure the TCS, TLS, SSA and stack pages of the other threads. The
+    // first word of a thread's GS page (its last TLS page) is its tid.
+    for (int tid = 1; tid < ntcs; tid++) {
+        set_thread_tcs_fields(thread_tcs, tmp_tcs, page_offset + PAGE_SIZE);
+        measure_page_add(&m, thread_tcs, &tcs_secinfo, page_offset);
         page_offset += PAGE_SIZE;
+
+        memset(gs_page, 0, PAGE_SIZE);
+        *(uint32_t *)gs_page = tid;
+        for (int i = 0; i < tls_npages + ssa_npages + stack_npages; i++) {
+            measure_page_add(&m, i == tls_npages - 1 ? gs_page : empty,
+                             &tmp_secinfo, page_offset);
+            page_offset += PAGE_SIZE;
+        }
     }
 
     // Measure heap pages.
-    page = (void *)empty_page;
     for (int i = 0; i < heap_npages; i++) {
-        memset(&current_page, 0, PAGE_SIZE);
-        memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&m, empty, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
     // Finalize hash
-    g_update_counter = g_update_counter * 512;
-    sha256final(hash, g_update_counter);
+    measure_final(&m, hash);
+
+    free(tmp_tcs);
+    free(thread_tcs);
+    free(gs_page);
+    free(empty);
 }
 
 #if 0
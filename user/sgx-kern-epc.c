@@ -30,64 +30,293 @@
 #include <sgx-kern-epc.h>
 
 //
-// NOTE.
-//   bitmap can contain more useful info (e.g., eid, contiguous region &c)
+// EPC allocator
+//   - free pages form a buddy system: a free block of 2^order pages is
+//     headed by its first page (info.order = order) and linked into
+//     g_free[order]; every other page has order -1
+//   - owned pages are linked per key (enclave): the RESERVED ones in
+//     allocation order, so that get_epc() hands them out front to back,
+//     and the others. Both lists reuse the prev/next of epc_info_t.
+//   - allocation, lookup and teardown are O(log EPC + pages touched)
 //
+#define EPC_MAX_ORDER 31
+
+typedef struct {
+    int reserved;       // head of RESERVED pages, in allocation order
+    int used;           // head of the others
+} epc_owner_t;
+
 static epc_t *g_epc;
 static epc_info_t *g_epc_info;
 static int g_num_epc;
+static int g_num_used;  // pages neither FREE_PAGE nor RESERVED
 
-void init_epc(int nepc) {
-    g_num_epc = nepc;
+static int g_free[EPC_MAX_ORDER];
+static int g_max_order;
+
+static epc_owner_t *g_owner;
+static int g_num_owner;
+
+// circular doubly linked lists of page indexes, -1 is empty
+static
+void list_add_tail(int *head, int idx)
+{
+    epc_info_t *e = &g_epc_info[idx];
 
-    //toward making g_num_epc configurable
-    //g_epc = memalign(PAGE_SIZE, g_num_epc * sizeof(epc_t));
+    if (*head == -1) {
+        e->prev = e->next = idx;
+        *head = idx;
+        return;
+    }
+
+    int tail = g_epc_info[*head].prev;
+    e->prev = tail;
+    e->next = *head;
+    g_epc_info[tail].next = idx;
+    g_epc_info[*head].prev = idx;
+}
 
-    g_epc = (epc_t *)mmap((void *)EPC_ADDR, g_num_epc * sizeof(epc_t),
+static
+void list_del(int *head, int idx)
+{
+    epc_info_t *e = &g_epc_info[idx];
+
+    if (e->next == idx) {
+        *head = -1;
+    } else {
+        g_epc_info[e->prev].next = e->next;
+        g_epc_info[e->next].prev = e->prev;
+        if (*head == idx)
+            *head = e->next;
+    }
+    e->prev = e->next = -1;
+}
+
+static
+epc_owner_t *get_owner(int key)
+{
+    assert(key >= 0);
+
+    if (key >= g_num_owner) {
+        int n = g_num_owner ? g_num_owner : KEID_CHUNK;
+        while (n <= key)
+            n *= 2;
+
+        g_owner = realloc(g_owner, n * sizeof(epc_owner_t));
+        if (!g_owner)
+            err(1, "failed to allocate EPC owners");
+        for (int i = g_num_owner; i < n; i++) {
+            g_owner[i].reserved = -1;
+            g_owner[i].used = -1;
+        }
+        g_num_owner = n;
+    }
+    return &g_owner[key];
+}
+
+static
+void free_block_insert(int idx, int order)
+{
+    g_epc_info[idx].order = order;
+    list_add_tail(&g_free[order], idx);
+}
+
+static
+void free_block_remove(int idx)
+{
+    list_del(&g_free[g_epc_info[idx].order], idx);
+    g_epc_info[idx].order = -1;
+}
+
+// free [beg, end) as the largest aligned blocks that fit
+static
+void free_range(int beg, int end)
+{
+    while (beg < end) {
+        int order = 0;
+        while (order < g_max_order
+               && (beg & ((2 << order) - 1)) == 0
+               && beg + (2 << order) <= end)
+            order++;
+        free_block_insert(beg, order);
+        beg += 1 << order;
+    }
+}
+
+// give page idx back and merge it with its free buddies
+static
+void put_epc_index(int idx)
+{
+    assert(0 <= idx && idx < g_num_epc);
+
+    int order = 0;
+
+    if (g_epc_info[idx].type != RESERVED)
+        g_num_used--;
+    g_epc_info[idx].key = 0;
+    g_epc_info[idx].type = FREE_PAGE;
+
+    while (order < g_max_order) {
+        int buddy = idx ^ (1 << order);
+        if (buddy + (1 << order) > g_num_epc
+            || g_epc_info[buddy].order != order)
+            break;
+        free_block_remove(buddy);
+        idx &= ~(1 << order);
+        order++;
+    }
+    free_block_insert(idx, order);
+}
+
+// smallest order with 2^order >= npages
+static
+int pages_to_order(int npages)
+{
+    int order = 0;
+    while ((1 << order) < npages)
+        order++;
+    return order;
+}
+
+// take npages pages in a row off the free lists, -1 if there is no block
+// large enough; the tail of the block beyond npages goes back
+static
+int buddy_alloc(int npages)
+{
+    int want = pages_to_order(npages);
+    int order = want;
+
+    if (want > g_max_order)
+        return -1;
+    while (order <= g_max_order && g_free[order] == -1)
+        order++;
+    if (order > g_max_order)
+        return -1;
+
+    int idx = g_free[order];
+    free_block_remove(idx);
+
+    // split, the upper halves stay free
+    while (order > want) {
+        order--;
+        free_block_insert(idx + (1 << order), order);
+    }
+    free_range(idx + npages, idx + (1 << want));
+    return idx;
+}
+
+// take exactly [beg, beg + npages) off the free lists, if it is all free
+static
+bool buddy_take(int beg, int npages)
+{
+    int end = beg + npages;
+
+    if (beg < 0 || npages <= 0 || end > g_num_epc)
+        return false;
+    for (int i = beg; i < end; i++) {
+        if (g_epc_info[i].type != FREE_PAGE)
+            return false;
+    }
+
+    for (int i = beg; i < end; ) {
+        // the free block that holds page i
+        int order = 0, head = i;
+        while (g_epc_info[head].order != order) {
+            order++;
+            assert(order <= g_max_order);
+            head = i & ~((1 << order) - 1);
+        }
+        int block_end = head + (1 << order);
+
+        free_block_remove(head);
+        free_range(head, beg > head ? beg : head);
+        if (block_end > end)
+            free_range(end, block_end);
+        i = block_end;
+    }
+    return true;
+}
+
+// hand [beg, beg + npages) to key as type pt
+static
+void assign_pages(int beg, int npages, int key, epc_type_t pt)
+{
+    epc_owner_t *owner = get_owner(key);
+
+    for (int i = beg; i < beg + npages; i++) {
+        g_epc_info[i].key = key;
+        g_epc_info[i].type = pt;
+        list_add_tail(pt == RESERVED ? &owner->reserved : &owner->used, i);
+    }
+    if (pt != RESERVED)
+        g_num_used += npages;
+}
+
+// EPC of nepc pages at base. The backing is reserved lazily: untouched EPC
+// costs no memory, so a multi-GB EPC is fine as long as enclaves do not
+// fill it.
+void init_epc(uint64_t base, int nepc) {
+    g_num_epc = nepc;
+
+    g_epc = (epc_t *)mmap((void *)base, (size_t)g_num_epc * sizeof(epc_t),
                           PROT_READ|PROT_WRITE,
-                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
     if(g_epc == MAP_FAILED) {
         perror("EPC ALLOC FAIL");
         exit(EXIT_FAILURE);
     }
+    if ((uint64_t)g_epc != base)
+        sgx_dbg(warn, "EPC is at %p instead of 0x%" PRIx64, (void *)g_epc, base);
 
 
-    sgx_dbg(kern, "g_epc: %p", (void *)g_epc);
-
+    sgx_dbg(kern, "g_epc: %p (%d pages)", (void *)g_epc, g_num_epc);
 
-    if (!g_epc)
-        err(1, "failed to allocate EPC");
 
-    g_epc_info = malloc(g_num_epc * sizeof(epc_info_t));
+    g_epc_info = malloc((size_t)g_num_epc * sizeof(epc_info_t));
     if (!g_epc_info)
         err(1, "failed to allocate EPC map in kernel");
 
-    memset(g_epc, 0, g_num_epc * sizeof(epc_t));
-    memset(g_epc_info, 0, g_num_epc * sizeof(epc_info_t));
-}
+    memset(g_epc_info, 0, (size_t)g_num_epc * sizeof(epc_info_t));
 
-static
-int get_epc_index(int key, epc_type_t pt)
-{
-    static int last = 0;
+    g_max_order = 0;
+    while (g_max_order + 1 < EPC_MAX_ORDER && (2 << g_max_order) <= g_num_epc)
+        g_max_order++;
+    for (int i = 0; i < EPC_MAX_ORDER; i++)
+        g_free[i] = -1;
     for (int i = 0; i < g_num_epc; i++) {
-        int idx = (i + last) % g_num_epc;
-        if (g_epc_info[idx].key == key
-            && g_epc_info[idx].type == RESERVED) {
-            g_epc_info[idx].type = pt;
-            return idx;
-        }
+        g_epc_info[i].order = -1;
+        g_epc_info[i].prev = g_epc_info[i].next = -1;
     }
-    return -1;
+    free_range(0, g_num_epc);
+}
+
+// index of the EPC page at addr, -1 if addr is not one
+int epc_index(void *addr)
+{
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)&g_epc[0];
+
+    if ((uintptr_t)addr < (uintptr_t)&g_epc[0]
+        || off >= (uintptr_t)g_num_epc * sizeof(epc_t)
+        || off % sizeof(epc_t))
+        return -1;
+    return off / sizeof(epc_t);
 }
 
+// next RESERVED page of key, now of type pt
 static
-void put_epc_index(int index)
+int get_epc_index(int key, epc_type_t pt)
 {
-    assert(0 <= index && index < g_num_epc);
-    assert(g_epc_info[index].type != FREE_PAGE);
+    epc_owner_t *owner = get_owner(key);
+    int idx = owner->reserved;
+
+    if (idx == -1)
+        return -1;
 
-    g_epc_info[index].type = FREE_PAGE;
+    list_del(&owner->reserved, idx);
+    g_epc_info[idx].type = pt;
+    list_add_tail(&owner->used, idx);
+    g_num_used++;
+    return idx;
 }
 
 epc_t *get_epc(int key, epc_type_t pt)
@@ -98,6 +327,27 @@ epc_t *get_epc(int key, epc_type_t pt)
     return NULL;
 }
 
+// the next npages RESERVED pages of key, now of type pt; NULL unless that
+// many are left. They are adjacent: one block, handed out front to back.
+epc_t *get_epc_run(int key, epc_type_t pt, int npages)
+{
+    epc_owner_t *owner = get_owner(key);
+    int beg = owner->reserved;
+
+    if (npages <= 0 || beg == -1 || beg + npages > g_num_epc)
+        return NULL;
+    for (int i = beg; i < beg + npages; i++) {
+        if (g_epc_info[i].type != RESERVED || g_epc_info[i].key != key)
+            return NULL;
+    }
+
+    for (int i = 0; i < npages; i++) {
+        int idx = get_epc_index(key, pt);
+        assert(idx == beg + i);
+    }
+    return &g_epc[beg];
+}
+
 epc_t *get_epc_region_beg(void)
 {
     return &g_epc[0];
@@ -117,6 +367,7 @@ const char *epc_bitmap_to_str(epc_type_t type)
         case TCS_PAGE : return "TCS ";
         case REG_PAGE : return "REG ";
         case RESERVED : return "RERV";
+        case VA_PAGE  : return "VA  ";
         default:
         {
             sgx_dbg(err, "unknown epc page type (%d)", type);
@@ -129,67 +380,40 @@ void dbg_dump_epc(void)
 {
     for (int i = 0; i < g_num_epc; i++) {
         fprintf(stderr, "[%02d] %p (%02d/%s)\n",
-                i, g_epc[i],
+                i, (void *)&g_epc[i],
                 g_epc_info[i].key,
                 epc_bitmap_to_str(g_epc_info[i].type));
     }
     fprintf(stderr, "\n");
 }
 
-// XXX. convert addr to index like free_epc_pages
-int find_epc_type(void *addr)
+// pages handed out, the RESERVED ones aside; the EPC pager reads it from
+// its own thread
+int count_used_epc(void)
 {
-    for (int i = 0; i < g_num_epc; i++) {
-        if (addr == &g_epc[i])
-            return g_epc_info[i].type;
-    }
-
-    return -1;
+    return __atomic_load_n(&g_num_used, __ATOMIC_RELAXED);
 }
 
-static
-int reserve_epc_index(int key)
+int find_epc_type(void *addr)
 {
-    static int last = 0;
-    for (int i = 0; i < g_num_epc; i++) {
-        int idx = (i + last) % g_num_epc;
-        if (g_epc_info[idx].type == FREE_PAGE) {
-            g_epc_info[idx].key = key;
-            g_epc_info[idx].type = RESERVED;
-            return idx;
-        }
-    }
-    return -1;
+    int idx = epc_index(addr);
+    if (idx == -1)
+        return -1;
+    return g_epc_info[idx].type;
 }
 
 static
 int alloc_epc_index_pages(int npages, int key)
 {
-    int beg = reserve_epc_index(key);
-    if (beg == -1)
+    if (npages <= 0)
         return -1;
 
-    // request too many pages
-    if (beg + npages >= g_num_epc) {
-        put_epc_index(beg);
+    int beg = buddy_alloc(npages);
+    if (beg == -1)
         return -1;
-    }
-
-    // check if we have npages
-    int i;
-    for (i = beg + 1; i < beg + npages; i++) {
-        if (g_epc_info[i].type != FREE_PAGE) {
-            // restore and return
-            for (int j = beg; j < i; j ++) {
-                put_epc_index(i);
-            }
-            return -1;
-        }
-        g_epc_info[i].key = key;
-        g_epc_info[i].type = RESERVED;
-    }
 
     // npages epcs allocated
+    assign_pages(beg, npages, key, RESERVED);
     return beg;
 }
 
@@ -203,35 +427,68 @@ epc_t *alloc_epc_pages(int npages, int key)
 
 epc_t *alloc_epc_page(int key)
 {
-    int idx = reserve_epc_index(key);
-    if (idx != -1)
-        return &g_epc[idx];
-    return NULL;
+    return alloc_epc_pages(1, key);
 }
 
+// npages free pages in a row, handed out directly as pt. The run goes at
+// hint (one past the caller's previous run) when those pages are free, so
+// that consecutive runs stay adjacent whenever EPC allows it.
+epc_t *alloc_epc_run(int key, epc_type_t pt, int npages, epc_t *hint)
+{
+    int beg = hint ? epc_index(hint) : -1;
+
+    if (npages <= 0)
+        return NULL;
+    if (beg == -1 || !buddy_take(beg, npages))
+        beg = buddy_alloc(npages);
+    if (beg == -1)
+        return NULL;
+
+    assign_pages(beg, npages, key, pt);
+    return &g_epc[beg];
+}
+
+// release the pages still RESERVED by the owner of epc
 void free_reserved_epc_pages(epc_t *epc)
 {
-    int beg = ((unsigned long)epc - (unsigned long)&g_epc[0]) / sizeof(epc_t);
-    int key = g_epc_info[beg].key;
+    int beg = epc_index(epc);
+    if (beg == -1)
+        return;
 
-    for (int i = beg; i < g_num_epc; i ++) {
-        if (g_epc_info[i].key == key && g_epc_info[i].type == RESERVED) {
-            g_epc_info[i].key = 0;
-            g_epc_info[i].type = FREE_PAGE;
-        }
+    epc_owner_t *owner = get_owner(g_epc_info[beg].key);
+    while (owner->reserved != -1) {
+        int idx = owner->reserved;
+        list_del(&owner->reserved, idx);
+        put_epc_index(idx);
     }
 }
 
-void free_epc_pages(epc_t *epc)
+// fn(page, type, arg) on every page key holds, the RESERVED ones aside
+void for_each_epc(int key, void (*fn)(epc_t *, epc_type_t, void *), void *arg)
 {
-    int beg = ((unsigned long)epc - (unsigned long)&g_epc[0]) / sizeof(epc_t);
-    int key = g_epc_info[beg].key;
+    if (key < 0 || key >= g_num_owner || g_owner[key].used == -1)
+        return;
+
+    int head = g_owner[key].used, idx = head;
+    do {
+        fn(&g_epc[idx], g_epc_info[idx].type, arg);
+        idx = g_epc_info[idx].next;
+    } while (idx != head);
+}
 
-    for (int i = beg; i < g_num_epc; i ++) {
-        if (g_epc_info[i].key == key) {
-            g_epc_info[i].key = 0;
-            g_epc_info[i].type = FREE_PAGE;
-        }
+// release every page of the owner of epc
+void free_epc_pages(epc_t *epc)
+{
+    int beg = epc_index(epc);
+    if (beg == -1)
+        return;
+
+    epc_owner_t *owner = get_owner(g_epc_info[beg].key);
+    free_reserved_epc_pages(epc);
+    while (owner->used != -1) {
+        int idx = owner->used;
+        list_del(&owner->used, idx);
+        put_epc_index(idx);
     }
 }
 
@@ -248,9 +505,71 @@ int count_epc(int key)
     return cnt;
 }
 
+// pages on the free lists, each block checked against its buddy order
+int count_free_epc(void)
+{
+    int cnt = 0;
+    for (int order = 0; order <= g_max_order; order ++) {
+        int idx = g_free[order];
+        if (idx == -1)
+            continue;
+        do {
+            assert(g_epc_info[idx].order == order);
+            assert((idx & ((1 << order) - 1)) == 0);
+            for (int i = idx; i < idx + (1 << order); i ++)
+                assert(g_epc_info[i].type == FREE_PAGE);
+            cnt += 1 << order;
+            idx = g_epc_info[idx].next;
+        } while (idx != g_free[order]);
+    }
+    return cnt;
+}
+
+static
+void count_type(epc_t *epc, epc_type_t type, void *arg)
+{
+    ((int *)arg)[type] ++;
+}
+
+// enclaves of random sizes come and go, all of EPC comes back in one piece
+#define CHURN_KEYS 16
+
+void churn_epc(void)
+{
+    epc_t *live[CHURN_KEYS] = { NULL };
+    unsigned int seed = 1;
+
+    for (int round = 0; round < 10000; round ++) {
+        int key = rand_r(&seed) % CHURN_KEYS;
+        if (live[key]) {
+            free_epc_pages(live[key]);
+            live[key] = NULL;
+            assert(count_epc(key) == 0);
+        } else {
+            int npages = 1 + rand_r(&seed) % 100;
+            live[key] = alloc_epc_pages(npages, key);
+            if (!live[key])
+                continue;
+            (void) get_epc(key, SECS_PAGE);
+            (void) alloc_epc_run(key, REG_PAGE, 1 + rand_r(&seed) % 8,
+                                 live[key] + npages);
+            free_reserved_epc_pages(live[key]);
+        }
+        assert(count_free_epc() + count_epc(key) <= NUM_EPC);
+    }
+    for (int key = 0; key < CHURN_KEYS; key ++) {
+        if (live[key])
+            free_epc_pages(live[key]);
+    }
+    assert(count_free_epc() == NUM_EPC);
+    assert(count_used_epc() == 0);
+    assert(alloc_epc_pages(1 << g_max_order, 1) == get_epc_region_beg());
+    free_epc_pages(get_epc_region_beg());
+}
+
 int main(int argc, char *argv[])
 {
-    init_epc(NUM_EPC);
+    init_epc(EPC_ADDR, NUM_EPC);
 
     epc_t *epc = alloc_epc_pages(NUM_EPC/2, 1);
     assert(count_epc(1) == NUM_EPC/2);
@@ -263,10 +582,36 @@ int main(int argc, char *argv[])
     (void) alloc_epc_pages(4, 4);
 
     assert(count_epc(2) + count_epc(3) + count_epc(4) == 9);
+    assert(count_used_epc() == 0);
 
     assert(get_epc(2, SECS_PAGE) != 0);
     assert(get_epc(2, SECS_PAGE) != 0);
     assert(get_epc(2, SECS_PAGE) == 0);
+    assert(count_used_epc() == 2);
+
+    // runs come off the front of the reserved pages, never past them
+    epc_t *resv = alloc_epc_pages(8, 6);
+    assert(get_epc(6, SECS_PAGE) == resv);
+    assert(get_epc_run(6, REG_PAGE, 3) == resv + 1);
+    assert(get_epc_run(6, REG_PAGE, 5) == NULL);
+    assert(get_epc_run(6, REG_PAGE, 4) == resv + 4);
+    assert(get_epc_run(6, REG_PAGE, 1) == NULL);
+    assert(count_used_epc() == 2 + 8);
+    free_epc_pages(resv);
+    assert(count_epc(6) == 0 && count_used_epc() == 2);
+
+    epc_t *run = alloc_epc_run(5, REG_PAGE, 8, NULL);
+    assert(run && count_epc(5) == 8);
+    assert(get_epc_run(5, REG_PAGE, 1) == NULL);
+    assert(alloc_epc_run(5, REG_PAGE, 8, run + 8) == run + 8);
+    assert(alloc_epc_run(5, REG_PAGE, NUM_EPC, NULL) == NULL);
+    int types[VA_PAGE + 1] = { 0 };
+    for_each_epc(5, count_type, types);
+    assert(types[REG_PAGE] == 16 && types[SECS_PAGE] == 0);
+    for_each_epc(MAX_ENCLAVES, count_type, types);
+    assert(types[REG_PAGE] == 16);
+    free_epc_pages(run);
+    assert(count_epc(5) == 0);
 
     dbg_dump_epc();
 
@@ -274,6 +619,16 @@ int main(int argc, char *argv[])
 
     dbg_dump_epc();
 
+    assert(find_epc_type(get_epc_region_beg()) == FREE_PAGE);
+    assert(find_epc_type((char *)get_epc_region_beg() + 1) == -1);
+    assert(find_epc_type(get_epc_region_end()) == -1);
+
+    free_epc_pages(alloc_epc_pages(2, 2));
+    free_epc_pages(alloc_epc_pages(4, 4));
+    assert(count_free_epc() == NUM_EPC);
+
+    churn_epc();
+
     return 0;
 }
 #endif
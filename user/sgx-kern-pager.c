@@ -0,0 +1,406 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define SGX_KERNEL
+#include <sgx-kern.h>
+#include <sgx-kern-epc.h>
+#include <sgx-kern-pager.h>
+#include <sgx-utils.h>
+
+//
+// EPC pager
+//   - an EPC page is also the enclave linear address of its contents
+//     (epc_to_vaddr()), so an evicted page can only come back to its own
+//     frame. EPC is oversubscribed by a limit on resident pages below the
+//     size of EPC instead: qemu gives the memory of an evicted frame back
+//     to the host, the frame itself stays allocated.
+//   - only stack and heap pages are tracked; SECS, TCS, TLS, SSA and code
+//     never leave EPC. A tracked page owns a VA slot, a backing page and a
+//     PCMD for as long as it is tracked.
+//   - victims come from a clock over the tracked pages, with the accessed
+//     bit that qemu keeps per EPC page (ENCLS_OSGX_EPC_AGE) as the second
+//     chance. A batch of victims is EBLOCKed, ETRACKed once and EWBed by
+//     a single ENCLS_OSGX_EVICT.
+//   - an enclave access to an evicted page makes qemu ELDU it with the
+//     operands in g_swap[] (the emulator has no #PF to deliver to us) and
+//     move it to EPC_SWAP_IN; the clock takes such pages back as resident.
+//   - reclaim runs directly when the kernel allocates past the limit, and
+//     from a thread that brings the resident count back to the low
+//     watermark once faults pushed it over the limit.
+//
+#define EPC_PAGER_KEY        MAX_ENCLAVES     // EPC owner of the VA pages
+#define EPC_PAGER_BATCH      64               // victims per ENCLS_OSGX_EVICT
+#define EPC_PAGER_PERIOD_NS  1000000
+#define VA_SLOTS             (PAGE_SIZE / sizeof(uint64_t))
+
+typedef enum {
+    PAGE_UNTRACKED = 0,
+    PAGE_RESIDENT,
+    PAGE_EVICTED,
+} pager_state_t;
+
+static int g_limit;                 // resident EPC pages, 0: no paging
+static int g_low;                   // reclaim down to it
+static int g_nepc;
+static epc_t *g_epc;
+
+static epc_swap_t *g_swap;          // shared with qemu
+static uint64_t g_faults;           // pages qemu loaded, bumped by qemu
+static uint64_t g_faults_seen;      // of those, taken back by the clock
+static int g_nout;                  // pages in PAGE_EVICTED
+
+static uint8_t *g_state;            // pager_state_t per EPC page
+static epc_t *g_backing;            // untrusted copy of an evicted page
+static pcmd_t *g_pcmd;
+
+// clock: EPC indexes of the tracked pages
+static int *g_tracked;
+static int g_ntracked;
+static int g_hand;
+
+// free VA slots: recycled ones, then the rest of the newest VA page
+static uint64_t **g_va_free;
+static int g_va_nfree;
+static uint64_t *g_va_next;
+static uint64_t *g_va_end;
+
+static pthread_mutex_t pager_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// EPC pages holding enclave contents right now: g_nout are evicted, less
+// the ones qemu loaded since the clock last passed them
+static
+int epc_resident(void)
+{
+    int64_t in = __atomic_load_n(&g_faults, __ATOMIC_ACQUIRE) - g_faults_seen;
+    return count_used_epc() - (g_nout - (int)in);
+}
+
+static
+uint64_t *alloc_va_slot(void)
+{
+    if (g_va_nfree > 0)
+        return g_va_free[--g_va_nfree];
+
+    if (g_va_next == g_va_end) {
+        epc_t *va = alloc_epc_run(EPC_PAGER_KEY, VA_PAGE, 1, NULL);
+        if (!va)
+            return NULL;
+        EPA(va);
+        g_va_next = (uint64_t *)epc_to_vaddr(va);
+        g_va_end = g_va_next + VA_SLOTS;
+    }
+    return g_va_next++;
+}
+
+static
+void free_va_slot(uint64_t *slot)
+{
+    g_va_free[g_va_nfree++] = slot;
+}
+
+// an evicted page that qemu loaded back is resident again
+static
+void take_back(int idx)
+{
+    if (__atomic_load_n(&g_swap[idx].state, __ATOMIC_ACQUIRE) != EPC_SWAP_IN)
+        return;
+
+    __atomic_store_n(&g_swap[idx].state, EPC_SWAP_NONE, __ATOMIC_RELAXED);
+    g_state[idx] = PAGE_RESIDENT;
+    g_nout--;
+    g_faults_seen++;
+}
+
+// up to want victims from the clock hand on, out of one batch of tracked
+// pages; the ones accessed since the hand last passed are spared unless
+// force is set
+static
+int pick_victims(int *victims, int want, bool force)
+{
+    uint64_t pages[EPC_PAGER_BATCH];
+    uint8_t accessed[EPC_PAGER_BATCH];
+    int cands[EPC_PAGER_BATCH];
+    int n = 0, nvictims = 0;
+
+    for (int i = 0; i < g_ntracked && n < EPC_PAGER_BATCH; i++) {
+        int idx = g_tracked[g_hand];
+        g_hand = (g_hand + 1) % g_ntracked;
+
+        if (g_state[idx] == PAGE_EVICTED)
+            take_back(idx);
+        if (g_state[idx] != PAGE_RESIDENT)
+            continue;
+        cands[n] = idx;
+        pages[n] = (uint64_t)epc_to_vaddr(&g_epc[idx]);
+        n++;
+    }
+    if (n == 0)
+        return 0;
+
+    encls_epc_age(pages, n, accessed);
+    for (int i = 0; i < n && nvictims < want; i++) {
+        if (force || !accessed[i])
+            victims[nvictims++] = cands[i];
+    }
+    return nvictims;
+}
+
+// the page of an ENCLS_OSGX_EVICT desc was never blocked
+static inline
+bool eblock_failed(uint64_t status)
+{
+    return status == ERR_SGX_BLKSTATE || status == ERR_SGX_NOTBLOCKABLE ||
+           status == ERR_SGX_PG_INVLD || status == ERR_SGX_PG_IS_SECS;
+}
+
+// EBLOCK, ETRACK and EWB a batch of victims with one ENCLS_OSGX_EVICT;
+// returns how many went out
+static
+int evict(int *victims, int n)
+{
+    static evict_desc_t descs[EPC_PAGER_BATCH] __attribute__((aligned(32)));
+    int nout = 0;
+
+    for (int i = 0; i < n; i++) {
+        int idx = victims[i];
+        epc_swap_t *swap = &g_swap[idx];
+
+        // from now on, an access that finds the page blocked is retried
+        __atomic_store_n(&swap->state, EPC_SWAP_BUSY, __ATOMIC_RELEASE);
+        descs[i].pageinfo = swap->pageinfo;
+        descs[i].epcpage = (uint64_t)epc_to_vaddr(&g_epc[idx]);
+        descs[i].va_slot = swap->va_slot;
+        descs[i].status = 0;
+    }
+
+    encls_evict(descs, n);
+
+    for (int i = 0; i < n; i++) {
+        int idx = victims[i];
+        epc_swap_t *swap = &g_swap[idx];
+
+        if (descs[i].status == 0) {
+            g_state[idx] = PAGE_EVICTED;
+            g_nout++;
+            nout++;
+            __atomic_store_n(&swap->state, EPC_SWAP_OUT, __ATOMIC_RELEASE);
+        } else if (eblock_failed(descs[i].status)) {
+            sgx_dbg(warn, "failed to block EPC page %p", (void *)&g_epc[idx]);
+            __atomic_store_n(&swap->state, EPC_SWAP_NONE, __ATOMIC_RELEASE);
+        } else {
+            // blocked for good: every access to it would be retried
+            errx(1, "EWB of EPC page %p failed: %" PRIu64,
+                 (void *)&g_epc[idx], descs[i].status);
+        }
+    }
+    return nout;
+}
+
+// evict until at most target pages are resident, or until the clock went
+// round twice without finding a victim (the second time round, with every
+// accessed bit already cleared once, it takes whatever it finds)
+static
+void reclaim(int target)
+{
+    int victims[EPC_PAGER_BATCH];
+    int scanned = 0;
+
+    while (epc_resident() > target && scanned < 3 * g_ntracked) {
+        int want = epc_resident() - target;
+        if (want > EPC_PAGER_BATCH)
+            want = EPC_PAGER_BATCH;
+
+        int n = pick_victims(victims, want, scanned >= 2 * g_ntracked);
+        if (n == 0 || evict(victims, n) == 0) {
+            scanned += EPC_PAGER_BATCH;
+            continue;
+        }
+        scanned = 0;
+    }
+}
+
+static
+void *pager_thread(void *arg)
+{
+    struct timespec period = { 0, EPC_PAGER_PERIOD_NS };
+
+    for (;;) {
+        nanosleep(&period, NULL);
+
+        pthread_mutex_lock(&pager_lock);
+        if (epc_resident() > g_limit)
+            reclaim(g_low);
+        pthread_mutex_unlock(&pager_lock);
+    }
+    return NULL;
+}
+
+static
+void *alloc_table(size_t size)
+{
+    void *table = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+        err(1, "failed to allocate EPC pager tables");
+    return table;
+}
+
+// OPENSGX_EPC_LIMIT=size[k|M|G]: resident EPC, paging is off when unset or
+// not below the size of EPC
+static
+int epc_limit_pages(void)
+{
+    unsigned long long size = env_size("OPENSGX_EPC_LIMIT");
+
+    size /= PAGE_SIZE;
+    return size < (unsigned long long)g_nepc ? (int)size : 0;
+}
+
+void epc_pager_init(void)
+{
+    pthread_t thread;
+
+    g_epc = get_epc_region_beg();
+    g_nepc = get_epc_region_end() - get_epc_region_beg();
+    g_limit = epc_limit_pages();
+    if (g_limit == 0)
+        return;
+    g_low = g_limit - g_limit / 16;
+
+    g_swap = alloc_table((size_t)g_nepc * sizeof(epc_swap_t));
+    g_state = alloc_table((size_t)g_nepc);
+    g_backing = alloc_table((size_t)g_nepc * sizeof(epc_t));
+    g_pcmd = alloc_table((size_t)g_nepc * sizeof(pcmd_t));
+    g_tracked = alloc_table((size_t)g_nepc * sizeof(int));
+    g_va_free = alloc_table((size_t)g_nepc * sizeof(uint64_t *));
+
+    encls_pager(g_swap, g_nepc, &g_faults);
+
+    if (pthread_create(&thread, NULL, pager_thread, NULL))
+        err(1, "failed to start the EPC pager");
+    pthread_detach(thread);
+
+    sgx_dbg(info, "EPC paging: %d of %d pages resident", g_limit, g_nepc);
+}
+
+void epc_pager_track(epc_t *epc, int npages, epc_t *secs)
+{
+    if (g_limit == 0)
+        return;
+
+    pthread_mutex_lock(&pager_lock);
+    for (int i = 0; i < npages; i++) {
+        int idx = epc_index(&epc[i]);
+        assert(idx != -1 && g_state[idx] == PAGE_UNTRACKED);
+
+        uint64_t *slot = alloc_va_slot();
+        if (!slot) {
+            sgx_dbg(warn, "no EPC left for VA pages, %p stays resident",
+                    (void *)&epc[i]);
+            break;
+        }
+
+        epc_swap_t *swap = &g_swap[idx];
+        memset(swap, 0, sizeof(epc_swap_t));
+        swap->pageinfo.srcpge  = (uint64_t)&g_backing[idx];
+        swap->pageinfo.secinfo = (uint64_t)&g_pcmd[idx];
+        swap->pageinfo.secs    = (uint64_t)epc_to_vaddr(secs);
+        swap->pageinfo.linaddr = (uint64_t)epc_to_vaddr(&epc[i]);
+        swap->va_slot          = (uint64_t)slot;
+
+        g_state[idx] = PAGE_RESIDENT;
+        g_tracked[g_ntracked++] = idx;
+    }
+    pthread_mutex_unlock(&pager_lock);
+}
+
+// forget the pages of the enclave secs, which is going away
+void epc_pager_untrack(epc_t *secs)
+{
+    if (g_limit == 0)
+        return;
+
+    pthread_mutex_lock(&pager_lock);
+    for (int i = 0; i < g_ntracked; ) {
+        int idx = g_tracked[i];
+        epc_swap_t *swap = &g_swap[idx];
+
+        if (swap->pageinfo.secs != (uint64_t)epc_to_vaddr(secs)) {
+            i++;
+            continue;
+        }
+
+        if (g_state[idx] == PAGE_EVICTED)
+            take_back(idx);
+        if (g_state[idx] == PAGE_EVICTED) {
+            // ELDU the page still out, which clears its VA slot, so that
+            // EREMOVE finds it valid; a vCPU may be loading it already
+            g_nout--;
+            uint32_t state = EPC_SWAP_OUT;
+            if (__sync_bool_compare_and_swap(&swap->state, EPC_SWAP_OUT,
+                                             EPC_SWAP_BUSY)) {
+                if (ELDU(&swap->pageinfo, &g_epc[idx],
+                         (uint64_t *)swap->va_slot) == 0)
+                    state = EPC_SWAP_IN;
+            } else {
+                while ((state = __atomic_load_n(&swap->state,
+                                                __ATOMIC_ACQUIRE)) ==
+                       EPC_SWAP_BUSY)
+                    sched_yield();
+                if (state == EPC_SWAP_IN)
+                    g_faults_seen++;
+            }
+            if (state == EPC_SWAP_IN)
+                free_va_slot((uint64_t *)swap->va_slot);
+            else
+                sgx_dbg(warn, "failed to load back EPC page %p, VA slot lost",
+                        (void *)&g_epc[idx]);
+        } else
+            free_va_slot((uint64_t *)swap->va_slot);
+        memset(swap, 0, sizeof(epc_swap_t));
+        g_state[idx] = PAGE_UNTRACKED;
+
+        // the last tracked page takes its place in the clock
+        g_tracked[i] = g_tracked[--g_ntracked];
+    }
+    if (g_hand >= g_ntracked)
+        g_hand = 0;
+    pthread_mutex_unlock(&pager_lock);
+}
+
+void epc_pager_reserve(int npages)
+{
+    if (g_limit == 0)
+        return;
+
+    pthread_mutex_lock(&pager_lock);
+    if (epc_resident() + npages > g_limit)
+        reclaim(g_low > npages ? g_low - npages : 0);
+    pthread_mutex_unlock(&pager_lock);
+}
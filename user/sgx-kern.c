@@ -7,21 +7,31 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <math.h>
+#include <pthread.h>
+#include <limits.h>
 
 #define SGX_KERNEL
 #include <sgx-kern.h>
 #include <sgx-utils.h>
 #include <sgx-kern-epc.h>
+#include <sgx-kern-pager.h>
 #include <sgx-crypto.h>
 
 #define NUM_THREADS 1
 
-keid_t kenclaves[MAX_ENCLAVES];
+// Enclaves by keid: chunks of KEID_CHUNK entries, allocated as keids need
+// them and never freed, so a lookup is O(1) and safe without kern_lock.
+// Keids that sys_destroy_enclave() gave back are handed out again first.
+static keid_t *kenclaves[MAX_ENCLAVES / KEID_CHUNK];
+static int keid_free[MAX_ENCLAVES];
+static int keid_nfree;
+static int next_keid;
+
+// Enclave creation, teardown and heap growth (which arrives from the
+// trampoline of every enclave thread)
+static pthread_mutex_t kern_lock = PTHREAD_MUTEX_INITIALIZER;
 
 char *empty_page;
-static epc_t *epc_heap_beg;
-static epc_t *epc_heap_end;
-static epc_t *epc_stack_end;
 
 static einittoken_t *app_token;
 
@@ -29,6 +39,7 @@ static void encls_qemu_init(uint64_t startPage, uint64_t endPage);
 static void set_cpusvn(uint8_t svn);
 static void set_intel_pubkey(uint64_t pubKey);
 static void set_stack(uint64_t sp);
+static keid_t *get_keid(int keid);
 
 void set_app_token(einittoken_t *token)
 {
@@ -88,21 +99,11 @@ int EINIT(uint64_t sigstruct, epc_t *secs, uint64_t einittoken)
 }
 
 static
-void EADD(pageinfo_t *pageinfo, epc_t *epc)
+void EADD_RANGE(eadd_desc_t *descs, int n)
 {
-    // RBX: PAGEINFO(In, EA)
-    // RCX: EPCPAGE(In, EA)
-    encls(ENCLS_EADD,
-          (uint64_t)pageinfo,
-          (uint64_t)epc_to_vaddr(epc),
-          0x0, NULL);
-}
-
-static
-void EEXTEND(uint64_t pageChunk)
-{
-    // RCX: 256B Page Chunk to be hashed(In, EA)
-    encls(ENCLS_EEXTEND, 0x0, pageChunk, 0x0, NULL);
+    // RBX: eadd_desc_t array(In, EA)
+    // RCX: number of descriptors(In)
+    encls(ENCLS_OSGX_EADD_RANGE, (uint64_t)descs, (uint64_t)n, 0x0, NULL);
 }
 
 static
@@ -136,6 +137,16 @@ int EBLOCK(uint64_t epc_addr)
     return (int)(out.oeax);
 }
 
+int ETRACK(epc_t *secs)
+{
+    // RCX: SECS Addr(In, EA)
+    // EAX: Error Code(Out)
+    out_regs_t out;
+    encls(ENCLS_ETRACK, 0x0, (uint64_t)epc_to_vaddr(secs), 0x0, &out);
+
+    return (int)(out.oeax);
+}
+
 int EWB(pageinfo_t *pageinfo_addr, epc_t *epc_addr, uint64_t *VA_slot_addr)
 {
     // EAX: Error(Out)
@@ -147,14 +158,58 @@ int EWB(pageinfo_t *pageinfo_addr, epc_t *epc_addr, uint64_t *VA_slot_addr)
     return (int)(out.oeax);
 }
 
-void EPA(int keid)
+void EPA(epc_t *epc)
 {
     // RBX: PT_VA (In, Const)
     // RCX: EPC Addr(In, EA)
-    uint64_t epc_addr = (uint64_t)alloc_epc_page(keid);
-    // Assume that we maintain the one Enclave...
-    keid = 0;
-    encls(ENCLS_EPA, PT_VA, epc_addr, 0, NULL);
+    encls(ENCLS_EPA, PT_VA, (uint64_t)epc_to_vaddr(epc), 0, NULL);
+}
+
+int ELDU(pageinfo_t *pageinfo, epc_t *epc, uint64_t *va_slot)
+{
+    // RBX: PAGEINFO(In, EA)
+    // RCX: EPC Addr(In, EA)
+    // RDX: VA slot Addr(In, EA)
+    // EAX: Error Code(Out)
+    out_regs_t out;
+    encls(ENCLS_ELDU, (uint64_t)pageinfo, (uint64_t)epc_to_vaddr(epc),
+          (uint64_t)va_slot, &out);
+    return (int)(out.oeax);
+}
+
+int EREMOVE(epc_t *epc)
+{
+    // RCX: EPC Addr(In, EA)
+    // EAX: Error Code(Out)
+    out_regs_t out;
+    encls(ENCLS_EREMOVE, 0x0, (uint64_t)epc_to_vaddr(epc), 0x0, &out);
+    return (int)(out.oeax);
+}
+
+void encls_pager(epc_swap_t *swap, int nepc, uint64_t *faults)
+{
+    // RBX: epc_swap_t per EPC page(In, EA), NULL to stop paging
+    // RCX: number of EPC pages(In)
+    // RDX: counter of pages loaded on access(In, EA)
+    encls(ENCLS_OSGX_PAGER, (uint64_t)swap, (uint64_t)nepc, (uint64_t)faults, NULL);
+}
+
+void encls_epc_age(uint64_t *pages, int n, uint8_t *accessed)
+{
+    // RBX: EPC page addrs(In, EA)
+    // RCX: number of pages(In)
+    // RDX: accessed byte per page(Out, EA)
+    encls(ENCLS_OSGX_EPC_AGE, (uint64_t)pages, (uint64_t)n, (uint64_t)accessed, NULL);
+}
+
+int encls_evict(evict_desc_t *descs, int n)
+{
+    // RBX: evict_desc_t per page(In/Out, EA)
+    // RCX: number of pages(In)
+    // EAX: number of pages written back(Out)
+    out_regs_t out;
+    encls(ENCLS_OSGX_EVICT, (uint64_t)descs, (uint64_t)n, 0x0, &out);
+    return (int)(out.oeax);
 }
 
 static
@@ -172,9 +227,11 @@ void encls_epcm_clear(uint64_t target_epc)
 }
 
 static
-void encls_stat(int keid, qstat_t *qstat)
+void encls_stat(epc_t *secs, qstat_t *qstat)
 {
-    encls(ENCLS_OSGX_STAT, keid, (uint64_t)qstat, 0x0, NULL);
+    // RBX: SECS of the enclave(In, EA)
+    // RCX: statistics(Out, EA)
+    encls(ENCLS_OSGX_STAT, (uint64_t)epc_to_vaddr(secs), (uint64_t)qstat, 0x0, NULL);
 }
 
 static
@@ -288,72 +345,113 @@ epc_t *ecreate(int eid, uint64_t enclave_addr, uint64_t enclave_size, bool intel
     return epc;
 }
 
-static
-void measure_enclave_page(uint64_t page_chunk_addr)
-{
-    EEXTEND(page_chunk_addr);
-}
+// EADD (with EEXTEND of the whole page) n pages in one
+// ENCLS_OSGX_EADD_RANGE: epcs[i] gets the page at page + i * step, so a
+// step of 0 adds the same (empty) page n times.
+// Enclave creation is serialized, so one descriptor buffer will do.
+#define EADD_BATCH_PAGES 256
+
+static eadd_desc_t eadd_descs[EADD_BATCH_PAGES]
+    __attribute__((aligned(PAGEINFO_ALIGN_SIZE)));
 
-// add (copy) a single page to a epc page
 static
-bool add_page_to_epc(void *page, epc_t *epc, epc_t *secs, page_type_t pt)
+bool add_run_to_epc(void *page, size_t step, epc_t **epcs, int n,
+                    epc_t *secs, page_type_t pt)
 {
-    pageinfo_t *pageinfo = memalign(PAGEINFO_ALIGN_SIZE, sizeof(pageinfo_t));
-    if (!pageinfo)
-        err(1, "failed to allocate pageinfo");
+    assert(n <= EADD_BATCH_PAGES);
 
-    secinfo_t *secinfo = alloc_secinfo(true, true, false, pt);
+    secinfo_t *secinfo = alloc_secinfo(true, true, pt == PT_REG, pt);
     if (!secinfo)
         err(1, "failed to allocate secinfo");
 
-    if (pt == PT_REG) {
-        secinfo->flags.x = true;
-        // change permissions of a page table entry
-        sgx_dbg(kern, "+x to %p", (void *)epc);
-        if (mprotect(epc, PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC) == -1)
-            err(1, "failed to add executable permission");
-    }
+    for (int i = 0; i < n; i++) {
+        eadd_desc_t *desc = &eadd_descs[i];
+        void *src = (void *)((uintptr_t)page + i * step);
 
-    pageinfo->srcpge  = (uint64_t)page;
-    pageinfo->secinfo = (uint64_t)secinfo;
-    pageinfo->secs    = (uint64_t)epc_to_vaddr(secs);
-    pageinfo->linaddr = (uint64_t)epc_to_vaddr(epc);
+        memset(desc, 0, sizeof(eadd_desc_t));
+        desc->pageinfo.srcpge  = (uint64_t)src;
+        desc->pageinfo.secinfo = (uint64_t)secinfo;
+        desc->pageinfo.secs    = (uint64_t)epc_to_vaddr(secs);
+        desc->pageinfo.linaddr = (uint64_t)epc_to_vaddr(epcs[i]);
+        desc->epcpage          = (uint64_t)epc_to_vaddr(epcs[i]);
+        desc->flags            = EADD_DESC_EXTEND;
 
-    sgx_dbg(kern, "add/copy %p -> %p", page, epc_to_vaddr(epc));
-    //if (sgx_dbg_eadd)
-    //    hexdump(stderr, page, 32);
+        sgx_dbg(kern, "add/copy %p -> %p", src, epc_to_vaddr(epcs[i]));
+    }
 
-    EADD(pageinfo, epc);
+    // change permissions of the page table entries, one call per run of
+    // adjacent pages
+    for (int i = 0; pt == PT_REG && i < n; ) {
+        int j = i + 1;
+        while (j < n && epcs[j] == epcs[j - 1] + 1)
+            j++;
+        sgx_dbg(kern, "+x to %p (%d pages)", (void *)epcs[i], j - i);
+        if (mprotect(epcs[i], (j - i) * PAGE_SIZE,
+                     PROT_READ|PROT_WRITE|PROT_EXEC) == -1)
+            err(1, "failed to add executable permission");
+        i = j;
+    }
 
-    // for EEXTEND
-    for(int i = 0; i < PAGE_SIZE/MEASUREMENT_SIZE; i++)
-        measure_enclave_page((uint64_t)epc_to_vaddr(epc) + i*MEASUREMENT_SIZE);
+    EADD_RANGE(eadd_descs, n);
 
-    free(pageinfo);
     free(secinfo);
-
     return true;
 }
 
+// add (copy) a single page to a epc page
 static
-bool aug_page_to_epc(epc_t *epc, epc_t *secs)
+bool add_page_to_epc(void *page, epc_t *epc, epc_t *secs, page_type_t pt)
 {
-    pageinfo_t *pageinfo = memalign(PAGEINFO_ALIGN_SIZE, sizeof(pageinfo_t));
-    if (!pageinfo) {
-        err(1, "failed to allocate pageinfo");
-        return false;
-    }
+    return add_run_to_epc(page, 0, &epc, 1, secs, pt);
+}
 
-    pageinfo->srcpge  = 0;
-    pageinfo->secinfo = 0;
-    pageinfo->secs    = (uint64_t)secs;
-    pageinfo->linaddr = (uint64_t)epc_to_vaddr(epc);
+// get npages epc pages and add the pages at page + i * step to them;
+// *first/*last are set to the first/last epc page when given. Pageable
+// pages are handed to the EPC pager as they are added.
+static
+bool add_range_to_epc(int eid, void *page, size_t step, int npages,
+                      epc_t *secs, epc_type_t epc_pt, page_type_t pt,
+                      bool pageable, epc_t **first, epc_t **last)
+{
+    epc_t *epcs[EADD_BATCH_PAGES];
+
+    for (int i = 0; i < npages; ) {
+        int n = npages - i < EADD_BATCH_PAGES ? npages - i : EADD_BATCH_PAGES;
+        epc_pager_reserve(n);
+        for (int j = 0; j < n; j++) {
+            epcs[j] = get_epc(eid, epc_pt);
+            if (!epcs[j])
+                return false;
+        }
+        if (!add_run_to_epc(page, step, epcs, n, secs, pt))
+            return false;
+        for (int j = 0; pageable && j < n; j++)
+            epc_pager_track(epcs[j], 1, secs);
+        if (i == 0 && first)
+            *first = epcs[0];
+        if (last)
+            *last = epcs[n - 1];
+        page = (void *)((uintptr_t)page + n * step);
+        i += n;
+    }
+    return true;
+}
 
-    EAUG(pageinfo, epc);
+// EAUG a run of npages adjacent pages (kern_lock held)
+static
+void aug_pages_to_epc(epc_t *run, int npages, epc_t *secs)
+{
+    static pageinfo_t pageinfo
+        __attribute__((aligned(PAGEINFO_ALIGN_SIZE)));
 
-    free(pageinfo);
+    pageinfo.srcpge  = 0;
+    pageinfo.secinfo = 0;
+    pageinfo.secs    = (uint64_t)secs;
 
-    return true;
+    for (int i = 0; i < npages; i ++) {
+        pageinfo.linaddr = (uint64_t)epc_to_vaddr(&run[i]);
+        EAUG(&pageinfo, &run[i]);
+    }
 }
 
 // add multiple pages to epc pages (will be allocated)
@@ -361,15 +459,8 @@ static
 bool add_pages_to_epc(int eid, void *page, int npages,
                       epc_t *secs, epc_type_t epc_pt, page_type_t pt)
 {
-    for (int i = 0; i < npages; i++) {
-        epc_t *epc = get_epc(eid, (uint64_t)epc_pt);
-        if (!epc)
-            return false;
-        if (!add_page_to_epc(page, epc, secs, pt))
-            return false;
-        page = (void *)((uintptr_t)page + PAGE_SIZE);
-    }
-    return true;
+    return add_range_to_epc(eid, page, PAGE_SIZE, npages, secs, epc_pt, pt,
+                            false, NULL, NULL);
 }
 
 // add multiple empty pages to epc pages (will be allocated)
@@ -377,51 +468,57 @@ static
 bool add_empty_pages_to_epc(int eid, int npages, epc_t *secs,
                             epc_type_t epc_pt, page_type_t pt, mem_type_t mt)
 {
-    for (int i = 0; i < npages; i ++) {
-        epc_t *epc = get_epc(eid, epc_pt);
-        if (!epc)
-            return false;
-        if (!add_page_to_epc(empty_page, epc, secs, pt))
-            return false;
-        if (i == 0 && mt == MT_HEAP) {
-            epc_heap_beg = epc;
-            sgx_dbg(kern, "epc_heap_beg is set as %p",(void *)epc_heap_beg);
-        }
-        if ((i == npages - 1) && mt == MT_HEAP) {
-            epc_heap_end = (epc_t *)((char *)epc + PAGE_SIZE - 1);
-            sgx_dbg(kern, "epc_heap_end is set as %p",(void *)epc_heap_end);
-        }
-        if ((i == npages - 1) && mt == MT_STACK) {
-            epc_stack_end = epc;
-            sgx_dbg(kern, "eps_stack_end is set as %p", (void *)epc_stack_end);
-        }
+    keid_t *enc = get_keid(eid);
+    epc_t *first = NULL, *last = NULL;
+    bool pageable = (mt == MT_STACK || mt == MT_HEAP);
+
+    if (!add_range_to_epc(eid, empty_page, 0, npages, secs, epc_pt, pt,
+                          pageable, &first, &last))
+        return false;
+    if (npages > 0 && mt == MT_HEAP) {
+        enc->heap_beg = first;
+        sgx_dbg(kern, "heap_beg of %d is set as %p", eid, (void *)enc->heap_beg);
+        enc->heap_end = (epc_t *)((char *)last + PAGE_SIZE - 1);
+        sgx_dbg(kern, "heap_end of %d is set as %p", eid, (void *)enc->heap_end);
+    }
+    if (npages > 0 && mt == MT_STACK) {
+        enc->stack_end = last;
+        sgx_dbg(kern, "stack_end of %d is set as %p", eid, (void *)enc->stack_end);
     }
     return true;
 }
 
-unsigned long get_epc_heap_beg() {
-    return (unsigned long)epc_heap_beg;
+// preallocated heap of enclave keid, 0 unless it is alive
+unsigned long get_epc_heap_beg(int keid) {
+    keid_t *enc = get_keid(keid);
+    return enc ? (unsigned long)enc->heap_beg : 0;
 }
 
-unsigned long get_epc_heap_end() {
-    return (unsigned long)epc_heap_end;
+unsigned long get_epc_heap_end(int keid) {
+    keid_t *enc = get_keid(keid);
+    return enc ? (unsigned long)enc->heap_end : 0;
 }
 
 // init custom data structures for qemu-sgx
 bool sys_sgx_init(void)
 {
-    // enclave map
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
-        memset(&(kenclaves[i]), 0, sizeof(keid_t));
-        kenclaves[i].keid = -1;
-    }
-
-    init_epc(NUM_EPC);
+    // EPC geometry is qemu's (-epc size[,base]): ask for it, map it there
+    // and hand the mapping back
+    out_regs_t out;
+    encls(ENCLS_OSGX_INIT, 0x0, 0x0, 0x0, &out);
+    if (!out.orbx || out.orcx <= out.orbx
+        || (out.orcx - out.orbx) / PAGE_SIZE > INT_MAX)
+        errx(1, "invalid EPC geometry from qemu: 0x%lx-0x%lx",
+             (unsigned long)out.orbx, (unsigned long)out.orcx);
+    init_epc(out.orbx, (out.orcx - out.orbx) / PAGE_SIZE);
 
     // QEMU Setup initialization for SGX
     encls_qemu_init((uint64_t)get_epc_region_beg(),
                     (uint64_t)get_epc_region_end());
 
+    // EPC paging, if OPENSGX_EPC_LIMIT asks for it
+    epc_pager_init();
+
     // Set default cpu svn
     set_cpusvn(CPU_SVN);
 
@@ -432,57 +529,187 @@ bool sys_sgx_init(void)
     return true;
 }
 
-// allocate keid
+// the enclave keid, NULL unless it is alive
+static
+keid_t *get_keid(int keid)
+{
+    keid_t *chunk;
+
+    if (keid < 0 || keid >= MAX_ENCLAVES)
+        return NULL;
+    chunk = __atomic_load_n(&kenclaves[keid / KEID_CHUNK], __ATOMIC_ACQUIRE);
+    if (!chunk || chunk[keid % KEID_CHUNK].keid != keid)
+        return NULL;
+    return &chunk[keid % KEID_CHUNK];
+}
+
+// allocate keid (kern_lock held), -1 once MAX_ENCLAVES are alive
 static
 int alloc_keid(void)
 {
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
-        if (kenclaves[i].keid == -1) {
-            kenclaves[i].keid = i;
-            return i;
+    int keid;
+
+    if (keid_nfree > 0)
+        keid = keid_free[--keid_nfree];
+    else if (next_keid < MAX_ENCLAVES)
+        keid = next_keid++;
+    else
+        return -1;
+
+    keid_t **chunk = &kenclaves[keid / KEID_CHUNK];
+    if (!*chunk) {
+        keid_t *entries = calloc(KEID_CHUNK, sizeof(keid_t));
+        if (!entries)
+            err(1, "failed to allocate enclave table");
+        for (int i = 0; i < KEID_CHUNK; i ++)
+            entries[i].keid = -1;
+        __atomic_store_n(chunk, entries, __ATOMIC_RELEASE);
+    }
+
+    keid_t *enc = &(*chunk)[keid % KEID_CHUNK];
+    memset(enc, 0, sizeof(keid_t));
+    enc->keid = keid;
+    return keid;
+}
+
+// free keid (kern_lock held)
+static
+void free_keid(int keid)
+{
+    get_keid(keid)->keid = -1;
+    keid_free[keid_nfree++] = keid;
+}
+
+// EREMOVE every page of an enclave but its SECS, which has to go last
+static
+void eremove_page(epc_t *epc, epc_type_t type, void *arg)
+{
+    if (type == SECS_PAGE)
+        return;
+    if (EREMOVE(epc)) {
+        sgx_dbg(err, "failed to remove EPC page %p", (void *)epc);
+        (*(int *)arg) ++;
+    }
+}
+
+// Take the enclave keid out of EPC and free its keid (kern_lock held).
+// Its threads must have left it.
+static
+int teardown_enclave(int keid)
+{
+    keid_t *enc = get_keid(keid);
+    int failed = 0;
+
+    if (enc->secs) {
+        // pages still evicted are loaded back, which frees their VA slots
+        epc_pager_untrack(enc->secs);
+        for_each_epc(keid, eremove_page, &failed);
+        if (failed || EREMOVE(enc->secs)) {
+            sgx_dbg(err, "failed to tear enclave %d down", keid);
+            return -1;
         }
     }
-    return -1;
+    if (enc->enclave)
+        free_epc_pages((epc_t *)enc->enclave);
+    free_keid(keid);
+    return 0;
 }
 
 // TODO. 1. param entry should be deleted
 //       2. param intel_flag looks ugly, integrate it to sig or tcs
 // init an enclave
-// XXX. need a big lock
 // XXX. sig should reflects intel_flag, so don't put it as an arugment
 
+// Thread #tid >= 1 of a multi-TCS enclave: a copy of the main TCS pointing
+// at its own TLS and SSA pages (the stack follows the SSA, see sgx-entry.S).
+// The first word of its GS page holds tid, which is how the enclave finds
+// its own stub page and ring (thread 0's page stays zero).
+static
+epc_t *add_thread_to_epc(int eid, tcs_t *tcs0, int tid, int tls_npages,
+                         int ssa_npages, int stack_npages, epc_t *secs)
+{
+    tcs_t *tcs = memalign(PAGE_SIZE, sizeof(tcs_t));
+    void *gs_page = memalign(PAGE_SIZE, PAGE_SIZE);
+    epc_t *tcs_epc = NULL;
+
+    if (!tcs || !gs_page)
+        err(1, "failed to allocate tcs");
+
+    tcs_epc = get_epc(eid, TCS_PAGE);
+    if (!tcs_epc)
+        goto out;
+
+    // TLS and SSA are added right after this TCS (SECS is the base page)
+    uint64_t tls_offset = (uint64_t)epc_to_vaddr(tcs_epc) + PAGE_SIZE
+                          - (uint64_t)epc_to_vaddr(secs);
+    set_thread_tcs_fields(tcs, tcs0, tls_offset);
+
+    memset(gs_page, 0, PAGE_SIZE);
+    *(uint32_t *)gs_page = tid;
+
+    sgx_dbg(info, "add tcs #%d (@%p)", tid, (void *)epc_to_vaddr(tcs_epc));
+    if (!add_page_to_epc(tcs, epc_to_vaddr(tcs_epc), secs, PT_TCS)
+        || !add_empty_pages_to_epc(eid, tls_npages - 1, secs, REG_PAGE, PT_REG, MT_TLS)
+        || !add_pages_to_epc(eid, gs_page, 1, secs, REG_PAGE, PT_REG)
+        || !add_empty_pages_to_epc(eid, ssa_npages, secs, REG_PAGE, PT_REG, MT_SSA)
+        || !add_empty_pages_to_epc(eid, stack_npages, secs, REG_PAGE, PT_REG, MT_STACK))
+        tcs_epc = NULL;
+
+ out:
+    free(tcs);
+    free(gs_page);
+    return tcs_epc;
+}
+
 int sys_create_enclave(void *base, unsigned int code_pages,
                        tcs_t *tcs, sigstruct_t *sig, einittoken_t *token,
-                       int intel_flag)
+                       int intel_flag, int ntcs, int heap_max)
 {
     int ret = -1;
+
+    pthread_mutex_lock(&kern_lock);
     int eid = alloc_keid();
-    kenclaves[eid].kin_n++;
 
     // full
-    if (eid == -1)
+    if (eid == -1) {
+        pthread_mutex_unlock(&kern_lock);
         return -1;
-    kenclaves[eid].keid = eid;
+    }
+    keid_t *enc = get_keid(eid);
+    enc->kin_n++;
 
     //      enclave (@eid) w/ npages
     //      |
     //      v
-    // EPC: [SECS][TCS][TLS]+[CODE][DATA]+[SSA][HEAP][RESV]
+    // EPC: [SECS][TCS][TLS]+[CODE][DATA]+[SSA][STACK]
+    //      ([TCS][TLS]+[SSA][STACK]) * (ntcs - 1) [HEAP][RESV]
     //
-    // Note, npages must be power of 2.
+    // Note, npages must be power of 2. RESV stays reserved to the enclave
+    // after EINIT: it is the part of ELRANGE that EAUG grows the heap into.
     int sec_npages  = 1;
     int tcs_npages  = 1;
     int tls_npages  = get_tls_npages(tcs);
     int ssa_npages  = 2; // XXX: Temperily set
     int stack_npages = STACK_PAGE_FRAMES_PER_THREAD;
     int heap_npages = HEAP_PAGE_FRAMES;
-    int npages = sec_npages + tcs_npages + tls_npages \
-        + code_pages + ssa_npages + stack_npages + heap_npages;
-    npages = rop2(npages);
+
+    if (ntcs < 1 || ntcs > SGX_MAX_TCS) {
+        sgx_dbg(err, "unsupported number of TCS: %d", ntcs);
+        goto err;
+    }
+    if (heap_max < heap_npages || heap_max > HEAP_MAX_PAGE_FRAMES) {
+        sgx_dbg(err, "unsupported heap size: %d pages", heap_max);
+        goto err;
+    }
+
+    // sgx-tool measures the same layout
+    int npages = enclave_npages(tcs, code_pages, ntcs, heap_max);
 
     epc_t *enclave = alloc_epc_pages(npages, eid);
     if (!enclave)
         goto err;
+    enc->enclave = (uint64_t)enclave;
+    enc->elrange_end = enclave + npages;
 
     // allocate secs
     int enclave_size = PAGE_SIZE * npages;
@@ -493,7 +720,7 @@ int sys_create_enclave(void *base, unsigned int code_pages,
     epc_t *secs = ecreate(eid, (uint64_t)enclave_addr, enclave_size, intel_flag);
     if (!secs)
         goto err;
-    kenclaves[eid].secs = secs;
+    enc->secs = secs;
 
     sgx_dbg(info, "enclave addr: %p (size: 0x%x w/ secs = %p)",
             enclave_addr, enclave_size, epc_to_vaddr(secs));
@@ -515,34 +742,50 @@ int sys_create_enclave(void *base, unsigned int code_pages,
     sgx_dbg(info, "add tls (fs/gs) pages: %p (%d pages)",
             empty_page, tls_npages);
     if (!add_empty_pages_to_epc(eid, tls_npages, secs, REG_PAGE, PT_REG, MT_TLS))
-        err(1, "failed to add pages");
+        goto err;
 
     // allocate code pages
     sgx_dbg(info, "add target code/data: %p (%d pages)",
             base, code_pages);
     if (!add_pages_to_epc(eid, base, code_pages, secs, REG_PAGE, PT_REG))
-        err(1, "failed to add pages");
+        goto err;
 
     // allocate SSA pages
     sgx_dbg(info, "add ssa pages: %p (%d pages)",
             empty_page, ssa_npages);
     if (!add_empty_pages_to_epc(eid, ssa_npages, secs, REG_PAGE, PT_REG, MT_SSA))
-        err(1, "failed to add pages");
-    kenclaves[eid].prealloc_ssa = ssa_npages * PAGE_SIZE;
+        goto err;
+    enc->prealloc_ssa = ssa_npages * PAGE_SIZE;
 
     // allocate stack pages
     sgx_dbg(info, "add stack pages: %p (%d pages)",
             empty_page, stack_npages);
     if (!add_empty_pages_to_epc(eid, stack_npages, secs, REG_PAGE, PT_REG, MT_STACK))
-        err(1, "failed to add pages");
-    kenclaves[eid].prealloc_stack = stack_npages * PAGE_SIZE;
+        goto err;
+    enc->prealloc_stack = stack_npages * PAGE_SIZE;
+
+    // the main thread's stack; extra threads get theirs from their SSA
+    epc_t *stack_end = enc->stack_end;
+
+    // allocate per-thread TCS/TLS/SSA/stack for the other threads
+    enc->tcss[0] = epc_to_vaddr(tcs_epc);
+    for (int i = 1; i < ntcs; i ++) {
+        epc_t *epc = add_thread_to_epc(eid, tcs, i, tls_npages,
+                                       ssa_npages, stack_npages, secs);
+        if (!epc)
+            goto err;
+        enc->tcss[i] = epc_to_vaddr(epc);
+    }
+    enc->ntcs = ntcs;
+    enc->stack_end = stack_end;
 
     // allocate heap pages
     sgx_dbg(info, "add heap pages: %p (%d pages)",
             empty_page, heap_npages);
     if (!add_empty_pages_to_epc(eid, heap_npages, secs, REG_PAGE, PT_REG, MT_HEAP))
-        err(1, "failed to add pages");
-    kenclaves[eid].prealloc_heap = heap_npages * PAGE_SIZE;
+        goto err;
+    enc->prealloc_heap = heap_npages * PAGE_SIZE;
+    enc->aug_next = (epc_t *)((char *)enc->heap_end + 1);
 
 #if 0
     // dump sig structure
@@ -554,7 +797,7 @@ int sys_create_enclave(void *base, unsigned int code_pages,
 #endif
 
     // Stack enclave stack pointer.
-    set_stack((uint64_t)epc_stack_end);
+    set_stack((uint64_t)enc->stack_end);
 
     if (init_enclave(secs, sig, token))
         goto err;
@@ -564,63 +807,98 @@ int sys_create_enclave(void *base, unsigned int code_pages,
 
 //    dbg_dump_epc();
 
-    // remove reserved pages
-    free_reserved_epc_pages(enclave);
-
     // update per-enclave info
-    kenclaves[eid].tcs = epc_to_vaddr(tcs_epc);
-    kenclaves[eid].enclave = (uint64_t)enclave;
+    enc->tcs = epc_to_vaddr(tcs_epc);
 
-    kenclaves[eid].kout_n++;
+    enc->kout_n++;
+    pthread_mutex_unlock(&kern_lock);
     return ret;
 
  err:
-    free_epc_pages(enclave);
-    kenclaves[eid].kout_n++;
+    teardown_enclave(eid);
+    pthread_mutex_unlock(&kern_lock);
     return -1;
 }
 
 int sys_stat_enclave(int keid, keid_t *stat)
 {
-    if (keid < 0 || keid >= MAX_ENCLAVES) {
-        return -1;
-    }
-    //*stat = kenclaves[keid];
-    if (stat == NULL) {
+    keid_t *enc = get_keid(keid);
+
+    if (enc == NULL || stat == NULL) {
         return -1;
     }
 
-    kenclaves[keid].kin_n++;
-    encls_stat(keid, &(kenclaves[keid].qstat));
-    kenclaves[keid].kout_n++;
-    memcpy(stat, &(kenclaves[keid]), sizeof(keid_t));
+    enc->kin_n++;
+    encls_stat(enc->secs, &(enc->qstat));
+    enc->kout_n++;
+    memcpy(stat, enc, sizeof(keid_t));
 
     return 0;
 }
 
-unsigned long sys_add_epc(int keid) {
-    kenclaves[keid].kin_n++;
-    epc_t *secs = kenclaves[keid].secs;
+// Tear the enclave keid down with EREMOVE and recycle its EPC and keid;
+// none of its threads may be inside
+int sys_destroy_enclave(int keid)
+{
+    int ret = -1;
 
-    epc_t *free_epc_page = alloc_epc_page(keid);
-    if (free_epc_page == NULL) {
-        kenclaves[keid].kout_n++;
+    pthread_mutex_lock(&kern_lock);
+    if (get_keid(keid))
+        ret = teardown_enclave(keid);
+    pthread_mutex_unlock(&kern_lock);
+    return ret;
+}
+
+static
+unsigned long add_epcs_locked(keid_t *enc, int min, int max, int *npages)
+{
+    epc_t *secs = enc->secs;
+    epc_t *run;
+    int n = max;
+
+    // EAUG stays in [aug_next, ELRANGE end): the pages the enclave still
+    // has reserved, handed out in address order
+    if (enc->elrange_end - enc->aug_next < n)
+        n = enc->elrange_end - enc->aug_next;
+    if (n < min)
         return 0;
-    }
 
-    epc_t *epc = get_epc(keid, (uint64_t)REG_PAGE);
-    if (!epc) {
-        kenclaves[keid].kout_n++;
+    epc_pager_reserve(n);
+
+    run = get_epc_run(enc->keid, REG_PAGE, n);
+    if (!run)
         return 0;
-    }
+    assert(run == enc->aug_next);
+
+    aug_pages_to_epc(run, n, secs);
+    epc_pager_track(run, n, secs);
+    enc->aug_next = run + n;
+    enc->augged_heap += n * PAGE_SIZE;
+
+    *npages = n;
+    return (unsigned long)run;
+}
+
+// Heap growth: EAUG between min and max adjacent pages in one call, the
+// enclave EACCEPTs them. Returns the first page (0 on failure, e.g. when
+// fewer than min pages of ELRANGE are left) and the length of the run in
+// *npages.
+unsigned long sys_add_epcs(int keid, int min, int max, int *npages) {
+    unsigned long epc = 0;
 
-    if (!aug_page_to_epc(epc, secs)) {
-        kenclaves[keid].kout_n++;
+    *npages = 0;
+    if (min <= 0 || min > max)
         return 0;
+
+    pthread_mutex_lock(&kern_lock);
+    keid_t *enc = get_keid(keid);
+    if (enc) {
+        enc->kin_n++;
+        epc = add_epcs_locked(enc, min, max, npages);
+        enc->kout_n++;
     }
-    kenclaves[keid].augged_heap += PAGE_SIZE;
-    kenclaves[keid].kout_n++;
-    return (unsigned long)epc;
+    pthread_mutex_unlock(&kern_lock);
+    return epc;
 }
 
 // For unit test
@@ -674,11 +952,8 @@ void test_eaug(pageinfo_t *pageinfo, epc_t *epc)
 // allocate keid
 int test_alloc_keid(void)
 {
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
-        if (kenclaves[i].keid == -1) {
-            kenclaves[i].keid = i;
-            return i;
-        }
-    }
-    return -1;
+    pthread_mutex_lock(&kern_lock);
+    int keid = alloc_keid();
+    pthread_mutex_unlock(&kern_lock);
+    return keid;
 }
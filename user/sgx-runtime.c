@@ -32,12 +32,32 @@
 #include <err.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #define is_aligned(addr, bytes) \
      ((((uintptr_t)(const void *)(addr)) & (bytes - 1)) == 0)
 
 ENCCALL2(enclave2_call, int, char **)
 
+// OPENSGX_THREADS=n runs enclave_main() on n TCSes concurrently; a signed
+// enclave gets the count of its conf (THREADS:) by default
+static tcs_t *thread_tcss[SGX_MAX_TCS];
+
+// int3 in the enclave takes an AEX and raises SIGTRAP at the AEP;
+// returning runs the AEP, which ERESUMEs the enclave past the int3
+static
+void sigtrap_handler(int sig)
+{
+}
+
+static
+void *enclave_thread(void *arg)
+{
+    sgx_enter(thread_tcss[(uintptr_t)arg], exception_handler);
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     char *binary;
@@ -74,11 +94,27 @@ int main(int argc, char **argv)
 
     entry_offset = (uint64_t)entry - (uint64_t)base_addr;
 
-    tcs_t *tcs = init_enclave(base_addr, entry_offset, npages, conf);
+    // a signed enclave runs on the TCSes it was measured for
+    int nthreads = conf ? load_threads(conf) : 1;
+    char *threads_env = getenv("OPENSGX_THREADS");
+    if (threads_env)
+        nthreads = atoi(threads_env);
+    if (nthreads < 1 || nthreads > SGX_MAX_TCS)
+        errx(1, "OPENSGX_THREADS must be within [1, %d]", SGX_MAX_TCS);
+
+    tcs_t *tcs = init_enclave_mt(base_addr, entry_offset, npages, conf,
+                                 nthreads, thread_tcss);
     if (!tcs)
         err(1, "failed to run enclave");
 
     void (*aep)() = exception_handler;
+    signal(SIGTRAP, sigtrap_handler);
+
+    pthread_t threads[SGX_MAX_TCS];
+    for (int i = 1; i < nthreads; i ++) {
+        if (pthread_create(&threads[i], NULL, enclave_thread, (void *)(uintptr_t)i))
+            err(1, "failed to create enclave thread");
+    }
 
     int test = 0;
     if (argc == 2)
@@ -93,6 +129,9 @@ int main(int argc, char **argv)
     else
         enclave2_call(tcs, aep, argc, argv);
 
+    for (int i = 1; i < nthreads; i ++)
+        pthread_join(threads[i], NULL);
+
     // print report
     collecting_enclu_stat();
 
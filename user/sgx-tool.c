@@ -22,6 +22,12 @@
 #include <err.h>
 #include <getopt.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sgx.h>
 #include <sgx-user.h>
@@ -80,6 +86,145 @@ void cmd_pkg(char *bin)
     // TODO
 }
 
+// Measurements are cached in $OPENSGX_MEASURE_CACHE/<key>, where the key
+// hashes the binary together with the enclave layout measured below, so an
+// unchanged binary is measured only once.
+#define MEASURE_KEY_CHUNK   (1 << 20)
+#define MEASURE_KEY_THREADS 16
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    int nchunks;
+    int nthreads;
+    int tid;
+    unsigned char (*digests)[32];
+} key_job_t;
+
+static
+void *hash_key_chunks(void *arg)
+{
+    key_job_t *job = arg;
+
+    for (int i = job->tid; i < job->nchunks; i += job->nthreads) {
+        size_t off = (size_t)i * MEASURE_KEY_CHUNK;
+        size_t len = job->size - off;
+        if (len > MEASURE_KEY_CHUNK)
+            len = MEASURE_KEY_CHUNK;
+        sha256(job->data + off, len, job->digests[i], 0);
+    }
+    return NULL;
+}
+
+// SHA-256 of the layout and of the SHA-256s of every 1 MB of the binary.
+// The chunks are hashed on all cores, straight out of the page cache.
+static
+bool measure_key(char *binary, int ntcs, int heap_max, char key[64+1])
+{
+    struct stat st;
+    unsigned char *data;
+    unsigned char digest[32];
+    char layout[128];
+    int fd;
+
+    fd = open(binary, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    int nchunks = (st.st_size + MEASURE_KEY_CHUNK - 1) / MEASURE_KEY_CHUNK;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > MEASURE_KEY_THREADS)
+        nthreads = MEASURE_KEY_THREADS;
+    if (nthreads > nchunks)
+        nthreads = nchunks;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    unsigned char (*digests)[32] = malloc(nchunks * 32);
+    key_job_t jobs[MEASURE_KEY_THREADS];
+    pthread_t threads[MEASURE_KEY_THREADS];
+    if (!digests)
+        err(1, "failed to allocate digests");
+
+    for (int i = 0; i < nthreads; i++) {
+        jobs[i] = (key_job_t) { data, st.st_size, nchunks, nthreads, i, digests };
+        if (i > 0 && pthread_create(&threads[i], NULL, hash_key_chunks, &jobs[i]))
+            err(1, "failed to create thread");
+    }
+    hash_key_chunks(&jobs[0]);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    sha256_context ctx;
+    snprintf(layout, sizeof(layout),
+             "opensgx-measure-v1 tcs=%d ssa=2 stack=%d heap=%d size=%ld\n",
+             ntcs, STACK_PAGE_FRAMES_PER_THREAD, heap_max,
+             (long)st.st_size);
+    sha256_init(&ctx);
+    sha256_starts(&ctx, 0);
+    sha256_update(&ctx, (unsigned char *)layout, strlen(layout));
+    sha256_update(&ctx, (unsigned char *)digests, nchunks * 32);
+    sha256_finish(&ctx, digest);
+    sha256_free(&ctx);
+    fmt_hash(digest, key);
+
+    free(digests);
+    munmap(data, st.st_size);
+    return true;
+}
+
+// Store atomically: concurrent signers may race on the same entry
+static
+void measure_cache_store(const char *path, char *hash_str)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        warn("failed to write %s", tmp);
+        return;
+    }
+    fprintf(fp, "# generated measurement\n");
+    fprintf(fp, "MEASUREMENT: %s\n", hash_str);
+    if (fclose(fp) || rename(tmp, path)) {
+        warn("failed to write %s", path);
+        unlink(tmp);
+    }
+}
+
+// The enclave layout beyond the binary: the TCS count comes from
+// OPENSGX_THREADS as for sgx-runtime, the heap ELRANGE from OPENSGX_HEAP.
+// They change the measurement, so every conf down to the signed one
+// records them (THREADS:, HEAP:) and the runtime builds the enclave it was
+// signed for.
+static
+int measure_threads(void)
+{
+    char *env = getenv("OPENSGX_THREADS");
+    int ntcs = env ? atoi(env) : 1;
+
+    if (ntcs < 1 || ntcs > SGX_MAX_TCS)
+        errx(1, "OPENSGX_THREADS must be within [1, %d]", SGX_MAX_TCS);
+    return ntcs;
+}
+
+static
+void print_layout(int ntcs, int heap_max)
+{
+    printf("# measured enclave layout\n");
+    printf("THREADS: %d\n", ntcs);
+    printf("HEAP: %d\n", heap_max);
+}
+
 void cmd_measure(char *binary)
 {
     void *code;
@@ -88,6 +233,27 @@ void cmd_measure(char *binary)
     unsigned long entry_offset;
     unsigned char hash[32];
     int toff;
+    char *cache = getenv("OPENSGX_MEASURE_CACHE");
+    char key[64+1];
+    char path[PATH_MAX];
+    int ntcs = measure_threads();
+    int heap_max = env_heap_npages();
+
+    path[0] = '\0';
+    if (cache && cache[0] && measure_key(binary, ntcs, heap_max, key)) {
+        mkdir(cache, 0755);
+        snprintf(path, sizeof(path), "%s/%s", cache, key);
+        if (access(path, R_OK) == 0) {
+            unsigned char *cached = load_measurement(path);
+            char *hash_str = fmt_bytes(cached, 32);
+            printf("# generated measurement\n");
+            printf("MEASUREMENT: %s\n", hash_str);
+            print_layout(ntcs, heap_max);
+            free(hash_str);
+            free(cached);
+            return;
+        }
+    }
 
     code = load_elf_enclave(binary, &npages, &entry, &toff);
     if (code == NULL) {
@@ -95,7 +261,7 @@ void cmd_measure(char *binary)
     }
 
     entry_offset = (unsigned long)entry - (unsigned long)code;
-    generate_enclavehash(hash, code, npages, entry_offset);
+    generate_enclavehash(hash, code, npages, entry_offset, ntcs, heap_max);
 
     // generate sgx-[binary].conf
     // # ENTRY: (size, offset)
@@ -105,6 +271,11 @@ void cmd_measure(char *binary)
     char *hash_str = fmt_bytes(hash, 32);
     printf("# generated measurement\n");
     printf("MEASUREMENT: %s\n", hash_str);
+    print_layout(ntcs, heap_max);
+
+    if (path[0])
+        measure_cache_store(path, hash_str);
+    free(hash_str);
 }
 
 void cmd_gen_sigstruct(char *conf)
@@ -221,6 +392,7 @@ void cmd_gen_sigstruct(char *conf)
     printf("Q1            : \n");
     printf("Q2            : \n");
     printf("# SIGSTRUCT END\n");
+    print_layout(load_threads(conf), load_heap(conf));
 }
 
 void cmd_sign(char *conf, char *key)
@@ -311,6 +483,7 @@ void cmd_sign(char *conf, char *key)
     printf("# SIGSTRUCT START\n");
     printf("%s\n", msg);
     printf("# SIGSTRUCT END\n");
+    print_layout(load_threads(conf), load_heap(conf));
 
     /*unsigned char exp[4] = { 0x00, 0x00, 0x00, 0x03 };
     char *mod_str = fmt_bytes(pubkey, 384);
@@ -483,7 +656,8 @@ void cmd_help()
     printf("  -h|--help         : help message\n");
     printf("  -p|--pkg          : package a static binary\n");
     printf("  -m|--measure      : measure a binary with given region\n");
-    printf("                      (-m BINARY)\n");
+    printf("                      (-m BINARY, for OPENSGX_THREADS TCSes and\n");
+    printf("                       an OPENSGX_HEAP heap)\n");
     printf("  -s|--sign         : generate rsa sign on a sigstruct with private key\n");
     printf("                      (-s SIGSTRUECT --key=KEYFILE)\n");
     printf("  -M|--mac          : generate mac on a einittoken with Launch Key\n");
@@ -30,6 +30,8 @@
 #include <sgx-malloc.h>
 #include <stdarg.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <time.h>
 
 const char *fcode_to_str(fcode_t fcode)
 {
@@ -50,6 +52,7 @@ const char *fcode_to_str(fcode_t fcode)
     case FUNC_CONNECT     : return "CONNECT";
     case FUNC_SEND        : return "SEND";
     case FUNC_RECV        : return "RECV";
+    case FUNC_RING        : return "RING";
 
     // only for testing purpose
     case FUNC_SYSCALL     : return "SYSCALL";
@@ -103,8 +106,8 @@ void dbg_dump_stub_in(sgx_stub_info *stub)
     hexdump(stderr, (void *)stub->in_data2, 32);
     fprintf(stderr, "++++++ ret:%x\n",
             stub->ret);
-    fprintf(stderr, "++++++ pending page:%x\n",
-            stub->pending_page);
+    fprintf(stderr, "++++++ pending page:%"PRIx64" (%u pages)\n",
+            stub->pending_page, stub->pending_npages);
     fprintf(stderr, "\n");
 
 }
@@ -198,12 +201,316 @@ int sgx_recv_tramp(int fd, void *buf, size_t len, int flags)
     return recv(fd, buf, len, flags);
 }
 
+// Ocall accounting, bumped concurrently by every enclave thread and the
+// exitless workers
+static ocall_stat_t ocall_stats[SGX_STAT_FCODES][2];
+
+const ocall_stat_t *sgx_ocall_stat(fcode_t fcode, bool ring)
+{
+    if (fcode >= SGX_STAT_FCODES)
+        return NULL;
+    return &ocall_stats[fcode][ring];
+}
+
+static inline
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Same log2 buckets as the per-leaf histograms kept by QEMU
+static
+void qlat_add(qlat_t *lat, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&lat->max_ns, __ATOMIC_RELAXED);
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    if (bucket >= SGX_STAT_BUCKETS)
+        bucket = SGX_STAT_BUCKETS - 1;
+
+    __atomic_fetch_add(&lat->n, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->hist[bucket], 1, __ATOMIC_RELAXED);
+    while (ns > max
+           && !__atomic_compare_exchange_n(&lat->max_ns, &max, ns, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static
+void ocall_account(fcode_t fcode, bool ring, uint64_t start,
+                   long out, long in)
+{
+    ocall_stat_t *st;
+
+    if (fcode >= SGX_STAT_FCODES)
+        return;
+
+    st = &ocall_stats[fcode][ring];
+    if (out > 0)
+        __atomic_fetch_add(&st->bytes_out, out, __ATOMIC_RELAXED);
+    if (in > 0)
+        __atomic_fetch_add(&st->bytes_in, in, __ATOMIC_RELAXED);
+    qlat_add(&st->lat, now_ns() - start);
+}
+
+// Bytes a finished ring request moved through sqe->data or the bounce region
+static
+void ring_account(sgx_ring_sqe *sqe, int ret, uint64_t start)
+{
+    long out = 0, in = 0;
+
+    switch (sqe->fcode) {
+    case FUNC_PUTS:
+    case FUNC_WRITE:
+    case FUNC_SEND:
+        out = sqe->len;
+        break;
+    case FUNC_READ:
+    case FUNC_RECV:
+        in = ret;
+        break;
+    case FUNC_TIME:
+        in = sizeof(time_t);
+        break;
+    default:
+        break;
+    }
+    ocall_account(sqe->fcode, true, start, out, in);
+}
+
+// Bytes a stub call moved through sgx_stub_info
+static
+void stub_account(sgx_stub_info *stub, uint64_t start)
+{
+    long out = 0, in = 0;
+
+    switch (stub->fcode) {
+    case FUNC_PUTS:
+        out = strnlen(stub->out_data1, SGXLIB_MAX_ARG);
+        break;
+    case FUNC_WRITE:
+    case FUNC_SEND:
+    case FUNC_BIND:
+    case FUNC_CONNECT:
+        out = stub->out_arg2;
+        break;
+    case FUNC_READ:
+    case FUNC_RECV:
+        in = stub->in_arg1;
+        break;
+    case FUNC_ACCEPT:
+        in = *(socklen_t *)stub->out_data2;
+        break;
+    case FUNC_GMTIME:
+        in = sizeof(struct tm);
+        break;
+    case FUNC_TIME:
+        in = sizeof(time_t);
+        break;
+    default:
+        break;
+    }
+    ocall_account(stub->fcode, false, start, out, in);
+}
+
+// One queued ocall; the result goes to the cqe, read-like requests hand
+// their data back in place in sqe->data
+static
+int sgx_ring_tramp(sgx_ring *ring, sgx_ring_sqe *sqe)
+{
+    char *buf = sqe->data;
+    size_t max = SGX_RING_DATA;
+    time_t t;
+
+    // large I/O: the syscall works on the bounce region directly
+    if (sqe->flags & SGX_RING_BOUNCE) {
+        buf = (char *)(uintptr_t)ring->bounce;
+        max = ring->bounce_size;
+    }
+    if (sqe->len > max)
+        return -1;
+
+    switch (sqe->fcode) {
+    case FUNC_PUTS:
+        // raw stdout stream, puts() queues its own newline
+        return fwrite(buf, 1, sqe->len, stdout);
+    case FUNC_PUTCHAR:
+        return putchar(sqe->arg1);
+    case FUNC_WRITE:
+        return sgx_write_tramp(sqe->arg1, buf, sqe->len);
+    case FUNC_READ:
+        return sgx_read_tramp(sqe->arg1, buf, sqe->len);
+    case FUNC_SEND:
+        return sgx_send_tramp(sqe->arg1, buf, sqe->len, sqe->arg3);
+    case FUNC_RECV:
+        return sgx_recv_tramp(sqe->arg1, buf, sqe->len, sqe->arg3);
+    case FUNC_CLOSE:
+        return sgx_close_tramp(sqe->arg1);
+    case FUNC_TIME:
+        t = sgx_time_tramp(NULL);
+        memcpy(sqe->data, &t, sizeof(time_t));
+        return sizeof(time_t);
+    default:
+        sgx_dbg(warn, "Incorrect function code in ring: %d", sqe->fcode);
+        return -1;
+    }
+}
+
+// Drain everything the enclave queued so far; called by the trampoline on
+// every exit and by the exitless workers, hence the lock (one per TCS)
+static pthread_mutex_t ring_lock[SGX_MAX_TCS];
+
+static inline
+pthread_mutex_t *ring_lock_of(sgx_ring *ring)
+{
+    return &ring_lock[((uintptr_t)ring - SGX_RING_ADDR) / SGX_STUB_SIZE];
+}
+
+static
+bool ring_pending(sgx_ring *ring)
+{
+    return __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE) != ring->sq_head;
+}
+
+static
+void sgx_drain_ring(sgx_ring *ring)
+{
+    uint32_t tail;
+
+    pthread_mutex_lock(ring_lock_of(ring));
+
+    tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    if (ring->sq_head == tail)
+        goto out;
+
+    if (tail - ring->sq_head > SGX_RING_SLOTS) {
+        sgx_msg(warn, "Corrupted ocall ring");
+        __atomic_store_n(&ring->sq_head, tail, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->cq_tail, tail, __ATOMIC_RELEASE);
+        goto out;
+    }
+
+    ring->nr_drains ++;
+    while (ring->sq_head != tail) {
+        uint32_t seq = ring->sq_head;
+        sgx_ring_sqe *sqe = &ring->sq[seq & (SGX_RING_SLOTS - 1)];
+        sgx_ring_cqe *cqe = &ring->cq[seq & (SGX_RING_SLOTS - 1)];
+        uint64_t start = now_ns();
+
+        sgx_dbg(user, "Ring function code: %s", fcode_to_str(sqe->fcode));
+
+        cqe->seq = seq;
+        cqe->ret = sgx_ring_tramp(ring, sqe);
+        ring_account(sqe, cqe->ret, start);
+        if (cqe->ret < 0 && (sqe->flags & SGX_RING_DEFERRED))
+            __sync_bool_compare_and_swap(&ring->error, 0, cqe->ret);
+
+        ring->nr_reqs ++;
+
+        // publish one by one, an exitless caller may be spinning on it
+        __atomic_store_n(&ring->sq_head, seq + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->cq_tail, seq + 1, __ATOMIC_RELEASE);
+    }
+
+    // deferred output should not sit in our stdio buffer across ERESUME
+    fflush(stdout);
+out:
+    pthread_mutex_unlock(ring_lock_of(ring));
+}
+
+// Exitless mode (opt-in, OPENSGX_EXITLESS=<nr of workers>)
+//  - host workers poll the rings of all TCSes, so the enclave only spins
+//    on sq_head
+//  - a worker spins exitless_spin times on an empty ring, then sleeps
+//    with exponential backoff up to exitless_sleep_max us
+//  - the enclave spins ring->spin times on a full ring or a missing
+//    completion, then falls back to a regular exit to the trampoline
+static unsigned long exitless_spin = SGX_EXITLESS_SPIN;
+static unsigned long exitless_sleep_max = SGX_EXITLESS_SLEEP_US;
+
+static
+void *sgx_exitless_worker(void *arg)
+{
+    unsigned long idle = 0;
+    unsigned long nap = 1;
+    bool busy;
+    int tid;
+
+    for (;;) {
+        busy = false;
+        for (tid = 0; tid < SGX_MAX_TCS; tid ++) {
+            sgx_ring *ring = (sgx_ring *)SGX_RING_ADDR_OF(tid);
+            if (ring_pending(ring)) {
+                sgx_drain_ring(ring);
+                busy = true;
+            }
+        }
+
+        if (busy) {
+            idle = 0;
+            nap = 1;
+        } else if (idle < exitless_spin) {
+            idle ++;
+            asm volatile("pause" ::: "memory");
+        } else {
+            usleep(nap);
+            if (nap < exitless_sleep_max)
+                nap <<= 1;
+        }
+    }
+    return NULL;
+}
+
+static
+unsigned long env_ulong(const char *name, unsigned long def)
+{
+    char *env = getenv(name);
+    return env ? strtoul(env, NULL, 0) : def;
+}
+
+static
+bool sgx_init_exitless(void)
+{
+    unsigned long nworkers = env_ulong("OPENSGX_EXITLESS", 0);
+    pthread_t worker;
+    unsigned long i;
+    int tid;
+
+    if (nworkers == 0)
+        return true;
+
+    exitless_spin = env_ulong("OPENSGX_EXITLESS_SPIN", exitless_spin);
+    exitless_sleep_max = env_ulong("OPENSGX_EXITLESS_SLEEP", exitless_sleep_max);
+    if (exitless_sleep_max == 0)
+        exitless_sleep_max = 1;
+
+    for (i = 0; i < nworkers; i ++) {
+        if (pthread_create(&worker, NULL, sgx_exitless_worker, NULL))
+            return false;
+        pthread_detach(worker);
+    }
+
+    for (tid = 0; tid < SGX_MAX_TCS; tid ++) {
+        sgx_ring *ring = (sgx_ring *)SGX_RING_ADDR_OF(tid);
+        ring->spin = exitless_spin;
+        __atomic_store_n(&ring->exitless, 1, __ATOMIC_RELEASE);
+    }
+
+    sgx_dbg(info, "exitless ocalls: %lu workers, spin %lu, sleep <= %luus",
+            nworkers, exitless_spin, exitless_sleep_max);
+    return true;
+}
+
 static
 void clear_abi_in_fields(sgx_stub_info *stub)   //from non-enclave to enclave
 {
     if (stub != NULL) {
         stub->ret = 0;
         stub->pending_page = 0;
+        stub->pending_npages = 0;
         memset(stub->in_data1, 0 , SGXLIB_MAX_ARG);
         memset(stub->in_data2, 0 , SGXLIB_MAX_ARG);
     }
@@ -226,16 +533,44 @@ void clear_abi_out_fields(sgx_stub_info *stub)  //from enclave to non-enclave
     }
 }
 
+// TCS the calling host thread runs (index into the per-TCS stub regions)
+static __thread int sgx_cur_tid;
+
+// Called before EENTER so that this thread's exits land on the stub of tcs
+void sgx_bind_tcs(tcs_t *tcs)
+{
+    int tid;
+
+    for (tid = 0; tid < SGX_MAX_TCS; tid ++) {
+        if (((sgx_stub_info *)STUB_ADDR_OF(tid))->tcs == tcs) {
+            sgx_cur_tid = tid;
+            return;
+        }
+    }
+}
+
+// TCS the calling thread entered (sgx_bind_tcs())
+tcs_t *sgx_bound_tcs(void)
+{
+    return ((sgx_stub_info *)STUB_ADDR_OF(sgx_cur_tid))->tcs;
+}
+
 //Trampoline code for stub handling in user
 void sgx_trampoline()
 {
     unsigned long epc_heap_beg = 0;
     unsigned long epc_heap_end = 0;
     unsigned long pending_page = 0;
+    uint64_t start = now_ns();
 
     sgx_msg(user, "Trampoline Entered");
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR_OF(sgx_cur_tid);
+    sgx_ring *ring = (sgx_ring *)SGX_RING_ADDR_OF(sgx_cur_tid);
     clear_abi_in_fields(stub);
+
+    // queued requests were issued before the call in the stub page
+    ring->nr_exits ++;
+    sgx_drain_ring(ring);
     //printf("Trampoline Entered fcode: %d mcode: %d\n", stub->fcode, stub->mcode);
 
     sgx_dbg(user, "Function code: %s", fcode_to_str(stub->fcode));
@@ -247,20 +582,23 @@ void sgx_trampoline()
         break;
     case FUNC_MALLOC:
         if (stub->mcode == MALLOC_INIT) {
-            epc_heap_beg = get_epc_heap_beg();
+            epc_heap_beg = get_epc_heap_beg(cur_keid);
             stub->heap_beg = epc_heap_beg;
-            epc_heap_end = get_epc_heap_end();
+            epc_heap_end = get_epc_heap_end(cur_keid);
             stub->heap_end = epc_heap_end;
         }
         else if (stub->mcode == REQUEST_EAUG) {
-            pending_page = sys_add_epc(cur_keid);
+            int max = stub->out_arg1 ? stub->out_arg1 : 1;
+            int min = stub->out_arg2 ? stub->out_arg2 : 1;
+            int npages = 0;
+            pending_page = sys_add_epcs(cur_keid, min, max, &npages);
             if (!pending_page)
-                printf("DEBUG failed in EAUG\n");
-            else{
-                printf("DEBUG succeed in EAUG\n");
-                printf("DEBUG pending page is %p\n", (void *)pending_page);
-                stub->pending_page = pending_page;
-            }
+                sgx_dbg(warn, "failed to EAUG %d..%d pages", min, max);
+            else
+                sgx_dbg(user, "EAUG %d pages at %p", npages, (void *)pending_page);
+            // 0 once ELRANGE is used up, morecore() fails the allocation
+            stub->pending_page = pending_page;
+            stub->pending_npages = npages;
         }
         else{
             sgx_msg(warn, "Incorrect malloc code");
@@ -307,6 +645,8 @@ void sgx_trampoline()
     case FUNC_RECV:
         stub->in_arg1 = sgx_recv_tramp(stub->out_arg1, stub->in_data1, (size_t)stub->out_arg2, stub->out_arg3);
         break;
+    case FUNC_RING:
+        break;
 /*
     case FUNC_SYSCALL:
         sgx_syscall();
@@ -318,27 +658,67 @@ void sgx_trampoline()
         break;
     }
 
+    stub_account(stub, start);
     clear_abi_out_fields(stub);
     //dbg_dump_stub_in(stub);
     // ERESUME at the end w/ info->tcs
     sgx_resume(stub->tcs, 0);
 }
 
+// Map the untrusted bounce region used for large read/write/send/recv
+static
+bool sgx_init_bounce(sgx_ring *ring)
+{
+    size_t size;
+    void *bounce;
+
+    size = env_ulong("OPENSGX_BOUNCE_SIZE", SGX_BOUNCE_SIZE);
+    size = (size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+    if (size == 0)
+        return true;
+
+    bounce = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (bounce == MAP_FAILED)
+        return false;
+
+    ring->bounce = (uintptr_t)bounce;
+    ring->bounce_size = size;
+
+    sgx_dbg(info, "bounce region: %p (%zu bytes)", bounce, size);
+    return true;
+}
+
 int sgx_init(void)
 {
     assert(sizeof(struct sgx_stub_info) < PAGE_SIZE);
+    assert(sizeof(struct sgx_ring) <= SGX_STUB_SIZE - PAGE_SIZE);
 
-    sgx_stub_info *stub = mmap((void *)STUB_ADDR, PAGE_SIZE,
-                               PROT_READ|PROT_WRITE,
-                               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (stub == MAP_FAILED)
+    sgx_stat_init();
+
+    // one stub page + ring per TCS
+    void *area = mmap((void *)STUB_ADDR, SGX_MAX_TCS * SGX_STUB_SIZE,
+                      PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
         return 0;
 
     //stub area init
-    memset((void *)stub, 0x00, PAGE_SIZE);
+    memset(area, 0x00, SGX_MAX_TCS * SGX_STUB_SIZE);
+
+    for (int tid = 0; tid < SGX_MAX_TCS; tid ++) {
+        sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR_OF(tid);
 
-    stub->abi = OPENSGX_ABI_VERSION;
-    stub->trampoline = (void *)(uintptr_t)sgx_trampoline;
+        stub->abi = OPENSGX_ABI_VERSION;
+        stub->trampoline = (void *)(uintptr_t)sgx_trampoline;
+
+        pthread_mutex_init(&ring_lock[tid], NULL);
+        if (!sgx_init_bounce((sgx_ring *)SGX_RING_ADDR_OF(tid)))
+            return 0;
+    }
+
+    if (!sgx_init_exitless())
+        return 0;
 
     return sys_sgx_init();
 }
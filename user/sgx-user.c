@@ -30,8 +30,10 @@
 #include <sgx-malloc.h>
 #include <stdarg.h>
 #include <malloc.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 
-static uint64_t _tcs_app;
 int cur_keid;
 keid_t cur_stat;
 
@@ -70,6 +72,8 @@ void enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
 
 void sgx_enter(tcs_t *tcs, void (*aep)())
 {
+    sgx_bind_tcs(tcs);
+
     // RBX: TCS (In, EA)
     // RCX: AEP (In, EA)
     enclu(ENCLU_EENTER, (uint64_t)tcs, (uint64_t)aep, 0, NULL);
@@ -81,24 +85,12 @@ void sgx_resume(tcs_t *tcs, void (*aep)()) {
     enclu(ENCLU_ERESUME, (uint64_t)tcs, (uint64_t)aep, 0, NULL);
 }
 
+// AEP: an AEX lands here once the host is done with the exception;
+// ERESUME the TCS this thread entered, with the same AEP for the next AEX
 void exception_handler(void)
 {
     sgx_msg(trace, "Asy_Call\n");
-    uint64_t aep = 0x00;
-    uint64_t rdx = 0x00;
-
-    asm("movl %0, %%eax\n\t"
-        "movq %1, %%rbx\n\t"
-        "movq %2, %%rcx\n\t"
-        "movq %3, %%rdx\n\t"
-        ".byte 0x0F\n\t"
-        ".byte 0x01\n\t"
-        ".byte 0xd7\n\t"
-        :
-        :"a"((uint32_t)ENCLU_ERESUME),
-         "b"((uint64_t)_tcs_app),
-         "c"((uint64_t)aep),
-         "d"((uint64_t)rdx));
+    sgx_resume(sgx_bound_tcs(), exception_handler);
 }
 
 // (ref re:2.13, EINIT/p88)
@@ -223,29 +215,100 @@ void update_einittoken(einittoken_t *token)
     // TODO : Set KEYID field
 }
 
+static const char *encls_leaf_names[SGX_STAT_ENCLS_LEAVES] = {
+    "ECREATE", "EADD", "EINIT", "EREMOVE", "EDBGRD", "EDBGWR", "EEXTEND",
+    "ELDB", "ELDU", "EBLOCK", "EPA", "EWB", "ETRACK", "EAUG", "EMODPR",
+    "EMODT",
+};
+
+static const char *enclu_leaf_names[SGX_STAT_ENCLU_LEAVES] = {
+    "EREPORT", "EGETKEY", "EENTER", "ERESUME", "EEXIT", "EACCEPT", "EMODPE",
+    "EACCEPTCOPY",
+};
+
+// Plain counters of qstat_t, in export order
+#define QSTAT_FIELD(f) { #f, offsetof(qstat_t, f) }
+static const struct {
+    const char *name;
+    size_t off;
+} qstat_fields[] = {
+    QSTAT_FIELD(mode_switch),
+    QSTAT_FIELD(tlbflush_n),
+    QSTAT_FIELD(aex_n),
+    QSTAT_FIELD(encls_n),
+    QSTAT_FIELD(ecreate_n),
+    QSTAT_FIELD(eadd_n),
+    QSTAT_FIELD(eextend_n),
+    QSTAT_FIELD(einit_n),
+    QSTAT_FIELD(eaug_n),
+    QSTAT_FIELD(enclu_n),
+    QSTAT_FIELD(eenter_n),
+    QSTAT_FIELD(eresume_n),
+    QSTAT_FIELD(eexit_n),
+    QSTAT_FIELD(egetkey_n),
+    QSTAT_FIELD(ereport_n),
+    QSTAT_FIELD(eaccept_n),
+    QSTAT_FIELD(keycache_hit_n),
+    QSTAT_FIELD(keycache_miss_n),
+    QSTAT_FIELD(ewb_n),
+    QSTAT_FIELD(eldu_n),
+    QSTAT_FIELD(epc_fault_n),
+    QSTAT_FIELD(epc_retry_n),
+    QSTAT_FIELD(epc_readahead_n),
+};
+#define QSTAT_NFIELDS (sizeof(qstat_fields) / sizeof(qstat_fields[0]))
+
+static inline
+uint64_t qstat_field(const qstat_t *qstat, int i)
+{
+    return *(const uint64_t *)((const char *)qstat + qstat_fields[i].off);
+}
+
+static
+void print_lat(const char *name, const qlat_t *lat)
+{
+    if (lat->n == 0)
+        return;
+    printf("%-12s\t: %"PRIu64" calls, avg %"PRIu64" ns, max %"PRIu64" ns\n",
+           name, lat->n, lat->total_ns / lat->n, lat->max_ns);
+}
+
 static
 void print_eid_stat(keid_t stat) {
      printf("--------------------------------------------\n");
-     printf("kern in count\t: %d\n",stat.kin_n);
-     printf("kern out count\t: %d\n",stat.kout_n);
+     printf("kern in count\t: %"PRIu64"\n",stat.kin_n);
+     printf("kern out count\t: %"PRIu64"\n",stat.kout_n);
+     printf("--------------------------------------------\n");
+     printf("encls count\t: %"PRIu64"\n",stat.qstat.encls_n);
+     printf("ecreate count\t: %"PRIu64"\n",stat.qstat.ecreate_n);
+     printf("eadd count\t: %"PRIu64"\n",stat.qstat.eadd_n);
+     printf("eextend count\t: %"PRIu64"\n",stat.qstat.eextend_n);
+     printf("einit count\t: %"PRIu64"\n",stat.qstat.einit_n);
+     printf("eaug count\t: %"PRIu64"\n",stat.qstat.eaug_n);
      printf("--------------------------------------------\n");
-     printf("encls count\t: %d\n",stat.qstat.encls_n);
-     printf("ecreate count\t: %d\n",stat.qstat.ecreate_n);
-     printf("eadd count\t: %d\n",stat.qstat.eadd_n);
-     printf("eextend count\t: %d\n",stat.qstat.eextend_n);
-     printf("einit count\t: %d\n",stat.qstat.einit_n);
-     printf("eaug count\t: %d\n",stat.qstat.eaug_n);
+     printf("enclu count\t: %"PRIu64"\n",stat.qstat.enclu_n);
+     printf("eenter count\t: %"PRIu64"\n",stat.qstat.eenter_n);
+     printf("eresume count\t: %"PRIu64"\n",stat.qstat.eresume_n);
+     printf("eexit count\t: %"PRIu64"\n",stat.qstat.eexit_n);
+     printf("egetkey count\t: %"PRIu64"\n",stat.qstat.egetkey_n);
+     printf("ereport count\t: %"PRIu64"\n",stat.qstat.ereport_n);
+     printf("eaccept count\t: %"PRIu64"\n",stat.qstat.eaccept_n);
+     printf("key cache hit/miss : %"PRIu64"/%"PRIu64"\n",
+            stat.qstat.keycache_hit_n, stat.qstat.keycache_miss_n);
+     printf("ewb/eldu count\t: %"PRIu64"/%"PRIu64"\n",
+            stat.qstat.ewb_n, stat.qstat.eldu_n);
+     printf("epc fault/retry : %"PRIu64"/%"PRIu64"\n",
+            stat.qstat.epc_fault_n, stat.qstat.epc_retry_n);
+     printf("epc readahead\t: %"PRIu64"\n", stat.qstat.epc_readahead_n);
      printf("--------------------------------------------\n");
-     printf("enclu count\t: %d\n",stat.qstat.enclu_n);
-     printf("eenter count\t: %d\n",stat.qstat.eenter_n);
-     printf("eresume count\t: %d\n",stat.qstat.eresume_n);
-     printf("eexit count\t: %d\n",stat.qstat.eexit_n);
-     printf("egetkey count\t: %d\n",stat.qstat.egetkey_n);
-     printf("ereport count\t: %d\n",stat.qstat.ereport_n);
-     printf("eaccept count\t: %d\n",stat.qstat.eaccept_n);
+     printf("mode switch count : %"PRIu64"\n",stat.qstat.mode_switch);
+     printf("tlb flush count\t: %"PRIu64"\n",stat.qstat.tlbflush_n);
+     printf("aex count\t: %"PRIu64"\n",stat.qstat.aex_n);
      printf("--------------------------------------------\n");
-     printf("mode switch count : %d\n",stat.qstat.mode_switch);
-     printf("tlb flush count\t: %d\n",stat.qstat.tlbflush_n);
+     for (int i = 0; i < SGX_STAT_ENCLS_LEAVES; i ++)
+         print_lat(encls_leaf_names[i], &stat.qstat.encls_lat[i]);
+     for (int i = 0; i < SGX_STAT_ENCLU_LEAVES; i ++)
+         print_lat(enclu_leaf_names[i], &stat.qstat.enclu_lat[i]);
      printf("--------------------------------------------\n");
      printf("TCS address\t: %lx\n", stat.tcs);
      printf("Pre-allocated EPC SSA region\t: 0x%lx\n",stat.prealloc_ssa);
@@ -255,7 +318,10 @@ void print_eid_stat(keid_t stat) {
      printf("Total EPC Heap region\t: 0x%lx\n",total_epc_heap);
 }
 
-tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, char *conf)
+// Creates an enclave with ntcs threads (TCSes); tcss[i] receives the TCS
+// a host thread passes to sgx_enter() to run as enclave thread #i
+tcs_t *init_enclave_mt(void *base, unsigned int offset, unsigned int n_of_pages,
+                       char *conf, int ntcs, tcs_t **tcss)
 {
     assert(sizeof(tcs_t) == PAGE_SIZE);
 
@@ -271,7 +337,6 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
 
     // XXX. tcs structure is freed at the end! maintain as part of
     // keid structure
-    _tcs_app = (uint64_t)tcs;
 
     // Calculate the offset for setting oentry of tcs
     set_tcs_fields(tcs, offset);
@@ -280,7 +345,19 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
     // argument.
     void (*aep)() = exception_handler;
 
+    // heap ELRANGE: what a signed enclave was measured for, OPENSGX_HEAP
+    // otherwise
+    int heap_max;
+
     if (conf != NULL) {
+        // the TCS count is part of the measured layout
+        int signed_ntcs = load_threads(conf);
+        if (signed_ntcs != ntcs)
+            errx(1, "%s is signed for %d threads, not %d", conf,
+                 signed_ntcs, ntcs);
+
+        heap_max = load_heap(conf);
+
         // load sigstruct from file
         sigstruct = load_sigstruct(conf);
 
@@ -289,6 +366,7 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
     } else {
         // Configuration file is not provided, generate a fake
         // configuration for testing purpose.
+        heap_max = env_heap_npages();
 
         // generate RSA key pair
         rsa_key_t pubkey;
@@ -329,7 +407,8 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
             err(1, "failed to allocate einittoken");
     }
 
-    int keid = sys_create_enclave(base, n_of_pages, tcs, sigstruct, token, false);
+    int keid = sys_create_enclave(base, n_of_pages, tcs, sigstruct, token,
+                                  false, ntcs, heap_max);
     if (keid < 0)
         err(1, "failed to create enclave");
 
@@ -338,8 +417,12 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
         err(1, "failed to stat enclave");
 
     // please check STUB_ADDR is mmaped in the main before enable below
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    stub->tcs = stat.tcs;
+    for (int i = 0; i < ntcs; i ++) {
+        sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR_OF(i);
+        stub->tcs = stat.tcss[i];
+        if (tcss)
+            tcss[i] = stat.tcss[i];
+    }
 
     free(tcs);
 
@@ -350,12 +433,219 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
     return stat.tcs;
 }
 
+tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, char *conf)
+{
+    return init_enclave_mt(base, offset, n_of_pages, conf, 1, NULL);
+}
+
 void collecting_enclu_stat(void)
 {
     if (sys_stat_enclave(cur_keid, &cur_stat) < 0)
 	err(1, "failed to stat enclave");
 
     print_eid_stat(cur_stat);
+
+    char *path = getenv("OPENSGX_STAT");
+    if (path && sgx_stat_export(path) < 0)
+        warn("failed to export stats to %s", path);
+}
+
+// Machine-readable stats export
+//  - OPENSGX_STAT=<file> writes the stats of the running enclave on exit
+//    and every time the process receives SIGUSR1
+//  - <file> ending in .csv gets one row per counter/histogram, anything
+//    else a JSON document
+//  - hist[i] counts latencies in [2^(i-1), 2^i) ns
+static
+void json_lat(FILE *fp, const qlat_t *lat)
+{
+    fprintf(fp, "{\"n\": %"PRIu64", \"total_ns\": %"PRIu64", "
+            "\"max_ns\": %"PRIu64", \"hist\": [",
+            lat->n, lat->total_ns, lat->max_ns);
+    for (int i = 0; i < SGX_STAT_BUCKETS; i ++)
+        fprintf(fp, "%s%"PRIu64, i ? ", " : "", lat->hist[i]);
+    fprintf(fp, "]}");
+}
+
+static
+void json_lats(FILE *fp, const char *key, const char **names,
+               const qlat_t *lats, int nleaves)
+{
+    bool first = true;
+
+    fprintf(fp, "  \"%s\": {", key);
+    for (int i = 0; i < nleaves; i ++) {
+        if (lats[i].n == 0)
+            continue;
+        fprintf(fp, "%s\n    \"%s\": ", first ? "" : ",", names[i]);
+        json_lat(fp, &lats[i]);
+        first = false;
+    }
+    fprintf(fp, "\n  },\n");
+}
+
+static
+void json_ocalls(FILE *fp, bool ring)
+{
+    bool first = true;
+
+    fprintf(fp, "  \"%s\": {", ring ? "ring" : "ocall");
+    for (int fcode = FUNC_PUTS; fcode < SGX_STAT_FCODES; fcode ++) {
+        const ocall_stat_t *st = sgx_ocall_stat(fcode, ring);
+        if (st->lat.n == 0)
+            continue;
+        fprintf(fp, "%s\n    \"%s\": {\"bytes_out\": %"PRIu64", "
+                "\"bytes_in\": %"PRIu64", \"lat\": ",
+                first ? "" : ",", fcode_to_str(fcode),
+                st->bytes_out, st->bytes_in);
+        json_lat(fp, &st->lat);
+        fprintf(fp, "}");
+        first = false;
+    }
+    fprintf(fp, "\n  }");
+}
+
+static
+void export_json(FILE *fp, keid_t *stat)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"keid\": %d,\n", stat->keid);
+    fprintf(fp, "  \"kern_in\": %"PRIu64",\n", stat->kin_n);
+    fprintf(fp, "  \"kern_out\": %"PRIu64",\n", stat->kout_n);
+    fprintf(fp, "  \"augged_heap\": %lu,\n", stat->augged_heap);
+
+    fprintf(fp, "  \"counters\": {");
+    for (unsigned i = 0; i < QSTAT_NFIELDS; i ++)
+        fprintf(fp, "%s\n    \"%s\": %"PRIu64, i ? "," : "",
+                qstat_fields[i].name, qstat_field(&stat->qstat, i));
+    fprintf(fp, "\n  },\n");
+
+    json_lats(fp, "encls", encls_leaf_names, stat->qstat.encls_lat,
+              SGX_STAT_ENCLS_LEAVES);
+    json_lats(fp, "enclu", enclu_leaf_names, stat->qstat.enclu_lat,
+              SGX_STAT_ENCLU_LEAVES);
+    json_ocalls(fp, false);
+    fprintf(fp, ",\n");
+    json_ocalls(fp, true);
+    fprintf(fp, "\n}\n");
+}
+
+static
+void csv_row(FILE *fp, const char *section, const char *name,
+             const qlat_t *lat, uint64_t bytes_out, uint64_t bytes_in)
+{
+    fprintf(fp, "%s,%s,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64,
+            section, name, lat->n, lat->total_ns, lat->max_ns,
+            bytes_out, bytes_in);
+    for (int i = 0; i < SGX_STAT_BUCKETS; i ++)
+        fprintf(fp, ",%"PRIu64, lat->hist[i]);
+    fprintf(fp, "\n");
+}
+
+static
+void export_csv(FILE *fp, keid_t *stat)
+{
+    fprintf(fp, "section,name,count,total_ns,max_ns,bytes_out,bytes_in");
+    for (int i = 0; i < SGX_STAT_BUCKETS; i ++)
+        fprintf(fp, ",h%d", i);
+    fprintf(fp, "\n");
+
+    for (unsigned i = 0; i < QSTAT_NFIELDS; i ++) {
+        qlat_t lat = { .n = qstat_field(&stat->qstat, i) };
+        csv_row(fp, "counter", qstat_fields[i].name, &lat, 0, 0);
+    }
+    for (int i = 0; i < SGX_STAT_ENCLS_LEAVES; i ++) {
+        if (stat->qstat.encls_lat[i].n)
+            csv_row(fp, "encls", encls_leaf_names[i],
+                    &stat->qstat.encls_lat[i], 0, 0);
+    }
+    for (int i = 0; i < SGX_STAT_ENCLU_LEAVES; i ++) {
+        if (stat->qstat.enclu_lat[i].n)
+            csv_row(fp, "enclu", enclu_leaf_names[i],
+                    &stat->qstat.enclu_lat[i], 0, 0);
+    }
+    for (int ring = 0; ring < 2; ring ++) {
+        for (int fcode = FUNC_PUTS; fcode < SGX_STAT_FCODES; fcode ++) {
+            const ocall_stat_t *st = sgx_ocall_stat(fcode, ring);
+            if (st->lat.n)
+                csv_row(fp, ring ? "ring" : "ocall", fcode_to_str(fcode),
+                        &st->lat, st->bytes_out, st->bytes_in);
+        }
+    }
+}
+
+int sgx_stat_export(const char *path)
+{
+    keid_t *stat;
+    FILE *fp;
+    size_t len = strlen(path);
+    char tmp[PATH_MAX];
+
+    // no enclave yet
+    if (!cur_stat.tcs)
+        return -1;
+
+    stat = malloc(sizeof(keid_t));
+    if (!stat)
+        return -1;
+    if (sys_stat_enclave(cur_keid, stat) < 0)
+        goto err;
+
+    // readers never see a half-written file
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (!fp)
+        goto err;
+
+    if (len > 4 && !strcmp(path + len - 4, ".csv"))
+        export_csv(fp, stat);
+    else
+        export_json(fp, stat);
+
+    if (fclose(fp) || rename(tmp, path))
+        goto err;
+
+    free(stat);
+    return 0;
+err:
+    free(stat);
+    return -1;
+}
+
+static
+void *stat_signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    char *path = getenv("OPENSGX_STAT");
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig))
+            continue;
+        if (sgx_stat_export(path) < 0)
+            warn("failed to export stats to %s", path);
+    }
+    return NULL;
+}
+
+// Must run before any other thread exists: SIGUSR1 stays blocked in every
+// thread and is only picked up by the exporter thread
+void sgx_stat_init(void)
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    if (!getenv("OPENSGX_STAT"))
+        return;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL)
+        || pthread_create(&thread, NULL, stat_signal_thread, &set)) {
+        warn("failed to start the stats exporter");
+        return;
+    }
+    pthread_detach(thread);
 }
 
 int sgx_host_read(void *buf, int len)
@@ -381,6 +381,88 @@ unsigned char *load_measurement(char *conf)
     return measurement;
 }
 
+// value of the first "field: n" line of conf, def if there is none
+static
+int load_layout_field(char *conf, const char *field, int def)
+{
+    FILE *fp = fopen(conf, "r");
+    if (!fp)
+        err(1, "failed to locate %s", conf);
+
+    char *line = NULL;
+    size_t len = 0;
+    int val = def;
+
+    const int nfield = strlen(field);
+
+    while (getline(&line, &len, fp) != -1) {
+        if (!strncmp(line, field, nfield)) {
+            val = atoi(line + nfield);
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return val;
+}
+
+// TCSes the enclave of conf was measured for (THREADS:), 1 if it does
+// not say
+int load_threads(char *conf)
+{
+    return load_layout_field(conf, "THREADS: ", 1);
+}
+
+// heap pages of ELRANGE the enclave of conf was measured for (HEAP:),
+// HEAP_PAGE_FRAMES if it does not say
+int load_heap(char *conf)
+{
+    int npages = load_layout_field(conf, "HEAP: ", HEAP_PAGE_FRAMES);
+
+    if (npages < HEAP_PAGE_FRAMES || npages > HEAP_MAX_PAGE_FRAMES)
+        errx(1, "%s: HEAP must be within [%d, %d] pages", conf,
+             HEAP_PAGE_FRAMES, HEAP_MAX_PAGE_FRAMES);
+    return npages;
+}
+
+// size[k|M|G] in the environment variable name, in bytes; 0 when unset
+unsigned long long env_size(const char *name)
+{
+    char *env = getenv(name);
+    char *p;
+
+    if (!env)
+        return 0;
+
+    unsigned long long size = strtoull(env, &p, 0);
+    if (*p == 'G' || *p == 'g') {
+        size <<= 30;
+        p++;
+    } else if (*p == 'M' || *p == 'm') {
+        size <<= 20;
+        p++;
+    } else if (*p == 'K' || *p == 'k') {
+        size <<= 10;
+        p++;
+    }
+    if (*p != '\0')
+        errx(1, "%s: size[k|M|G] expected", name);
+    return size;
+}
+
+// OPENSGX_HEAP=size[k|M|G]: heap the enclave may grow to. HEAP_PAGE_FRAMES
+// of it are preallocated, EAUG grows the heap into the rest of ELRANGE.
+int env_heap_npages(void)
+{
+    unsigned long long npages = env_size("OPENSGX_HEAP") / PAGE_SIZE;
+
+    if (npages > HEAP_MAX_PAGE_FRAMES)
+        errx(1, "OPENSGX_HEAP must be at most %d pages", HEAP_MAX_PAGE_FRAMES);
+    return npages < HEAP_PAGE_FRAMES ? HEAP_PAGE_FRAMES : (int)npages;
+}
+
 sigstruct_t *load_sigstruct(char *conf)
 {
     FILE *fp = fopen(conf, "r");
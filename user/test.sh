@@ -10,6 +10,7 @@ print_usage() {
 -h|--help : print help
 -i|--icount : count the number of executed instructions
 --perf|--performance-measure : measure SGX emulator performance metrics
+--paging : sweep the working set of test/simple-paging-bench over the EPC limit
 [test]    : run a test case
 EOF
   for f in test/*.c; do
@@ -48,11 +49,47 @@ run_test() {
 perf_test() {
   mkdir -p log
   BASE=log/$(basename $1)
-  $SGX $@ >$BASE.stdout 2>$BASE.stderr
+  OPENSGX_PROFILE=$BASE.profile $SGX -i $@ >$BASE.stdout 2>$BASE.stderr
   echo "$1"
   echo "-----------------------"
   awk '/count/ {print}' $BASE.stdout
   awk '/region/ {print}' $BASE.stdout
+  awk '/^sgx-profile:/ {print}' $BASE.stdout
+  echo "profile: $BASE.profile.txt, flame graph input: $BASE.profile.folded"
+}
+
+# working set at each percentage of OPENSGX_EPC_LIMIT, random and then
+# sequential touches; faults/sec and ewb/sec are over the whole run. The
+# heap ELRANGE (OPENSGX_HEAP) is sized for each working set, plus slack
+# for the preallocated heap and malloc.
+paging_test() {
+  BENCH=test/simple-paging-bench
+  LIMIT=${PAGING_LIMIT_PAGES:-2048}
+  make $BENCH >/dev/null || exit 1
+  mkdir -p log
+  BASE=log/$(basename $BENCH)
+  printf "EPC limit: %d pages\n" $LIMIT
+  printf "%-8s %-5s %8s %14s %12s %12s\n" \
+         "ws/limit" "mode" "ws" "touches/sec" "faults/sec" "ewb/sec"
+  for PCT in 25 50 75 100 125 150 200 400; do
+    for MODE in rand seq; do
+      PAGES=$((LIMIT * PCT / 100))
+      START=$(date +%s.%N)
+      QEMU_EPC=${QEMU_EPC:-1G} OPENSGX_EPC_LIMIT=$((LIMIT * 4))k \
+      OPENSGX_HEAP=$(((PAGES + 512) * 4))k \
+        $SGX -t $BENCH $PAGES $MODE >$BASE.stdout 2>$BASE.stderr
+      END=$(date +%s.%N)
+      awk -v pct=$PCT -v mode=$MODE -v pages=$PAGES -v t0=$START -v t1=$END '
+        /^paging-bench:/ { rate = $NF; sub("/sec", "", rate) }
+        /^epc fault\/retry/ { split($NF, f, "/"); faults += f[1] }
+        /^ewb\/eldu count/ { split($NF, e, "/"); ewb += e[1] }
+        END {
+          t = t1 - t0
+          printf "%-8s %-5s %8d %14s %12.0f %12.0f\n", pct "%", mode, pages,
+                 rate == "" ? "FAIL" : rate, faults / t, ewb / t
+        }' $BASE.stdout
+    done
+  done
 }
 
 if [[ $# == 0 ]]; then
@@ -100,6 +137,10 @@ case "$1" in
       printf "%-30s: please test it with simple_quotingEnclave together\n" "$OUT"
       continue
       fi
+      if [[ "$OUT" == "test/remote-attest-target-service" ]]; then
+      printf "%-30s: please test it with remote-attest-quote-service and attest-loadgen together\n" "$OUT"
+      continue
+      fi
       if [[ "$OUT" == "test/simple-openssl" ]]; then
       printf "%-30s: temporarily blocked\n" "$OUT"
       continue
@@ -128,6 +169,9 @@ case "$1" in
       echo "Ex) ./test.sh --perf simple"
     fi
     ;;
+  --paging)
+    paging_test
+    ;;
   -i|--icount)
     make $2
     shift
@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// An enclave test case for AEX and ERESUME.
+// Each int3 takes an AEX; the AEP ERESUMEs the enclave on the same TCS.
+
+#include "test.h"
+
+void enclave_main()
+{
+    volatile int resumed = 0;
+
+    // the second AEX checks that the first ERESUME gave the TCS back
+    asm volatile("int3" ::: "memory");
+    resumed ++;
+    asm volatile("int3" ::: "memory");
+    resumed ++;
+
+    if (resumed != 2)
+        while (1);
+
+    puts("resumed after AEX\n");
+    sgx_exit(NULL);
+}
@@ -0,0 +1,68 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Ocall round-trip benchmark: trampoline vs. exitless workers
+// (compare: ./test.sh test/simple-exitless
+//       vs. OPENSGX_EXITLESS=1 ./test.sh test/simple-exitless)
+
+#include "test.h"
+#include <unistd.h>
+
+#define EXITLESS_CALLS (10000)
+
+static inline
+uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void enclave_main()
+{
+    sgx_ring *ring = (sgx_ring *)SGX_RING_ADDR;
+    uint64_t exits = ring->nr_exits;
+    uint64_t start, cycles, min = UINT64_MAX, max = 0;
+    int i;
+
+    start = rdtsc();
+    for (i = 0; i < EXITLESS_CALLS; i++) {
+        uint64_t t = rdtsc();
+
+        // synchronous ocall, bad fd so that the host does no real work
+        close(-1);
+
+        t = rdtsc() - t;
+        if (t < min)
+            min = t;
+        if (t > max)
+            max = t;
+    }
+    cycles = rdtsc() - start;
+    exits = ring->nr_exits - exits;
+
+    printf("%s: %d ocalls, %lu exits\n",
+           ring->exitless ? "exitless" : "trampoline",
+           EXITLESS_CALLS, (unsigned long)exits);
+    printf("latency (cycles): avg %lu, min %lu, max %lu\n",
+           (unsigned long)(cycles / EXITLESS_CALLS),
+           (unsigned long)min, (unsigned long)max);
+
+    sgx_exit(NULL);
+}
@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tight load/store loops over stack, global and heap memory in an enclave
+// (measure with: time ./test.sh test/simple-memloop)
+
+#include "test.h"
+
+#define MEMLOOP_WORDS  (8192)
+#define MEMLOOP_ROUNDS (200)
+
+static long global_buf[MEMLOOP_WORDS];
+
+static
+long memloop(volatile long *buf, int nwords)
+{
+    long sum = 0;
+
+    for (int r = 0; r < MEMLOOP_ROUNDS; r++) {
+        for (int i = 0; i < nwords; i++)
+            buf[i] = i + r;
+        for (int i = 0; i < nwords; i++)
+            sum += buf[i];
+    }
+    return sum;
+}
+
+void enclave_main()
+{
+    long stack_buf[MEMLOOP_WORDS / 8];
+    long *heap_buf;
+    long sum = 0;
+
+    heap_buf = malloc(MEMLOOP_WORDS * sizeof(long));
+    if (!heap_buf)
+        sgx_exit(NULL);
+
+    sum += memloop(stack_buf, MEMLOOP_WORDS / 8);
+    sum += memloop(global_buf, MEMLOOP_WORDS);
+    sum += memloop(heap_buf, MEMLOOP_WORDS);
+
+    printf("memloop sum = %ld\n", sum);
+
+    free(heap_buf);
+    sgx_exit(NULL);
+}
@@ -0,0 +1,84 @@
+// EPC paging benchmark: page touches per second over a working set of argv[2] pages.
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Touches one word of a random page (or, with "seq" as argv[3], of the
+// next page) of a heap working set for BENCH_SECONDS. Run it with
+// OPENSGX_EPC_LIMIT below the working set to measure EWB/ELDU, or through
+// ./test.sh --paging, which sweeps the working set over the limit.
+
+#include "test.h"
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SECONDS (3)
+#define BENCH_PAGES   (1024)
+
+static
+uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+void enclave_main(int argc, char **argv)
+{
+    int npages = argc > 2 ? atoi(argv[2]) : BENCH_PAGES;
+    int seq = argc > 3 && !strcmp(argv[3], "seq");
+    uint32_t rng = 2463534242u;
+    time_t start, now;
+    long n = 0;
+    char *ws;
+
+    if (npages <= 0)
+        npages = BENCH_PAGES;
+
+    ws = malloc((size_t)npages * PAGE_SIZE);
+    if (!ws) {
+        printf("paging-bench: cannot allocate %d pages\n", npages);
+        sgx_exit(NULL);
+    }
+
+    // first touch, so the pager can evict every page
+    for (int i = 0; i < npages; i++)
+        ws[(size_t)i * PAGE_SIZE] = (char)i;
+
+    // start on a second boundary, time() only has second resolution
+    start = time(NULL);
+    while ((now = time(NULL)) == start)
+        ;
+    start = now;
+
+    do {
+        for (int i = 0; i < 64; i++, n++) {
+            size_t page = seq ? (size_t)(n % npages)
+                              : xorshift32(&rng) % (uint32_t)npages;
+            ws[page * PAGE_SIZE]++;
+        }
+    } while (time(NULL) - start < BENCH_SECONDS);
+
+    printf("paging-bench: %d pages %s, %ld touches in %d s: %ld/sec\n",
+           npages, seq ? "seq" : "rand", n, BENCH_SECONDS, n / BENCH_SECONDS);
+
+    free(ws);
+    sgx_exit(NULL);
+}
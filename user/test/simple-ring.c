@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Chatty output through the batched ocall ring
+// (compare exits vs. requests in the last line)
+
+#include "test.h"
+#include <unistd.h>
+
+#define RING_LINES (1000)
+
+void enclave_main()
+{
+    sgx_ring *ring = (sgx_ring *)SGX_RING_ADDR;
+    char msg[] = "write() through the ring\n";
+    time_t t;
+    int i;
+
+    for (i = 0; i < RING_LINES; i++) {
+        printf("line %d\n", i);
+        putchar('.');
+        puts("");
+        write(1, msg, sizeof(msg) - 1);
+    }
+
+    // synchronous, drains everything queued above in the same exit
+    t = time(NULL);
+
+    printf("time = %ld, %lu requests in %lu exits\n",
+           (long)t, (unsigned long)ring->nr_reqs,
+           (unsigned long)ring->nr_exits);
+
+    sgx_exit(NULL);
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Run the same enclave on several TCSes at once
+// (OPENSGX_THREADS=4 ./test.sh test/simple-threads)
+
+#include "test.h"
+#include <unistd.h>
+
+#define THREADS_ROUNDS (1 << 20)
+
+void enclave_main()
+{
+    char msg[64];
+    long sum = 0;
+    int tid = sgx_thread_id();
+    int len, i;
+
+    // private stack per thread: the loop counters must not interfere
+    for (i = 0; i < THREADS_ROUNDS; i++)
+        sum += i ^ tid;
+
+    // each thread posts to its own ring, so no locking here
+    len = snprintf(msg, sizeof(msg), "thread %d: sum = %ld\n", tid, sum);
+    write(1, msg, len);
+
+    sgx_exit(NULL);
+}
@@ -0,0 +1,92 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Concurrent EAUG/EACCEPT and EEXIT/ERESUME from every enclave thread
+// (OPENSGX_THREADS=8 ./test.sh test/stress-threads)
+
+#include "test.h"
+#include <unistd.h>
+
+#define STRESS_ROUNDS (64)
+
+static
+int eaccept(secinfo_t *secinfo, uint64_t page)
+{
+    int ret;
+
+    __asm__ __volatile__(".byte 0x0F\n\t"
+                         ".byte 0x01\n\t"
+                         ".byte 0xd7\n\t"
+                         :"=a"(ret)
+                         :"a"((uint32_t)ENCLU_EACCEPT),
+                          "b"((uint64_t)secinfo),
+                          "c"(page)
+                         :"memory");
+    return ret;
+}
+
+// One EAUG request through this thread's stub (an EEXIT/ERESUME round
+// trip) followed by the EACCEPT of the new page
+static
+long *grow_page(void)
+{
+    sgx_stub_info *stub = sgx_stub();
+    secinfo_t secinfo __attribute__((aligned(SECINFO_ALIGN_SIZE)));
+
+    memset(&secinfo, 0, sizeof(secinfo));
+    secinfo.flags.r = 1;
+    secinfo.flags.w = 1;
+    secinfo.flags.pending = 1;
+    secinfo.flags.page_type = PT_REG;
+
+    stub->pending_page = 0;
+    stub->fcode = FUNC_MALLOC;
+    stub->mcode = REQUEST_EAUG;
+    sgx_exit(stub->trampoline);
+
+    if (!stub->pending_page || eaccept(&secinfo, stub->pending_page) != 0)
+        return NULL;
+    return (long *)(uint64_t)stub->pending_page;
+}
+
+void enclave_main()
+{
+    int tid = sgx_thread_id();
+    int ok = 0;
+    char msg[64];
+    int len, i;
+
+    for (i = 0; i < STRESS_ROUNDS; i++) {
+        long *page = grow_page();
+        if (!page)
+            continue;
+
+        // the page must be ours alone
+        page[0] = tid;
+        page[PAGE_SIZE / sizeof(long) - 1] = i;
+        if (page[0] == tid && page[PAGE_SIZE / sizeof(long) - 1] == i)
+            ok++;
+    }
+
+    len = snprintf(msg, sizeof(msg), "thread %d: %d/%d pages\n",
+                   tid, ok, STRESS_ROUNDS);
+    write(1, msg, len);
+
+    sgx_exit(NULL);
+}